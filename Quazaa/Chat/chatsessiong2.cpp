@@ -116,20 +116,33 @@ void CChatSessionG2::OnRead()
 	}
 	else if( m_nState == csConnected || m_nState == csActive )
 	{
+		CBuffer* pInput = GetInputBuffer();
+		quint32 nOffset = 0;
+
 		G2Packet* pPacket = 0;
 		try
 		{
-			while((pPacket = G2Packet::ReadBuffer(GetInputBuffer())))
+			while((pPacket = G2Packet::ReadBuffer(pInput, nOffset)))
 			{
 				OnPacket(pPacket);
 
+				if(pPacket->m_nReference.loadAcquire() > 1)
+				{
+					pPacket->Detach();
+				}
+
 				pPacket->Release();
+				pPacket = 0;
 			}
 		}
 		catch(...)
 		{
 			if(pPacket)
 			{
+				if(pPacket->m_nReference.loadAcquire() > 1)
+				{
+					pPacket->Detach();
+				}
 				pPacket->Release();
 			}
 
@@ -137,6 +150,8 @@ void CChatSessionG2::OnRead()
 
 			CNetworkConnection::Close();
 		}
+
+		pInput->remove(0, nOffset);
 	}
 }
 
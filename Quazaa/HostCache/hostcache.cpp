@@ -32,25 +32,133 @@
 #include "quazaaglobals.h"
 
 #include <QDir>
+#include <QThread>
+#include <QtEndian>
+
+#include <exception>
 
 #include "hostcache.h"
 
 #include "debug_new.h"
 
+#define HOST_CACHE_MAGIC "QZHC"
+
+// hostcache.dat layout: one header, then nCount records of nRecordSize bytes, all little endian.
+struct HostCacheHeader
+{
+	char        szMagic[4];     // HOST_CACHE_MAGIC
+	quint16     nVersion;       // HOST_CACHE_CODE_VERSION
+	quint16     nRecordSize;    // sizeof(HostCacheRecord) of the writer
+	quint32     nCount;
+};
+
+struct HostCacheRecord
+{
+	uchar       pAddress[16];   // IPv4 in the first 4 bytes, IPv6 in network order
+	quint16     nPort;
+	quint8      nAddressType;   // 4 or 6
+	quint8      nReserved;
+	quint32     nFailures;
+	quint32     tTimestamp;
+	quint32     tLastConnect;
+};
+
+// Writes host cache snapshots off the network threads.
+// Only the newest pending snapshot is written, older ones are dropped.
+class CHostCacheSaver : public QThread
+{
+protected:
+	QMutex      m_pSection;
+	QByteArray  m_baPending;
+	QString     m_sMessage;
+	bool        m_bRunning;
+
+public:
+	CHostCacheSaver() :
+		m_bRunning( false )
+	{
+	}
+
+	~CHostCacheSaver()
+	{
+		wait();
+	}
+
+	void queue(const QByteArray& baData, const QString& sMessage)
+	{
+		QMutexLocker l( &m_pSection );
+
+		m_baPending = baData;
+		m_sMessage  = sMessage;
+
+		if ( !m_bRunning )
+		{
+			m_bRunning = true;
+			wait(); // previous run() may still be returning
+			start( QThread::LowPriority );
+		}
+	}
+
+protected:
+	void run()
+	{
+		forever
+		{
+			QByteArray baData;
+			QString sMessage;
+
+			{
+				QMutexLocker l( &m_pSection );
+
+				if ( m_baPending.isEmpty() )
+				{
+					m_bRunning = false;
+					return;
+				}
+
+				baData.swap( m_baPending );
+				sMessage = m_sMessage;
+			}
+
+			quint32 nCount = common::securedSaveFile( CQuazaaGlobals::DATA_PATH(), "hostcache.dat",
+													  sMessage, &baData, &CHostCacheSaver::writeSnapshot );
+			if ( nCount )
+			{
+				systemLog.postLog( LogSeverity::Debug,
+								   sMessage + QObject::tr( "Saved %1 hosts." ).arg( nCount - 1 ) );
+			}
+		}
+	}
+
+	// Returns the number of hosts plus one, so an empty cache still counts as written
+	static quint32 writeSnapshot(const void* const pData, QFile& oFile)
+	{
+		const QByteArray* pSnapshot = (const QByteArray*)pData;
+
+		if ( oFile.write( *pSnapshot ) != pSnapshot->size() )
+		{
+			throw std::exception(); // keeps the previous file
+		}
+
+		const HostCacheHeader* pHeader = (const HostCacheHeader*)pSnapshot->constData();
+		return qFromLittleEndian<quint32>( pHeader->nCount ) + 1;
+	}
+};
+
 CHostCache hostCache;
 
 CHostCache::CHostCache():
 	m_tLastSave( common::getTNowUTC() ),
-	m_nMaxCacheHosts( 3000 )
+	m_nMaxCacheHosts( 3000 ),
+	m_nSequence( 0 ),
+	m_pSaver( NULL )
 {
 }
 
 CHostCache::~CHostCache()
 {
-	while( !m_lHosts.isEmpty() )
-	{
-		delete m_lHosts.takeFirst();
-	}
+	delete m_pSaver;
+	qDeleteAll( m_lHosts );
 }
 
 CHostCacheHost* CHostCache::add(CEndPoint host, const QDateTime& ts)
@@ -82,7 +190,9 @@ CHostCacheHost* CHostCache::add(CEndPoint host, quint32 tTimeStamp)
 		int nMax = m_nMaxCacheHosts / 2;
 		while ( m_lHosts.size() > nMax )
 		{
-			delete m_lHosts.takeLast();
+			CHostCacheHost* pOldest = ( --m_lHosts.end() ).value();
+			unlink( pOldest );
+			delete pOldest;
 		}
 
 		save( tNow );
@@ -95,37 +205,35 @@ CHostCacheHost* CHostCache::add(CEndPoint host, quint32 tTimeStamp)
 		tTimeStamp = tNow - 60 ;
 	}
 
-	CHostCacheIterator itPrev = find( host );
+	CHostCacheHost* pPrev = m_lAddresses.value( host );
 
-	if ( itPrev != m_lHosts.end() )
+	if ( pPrev )
 	{
-		return update( itPrev, tTimeStamp );
+		return update( m_lHosts.find( pPrev->m_nTimeKey ), tTimeStamp );
 	}
 
 	CHostCacheHost* pNew = new CHostCacheHost( host, tTimeStamp );
-
-	CHostCacheIterator it = qLowerBound( m_lHosts.begin(), m_lHosts.end(),
-										 pNew, qLess<CHostCacheHost*>() );
-	m_lHosts.insert( it, pNew );
+	link( pNew );
 
 	return pNew;
 }
 
 CHostCacheIterator CHostCache::find(CEndPoint oHost)
 {
-	for ( CHostCacheIterator it = m_lHosts.begin(); it != m_lHosts.end(); ++it )
-	{
-		if ( (*it)->m_oAddress == oHost )
-			return it;
-	}
+	CHostCacheHost* pHost = m_lAddresses.value( oHost );
 
-	return m_lHosts.end();
+	if ( !pHost )
+		return m_lHosts.end();
+
+	return m_lHosts.find( pHost->m_nTimeKey );
 }
 
 CHostCacheIterator CHostCache::find(CHostCacheHost *pHost)
 {
-	CHostCacheIterator it = qFind( m_lHosts.begin(), m_lHosts.end(), pHost );
-	return it;
+	if ( m_lAddresses.value( pHost->m_oAddress ) != pHost )
+		return m_lHosts.end();
+
+	return m_lHosts.find( pHost->m_nTimeKey );
 }
 
 CHostCacheHost* CHostCache::update(CEndPoint oHost, const quint32 tTimeStamp)
@@ -151,9 +259,9 @@ CHostCacheHost* CHostCache::update(CHostCacheHost* pHost, const quint32 tTimeSta
 CHostCacheHost* CHostCache::update(CHostCacheIterator itHost, const quint32 tTimeStamp)
 {
 	CHostCacheHost* pHost = *itHost;
-	m_lHosts.erase( itHost );
+	unlink( pHost );
 	pHost->m_tTimestamp = tTimeStamp;
-	m_lHosts.prepend( pHost );
+	link( pHost );
 	return pHost;
 }
 
@@ -163,7 +271,7 @@ void CHostCache::remove(CHostCacheHost* pRemove)
 
 	if ( it != m_lHosts.end() )
 	{
-		m_lHosts.erase( it );
+		unlink( pRemove );
 	}
 
 	delete pRemove;
@@ -171,12 +279,12 @@ void CHostCache::remove(CHostCacheHost* pRemove)
 
 void CHostCache::remove(CEndPoint oHost)
 {
-	CHostCacheIterator it = find( oHost );
+	CHostCacheHost* pHost = m_lAddresses.value( oHost );
 
-	if ( it != m_lHosts.end() )
+	if ( pHost )
 	{
-		delete *it;
-		m_lHosts.erase( it );
+		unlink( pHost );
+		delete pHost;
 	}
 }
 
@@ -259,17 +367,50 @@ QString CHostCache::getXTry()
 
 void CHostCache::onFailure(CEndPoint addr)
 {
-	CHostCacheIterator itHost = find( addr );
+	CHostCacheHost* pHost = m_lAddresses.value( addr );
 
-	if ( itHost != m_lHosts.end() )
+	if ( pHost )
 	{
-		if ( (int)(++(*itHost)->m_nFailures) > quazaaSettings.Connection.FailureLimit )
+		if ( (int)( pHost->m_nFailures + 1 ) > quazaaSettings.Connection.FailureLimit )
 		{
 			remove( addr );
 		}
+		else
+		{
+			unlinkConnectable( pHost );
+			++pHost->m_nFailures;
+			linkConnectable( pHost );
+		}
+	}
+}
+
+void CHostCache::onSuccess(CEndPoint addr)
+{
+	CHostCacheHost* pHost = m_lAddresses.value( addr );
+
+	if ( pHost )
+	{
+		onSuccess( pHost );
 	}
 }
 
+void CHostCache::onSuccess(CHostCacheHost* pHost)
+{
+	if ( pHost->m_nFailures )
+	{
+		unlinkConnectable( pHost );
+		pHost->m_nFailures = 0;
+		linkConnectable( pHost );
+	}
+}
+
+void CHostCache::onConnect(CHostCacheHost* pHost, const quint32 tNow)
+{
+	unlinkConnectable( pHost );
+	pHost->m_tLastConnect = tNow;
+	linkConnectable( pHost );
+}
+
 CHostCacheHost* CHostCache::get()
 {
 	CHostCacheHost* pHost = NULL;
@@ -279,8 +420,8 @@ CHostCacheHost* CHostCache::get()
 		return pHost;
 	}
 
-	pHost = m_lHosts.first();
-	m_lHosts.removeFirst();
+	pHost = m_lHosts.begin().value();
+	unlink( pHost );
 
 	return pHost;
 }
@@ -300,24 +441,29 @@ CHostCacheHost* CHostCache::getConnectable(const quint32 tNow, QList<CHostCacheH
 
 	// First try untested or working hosts, then fall back to failed hosts to increase chances for
 	// successful connection
-	for ( int nFailures = 0; nFailures < quazaaSettings.Connection.FailureLimit; ++nFailures )
+	for ( int nFailures = 0; nFailures < quazaaSettings.Connection.FailureLimit &&
+		  nFailures < m_lConnectable.size(); ++nFailures )
 	{
-		foreach ( CHostCacheHost * pHost, m_lHosts )
+		const quint32 tThrottle = quazaaSettings.Gnutella.ConnectThrottle +
+								  nFailures * quazaaSettings.Connection.FailurePenalty;
+		const QMap<quint64, CHostCacheHost*>& lHosts = m_lConnectable.at( nFailures );
+
+		for ( QMap<quint64, CHostCacheHost*>::const_iterator it = lHosts.constBegin();
+			  it != lHosts.constEnd(); ++it )
 		{
-			if ( nFailures != pHost->m_nFailures )
-				continue;
+			CHostCacheHost* pHost = it.value();
+
+			// sorted by last connection attempt, the rest were tried even more recently
+			if ( tNow - pHost->m_tLastConnect <= tThrottle )
+				break;
 
 			if ( bCountry && pHost->m_oAddress.country() != sCountry )
 			{
 				continue;
 			}
 
-			if ( tNow - pHost->m_tLastConnect > ( quazaaSettings.Gnutella.ConnectThrottle +
-												  pHost->m_nFailures * quazaaSettings.Connection.FailurePenalty ) )
-			{
-				if ( !oExcept.contains( pHost ) )
-					return pHost;
-			}
+			if ( !oExcept.contains( pHost ) )
+				return pHost;
 		}
 	}
 
@@ -328,24 +474,61 @@ bool CHostCache::save(const quint32 tNow)
 {
 	ASSUME_LOCK( hostCache.m_pSection );
 
-	bool bReturn;
+	// Only the snapshot is taken under the lock, the disk is left to the saver thread.
+	const quint32 nCount = m_lHosts.size();
+
+	QByteArray baData( sizeof( HostCacheHeader ) + nCount * sizeof( HostCacheRecord ), '\0' );
 
-	quint32 nCount = common::securedSaveFile( CQuazaaGlobals::DATA_PATH(), "hostcache.dat", m_sMessage,
-											   this, &CHostCache::writeToFile );
-	if ( nCount )
+	HostCacheHeader* pHeader = (HostCacheHeader*)baData.data();
+	memcpy( pHeader->szMagic, HOST_CACHE_MAGIC, sizeof( pHeader->szMagic ) );
+	pHeader->nVersion    = qToLittleEndian<quint16>( HOST_CACHE_CODE_VERSION );
+	pHeader->nRecordSize = qToLittleEndian<quint16>( sizeof( HostCacheRecord ) );
+	pHeader->nCount      = qToLittleEndian<quint32>( nCount );
+
+	HostCacheRecord* pRecord = (HostCacheRecord*)( pHeader + 1 );
+
+	foreach ( CHostCacheHost* pHost, m_lHosts )
 	{
-		m_tLastSave = tNow;
-		bReturn = true;
+		if ( pHost->m_oAddress.protocol() == QAbstractSocket::IPv4Protocol )
+		{
+			qToLittleEndian<quint32>( pHost->m_oAddress.toIPv4Address(), pRecord->pAddress );
+			pRecord->nAddressType = 4;
+		}
+		else
+		{
+			Q_IPV6ADDR oIPv6 = pHost->m_oAddress.toIPv6Address();
+			memcpy( pRecord->pAddress, &oIPv6, sizeof( Q_IPV6ADDR ) );
+			pRecord->nAddressType = 6;
+		}
 
-		systemLog.postLog( LogSeverity::Debug,
-						   m_sMessage + QObject::tr( "Saved %1 hosts." ).arg( nCount ) );
+		pRecord->nPort        = qToLittleEndian<quint16>( pHost->m_oAddress.port() );
+		pRecord->nFailures    = qToLittleEndian<quint32>( pHost->m_nFailures );
+		pRecord->tTimestamp   = qToLittleEndian<quint32>( pHost->m_tTimestamp );
+		pRecord->tLastConnect = qToLittleEndian<quint32>( pHost->m_tLastConnect );
+
+		++pRecord;
 	}
-	else
+
+	if ( !m_pSaver )
 	{
-		bReturn = false;
+		m_pSaver = new CHostCacheSaver();
 	}
 
-	return bReturn;
+	m_pSaver->queue( baData, m_sMessage );
+	m_tLastSave = tNow;
+
+	return true;
+}
+
+/**
+  * Blocks until the snapshots queued by save() are on disk. Call without holding m_pSection.
+  */
+void CHostCache::waitForSave()
+{
+	if ( m_pSaver )
+	{
+		m_pSaver->wait();
+	}
 }
 
 void CHostCache::load()
@@ -359,7 +542,97 @@ void CHostCache::load()
 	if ( !file.exists() || !file.open( QIODevice::ReadOnly ) )
 		return;
 
-	QDataStream oStream( &file );
+	const quint32 tNow   = common::getTNowUTC();
+	const qint64  nSize  = file.size();
+
+	if ( file.peek( sizeof( HOST_CACHE_MAGIC ) - 1 ) == HOST_CACHE_MAGIC )
+	{
+		// records are read straight from the mapping, fall back to reading the file if it can't be mapped
+		uchar* pData = file.map( 0, nSize );
+
+		if ( pData )
+		{
+			loadRecords( pData, nSize, tNow );
+			file.unmap( pData );
+		}
+		else
+		{
+			QByteArray baData = file.readAll();
+			loadRecords( (const uchar*)baData.constData(), baData.size(), tNow );
+		}
+	}
+	else
+	{
+		loadLegacy( file, tNow );
+	}
+
+	file.close();
+
+	pruneOldHosts( tNow );
+
+	systemLog.postLog( LogSeverity::Debug,
+					   m_sMessage + QObject::tr( "Loaded %1 hosts." ).arg( m_lHosts.size() ) );
+}
+
+/**
+  * Helper method for load(), reads the current fixed record format.
+  * Requires Locking: RW
+  */
+void CHostCache::loadRecords(const uchar* pData, qint64 nLength, const quint32 tNow)
+{
+	if ( nLength < (qint64)sizeof( HostCacheHeader ) )
+		return;
+
+	const HostCacheHeader* pHeader = (const HostCacheHeader*)pData;
+	const quint16 nVersion    = qFromLittleEndian<quint16>( pHeader->nVersion );
+	const quint16 nRecordSize = qFromLittleEndian<quint16>( pHeader->nRecordSize );
+	quint32       nCount      = qFromLittleEndian<quint32>( pHeader->nCount );
+
+	// newer versions may only append fields to the record
+	if ( nVersion < HOST_CACHE_CODE_VERSION || nRecordSize < sizeof( HostCacheRecord ) )
+		return;
+
+	// a truncated file still gives its complete records
+	nCount = (quint32)qMin<qint64>( nCount, ( nLength - sizeof( HostCacheHeader ) ) / nRecordSize );
+
+	const uchar* pRecords = pData + sizeof( HostCacheHeader );
+
+	// saved newest first, add oldest first so equal timestamps keep their order
+	for ( quint32 i = nCount; i > 0; --i )
+	{
+		HostCacheRecord oRecord;
+		memcpy( &oRecord, pRecords + (qint64)( i - 1 ) * nRecordSize, sizeof( HostCacheRecord ) );
+
+		CEndPoint oAddress;
+		if ( oRecord.nAddressType == 4 )
+		{
+			oAddress.setAddress( qFromLittleEndian<quint32>( oRecord.pAddress ) );
+		}
+		else if ( oRecord.nAddressType == 6 )
+		{
+			Q_IPV6ADDR oIPv6;
+			memcpy( &oIPv6, oRecord.pAddress, sizeof( Q_IPV6ADDR ) );
+			oAddress.setAddress( oIPv6 );
+		}
+		else
+		{
+			continue;
+		}
+		oAddress.setPort( qFromLittleEndian<quint16>( oRecord.nPort ) );
+
+		restore( oAddress, qFromLittleEndian<quint32>( oRecord.tTimestamp ),
+				 qFromLittleEndian<quint32>( oRecord.nFailures ),
+				 qFromLittleEndian<quint32>( oRecord.tLastConnect ), tNow );
+	}
+}
+
+/**
+  * Helper method for load(), reads version 6 QDataStream files so an upgrade keeps the cache.
+  * Requires Locking: RW
+  */
+void CHostCache::loadLegacy(QFile& oFile, const quint32 tNow)
+{
+	QDataStream oStream( &oFile );
 
 	quint16 nVersion;
 	quint32 nCount;
@@ -367,18 +640,14 @@ void CHostCache::load()
 	oStream >> nVersion;
 	oStream >> nCount;
 
-	const quint32 tNow   = common::getTNowUTC();
-
-	if ( nVersion == HOST_CACHE_CODE_VERSION ) // else do load defaults
+	if ( nVersion == 6 ) // else do load defaults
 	{
 		CEndPoint oAddress;
 		quint32 nFailures    = 0;
 		quint32 tTimeStamp   = 0;
 		quint32 tLastConnect = 0;
 
-		CHostCacheHost* pHost = NULL;
-
-		while ( nCount )
+		while ( nCount && !oStream.atEnd() )
 		{
 			oStream >> oAddress;
 			oStream >> nFailures;
@@ -386,44 +655,51 @@ void CHostCache::load()
 			oStream >> tTimeStamp;
 			oStream >> tLastConnect;
 
-			if ( tTimeStamp - tNow > 0 )
-				tTimeStamp = tNow - 60;
-
-			pHost = add( oAddress, tTimeStamp );
-			if ( pHost )
-			{
-				if ( tLastConnect - tNow > 0 )
-					tLastConnect = tNow - 60;
-
-				pHost->m_nFailures    = nFailures;
-				pHost->m_tLastConnect = tLastConnect;
-			}
+			restore( oAddress, tTimeStamp, nFailures, tLastConnect, tNow );
 
 			--nCount;
-			pHost = NULL;
 		}
 	}
+}
 
-	file.close();
+/**
+  * Adds a host read from disk along with its connection history.
+  * Requires Locking: RW
+  */
+void CHostCache::restore(const CEndPoint& oAddress, quint32 tTimeStamp, quint32 nFailures,
+						 quint32 tLastConnect, const quint32 tNow)
+{
+	if ( tTimeStamp > tNow )
+		tTimeStamp = tNow - 60;
 
-	pruneOldHosts( tNow );
+	CHostCacheHost* pHost = add( oAddress, tTimeStamp );
 
-	systemLog.postLog( LogSeverity::Debug,
-					   m_sMessage + QObject::tr( "Loaded %1 hosts." ).arg( m_lHosts.size() ) );
+	if ( pHost && (int)nFailures > quazaaSettings.Connection.FailureLimit )
+	{
+		remove( pHost );
+	}
+	else if ( pHost )
+	{
+		if ( tLastConnect > tNow )
+			tLastConnect = tNow - 60;
+
+		unlinkConnectable( pHost );
+		pHost->m_nFailures    = nFailures;
+		pHost->m_tLastConnect = tLastConnect;
+		linkConnectable( pHost );
+	}
 }
 
 void CHostCache::pruneOldHosts(const quint32 tNow)
 {
-	QMutableListIterator<CHostCacheHost*> it( m_lHosts );
-	it.toBack();
-
-	while ( it.hasPrevious() )
+	// oldest hosts are at the end
+	while ( !m_lHosts.isEmpty() )
 	{
-		it.previous();
-		if ( (qint64)( tNow - it.value()->m_tTimestamp ) > quazaaSettings.Gnutella2.HostExpire )
+		CHostCacheHost* pHost = ( --m_lHosts.end() ).value();
+		if ( (qint64)( tNow - pHost->m_tTimestamp ) > quazaaSettings.Gnutella2.HostExpire )
 		{
-			delete it.value();
-			it.remove();
+			unlink( pHost );
+			delete pHost;
 		}
 		else
 		{
@@ -436,44 +712,58 @@ void CHostCache::pruneByQueryAck(const quint32 tNow)
 {
 	for ( CHostCacheIterator it = m_lHosts.begin(); it != m_lHosts.end(); )
 	{
-		if ( (*it)->m_tAck && tNow - (*it)->m_tAck > quazaaSettings.Gnutella2.QueryHostDeadline )
-		{
-			delete *it;
-			it = m_lHosts.erase( it );
-		}
-		else
+		CHostCacheHost* pHost = *it;
+		++it;
+
+		if ( pHost->m_tAck && tNow - pHost->m_tAck > quazaaSettings.Gnutella2.QueryHostDeadline )
 		{
-			++it;
+			unlink( pHost );
+			delete pHost;
 		}
 	}
 }
 
 /**
-  * Helper method for save()
-  * Requires Locking: R
+  * Adds pHost to all indices, as the newest host of its timestamp.
+  * Requires Locking: RW
   */
-quint32 CHostCache::writeToFile(const void * const pManager, QFile& oFile)
+void CHostCache::link(CHostCacheHost* pHost)
 {
-	QDataStream oStream( &oFile );
-	CHostCache* pHostCache = (CHostCache*)pManager;
+	++m_nSequence;
 
-	const quint16 nVersion = HOST_CACHE_CODE_VERSION;
-	const quint32 nCount   = (quint32)pHostCache->m_lHosts.size();
+	// inverted, so ascending map order is newest first
+	pHost->m_nTimeKey = ( (quint64)~pHost->m_tTimestamp << 32 ) | (quint32)~m_nSequence;
+
+	m_lHosts.insert( pHost->m_nTimeKey, pHost );
+	m_lAddresses.insert( pHost->m_oAddress, pHost );
+	linkConnectable( pHost );
+}
 
-	oStream << nVersion;
-	oStream << nCount;
+/**
+  * Removes pHost from all indices, does not delete it.
+  * Requires Locking: RW
+  */
+void CHostCache::unlink(CHostCacheHost* pHost)
+{
+	unlinkConnectable( pHost );
+	m_lAddresses.remove( pHost->m_oAddress );
+	m_lHosts.remove( pHost->m_nTimeKey );
+}
 
-	if ( nCount )
+void CHostCache::linkConnectable(CHostCacheHost* pHost)
+{
+	if ( (quint32)m_lConnectable.size() <= pHost->m_nFailures )
 	{
-		foreach ( CHostCacheHost* pHost, pHostCache->m_lHosts )
-		{
-			oStream << pHost->m_oAddress;
-			oStream << pHost->m_nFailures;
-			oStream << pHost->m_tTimestamp;
-			oStream << pHost->m_tLastConnect;
-		}
+		m_lConnectable.resize( pHost->m_nFailures + 1 );
 	}
 
-	return nCount;
+	m_lConnectable[pHost->m_nFailures].insert( connectKey( pHost ), pHost );
 }
 
+void CHostCache::unlinkConnectable(CHostCacheHost* pHost)
+{
+	if ( (quint32)m_lConnectable.size() > pHost->m_nFailures )
+	{
+		m_lConnectable[pHost->m_nFailures].remove( connectKey( pHost ) );
+	}
+}
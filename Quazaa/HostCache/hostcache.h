@@ -26,30 +26,44 @@
 #define HOSTCACHE_H
 
 #include <QMutex>
+#include <QMap>
+#include <QHash>
+#include <QVector>
 
 #include "hostcachehost.h"
 
 // Increment this if there have been made changes to the way of storing Host Cache Hosts.
-#define HOST_CACHE_CODE_VERSION	6
+#define HOST_CACHE_CODE_VERSION	7
 // History:
 // 4 - Initial implementation.
 // 6 - Fixed Hosts having an early date and changed time storage from QDateTime to quint32.
+// 7 - Fixed size little endian records behind a magic header, see HostCacheRecord.
 
 class QFile;
+class CHostCacheSaver;
 
-typedef QList<CHostCacheHost*>::iterator CHostCacheIterator;
+typedef QMap<quint64, CHostCacheHost*>::iterator CHostCacheIterator;
 
+// Hosts are indexed three ways: by address, by timestamp (m_lHosts, newest first)
+// and by failure count, then last connection attempt (m_lConnectable).
+// Change m_tTimestamp, m_nFailures and m_tLastConnect through CHostCache only, so the indices stay in sync.
 class CHostCache
 {
 
 public:
-	QList<CHostCacheHost*>  m_lHosts;
+	QMap<quint64, CHostCacheHost*>  m_lHosts;       // by CHostCacheHost::m_nTimeKey
 	mutable QMutex          m_pSection;
 	quint32                 m_tLastSave;
 
 	quint32                 m_nMaxCacheHosts;
 	QString                 m_sMessage;
 
+protected:
+	QHash<CEndPoint, CHostCacheHost*>           m_lAddresses;
+	QVector< QMap<quint64, CHostCacheHost*> >   m_lConnectable; // [failures], by connectKey()
+	quint32                 m_nSequence;    // tie breaker for equal timestamps
+	CHostCacheSaver*        m_pSaver;       // writes snapshots in the background
+
 public:
 	CHostCache();
 	~CHostCache();
@@ -73,21 +87,36 @@ public:
 	QString getXTry();
 
 	void onFailure(CEndPoint addr);
+	void onSuccess(CEndPoint addr);
+	void onSuccess(CHostCacheHost* pHost);
+	void onConnect(CHostCacheHost* pHost, const quint32 tNow);
 	CHostCacheHost* get();
 	CHostCacheHost* getConnectable(const quint32 tNow = common::getTNowUTC(),
 	                               QList<CHostCacheHost*> oExcept = QList<CHostCacheHost*>(),
 	                               QString sCountry = QString("ZZ"));
 
 	bool save(const quint32 tNow);
+	void waitForSave();
 	void load();
 
 	void pruneOldHosts(const quint32 tNow);
 	void pruneByQueryAck(const quint32 tNow);
 
-	static quint32 writeToFile(const void * const pManager, QFile& oFile);
-
 	inline quint32 count();
 	inline bool isEmpty();
+
+protected:
+	void link(CHostCacheHost* pHost);
+	void unlink(CHostCacheHost* pHost);
+	void linkConnectable(CHostCacheHost* pHost);
+	void unlinkConnectable(CHostCacheHost* pHost);
+
+	void loadRecords(const uchar* pData, qint64 nLength, const quint32 tNow);
+	void loadLegacy(QFile& oFile, const quint32 tNow);
+	void restore(const CEndPoint& oAddress, quint32 tTimeStamp, quint32 nFailures,
+				 quint32 tLastConnect, const quint32 tNow);
+
+	static inline quint64 connectKey(const CHostCacheHost* pHost);
 };
 
 CHostCacheHost* CHostCache::take(CEndPoint oHost)
@@ -101,6 +130,12 @@ CHostCacheHost* CHostCache::take(CHostCacheHost *pHost)
 	return it == m_lHosts.end() ? NULL : *it;
 }
 
+// Least recently tried first, ties go to the host linked last
+quint64 CHostCache::connectKey(const CHostCacheHost* pHost)
+{
+	return ( (quint64)pHost->m_tLastConnect << 32 ) | (quint32)pHost->m_nTimeKey;
+}
+
 quint32 CHostCache::count()
 {
 	return m_lHosts.size();
@@ -24,16 +24,6 @@
 
 #include "hostcachehost.h"
 
-template<>
-class qLess <CHostCacheHost*>
-{
-public:
-	inline bool operator()(const CHostCacheHost* l, const CHostCacheHost* r) const
-	{
-		return l->m_tTimestamp > r->m_tTimestamp;
-	}
-};
-
 CHostCacheHost::CHostCacheHost(CEndPoint oAddress, quint32 tTimestamp) :
 	m_oAddress( oAddress ),
 	m_tTimestamp( tTimestamp ),
@@ -44,7 +34,8 @@ CHostCacheHost::CHostCacheHost(CEndPoint oAddress, quint32 tTimestamp) :
 	m_tLastQuery(   0 ),
 	m_tRetryAfter(  0 ),
 	m_tLastConnect( 0 ),
-	m_nFailures(    0 )
+	m_nFailures(    0 ),
+	m_nTimeKey(     0 )
 {
 }
 
@@ -84,7 +75,6 @@ bool CHostCacheHost::canQuery(const quint32 tNow)
 void CHostCacheHost::setKey(quint32 nKey, const quint32 tNow, CEndPoint* pHost)
 {
 	m_tAck      = 0;
-	m_nFailures = 0;
 	m_nQueryKey = nKey;
 	m_nKeyTime  = tNow;
 	m_nKeyHost  = pHost ? *pHost : Network.GetLocalAddress();
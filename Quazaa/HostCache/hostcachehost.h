@@ -47,6 +47,8 @@ public:
 	quint32     m_nFailures;
 
 private:
+	quint64     m_nTimeKey;     // key in CHostCache::m_lHosts, newest first
+
 	CHostCacheHost(CEndPoint oAddress, quint32 tTimestamp);
 public:
 	~CHostCacheHost();
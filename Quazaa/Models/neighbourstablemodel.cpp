@@ -39,65 +39,56 @@
 
 #include "debug_new.h"
 
-CNeighboursTableModel::Neighbour::Neighbour(CNeighbour* pNeighbour) : pNode( pNeighbour )
+CNeighboursTableModel::Neighbour::Neighbour(const NeighbourStats& oStats) : pNode( oStats.m_pNode )
 {
-	quint32 tNow = time(0);
-
-	sHandshake      = pNode->m_sHandshake;
-	oAddress        = pNode->address();
-	tConnected      = tNow - pNode->m_tConnected;
-	nBandwidthIn    = pNode->m_mInput.Usage();
-	nBandwidthOut   = pNode->m_mOutput.Usage();
-	nBytesReceived  = pNode->m_mInput.m_nTotal;
-	nBytesSent      = pNode->m_mOutput.m_nTotal;
-	nCompressionIn  = pNode->GetTotalInDecompressed();
-	nCompressionOut = pNode->GetTotalOutCompressed();
+	sHandshake      = oStats.m_sHandshake;
+	oAddress        = oStats.m_oAddress;
+	tConnected      = oStats.m_tConnected;
+	nBandwidthIn    = oStats.m_nBandwidthIn;
+	nBandwidthOut   = oStats.m_nBandwidthOut;
+	nBytesReceived  = oStats.m_nBytesReceived;
+	nBytesSent      = oStats.m_nBytesSent;
+	nCompressionIn  = oStats.m_nCompressionIn;
+	nCompressionOut = oStats.m_nCompressionOut;
 	nLeafCount      = 0;
 	nLeafMax        = 0;
-	nPacketsIn      = pNode->m_nPacketsIn;
-	nPacketsOut     = pNode->m_nPacketsOut;
-	nRTT            = pNode->m_tRTT;
-	nState          = pNode->m_nState;
+	nPacketsIn      = oStats.m_nPacketsIn;
+	nPacketsOut     = oStats.m_nPacketsOut;
+	nRTT            = oStats.m_tRTT;
+	nState          = oStats.m_nState;
 	nType           = G2_UNKNOWN;
-	sUserAgent      = pNode->m_sUserAgent;
+	sUserAgent      = oStats.m_sUserAgent;
 	sCountryCode    = oAddress.country();
 	sCountry        = geoIP.countryNameFromCode( sCountryCode );
 	iCountry        = QIcon(":/Resource/Flags/" + sCountryCode.toLower() + ".png");
 
-	switch( pNode->m_nProtocol )
+	switch( oStats.m_nProtocol )
 	{
 	case dpG2:
 		nDiscoveryProtocol = dpG2;
-		nLeafCount = ((CG2Node*)pNode)->m_nLeafCount;
-		nLeafMax   = ((CG2Node*)pNode)->m_nLeafMax;
-		nType      = ((CG2Node*)pNode)->m_nType;
+		nLeafCount = oStats.m_nLeafCount;
+		nLeafMax   = oStats.m_nLeafMax;
+		nType      = oStats.m_nType;
 		break;
 
 	default:
 		break;
 	}
 
-	iNetwork = CNetworkIconProvider::icon( pNode->m_nProtocol );
+	iNetwork = CNetworkIconProvider::icon( oStats.m_nProtocol );
 }
 
 bool CNeighboursTableModel::Neighbour::update(int row, int col, QModelIndexList& to_update,
-											  CNeighboursTableModel* model)
+											  CNeighboursTableModel* model, const NeighbourStats& oStats)
 {
-	if ( !Neighbours.NeighbourExists( pNode ) )
-	{
-		return false;
-	}
-
 	bool bRet = false;
 
-	quint32 tNow = time(0);
-
-	sHandshake = pNode->m_sHandshake;
+	sHandshake = oStats.m_sHandshake;
 
-	if ( oAddress != pNode->address() )
+	if ( oAddress != oStats.m_oAddress )
 	{
 		to_update.append( model->index( row, ADDRESS ) );
-		oAddress = pNode->address();
+		oAddress = oStats.m_oAddress;
 
 		if ( col == ADDRESS )
 		{
@@ -105,9 +96,9 @@ bool CNeighboursTableModel::Neighbour::update(int row, int col, QModelIndexList&
 		}
 	}
 
-	if ( nState != pNode->m_nState && nState != nsConnected )
+	if ( nState != oStats.m_nState && nState != nsConnected )
 	{
-		nState = pNode->m_nState;
+		nState = oStats.m_nState;
 		to_update.append( model->index( row, TIME ) );
 
 		if ( col == TIME )
@@ -117,7 +108,7 @@ bool CNeighboursTableModel::Neighbour::update(int row, int col, QModelIndexList&
 	}
 	else if ( nState == nsConnected )
 	{
-		tConnected = tNow - pNode->m_tConnected;
+		tConnected = oStats.m_tConnected;
 		to_update.append( model->index( row, TIME ) );
 
 		if ( col == TIME )
@@ -126,8 +117,8 @@ bool CNeighboursTableModel::Neighbour::update(int row, int col, QModelIndexList&
 		}
 	}
 
-	nBandwidthIn  = pNode->m_mInput.Usage();
-	nBandwidthOut = pNode->m_mOutput.Usage();
+	nBandwidthIn  = oStats.m_nBandwidthIn;
+	nBandwidthOut = oStats.m_nBandwidthOut;
 	to_update.append( model->index( row, BANDWIDTH ) );
 
 	if ( col == BANDWIDTH )
@@ -135,10 +126,10 @@ bool CNeighboursTableModel::Neighbour::update(int row, int col, QModelIndexList&
 		bRet = true;
 	}
 
-	nBytesReceived  = pNode->m_mInput.m_nTotal;
-	nBytesSent      = pNode->m_mOutput.m_nTotal;
-	nCompressionIn  = pNode->GetTotalInDecompressed();
-	nCompressionOut = pNode->GetTotalOutCompressed();
+	nBytesReceived  = oStats.m_nBytesReceived;
+	nBytesSent      = oStats.m_nBytesSent;
+	nCompressionIn  = oStats.m_nCompressionIn;
+	nCompressionOut = oStats.m_nCompressionOut;
 	to_update.append( model->index(row, BYTES));
 
 	if ( col == BYTES )
@@ -146,10 +137,10 @@ bool CNeighboursTableModel::Neighbour::update(int row, int col, QModelIndexList&
 		bRet = true;
 	}
 
-	if ( nPacketsIn != pNode->m_nPacketsIn || nPacketsOut != pNode->m_nPacketsOut )
+	if ( nPacketsIn != oStats.m_nPacketsIn || nPacketsOut != oStats.m_nPacketsOut )
 	{
-		nPacketsIn  = pNode->m_nPacketsIn;
-		nPacketsOut = pNode->m_nPacketsOut;
+		nPacketsIn  = oStats.m_nPacketsIn;
+		nPacketsOut = oStats.m_nPacketsOut;
 		to_update.append( model->index( row, PACKETS ) );
 
 		if ( col == PACKETS )
@@ -158,9 +149,9 @@ bool CNeighboursTableModel::Neighbour::update(int row, int col, QModelIndexList&
 		}
 	}
 
-	if( nRTT != pNode->m_tRTT )
+	if( nRTT != oStats.m_tRTT )
 	{
-		nRTT = pNode->m_tRTT;
+		nRTT = oStats.m_tRTT;
 		to_update.append( model->index( row, PING ) );
 		if ( col == PING )
 		{
@@ -168,9 +159,9 @@ bool CNeighboursTableModel::Neighbour::update(int row, int col, QModelIndexList&
 		}
 	}
 
-	if ( sUserAgent != pNode->m_sUserAgent )
+	if ( sUserAgent != oStats.m_sUserAgent )
 	{
-		sUserAgent = pNode->m_sUserAgent;
+		sUserAgent = oStats.m_sUserAgent;
 		to_update.append( model->index( row, USER_AGENT ) );
 
 		if ( col == USER_AGENT )
@@ -179,14 +170,14 @@ bool CNeighboursTableModel::Neighbour::update(int row, int col, QModelIndexList&
 		}
 	}
 
-	switch ( pNode->m_nProtocol )
+	switch ( oStats.m_nProtocol )
 	{
 	case dpG2:
-		if ( nLeafCount != ((CG2Node*)pNode)->m_nLeafCount ||
-			 nLeafMax   != ((CG2Node*)pNode)->m_nLeafMax )
+		if ( nLeafCount != oStats.m_nLeafCount ||
+			 nLeafMax   != oStats.m_nLeafMax )
 		{
-			nLeafCount = ((CG2Node*)pNode)->m_nLeafCount;
-			nLeafMax   = ((CG2Node*)pNode)->m_nLeafMax;
+			nLeafCount = oStats.m_nLeafCount;
+			nLeafMax   = oStats.m_nLeafMax;
 			to_update.append( model->index( row, LEAVES ) );
 
 			if ( col == LEAVES )
@@ -195,9 +186,9 @@ bool CNeighboursTableModel::Neighbour::update(int row, int col, QModelIndexList&
 			}
 		}
 
-		if ( nType != ((CG2Node*)pNode)->m_nType )
+		if ( nType != oStats.m_nType )
 		{
-			nType = ((CG2Node*)pNode)->m_nType;
+			nType = oStats.m_nType;
 			to_update.append( model->index( row, MODE ) );
 
 			if ( col == MODE )
@@ -628,15 +619,17 @@ CNeighbour* CNeighboursTableModel::NodeFromIndex(const QModelIndex& index)
 
 void CNeighboursTableModel::AddNode(CNeighbour* pNode)
 {
-	Neighbours.m_pSection.lock();
-	if ( Neighbours.NeighbourExists( pNode ) )
+	NeighboursSnapshotPtr pSnapshot = Neighbours.GetSnapshot();
+	const NeighbourStats* pStats = pSnapshot->Find( pNode );
+
+	// not in the snapshot means it is already gone
+	if ( pStats )
 	{
 		beginInsertRows( QModelIndex(), m_lNodes.size(), m_lNodes.size() );
-		m_lNodes.append( new Neighbour( pNode ) );
+		m_lNodes.append( new Neighbour( *pStats ) );
 		endInsertRows();
 		m_bNeedSorting = true;
 	}
-	Neighbours.m_pSection.unlock();
 }
 
 void CNeighboursTableModel::RemoveNode(CNeighbour* pNode)
@@ -680,17 +673,16 @@ void CNeighboursTableModel::UpdateAll()
 	QModelIndexList uplist;
 	bool bSort = m_bNeedSorting;
 
-	if ( Neighbours.m_pSection.tryLock() )
+	NeighboursSnapshotPtr pSnapshot = Neighbours.GetSnapshot();
+
+	for ( int i = 0, max = m_lNodes.count(); i < max; ++i )
 	{
-		for ( int i = 0, max = m_lNodes.count(); i < max; ++i )
+		const NeighbourStats* pStats = pSnapshot->Find( m_lNodes[i]->pNode );
+
+		if ( pStats && m_lNodes[i]->update(i, m_nSortColumn, uplist, this, *pStats) )
 		{
-			if ( m_lNodes[i]->update(i, m_nSortColumn, uplist, this) )
-			{
-				bSort = true;
-			}
+			bSort = true;
 		}
-
-		Neighbours.m_pSection.unlock();
 	}
 
 	if ( bSort )
@@ -33,6 +33,7 @@
 #include <QIcon>
 
 class CNeighbour;
+struct NeighbourStats;
 
 class CNeighboursTableModel : public QAbstractTableModel
 {
@@ -82,8 +83,8 @@ public:
         QIcon		  iNetwork;
 		QIcon		  iCountry;
 
-		Neighbour(CNeighbour* pNeighbour);
-		bool update(int row, int col, QModelIndexList& to_update, CNeighboursTableModel* model);
+		Neighbour(const NeighbourStats& oStats);
+		bool update(int row, int col, QModelIndexList& to_update, CNeighboursTableModel* model, const NeighbourStats& oStats);
 		QVariant data(int col) const;
 		bool lessThan(int col, CNeighboursTableModel::Neighbour* pOther) const;
 
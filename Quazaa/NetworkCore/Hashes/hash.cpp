@@ -131,7 +131,7 @@ CHash* CHash::FromURN(QString sURN)
 		{
 			// valid sha1/base32
 			cyoBase32Decode( (char*)&pVal, baValue.data(), baValue.length() );
-			CHash* pRet = new CHash(QByteArray( (char*)&pVal ), CHash::SHA1);
+			CHash* pRet = new CHash(QByteArray( (char*)&pVal, ByteCount(CHash::SHA1) ), CHash::SHA1);
 			return pRet;
 		}
 	}
@@ -140,7 +140,7 @@ CHash* CHash::FromURN(QString sURN)
 		if(cyoBase16Validate(baValue.data(), baValue.length()) == 0)
 		{
 			cyoBase16Decode((char*)&pVal, baValue.data(), baValue.length());
-			CHash* pRet = new CHash(QByteArray((char*)&pVal), CHash::MD5);
+			CHash* pRet = new CHash(QByteArray((char*)&pVal, ByteCount(CHash::MD5)), CHash::MD5);
 			return pRet;
 		}
 	}
@@ -66,6 +66,15 @@ public:
 		return *this;
 	}
 
+	// Exchanges contents and allocations, nothing is copied
+	inline void swap(CBuffer& other)
+	{
+		qSwap(m_pBuffer, other.m_pBuffer);
+		qSwap(m_nLength, other.m_nLength);
+		qSwap(m_nBuffer, other.m_nBuffer);
+		qSwap(m_nMinimum, other.m_nMinimum);
+	}
+
 public:
 	CBuffer(quint32 nMinimum = 1024u);
 	~CBuffer();
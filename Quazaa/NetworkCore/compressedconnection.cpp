@@ -25,9 +25,12 @@
 #include "compressedconnection.h"
 #include "buffer.h"
 #include "systemlog.h"
+#include "quazaasettings.h"
 
 #include "debug_new.h"
 
+QAtomicInt CCompressedConnection::m_nTotalZlibMemory;
+
 CCompressedConnection::CCompressedConnection(QObject* parent) :
 	CNetworkConnection(parent)
 {
@@ -46,9 +49,16 @@ CCompressedConnection::CCompressedConnection(QObject* parent) :
 	m_nNextDeflateFlush = 4096;
 	m_bOutputPending = false;
 
+	m_nSampleOut = m_nSampleOutCom = 0;
+	m_nStoredSamples = 0;
+	m_nZlibMemory = 0;
+
 	memset(&m_sInput, 0, sizeof(z_stream));
 	memset(&m_sOutput, 0, sizeof(z_stream));
 
+	m_sInput.zalloc = m_sOutput.zalloc = &CCompressedConnection::ZAlloc;
+	m_sInput.zfree = m_sOutput.zfree = &CCompressedConnection::ZFree;
+	m_sInput.opaque = m_sOutput.opaque = this;
 }
 CCompressedConnection::~CCompressedConnection()
 {
@@ -73,11 +83,11 @@ bool CCompressedConnection::EnableInputCompression(bool bEnable)
 
 	return true;
 }
-bool CCompressedConnection::EnableOutputCompression(bool bEnable)
+bool CCompressedConnection::EnableOutputCompression(bool bEnable, int nWindowBits, int nMemLevel)
 {
 	if(bEnable && !m_bCompressedOutput)
 	{
-		bool bRet = SetupOutputStream();
+		bool bRet = SetupOutputStream(nWindowBits, nMemLevel);
 		if(bRet)
 		{
 			m_bCompressedOutput = true;
@@ -108,7 +118,7 @@ bool CCompressedConnection::SetupInputStream()
 	}
 	return true;
 }
-bool CCompressedConnection::SetupOutputStream()
+bool CCompressedConnection::SetupOutputStream(int nWindowBits, int nMemLevel)
 {
 	m_pZOutput = new CBuffer(8192);
 	if(m_pZOutput == 0)
@@ -116,15 +126,23 @@ bool CCompressedConnection::SetupOutputStream()
 		return false;
 	}
 
-	if(deflateInit(&m_sOutput, Z_DEFAULT_COMPRESSION) != Z_OK)
+	// the peer inflates with a full window, a smaller one on our side is always compatible
+	nWindowBits = qBound(9, nWindowBits, MAX_WBITS);
+	nMemLevel = qBound(1, nMemLevel, MAX_MEM_LEVEL);
+
+	if(deflateInit2(&m_sOutput, Z_DEFAULT_COMPRESSION, Z_DEFLATED, nWindowBits, nMemLevel, Z_DEFAULT_STRATEGY) != Z_OK)
 	{
 		delete m_pZOutput;
 		m_pZOutput = 0;
 		return false;
 	}
-	m_nNextDeflateFlush = m_nTotalOutput + 4096;
+	m_nNextDeflateFlush = m_nTotalOutputCom + quazaaSettings.Connection.DeflateFlushBytes;
 	m_tDeflateFlush.start();
 
+	m_nSampleOut = m_nTotalOutput;
+	m_nSampleOutCom = m_nTotalOutputCom;
+	m_nStoredSamples = 0;
+
 	return true;
 }
 void CCompressedConnection::CleanupInputStream()
@@ -239,15 +257,20 @@ void CCompressedConnection::Deflate()
 {
 	qint32 nFlushMode = Z_NO_FLUSH;
 
-	if(m_tDeflateFlush.elapsed() > 250ll || m_nTotalOutput > m_nNextDeflateFlush)
+	// small packets are batched into one flush, unless they have waited long enough
+	if(m_tDeflateFlush.elapsed() > qint64(quazaaSettings.Connection.DeflateFlushDelay) || m_nTotalOutputCom + m_pZOutput->size() >= m_nNextDeflateFlush)
 	{
 		nFlushMode = Z_SYNC_FLUSH;
-		m_nNextDeflateFlush += 4096;
-		m_tDeflateFlush.start();
 	}
 
-	if(m_pZOutput->size() == 0 && nFlushMode == Z_NO_FLUSH)
+	if(m_pZOutput->size() == 0 && (nFlushMode == Z_NO_FLUSH || !m_bOutputPending))
 	{
+		// nothing new since the last flush, don't send empty sync markers
+		if(nFlushMode == Z_SYNC_FLUSH)
+		{
+			m_nNextDeflateFlush = m_nTotalOutputCom + quazaaSettings.Connection.DeflateFlushBytes;
+			m_tDeflateFlush.start();
+		}
 		return;
 	}
 
@@ -285,9 +308,128 @@ void CCompressedConnection::Deflate()
 		}
 
 	}
-	while(m_sOutput.avail_in != 0);
+	while(m_sOutput.avail_in != 0 || m_sOutput.avail_out == 0);
 
 	m_bOutputPending = (nFlushMode == Z_NO_FLUSH);
 
+	if(nFlushMode == Z_SYNC_FLUSH)
+	{
+		m_nNextDeflateFlush = m_nTotalOutputCom + quazaaSettings.Connection.DeflateFlushBytes;
+		m_tDeflateFlush.start();
+
+		AdaptOutputCompression();
+	}
+}
+
+// Measures the ratio over samples of 64 KB and switches to stored blocks for a while
+// when compression does not pay off. The peer keeps receiving a valid deflate stream.
+void CCompressedConnection::AdaptOutputCompression()
+{
+	const quint64 nSampleIn = m_nTotalOutputCom - m_nSampleOutCom;
+	const quint64 nSampleOut = m_nTotalOutput - m_nSampleOut;
+
+	if(nSampleIn < 65536 || quazaaSettings.Connection.DeflateMinSaving <= 0)
+	{
+		return;
+	}
+
+	m_nSampleOut = m_nTotalOutput;
+	m_nSampleOutCom = m_nTotalOutputCom;
+
+	int nLevel = Z_DEFAULT_COMPRESSION;
+
+	if(m_nStoredSamples > 0)
+	{
+		if(--m_nStoredSamples > 0)
+		{
+			return;
+		}
+		// time to try compressing again
+	}
+	else
+	{
+		if(nSampleOut * 100 <= nSampleIn * (100 - quazaaSettings.Connection.DeflateMinSaving))
+		{
+			return;
+		}
+
+		nLevel = Z_NO_COMPRESSION;
+		m_nStoredSamples = 16;
+	}
+
+	// the stream was just flushed, so deflateParams() has nothing left to compress with the old level
+	if(m_pOutput->capacity() - m_pOutput->size() < 2048)
+	{
+		m_pOutput->ensure(2048u);
+	}
+
+	quint32 nOldSize = m_pOutput->size();
+
+	m_sOutput.next_in = Z_NULL;
+	m_sOutput.avail_in = 0;
+	m_sOutput.next_out = (Bytef*)m_pOutput->data() + nOldSize;
+	m_sOutput.avail_out = m_pOutput->capacity() - nOldSize;
+	m_sOutput.total_out = 0u;
+
+	qint32 nRet = deflateParams(&m_sOutput, nLevel, Z_DEFAULT_STRATEGY);
+
+	m_pOutput->resize(nOldSize + m_sOutput.total_out);
+	m_nTotalOutput += m_sOutput.total_out;
+
+	if(nRet != Z_OK)
+	{
+		systemLog.postLog(LogSeverity::Debug, QString("Could not change deflate level: %1").arg(nRet));
+		m_nStoredSamples = 0;
+	}
+}
+
+quint32 CCompressedConnection::CompressionMemory() const
+{
+	quint32 nMemory = m_nZlibMemory;
+
+	if(m_pZInput)
+	{
+		nMemory += m_pZInput->capacity();
+	}
+	if(m_pZOutput)
+	{
+		nMemory += m_pZOutput->capacity();
+	}
+
+	return nMemory;
+}
+quint32 CCompressedConnection::TotalCompressionMemory()
+{
+	return m_nTotalZlibMemory.fetchAndAddRelaxed(0);
+}
+
+// zlib allocators that account the memory of each stream.
+// The block size is kept in front of the block, 8 bytes keep zlib's data aligned.
+voidpf CCompressedConnection::ZAlloc(voidpf pOpaque, uInt nItems, uInt nSize)
+{
+	const quint32 nBytes = nItems * nSize;
+
+	char* pBlock = (char*)malloc(nBytes + 8);
+	if(!pBlock)
+	{
+		return Z_NULL;
+	}
+
+	*(quint32*)pBlock = nBytes;
+
+	static_cast<CCompressedConnection*>(pOpaque)->m_nZlibMemory += nBytes;
+	m_nTotalZlibMemory.fetchAndAddRelaxed(nBytes);
+
+	return pBlock + 8;
+}
+void CCompressedConnection::ZFree(voidpf pOpaque, voidpf pAddress)
+{
+	char* pBlock = (char*)pAddress - 8;
+	const quint32 nBytes = *(quint32*)pBlock;
+
+	static_cast<CCompressedConnection*>(pOpaque)->m_nZlibMemory -= nBytes;
+	m_nTotalZlibMemory.fetchAndAddRelaxed(-int(nBytes));
+
+	free(pBlock);
 }
 
@@ -27,6 +27,7 @@
 
 #include "networkconnection.h"
 #include <QElapsedTimer>
+#include <QAtomicInt>
 #include "zlib.h"
 
 
@@ -47,27 +48,43 @@ public:
 	quint64		m_nTotalInputDec;       // Total decompressed input in bytes.
 	quint64     m_nTotalOutput;         // Total output in bytes
 	quint64		m_nTotalOutputCom;      // Total decompressed output in bytes.
-	quint64     m_nNextDeflateFlush;    // Amount of bytes until a deflate buffer flush is triggered.
+	quint64     m_nNextDeflateFlush;    // m_nTotalOutputCom at which the batched output is flushed
 	bool        m_bOutputPending;       // Do we have data to send on the compressed output stream?
-	QElapsedTimer m_tDeflateFlush;      // Amount of time until a deflate buffer flush is triggered.
+	QElapsedTimer m_tDeflateFlush;      // Time since the last flush of the compressed output stream
+	quint64     m_nSampleOut;           // m_nTotalOutput when the current ratio sample started
+	quint64     m_nSampleOutCom;        // m_nTotalOutputCom when the current ratio sample started
+	int         m_nStoredSamples;       // samples left to send stored (uncompressed) deflate blocks
+	quint32     m_nZlibMemory;          // bytes zlib allocated for this connection's streams
+
+	static QAtomicInt m_nTotalZlibMemory;   // same, over all connections
 public:
 	CCompressedConnection(QObject* parent = 0);
 	virtual ~CCompressedConnection();
 
 	bool EnableInputCompression(bool bEnable = true);
-	bool EnableOutputCompression(bool bEnable = true);
+	// nWindowBits and nMemLevel bound the deflate state, see deflateInit2()
+	bool EnableOutputCompression(bool bEnable = true, int nWindowBits = MAX_WBITS, int nMemLevel = 8);
 
 	virtual qint64 readFromNetwork(qint64 nBytes);
 	virtual qint64 writeToNetwork(qint64 nBytes);
 
+	// Memory held for compression by this connection, zlib state and buffers
+	quint32 CompressionMemory() const;
+	// zlib state of all connections
+	static quint32 TotalCompressionMemory();
+
 protected:
 	bool SetupInputStream();
-	bool SetupOutputStream();
+	bool SetupOutputStream(int nWindowBits, int nMemLevel);
 	void CleanupInputStream();
 	void CleanupOutputStream();
 
 	void Inflate();
 	void Deflate();
+	void AdaptOutputCompression();
+
+	static voidpf ZAlloc(voidpf pOpaque, uInt nItems, uInt nSize);
+	static void ZFree(voidpf pOpaque, voidpf pAddress);
 
 public:
 	inline CBuffer* GetInputBuffer()
@@ -78,23 +95,19 @@ public:
 	{
 		return (m_bCompressedOutput ? m_pZOutput : m_pOutput);
 	}
-	inline virtual bool HasData()
+	inline virtual bool HasPendingOutput()
 	{
 		if(m_bOutputPending)
 		{
 			return true;
 		}
 
-		if(m_pZInput && !m_pZInput->isEmpty())
-		{
-			return true;
-		}
 		if(m_pZOutput && !m_pZOutput->isEmpty())
 		{
 			return true;
 		}
 
-		return CNetworkConnection::HasData();
+		return CNetworkConnection::HasPendingOutput();
 	}
 
 	float GetTotalInDecompressed()
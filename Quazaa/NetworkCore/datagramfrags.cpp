@@ -32,26 +32,70 @@
 
 #include "debug_new.h"
 
-DatagramIn::DatagramIn()
+DatagramSlab::DatagramSlab()
+{
+	m_pData = 0;
+	m_pLength = 0;
+	m_pFree = 0;
+	m_nFree = 0;
+	m_nSlots = 0;
+	m_nExhausted = 0;
+	m_nHeapBytes = 0;
+}
+DatagramSlab::~DatagramSlab()
 {
-	m_pBuffer = 0;
-	m_bLocked = 0;
-	m_nBuffer = 0;
+	Destroy();
 }
-DatagramIn::~DatagramIn()
+
+void DatagramSlab::Create(quint32 nSlots)
 {
-	if(m_pBuffer)
+	Destroy();
+
+	// slot numbers are 16 bit, GND_NO_SLOT is reserved
+	nSlots = qMin<quint32>(nSlots, GND_NO_SLOT);
+
+	m_nSlots = nSlots;
+	m_pData = new char[nSlots * GND_SLOT_SIZE];
+	m_pLength = new quint16[nSlots];
+	m_pFree = new quint16[nSlots];
+
+	// hand out low slots first
+	for(m_nFree = 0; m_nFree < nSlots; m_nFree++)
 	{
-		delete[] m_pBuffer;
+		m_pFree[m_nFree] = quint16(nSlots - 1 - m_nFree);
 	}
-	if(m_bLocked)
+
+	m_nExhausted = 0;
+}
+
+void DatagramSlab::Destroy()
+{
+	if(m_pData)
 	{
-		delete[] m_bLocked;
+		delete[] m_pData;
+		delete[] m_pLength;
+		delete[] m_pFree;
 	}
+
+	m_pData = 0;
+	m_pLength = 0;
+	m_pFree = 0;
+	m_nFree = 0;
+	m_nSlots = 0;
 }
 
-void DatagramIn::Create(CEndPoint pHost, quint8 nFlags, quint16 nSequence, quint8 nCount)
+DatagramIn::DatagramIn()
 {
+	m_nCount = 0;
+	m_ppTimerList = 0;
+	m_bDone = false;
+}
+
+// Reserves a slab slot for every part, the caller checks there are enough free ones
+void DatagramIn::Create(CEndPoint pHost, quint8 nFlags, quint16 nSequence, quint8 nCount, DatagramSlab& oSlab)
+{
+	Q_ASSERT(oSlab.FreeCount() >= nCount);
+
 	m_oAddress = pHost;
 
 	m_nSequence = nSequence;
@@ -61,27 +105,14 @@ void DatagramIn::Create(CEndPoint pHost, quint8 nFlags, quint16 nSequence, quint
 
 	m_tStarted = time(0);
 
-	if(m_nBuffer < m_nCount)
-	{
-		if(m_pBuffer)
-		{
-			delete[] m_pBuffer;
-		}
-		if(m_bLocked)
-		{
-			delete[] m_bLocked;
-		}
+	memset(m_pReceived, 0x00, sizeof(m_pReceived));
 
-		m_nBuffer = nCount;
-		m_pBuffer = new CBuffer*[nCount];
-		m_bLocked = new bool[nCount];
+	for(int i = 0; i < nCount; i++)
+	{
+		m_pSlot[i] = oSlab.Alloc();
 	}
-
-	memset(m_bLocked, 0x00, sizeof(bool) * m_nBuffer);
-	memset(m_pBuffer, 0x00, sizeof(CBuffer*) * m_nBuffer);
-
 }
-bool DatagramIn::Add(quint8 nPart, const void* pData, qint32 nLength)
+bool DatagramIn::Add(quint8 nPart, const void* pData, qint32 nLength, DatagramSlab& oSlab)
 {
 	if(nPart < 1 || nPart > m_nCount)
 	{
@@ -93,10 +124,25 @@ bool DatagramIn::Add(quint8 nPart, const void* pData, qint32 nLength)
 		return false;
 	}
 
-	if(m_bLocked[nPart - 1] == false)
+	quint32 nBit = 1u << ((nPart - 1) & 31);
+	quint32& nWord = m_pReceived[(nPart - 1) >> 5];
+
+	if(!(nWord & nBit))
 	{
-		m_bLocked[nPart - 1] = true;
-		m_pBuffer[nPart - 1]->append((char*)pData, nLength);
+		nWord |= nBit;
+
+		quint16 nSlot = m_pSlot[nPart - 1];
+		if(nLength > GND_SLOT_SIZE)
+		{
+			m_lLarge.insert(nPart - 1, QByteArray((const char*)pData, nLength));
+			oSlab.m_nHeapBytes += nLength;
+			oSlab.Length(nSlot) = 0;
+		}
+		else
+		{
+			memcpy(oSlab.Data(nSlot), pData, nLength);
+			oSlab.Length(nSlot) = quint16(nLength);
+		}
 
 		if(--m_nLeft == 0)
 		{
@@ -106,45 +152,385 @@ bool DatagramIn::Add(quint8 nPart, const void* pData, qint32 nLength)
 
 	return false;
 }
-G2Packet* DatagramIn::ToG2Packet()
+
+// Gives the reserved slots back, the datagram itself stays valid
+void DatagramIn::Release(DatagramSlab& oSlab)
+{
+	for(int i = 0; i < m_nCount; i++)
+	{
+		if(m_pSlot[i] != GND_NO_SLOT)
+		{
+			oSlab.Free(m_pSlot[i]);
+			m_pSlot[i] = GND_NO_SLOT;
+		}
+	}
+
+	for(QMap<quint8, QByteArray>::const_iterator itPart = m_lLarge.constBegin(); itPart != m_lLarge.constEnd(); ++itPart)
+	{
+		oSlab.m_nHeapBytes -= itPart.value().size();
+	}
+	m_lLarge.clear();
+}
+
+// Joins the parts in pAssembly, which is reused between datagrams
+G2Packet* DatagramIn::ToG2Packet(CBuffer* pAssembly, DatagramSlab& oSlab)
 {
-	if(m_nCount > 1)
+	pAssembly->clear();
+
+	for(int i = 0; i < m_nCount; i++)
 	{
-		for(qint32 i = 1; i < m_nCount; i++)
+		QMap<quint8, QByteArray>::const_iterator itPart = m_lLarge.constFind(i);
+		if(itPart != m_lLarge.constEnd())
 		{
-			m_pBuffer[0]->append(*m_pBuffer[i]);
+			pAssembly->append(itPart.value().constData(), itPart.value().size());
+		}
+		else
+		{
+			pAssembly->append(oSlab.Data(m_pSlot[i]), oSlab.Length(m_pSlot[i]));
 		}
 	}
 
-	if(m_bCompressed && !ZLibUtils::Uncompress(*m_pBuffer[0]))
+	if(m_bCompressed && !ZLibUtils::Uncompress(*pAssembly))
 	{
 		throw packet_error();
 	}
 
-	return G2Packet::ReadBuffer(m_pBuffer[0]);
+	return G2Packet::ReadBuffer(pAssembly);
 }
 
-DatagramOut::DatagramOut()
+DatagramInCache::DatagramInCache()
 {
-	m_pLocked = 0;
-	m_pBuffer = 0;
-	m_nLocked = 0;
-	m_bAck = false;
+	m_pSlots = 0;
+	m_nMask = 0;
+	m_nCount = 0;
+	m_tCurrent = 0;
+	m_pExpired = 0;
+	m_pDoneFirst = 0;
+	m_pDoneLast = 0;
+	memset(m_pWheel, 0, sizeof(m_pWheel));
 }
-DatagramOut::~DatagramOut()
+DatagramInCache::~DatagramInCache()
 {
-	if(m_pLocked)
+	if(m_pSlots)
 	{
-		delete[] m_pLocked;
+		delete[] m_pSlots;
 	}
 }
-void DatagramOut::Create(CEndPoint oAddr, G2Packet* pPacket, quint16 nSequence, CBuffer* pBuffer, bool bAck)
+
+// Sizes the table for nFrames datagrams, keeps it at most half full
+void DatagramInCache::Reserve(quint32 nFrames)
 {
-	Q_ASSERT(m_pBuffer == 0);
+	Q_ASSERT(m_nCount == 0);
+
+	quint32 nCapacity = 16;
+	while(nCapacity < nFrames * 2)
+	{
+		nCapacity <<= 1;
+	}
 
+	if(!m_pSlots || nCapacity != m_nMask + 1)
+	{
+		if(m_pSlots)
+		{
+			delete[] m_pSlots;
+		}
+		m_pSlots = new DatagramIn*[nCapacity];
+		m_nMask = nCapacity - 1;
+	}
+
+	Clear();
+}
+
+// Forgets all datagrams, the caller owns them
+void DatagramInCache::Clear()
+{
+	if(m_pSlots)
+	{
+		memset(m_pSlots, 0, sizeof(DatagramIn*) * (m_nMask + 1));
+	}
+	memset(m_pWheel, 0, sizeof(m_pWheel));
+	m_nCount = 0;
+	m_tCurrent = 0;
+	m_pExpired = 0;
+	m_pDoneFirst = 0;
+	m_pDoneLast = 0;
+}
+
+quint32 DatagramInCache::Hash(const CEndPoint& oAddress, quint16 nSequence)
+{
+	quint32 nHash = qHash(static_cast<const QHostAddress&>(oAddress));
+	nHash ^= (quint32(oAddress.port()) << 16) | nSequence;
+	return nHash * 0x9E3779B1u;
+}
+
+DatagramIn* DatagramInCache::Find(const CEndPoint& oAddress, quint16 nSequence) const
+{
+	if(!m_nCount)
+	{
+		return 0;
+	}
+
+	quint32 nHash = Hash(oAddress, nSequence);
+
+	for(quint32 i = nHash & m_nMask; m_pSlots[i]; i = (i + 1) & m_nMask)
+	{
+		DatagramIn* pDG = m_pSlots[i];
+
+		if(pDG->m_nHash == nHash && pDG->m_nSequence == nSequence && pDG->m_oAddress == oAddress)
+		{
+			return pDG;
+		}
+	}
+
+	return 0;
+}
+
+void DatagramInCache::Insert(DatagramIn* pDG, quint32 tNow, quint32 tExpire)
+{
+	Q_ASSERT(m_pSlots && m_nCount < m_nMask);
+
+	if(!m_nCount)
+	{
+		// the wheel may have been idle for a while
+		m_tCurrent = tNow;
+	}
+
+	pDG->m_nHash = Hash(pDG->m_oAddress, pDG->m_nSequence);
+	pDG->m_bDone = false;
+	pDG->m_ppTimerList = 0;
+
+	quint32 i = pDG->m_nHash & m_nMask;
+	while(m_pSlots[i])
+	{
+		i = (i + 1) & m_nMask;
+	}
+	m_pSlots[i] = pDG;
+	m_nCount++;
+
+	Schedule(pDG, tExpire);
+}
+
+quint32 DatagramInCache::SlotOf(DatagramIn* pDG) const
+{
+	quint32 i = pDG->m_nHash & m_nMask;
+	while(m_pSlots[i] != pDG)
+	{
+		Q_ASSERT(m_pSlots[i]);
+		i = (i + 1) & m_nMask;
+	}
+	return i;
+}
+
+void DatagramInCache::Remove(DatagramIn* pDG)
+{
+	// backward shift deletion, no tombstones
+	quint32 i = SlotOf(pDG);
+	quint32 j = i;
+
+	m_pSlots[i] = 0;
+
+	for(;;)
+	{
+		j = (j + 1) & m_nMask;
+
+		if(!m_pSlots[j])
+		{
+			break;
+		}
+
+		// entries whose home slot lies cyclically in (i, j] stay where they are
+		quint32 k = m_pSlots[j]->m_nHash & m_nMask;
+		if((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+		{
+			continue;
+		}
+
+		m_pSlots[i] = m_pSlots[j];
+		m_pSlots[j] = 0;
+		i = j;
+	}
+
+	m_nCount--;
+
+	Unlink(pDG);
+
+	if(pDG->m_bDone)
+	{
+		if(pDG->m_pDonePrev)
+		{
+			pDG->m_pDonePrev->m_pDoneNext = pDG->m_pDoneNext;
+		}
+		else
+		{
+			m_pDoneFirst = pDG->m_pDoneNext;
+		}
+
+		if(pDG->m_pDoneNext)
+		{
+			pDG->m_pDoneNext->m_pDonePrev = pDG->m_pDonePrev;
+		}
+		else
+		{
+			m_pDoneLast = pDG->m_pDonePrev;
+		}
+
+		pDG->m_bDone = false;
+	}
+}
+
+void DatagramInCache::Link(DatagramIn* pDG, DatagramIn** ppList)
+{
+	pDG->m_ppTimerList = ppList;
+	pDG->m_pTimerPrev = 0;
+	pDG->m_pTimerNext = *ppList;
+	if(*ppList)
+	{
+		(*ppList)->m_pTimerPrev = pDG;
+	}
+	*ppList = pDG;
+}
+
+void DatagramInCache::Unlink(DatagramIn* pDG)
+{
+	if(!pDG->m_ppTimerList)
+	{
+		return;
+	}
+
+	if(pDG->m_pTimerPrev)
+	{
+		pDG->m_pTimerPrev->m_pTimerNext = pDG->m_pTimerNext;
+	}
+	else
+	{
+		*pDG->m_ppTimerList = pDG->m_pTimerNext;
+	}
+
+	if(pDG->m_pTimerNext)
+	{
+		pDG->m_pTimerNext->m_pTimerPrev = pDG->m_pTimerPrev;
+	}
+
+	pDG->m_ppTimerList = 0;
+}
+
+// (Re)arms the expiry timer of a cached datagram
+void DatagramInCache::Schedule(DatagramIn* pDG, quint32 tExpire)
+{
+	Unlink(pDG);
+
+	pDG->m_tExpire = tExpire;
+
+	if(tExpire <= m_tCurrent)
+	{
+		Link(pDG, &m_pExpired);
+		return;
+	}
+
+	quint32 nDelta = tExpire - m_tCurrent;
+
+	if(nDelta < DG_WHEEL_SIZE)
+	{
+		Link(pDG, &m_pWheel[0][tExpire & DG_WHEEL_MASK]);
+	}
+	else
+	{
+		// later than the second level reaches, expire at its horizon
+		if(nDelta >= DG_WHEEL_SIZE * (DG_WHEEL_SIZE - 1))
+		{
+			tExpire = m_tCurrent + DG_WHEEL_SIZE * (DG_WHEEL_SIZE - 1);
+			pDG->m_tExpire = tExpire;
+		}
+
+		Link(pDG, &m_pWheel[1][(tExpire >> DG_WHEEL_BITS) & DG_WHEEL_MASK]);
+	}
+}
+
+// Marks a datagram as reassembled. It stays cached to swallow duplicate fragments,
+// but can be reclaimed early when we run out of frames.
+void DatagramInCache::Complete(DatagramIn* pDG)
+{
+	if(pDG->m_bDone)
+	{
+		return;
+	}
+
+	pDG->m_bDone = true;
+	pDG->m_pDoneNext = 0;
+	pDG->m_pDonePrev = m_pDoneLast;
+	if(m_pDoneLast)
+	{
+		m_pDoneLast->m_pDoneNext = pDG;
+	}
+	else
+	{
+		m_pDoneFirst = pDG;
+	}
+	m_pDoneLast = pDG;
+}
+
+void DatagramInCache::Advance(quint32 tNow)
+{
+	if(!m_nCount)
+	{
+		// nothing scheduled, no need to walk the empty slots
+		m_tCurrent = tNow;
+		return;
+	}
+
+	while(m_tCurrent < tNow)
+	{
+		m_tCurrent++;
+
+		if((m_tCurrent & DG_WHEEL_MASK) == 0)
+		{
+			// entering a new second level slot, spread it over the first level
+			DatagramIn* pDG = m_pWheel[1][(m_tCurrent >> DG_WHEEL_BITS) & DG_WHEEL_MASK];
+			while(pDG)
+			{
+				DatagramIn* pNext = pDG->m_pTimerNext;
+				Schedule(pDG, pDG->m_tExpire);
+				pDG = pNext;
+			}
+		}
+
+		DatagramIn** ppSlot = &m_pWheel[0][m_tCurrent & DG_WHEEL_MASK];
+		while(*ppSlot)
+		{
+			DatagramIn* pDG = *ppSlot;
+			Unlink(pDG);
+			Link(pDG, &m_pExpired);
+		}
+	}
+}
+
+// Returns a datagram whose timer has run out, the caller removes it
+DatagramIn* DatagramInCache::Expired(quint32 tNow)
+{
+	if(tNow > m_tCurrent)
+	{
+		Advance(tNow);
+	}
+
+	return m_pExpired;
+}
+
+DatagramOut::DatagramOut()
+{
+	m_pBuffer = new CBuffer(1024);
+	m_nCount = 0;
+	m_bAck = false;
+	m_pQueue = 0;
+}
+DatagramOut::~DatagramOut()
+{
+	delete m_pBuffer;
+}
+void DatagramOut::Create(CEndPoint oAddr, G2Packet* pPacket, quint16 nSequence, bool bAck)
+{
 	m_oAddress = oAddr;
 	m_nSequence = nSequence;
-	m_pBuffer = pBuffer;
+	m_pBuffer->clear();
 
 	pPacket->ToBuffer(m_pBuffer);
 
@@ -174,24 +560,12 @@ void DatagramOut::Create(CEndPoint oAddr, G2Packet* pPacket, quint16 nSequence,
 		m_pBuffer->insert(nOffset, (char*)&pHeader, sizeof(pHeader));
 	}
 
-	if(m_nLocked < m_nCount)
-	{
-		if(m_pLocked)
-		{
-			delete[] m_pLocked;
-		}
-		m_nLocked = m_nCount;
-		m_pLocked = new quint32[m_nLocked];
-	}
-
-	memset(m_pLocked, 0x00, sizeof(quint32) * m_nLocked);
+	memset(m_pLocked, 0x00, sizeof(quint32) * m_nCount);
 
 	m_tSent = time(0);
 }
 bool DatagramOut::GetPacket(quint32 tNow, char** ppPacket, quint32* pnPacket, bool bResend)
 {
-	Q_ASSERT(m_pBuffer != 0);
-
 	int nPart = 0;
 	for(; nPart < m_nCount; nPart++)
 	{
@@ -228,6 +602,14 @@ bool DatagramOut::GetPacket(quint32 tNow, char** ppPacket, quint32* pnPacket, bo
 	return true;
 
 }
+// Puts a fragment returned by GetPacket() back, it has not left the host
+void DatagramOut::Unsend(const char* pPacket)
+{
+	quint32 nPart = quint32(pPacket - m_pBuffer->data()) / (m_nPacket + sizeof(GND_HEADER));
+	Q_ASSERT(nPart < m_nCount);
+
+	m_pLocked[nPart] = 0;
+}
 bool DatagramOut::Acknowledge(quint8 nPart)
 {
 	if(nPart > 0 && nPart <= m_nCount && m_nAcked > 0)
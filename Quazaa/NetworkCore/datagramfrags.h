@@ -26,10 +26,63 @@
 #define DATAGRAMFRAGS_H
 
 #include "types.h"
+#include <QMap>
 
 class CBuffer;
 class G2Packet;
 
+// A GND datagram has at most 255 parts
+#define GND_MAX_PARTS	255
+// Largest fragment payload we keep, an Ethernet frame minus IPv4 and UDP headers
+#define GND_SLOT_SIZE	1472
+#define GND_NO_SLOT		0xFFFF
+// Bytes of larger parts (jumbo frames, IP fragmentation) kept on the heap at a time
+#define GND_HEAP_MAX	(1024 * 1024)
+
+// Fixed-size fragment slots carved out of a single allocation
+class DatagramSlab
+{
+protected:
+	char*		m_pData;
+	quint16*	m_pLength;
+	quint16*	m_pFree;		// Stack of free slot numbers
+	quint32		m_nFree;
+	quint32		m_nSlots;
+
+public:
+	quint32		m_nExhausted;	// Datagrams refused because not enough slots were free
+	quint32		m_nHeapBytes;	// Parts larger than a slot, held by DatagramIn::m_lLarge
+
+public:
+	DatagramSlab();
+	~DatagramSlab();
+
+	void Create(quint32 nSlots);
+	void Destroy();
+
+	inline quint16 Alloc()
+	{
+		return m_nFree ? m_pFree[--m_nFree] : GND_NO_SLOT;
+	}
+	inline void Free(quint16 nSlot)
+	{
+		Q_ASSERT(nSlot < m_nSlots && m_nFree < m_nSlots);
+		m_pFree[m_nFree++] = nSlot;
+	}
+	inline char* Data(quint16 nSlot)
+	{
+		return m_pData + nSlot * GND_SLOT_SIZE;
+	}
+	inline quint16& Length(quint16 nSlot)
+	{
+		return m_pLength[nSlot];
+	}
+	inline quint32 FreeCount() const
+	{
+		return m_nFree;
+	}
+};
+
 class DatagramIn
 {
 protected:
@@ -40,23 +93,96 @@ protected:
 	quint8  m_nLeft;
 	bool    m_bCompressed;
 	quint32 m_tStarted;
-	quint32 m_nBuffer;
-	bool*   m_bLocked;
-
-	CBuffer** m_pBuffer;
+	quint32 m_pReceived[(GND_MAX_PARTS + 31) / 32];	// One bit per part that arrived
+	quint16 m_pSlot[GND_MAX_PARTS];				// Slab slot reserved for each part
+	QMap<quint8, QByteArray> m_lLarge;			// Parts too big for their slot, by part index; rare
+
+	// DatagramInCache bookkeeping
+	quint32      m_nHash;
+	quint32      m_tExpire;
+	DatagramIn*  m_pTimerNext;
+	DatagramIn*  m_pTimerPrev;
+	DatagramIn** m_ppTimerList;	// Wheel slot or expired list this datagram is linked into
+	DatagramIn*  m_pDoneNext;
+	DatagramIn*  m_pDonePrev;
+	bool         m_bDone;
 public:
 	DatagramIn();
-	~DatagramIn();
 
-	void Create(CEndPoint pHost, quint8 nFlags, quint16 nSequence, quint8 nCount);
-	bool Add(quint8 nPart, const void* pData, qint32 nLength);
-	G2Packet* ToG2Packet();
+	void Create(CEndPoint pHost, quint8 nFlags, quint16 nSequence, quint8 nCount, DatagramSlab& oSlab);
+	bool Add(quint8 nPart, const void* pData, qint32 nLength, DatagramSlab& oSlab);
+	void Release(DatagramSlab& oSlab);
+	G2Packet* ToG2Packet(CBuffer* pAssembly, DatagramSlab& oSlab);
 
 
 	friend class CDatagrams;
+	friend class DatagramInCache;
+};
+
+#define DG_WHEEL_BITS	6
+#define DG_WHEEL_SIZE	(1 << DG_WHEEL_BITS)
+#define DG_WHEEL_MASK	(DG_WHEEL_SIZE - 1)
+
+// Reassembly cache for incoming datagrams.
+// Open-addressed table keyed on (address, port, sequence), expiry through a two level timer wheel
+// with one second ticks (64 s on the first level, 64 * 64 s on the second one).
+class DatagramInCache
+{
+protected:
+	DatagramIn**	m_pSlots;
+	quint32			m_nMask;
+	quint32			m_nCount;
+
+	quint32			m_tCurrent;							// Last tick the wheel has been advanced to
+	DatagramIn*		m_pWheel[2][DG_WHEEL_SIZE];
+	DatagramIn*		m_pExpired;							// Due datagrams, not yet removed
+
+	DatagramIn*		m_pDoneFirst;						// Completed datagrams, oldest first
+	DatagramIn*		m_pDoneLast;
+
+public:
+	DatagramInCache();
+	~DatagramInCache();
+
+	void Reserve(quint32 nFrames);
+	void Clear();
+
+	DatagramIn* Find(const CEndPoint& oAddress, quint16 nSequence) const;
+	void Insert(DatagramIn* pDG, quint32 tNow, quint32 tExpire);
+	void Remove(DatagramIn* pDG);
+
+	void Schedule(DatagramIn* pDG, quint32 tExpire);
+	void Complete(DatagramIn* pDG);
+
+	DatagramIn* Expired(quint32 tNow);
+	DatagramIn* OldestComplete() const
+	{
+		return m_pDoneFirst;
+	}
+
+	inline quint32 Capacity() const
+	{
+		return m_pSlots ? m_nMask + 1 : 0;
+	}
+	inline DatagramIn* At(quint32 nSlot) const
+	{
+		return m_pSlots[nSlot];
+	}
+	inline quint32 Count() const
+	{
+		return m_nCount;
+	}
+
+protected:
+	static quint32 Hash(const CEndPoint& oAddress, quint16 nSequence);
+	quint32 SlotOf(DatagramIn* pDG) const;
+	void Link(DatagramIn* pDG, DatagramIn** ppList);
+	void Unlink(DatagramIn* pDG);
+	void Advance(quint32 tNow);
 };
 
 class DatagramWatcher;
+struct DatagramQueue;
 
 class DatagramOut
 {
@@ -68,21 +194,29 @@ protected:
 	quint32     m_nPacket;
 	quint8      m_nCount;
 	quint8      m_nAcked;
-	quint32*    m_pLocked;
-	quint8      m_nLocked;
+	quint32     m_pLocked[GND_MAX_PARTS];
 	quint32     m_tSent;
 	bool        m_bAck;
 
+	// CDatagrams bookkeeping
+	DatagramOut*    m_pCacheNext;   // Send cache, newest first
+	DatagramOut*    m_pCachePrev;
+	DatagramQueue*  m_pQueue;       // Destination queue or resend wait this datagram is linked into
+	DatagramOut*    m_pQueueNext;
+	DatagramOut*    m_pQueuePrev;
+	quint32         m_tQueued;
+
 	DatagramWatcher*    m_pWatcher;
 	void*               m_pParam;
-	CBuffer* m_pBuffer;
+	CBuffer* m_pBuffer;             // Owned, keeps its capacity between datagrams
 
 public:
 	DatagramOut();
 	~DatagramOut();
 
-	void Create(CEndPoint oAddr, G2Packet* pPacket, quint16 nSequence, CBuffer* pBuffer, bool bAck = false);
+	void Create(CEndPoint oAddr, G2Packet* pPacket, quint16 nSequence, bool bAck = false);
 	bool GetPacket(quint32 tNow, char** ppPacket, quint32* pnPacket, bool bResend = false);
+	void Unsend(const char* pPacket);
 	bool Acknowledge(quint8 nPart);
 
 	friend class CDatagrams;
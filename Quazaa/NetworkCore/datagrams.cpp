@@ -34,6 +34,7 @@
 #include "systemlog.h"
 #include "querykeys.h"
 #include "query.h"
+#include "localsearch.h"
 #include "securitymanager.h"
 
 #include "HostCache/hostcache.h"
@@ -44,9 +45,27 @@
 #include "thread.h"
 #include "buffer.h"
 
+#if defined(Q_OS_LINUX)
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#endif
+
+// recvmmsg() is available since Linux 2.6.33 / glibc 2.12
+#if defined(Q_OS_LINUX) && defined(MSG_WAITFORONE)
+#define HAVE_RECVMMSG
+#endif
+
+// sendmmsg() is available since Linux 3.0 / glibc 2.14
+#if defined(HAVE_RECVMMSG) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 14))
+#define HAVE_SENDMMSG
+#endif
+
 #include "debug_new.h"
 
 CDatagrams Datagrams;
+CThread DatagramsThread;
 
 CDatagrams::CDatagrams()
 {
@@ -54,7 +73,32 @@ CDatagrams::CDatagrams()
 
 	m_pRecvBuffer = new CBuffer();
 	m_pHostAddress = new QHostAddress();
+
+	for(int i = 0; i < UDP_RECV_BATCH; i++)
+	{
+		m_pBatchBuffers[i] = 0;
+	}
 	m_nSequence = 0;
+	m_nSocketFamily = 0;
+
+	m_pSendFirst = 0;
+	m_pSendLast = 0;
+	m_nSendCount = 0;
+	m_pSendIndex = 0;
+	m_nSendMask = 0;
+
+	m_pQueueIndex = 0;
+	m_nQueueMask = 0;
+	m_pRingFirst = 0;
+	m_pRingLast = 0;
+	m_oResendWait.m_pFirst = 0;
+	m_oResendWait.m_pLast = 0;
+	m_oResendWait.m_bInRing = false;
+
+	m_pAssembly = new CBuffer();
+
+	m_nAckFirst = 0;
+	m_nAcks = 0;
 
 	m_bActive = false;
 
@@ -64,7 +108,12 @@ CDatagrams::CDatagrams()
 
 	m_nInFrags = 0;
 	m_nOutFrags = 0;
+	m_nInExhausted = 0;
+	m_nOutExhausted = 0;
+	m_nAckDropped = 0;
 
+	m_pOutbox = 0;
+	m_pOutboxTail = 0;
 }
 CDatagrams::~CDatagrams()
 {
@@ -91,6 +140,13 @@ CDatagrams::~CDatagrams()
 	{
 		delete m_pHostAddress;
 	}
+
+	delete m_pAssembly;
+
+	for(int i = 0; i < UDP_RECV_BATCH; i++)
+	{
+		delete m_pBatchBuffers[i];
+	}
 }
 
 void CDatagrams::Listen()
@@ -105,6 +161,11 @@ void CDatagrams::Listen()
 
 	Q_ASSERT(m_pSocket == 0);
 
+	DatagramsThread.start("Datagrams", &m_pSection, this);
+}
+
+void CDatagrams::SetupThread()
+{
 	m_pSocket = new QUdpSocket(this);
 
 	CEndPoint addr = Network.GetLocalAddress();
@@ -113,19 +174,61 @@ void CDatagrams::Listen()
 		systemLog.postLog(LogSeverity::Debug, QString("Datagrams listening on %1").arg(m_pSocket->localPort()));
 		m_nDiscarded = 0;
 
-		for(int i = 0; i < quazaaSettings.Gnutella2.UdpBuffers; i++)
+#if defined(Q_OS_LINUX)
+		// batched sends need addresses in the socket's own family (v4-mapped on a dual-stack socket)
+		struct sockaddr_storage oLocal;
+		socklen_t nLocal = sizeof(oLocal);
+		if(getsockname(m_pSocket->socketDescriptor(), (struct sockaddr*)&oLocal, &nLocal) == 0)
 		{
-			m_FreeBuffer.append(new CBuffer(1024));
+			m_nSocketFamily = oLocal.ss_family;
 		}
+#endif
 
+		// everything the UDP path needs is allocated here, nothing while running
+		m_oSlab.Create(quazaaSettings.Gnutella2.UdpBuffers);
+
+		m_RecvCache.Reserve(quazaaSettings.Gnutella2.UdpInFrames);
+		m_FreeDGIn.reserve(quazaaSettings.Gnutella2.UdpInFrames);
 		for(int i = 0; i < quazaaSettings.Gnutella2.UdpInFrames; i++)
 		{
 			m_FreeDGIn.append(new DatagramIn);
 		}
 
-		for(int i = 0; i < quazaaSettings.Gnutella2.UdpOutFrames; i++)
+		quint32 nOutFrames = qMax(1, quazaaSettings.Gnutella2.UdpOutFrames);
+		m_FreeDGOut.reserve(nOutFrames);
+		m_FreeQueues.reserve(nOutFrames);
+		for(quint32 i = 0; i < nOutFrames; i++)
 		{
 			m_FreeDGOut.append(new DatagramOut);
+			m_FreeQueues.append(new DatagramQueue);
+		}
+
+		// both stay at most half full, sequences are 16 bit
+		quint32 nIndex = 16;
+		while(nIndex < nOutFrames * 2 && nIndex < 65536)
+		{
+			nIndex <<= 1;
+		}
+		m_pSendIndex = new DatagramOut*[nIndex];
+		memset(m_pSendIndex, 0, sizeof(DatagramOut*) * nIndex);
+		m_nSendMask = nIndex - 1;
+
+		nIndex = 16;
+		while(nIndex < nOutFrames * 2)
+		{
+			nIndex <<= 1;
+		}
+		m_pQueueIndex = new DatagramQueue*[nIndex];
+		memset(m_pQueueIndex, 0, sizeof(DatagramQueue*) * nIndex);
+		m_nQueueMask = nIndex - 1;
+
+		for(int i = 0; i < UDP_RECV_BATCH; i++)
+		{
+			if(!m_pBatchBuffers[i])
+			{
+				m_pBatchBuffers[i] = new CBuffer(UDP_RECV_BUFFER);
+				m_pBatchBuffers[i]->ensure(UDP_RECV_BUFFER);
+			}
 		}
 
 		connect(this, SIGNAL(SendQueueUpdated()), this, SLOT(FlushSendCache()), Qt::QueuedConnection);
@@ -136,7 +239,8 @@ void CDatagrams::Listen()
 	else
 	{
 		systemLog.postLog(LogSeverity::Debug, QString("Can't bind UDP socket! UDP communication disabled!"));
-		Disconnect();
+		delete m_pSocket;
+		m_pSocket = 0;
 	}
 
 	m_bFirewalled = true;
@@ -149,6 +253,16 @@ void CDatagrams::Disconnect()
 
 	m_bActive = false;
 
+	if(DatagramsThread.isRunning())
+	{
+		DatagramsThread.exit(0);
+	}
+}
+
+void CDatagrams::CleanupThread()
+{
+	m_bActive = false;
+
 	if(m_pSocket)
 	{
 		m_pSocket->close();
@@ -158,75 +272,202 @@ void CDatagrams::Disconnect()
 
 	disconnect(SIGNAL(SendQueueUpdated()));
 
-	while(!m_AckCache.isEmpty())
+	m_nAckFirst = 0;
+	m_nAcks = 0;
+
+	while(m_pSendFirst)
 	{
-		QPair<CEndPoint, char*> oAck = m_AckCache.takeFirst();
-		delete [] oAck.second;
+		Remove(m_pSendFirst);
 	}
 
-	while(!m_SendCache.isEmpty())
+	qDeleteAll(m_FreeQueues);
+	m_FreeQueues.clear();
+	delete [] m_pQueueIndex;
+	m_pQueueIndex = 0;
+	delete [] m_pSendIndex;
+	m_pSendIndex = 0;
+
+	for(quint32 i = 0; i < m_RecvCache.Capacity(); i++)
 	{
-		Remove(m_SendCache.first());
+		if(DatagramIn* pDG = m_RecvCache.At(i))
+		{
+			Remove(pDG, true);
+			m_FreeDGIn.append(pDG);
+		}
 	}
+	m_RecvCache.Clear();
+
+	qDeleteAll(m_FreeDGIn);
+	m_FreeDGIn.clear();
 
-	while(!m_RecvCacheTime.isEmpty())
+	qDeleteAll(m_FreeDGOut);
+	m_FreeDGOut.clear();
+
+	m_oSlab.Destroy();
+
+	// the network thread is shutting us down, packets it did not pick up are dropped
+	PublishTasks();
+	DatagramTask* pTask = m_pNetworkTasks.fetchAndStoreAcquire(0);
+	while(pTask)
 	{
-		Remove(m_RecvCacheTime.first());
+		DatagramTask* pNext = pTask->m_pNext;
+		pTask->m_pPacket->Release();
+		delete pTask;
+		pTask = pNext;
 	}
 
-	while(!m_FreeDGIn.isEmpty())
+	moveToThread(qApp->thread());
+}
+
+void CDatagrams::OnDatagram()
+{
+	if(!m_bActive)
 	{
-		delete m_FreeDGIn.takeFirst();
+		return;
 	}
 
-	while(!m_FreeDGOut.isEmpty())
+	// Drain up to UdpReceiveBatch datagrams per wakeup, then give the event loop a chance
+	const quint32 nBudget = quazaaSettings.Gnutella2.UdpReceiveBatch;
+	quint32 nReceived = 0;
+
+	while(nReceived < nBudget && m_bActive && m_pSocket->hasPendingDatagrams())
 	{
-		delete m_FreeDGOut.takeFirst();
+		int nBatch = 0;
+
+#ifdef HAVE_RECVMMSG
+		// The first datagram always goes through QUdpSocket, reading it rearms the socket notifier
+		if(nReceived > 0)
+		{
+			nBatch = ReceiveBatch(qMin<quint32>(nBudget - nReceived, UDP_RECV_BATCH));
+		}
+#endif
+
+		if(nBatch <= 0)
+		{
+			ReceiveOne();
+			nBatch = 1;
+		}
+
+		nReceived += nBatch;
 	}
 
-	while(!m_FreeBuffer.isEmpty())
+	PublishTasks();
+
+	if(m_bActive && nReceived >= nBudget && m_pSocket->hasPendingDatagrams())
 	{
-		delete m_FreeBuffer.takeFirst();
+		QMetaObject::invokeMethod(this, "OnDatagram", Qt::QueuedConnection);
 	}
 }
 
-void CDatagrams::OnDatagram()
+void CDatagrams::ReceiveOne()
 {
-	if(!m_bActive)
+	qint64 nSize = m_pSocket->pendingDatagramSize();
+	m_pRecvBuffer->resize(nSize);
+	qint64 nReadSize = m_pSocket->readDatagram(m_pRecvBuffer->data(), nSize, m_pHostAddress, &m_nPort);
+
+	ProcessDatagram(nReadSize);
+}
+
+// Reads up to nMax datagrams with a single recvmmsg() call into the pre-allocated batch buffers.
+// Returns the number of datagrams processed, 0 if none could be read this way.
+int CDatagrams::ReceiveBatch(int nMax)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr arrMessages[UDP_RECV_BATCH];
+	struct iovec arrVectors[UDP_RECV_BATCH];
+	struct sockaddr_storage arrAddresses[UDP_RECV_BATCH];
+
+	nMax = qMin(nMax, UDP_RECV_BATCH);
+
+	memset(&arrMessages[0], 0, sizeof(struct mmsghdr) * nMax);
+
+	for(int i = 0; i < nMax; i++)
 	{
-		return;
+		arrVectors[i].iov_base = m_pBatchBuffers[i]->data();
+		arrVectors[i].iov_len = UDP_RECV_BUFFER;
+		arrMessages[i].msg_hdr.msg_iov = &arrVectors[i];
+		arrMessages[i].msg_hdr.msg_iovlen = 1;
+		arrMessages[i].msg_hdr.msg_name = &arrAddresses[i];
+		arrMessages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
 	}
 
-	//while(m_pSocket->hasPendingDatagrams())
+	int nCount = recvmmsg(m_pSocket->socketDescriptor(), &arrMessages[0], nMax, MSG_DONTWAIT, 0);
+
+	if(nCount <= 0)
 	{
-		qint64 nSize = m_pSocket->pendingDatagramSize();
-		m_pRecvBuffer->resize(nSize);
-		qint64 nReadSize = m_pSocket->readDatagram(m_pRecvBuffer->data(), nSize, m_pHostAddress, &m_nPort);
+		return 0;
+	}
 
-		m_mInput.Add(nReadSize);
+	CBuffer* pOwnBuffer = m_pRecvBuffer;
 
-		if(nReadSize < 8)
+	for(int i = 0; i < nCount && m_bActive; i++)
+	{
+		if(arrMessages[i].msg_hdr.msg_flags & MSG_TRUNC)
 		{
-		//	continue;
-			return;
+			m_nDiscarded++;
+			continue;
 		}
 
-		m_nInFrags++;
-
-		GND_HEADER* pHeader = (GND_HEADER*)m_pRecvBuffer->data();
-		if(strncmp((char*)&pHeader->szTag, "GND", 3) == 0 && pHeader->nPart > 0 && (pHeader->nCount == 0 || pHeader->nPart <= pHeader->nCount))
+		struct sockaddr* pAddress = (struct sockaddr*)&arrAddresses[i];
+		m_pHostAddress->setAddress(pAddress);
+		if(pAddress->sa_family == AF_INET6)
 		{
-			if(pHeader->nCount == 0)
-			{
-				// ACK
-				OnAcknowledgeGND();
-			}
-			else
+			struct sockaddr_in6* pAddress6 = (struct sockaddr_in6*)pAddress;
+			m_nPort = ntohs(pAddress6->sin6_port);
+
+			// dual-stack socket reports IPv4 peers as v4-mapped, QUdpSocket hands them out as plain IPv4
+			if(IN6_IS_ADDR_V4MAPPED(&pAddress6->sin6_addr))
 			{
-				// DG
-				OnReceiveGND();
+				quint32 nIPv4;
+				memcpy(&nIPv4, &pAddress6->sin6_addr.s6_addr[12], sizeof(quint32));
+				m_pHostAddress->setAddress(ntohl(nIPv4));
 			}
 		}
+		else
+		{
+			m_nPort = ntohs(((struct sockaddr_in*)pAddress)->sin_port);
+		}
+
+		// handlers work on m_pRecvBuffer, point it at the batch buffer instead of copying
+		m_pRecvBuffer = m_pBatchBuffers[i];
+		m_pRecvBuffer->resize(arrMessages[i].msg_len);
+
+		ProcessDatagram(arrMessages[i].msg_len);
+	}
+
+	m_pRecvBuffer = pOwnBuffer;
+
+	return nCount;
+#else
+	Q_UNUSED(nMax);
+	return 0;
+#endif
+}
+
+void CDatagrams::ProcessDatagram(qint64 nReadSize)
+{
+	m_mInput.Add(nReadSize);
+
+	if(nReadSize < 8)
+	{
+		return;
+	}
+
+	m_nInFrags++;
+
+	GND_HEADER* pHeader = (GND_HEADER*)m_pRecvBuffer->data();
+	if(strncmp((char*)&pHeader->szTag, "GND", 3) == 0 && pHeader->nPart > 0 && (pHeader->nCount == 0 || pHeader->nPart <= pHeader->nCount))
+	{
+		if(pHeader->nCount == 0)
+		{
+			// ACK
+			OnAcknowledgeGND();
+		}
+		else
+		{
+			// DG
+			OnReceiveGND();
+		}
 	}
 }
 
@@ -234,118 +475,114 @@ void CDatagrams::OnReceiveGND()
 {
 
 	GND_HEADER* pHeader = (GND_HEADER*)m_pRecvBuffer->data();
-	QHostAddress nIp = *m_pHostAddress;
-	quint32 nSeq = ((pHeader->nSequence << 16) & 0xFFFF0000) + (m_nPort & 0x0000FFFF);
+	CEndPoint oSender(*m_pHostAddress, m_nPort);
+	quint32 tNow = time(0);
+	qint32 nLength = m_pRecvBuffer->size() - sizeof(GND_HEADER);
 
 #ifdef DEBUG_UDP
 	systemLog.postLog(LogSeverity::Debug, "Received GND from %s:%u nSequence = %u nPart = %u nCount = %u", m_pHostAddress->toString().toLocal8Bit().constData(), m_nPort, pHeader->nSequence, pHeader->nPart, pHeader->nCount);
 #endif
 
-	DatagramIn* pDG = 0;
-
-	if(m_RecvCache.contains(nIp) && m_RecvCache[nIp].contains(nSeq))
+	if(nLength > GND_SLOT_SIZE && m_oSlab.m_nHeapBytes + nLength > GND_HEAP_MAX)
 	{
-		pDG = m_RecvCache[nIp][nSeq];
+		// larger parts go to the heap, but only so many at a time; the sender retries
+		systemLog.postLog(LogSeverity::Debug, QString("Dropping %1 byte GND fragment from %2, too many large fragments pending").arg(nLength).arg(oSender.toStringWithPort()));
+		m_nDiscarded++;
+		return;
+	}
 
+	// the reassembly side is only touched by the UDP thread, no locking needed
+	DatagramIn* pDG = m_RecvCache.Find(oSender, pHeader->nSequence);
+
+	if(pDG)
+	{
 		// To give a chance for bigger packages ;)
 		if(pDG->m_nLeft)
 		{
-			pDG->m_tStarted = time(0);
+			pDG->m_tStarted = tNow;
+			m_RecvCache.Schedule(pDG, tNow + quazaaSettings.Gnutella2.UdpInExpire + 1);
 		}
 	}
 	else
 	{
-		QMutexLocker l(&m_pSection);
-
-		if(!m_FreeDGIn.isEmpty())
-		{
-			pDG = m_FreeDGIn.takeFirst();
-		}
-		else
+		if(m_FreeDGIn.isEmpty())
 		{
+			RemoveOldIn(true);
 			if(m_FreeDGIn.isEmpty())
 			{
-				RemoveOldIn(true);
-				if(m_FreeDGIn.isEmpty())
-				{
-#ifdef DEBUG_UDP
-					systemLog.postLog(LogSeverity::Debug, QString("UDP in frames exhausted"));
-#endif
-					m_nDiscarded++;
-					return;
-				}
+				m_nInExhausted++;
+				m_nDiscarded++;
+				return;
 			}
-
-			pDG = m_FreeDGIn.takeFirst();
 		}
 
-		if(m_FreeBuffer.size() < pHeader->nCount)
+		if(m_oSlab.FreeCount() < pHeader->nCount)
 		{
-			m_nDiscarded++;
-			m_FreeDGIn.append(pDG);
 			RemoveOldIn(false);
-			return;
+			if(m_oSlab.FreeCount() < pHeader->nCount)
+			{
+				m_oSlab.m_nExhausted++;
+				m_nDiscarded++;
+				return;
+			}
 		}
 
-		pDG->Create(CEndPoint(*m_pHostAddress, m_nPort), pHeader->nFlags, pHeader->nSequence, pHeader->nCount);
-
-		for(int i = 0; i < pHeader->nCount; i++)
-		{
-			Q_ASSERT(pDG->m_pBuffer[i] == 0);
-			pDG->m_pBuffer[i] = m_FreeBuffer.takeFirst();
-		}
+		pDG = m_FreeDGIn.takeLast();
+		pDG->Create(oSender, pHeader->nFlags, pHeader->nSequence, pHeader->nCount, m_oSlab);
 
-		m_RecvCache[nIp][nSeq] = pDG;
-		m_RecvCacheTime.prepend(pDG);
+		m_RecvCache.Insert(pDG, tNow, tNow + quazaaSettings.Gnutella2.UdpInExpire + 1);
 	}
 
 	// It is here, in case if we did not have free datagrams
 	// ACK = I've received a datagram, and if you have received and rejected it, do not send ACK-a
 	if(pHeader->nFlags & 0x02)
 	{
-		GND_HEADER* pAck = new GND_HEADER;
+		if(m_nAcks < UDP_ACK_RING)
+		{
+			DatagramAck& oAck = m_pAcks[(m_nAckFirst + m_nAcks) % UDP_ACK_RING];
+			m_nAcks++;
 
-		memcpy(pAck, pHeader, sizeof(GND_HEADER));
-		pAck->nCount = 0;
-		pAck->nFlags = 0;
+			oAck.m_oAddress = oSender;
+			memcpy(&oAck.m_oHeader, pHeader, sizeof(GND_HEADER));
+			oAck.m_oHeader.nCount = 0;
+			oAck.m_oHeader.nFlags = 0;
 
 #ifdef DEBUG_UDP
-		systemLog.postLog(LogSeverity::Debug, "Sending UDP ACK to %s:%u", m_pHostAddress->toString().toLocal8Bit().constData(), m_nPort);
+			systemLog.postLog(LogSeverity::Debug, "Sending UDP ACK to %s:%u", m_pHostAddress->toString().toLocal8Bit().constData(), m_nPort);
 #endif
 
-		//m_pSocket->writeDatagram((char*)&oAck, sizeof(GND_HEADER), *m_pHostAddress, m_nPort);
-		//m_mOutput.Add(sizeof(GND_HEADER));
-		m_AckCache.append(qMakePair(CEndPoint(*m_pHostAddress, m_nPort), reinterpret_cast<char*>(pAck)));
-		if( m_AckCache.count() == 1 )
-			QMetaObject::invokeMethod(this, "FlushSendCache", Qt::QueuedConnection);
+			if( m_nAcks == 1 )
+				QMetaObject::invokeMethod(this, "FlushSendCache", Qt::QueuedConnection);
+		}
+		else
+		{
+			// the sender will resend, we ACK it then
+			m_nAckDropped++;
+		}
 	}
 
-	if(pDG->Add(pHeader->nPart, m_pRecvBuffer->data() + sizeof(GND_HEADER), m_pRecvBuffer->size() - sizeof(GND_HEADER)))
+	if(pDG->Add(pHeader->nPart, m_pRecvBuffer->data() + sizeof(GND_HEADER), nLength, m_oSlab))
 	{
 
 		G2Packet* pPacket = 0;
 		try
 		{
-			CEndPoint addr(*m_pHostAddress, m_nPort);
-			pPacket = pDG->ToG2Packet();
-			if(pPacket)
-			{
-				OnPacket(addr, pPacket);
-			}
-
+			pPacket = pDG->ToG2Packet(m_pAssembly, m_oSlab);
 		}
 		catch(...)
 		{
 
 		}
+
+		// the packet owns a copy of the data, keep the frame only to swallow duplicate fragments
+		Remove(pDG, true);
+		m_RecvCache.Complete(pDG);
+
 		if(pPacket)
 		{
+			OnPacket(oSender, pPacket);
 			pPacket->Release();
 		}
-
-		m_pSection.lock();
-		Remove(pDG, true);
-		m_pSection.unlock();
 	}
 
 }
@@ -358,12 +595,19 @@ void CDatagrams::OnAcknowledgeGND()
 	systemLog.postLog(LogSeverity::Debug, "UDP received GND ACK from %s seq %u part %u", m_pHostAddress->toString().toLocal8Bit().constData(), pHeader->nSequence, pHeader->nPart);
 #endif
 
-	if(!m_SendCacheMap.contains(pHeader->nSequence))
+	QMutexLocker l(&m_pSection);
+
+	if(!m_pSendIndex)
 	{
 		return;
 	}
 
-	DatagramOut* pDG = m_SendCacheMap.value(pHeader->nSequence);
+	DatagramOut* pDG = m_pSendIndex[pHeader->nSequence & m_nSendMask];
+
+	if(!pDG || pDG->m_nSequence != pHeader->nSequence)
+	{
+		return;
+	}
 
 	if(pDG->Acknowledge(pHeader->nPart))
 	{
@@ -373,105 +617,398 @@ void CDatagrams::OnAcknowledgeGND()
 
 void CDatagrams::Remove(DatagramIn* pDG, bool bReclaim)
 {
-	for(int i = 0; i < pDG->m_nCount; i++)
+	pDG->Release(m_oSlab);
+
+	if(bReclaim)
 	{
-		if(pDG->m_pBuffer[i])
-		{
-			m_FreeBuffer.append(pDG->m_pBuffer[i]);
-			pDG->m_pBuffer[i]->clear();
-			pDG->m_pBuffer[i] = 0;
-		}
+		return;
 	}
 
-	if(bReclaim)
+	m_RecvCache.Remove(pDG);
+	m_FreeDGIn.append(pDG);
+}
+
+// Removes a package from the cache collection.
+void CDatagrams::RemoveOldIn(bool bForce)
+{
+	quint32 tNow = time(0);
+	bool bRemoved = false;
+
+	while(DatagramIn* pDG = m_RecvCache.Expired(tNow))
+	{
+		Remove(pDG);
+		bRemoved = true;
+	}
+
+	if(bForce && !bRemoved && m_RecvCache.OldestComplete())
 	{
+		Remove(m_RecvCache.OldestComplete());
+	}
+}
+
+void CDatagrams::Remove(DatagramOut* pDG)
+{
+	if(m_pSendIndex[pDG->m_nSequence & m_nSendMask] != pDG)
+	{
+		// already back in the free list
 		return;
 	}
 
-	if(m_RecvCache.contains(pDG->m_oAddress))
+	m_pSendIndex[pDG->m_nSequence & m_nSendMask] = 0;
+
+	if(pDG->m_pCachePrev)
 	{
-		quint32 nSeq = ((pDG->m_nSequence << 16) & 0xFFFF0000) + (pDG->m_oAddress.port() & 0x0000FFFF);
-		Q_ASSERT(pDG == m_RecvCache[pDG->m_oAddress][nSeq]);
-		m_RecvCache[pDG->m_oAddress].remove(nSeq);
-		if(m_RecvCache[pDG->m_oAddress].isEmpty())
-		{
-			m_RecvCache.remove(pDG->m_oAddress);
-		}
+		pDG->m_pCachePrev->m_pCacheNext = pDG->m_pCacheNext;
+	}
+	else
+	{
+		m_pSendFirst = pDG->m_pCacheNext;
+	}
+	if(pDG->m_pCacheNext)
+	{
+		pDG->m_pCacheNext->m_pCachePrev = pDG->m_pCachePrev;
+	}
+	else
+	{
+		m_pSendLast = pDG->m_pCachePrev;
+	}
+	m_nSendCount--;
 
-		QLinkedList<DatagramIn*>::iterator itFrame = m_RecvCacheTime.end();
-		while( itFrame != m_RecvCacheTime.begin() )
-		{
-			--itFrame;
+	QueueUnlink(pDG);
 
-			if( *itFrame == pDG )
-			{
-				m_RecvCacheTime.erase(itFrame);
-				break;
-			}
-		}
+	m_FreeDGOut.append(pDG);
+}
+
+void CDatagrams::QueueAppend(DatagramQueue* pQueue, DatagramOut* pDG)
+{
+	Q_ASSERT(pDG->m_pQueue == 0);
 
-		m_FreeDGIn.append(pDG);
+	pDG->m_pQueue = pQueue;
+	pDG->m_pQueueNext = 0;
+	pDG->m_pQueuePrev = pQueue->m_pLast;
+	if(pQueue->m_pLast)
+	{
+		pQueue->m_pLast->m_pQueueNext = pDG;
 	}
+	else
+	{
+		pQueue->m_pFirst = pDG;
+	}
+	pQueue->m_pLast = pDG;
 }
 
-// Removes a package from the cache collection.
-void CDatagrams::RemoveOldIn(bool bForce)
+// Takes a datagram off its destination queue or the resend wait, an emptied destination queue is released
+void CDatagrams::QueueUnlink(DatagramOut* pDG)
 {
-	quint32 tNow = time(0);
-	bool bRemoved = false;
+	DatagramQueue* pQueue = pDG->m_pQueue;
 
-	while(!m_RecvCacheTime.isEmpty() && (tNow - m_RecvCacheTime.back()->m_tStarted > quazaaSettings.Gnutella2.UdpInExpire || m_RecvCacheTime.back()->m_nLeft == 0))
+	if(!pQueue)
 	{
-		Remove(m_RecvCacheTime.back());
-		bRemoved = true;
+		return;
 	}
 
-	if(bForce && !bRemoved && !m_RecvCacheTime.isEmpty())
+	if(pDG->m_pQueuePrev)
 	{
-		for(QLinkedList<DatagramIn*>::iterator itPacket = m_RecvCacheTime.begin(); itPacket != m_RecvCacheTime.end(); ++itPacket)
+		pDG->m_pQueuePrev->m_pQueueNext = pDG->m_pQueueNext;
+	}
+	else
+	{
+		pQueue->m_pFirst = pDG->m_pQueueNext;
+	}
+	if(pDG->m_pQueueNext)
+	{
+		pDG->m_pQueueNext->m_pQueuePrev = pDG->m_pQueuePrev;
+	}
+	else
+	{
+		pQueue->m_pLast = pDG->m_pQueuePrev;
+	}
+
+	pDG->m_pQueue = 0;
+
+	if(!pQueue->m_pFirst && pQueue != &m_oResendWait)
+	{
+		ReleaseQueue(pQueue);
+	}
+}
+
+DatagramQueue* CDatagrams::FindQueue(const QHostAddress& oAddress, quint32 nHash)
+{
+	for(quint32 i = nHash & m_nQueueMask; m_pQueueIndex[i]; i = (i + 1) & m_nQueueMask)
+	{
+		if(m_pQueueIndex[i]->m_nHash == nHash && m_pQueueIndex[i]->m_oAddress == oAddress)
 		{
-			if((*itPacket)->m_nLeft == 0)
-			{
-				Remove(*itPacket);
-				break;
-			}
+			return m_pQueueIndex[i];
 		}
 	}
+
+	return 0;
 }
 
-void CDatagrams::Remove(DatagramOut* pDG)
+// Drops an empty destination queue from the ring and the index
+void CDatagrams::ReleaseQueue(DatagramQueue* pQueue)
 {
-	m_SendCacheMap.remove(pDG->m_nSequence);
+	Q_ASSERT(!pQueue->m_pFirst);
 
-	QLinkedList<DatagramOut*>::iterator itFrame = m_SendCache.end();
-	while( itFrame != m_SendCache.begin() )
+	RingUnlink(pQueue);
+
+	// backward shift deletion, see DatagramInCache::Remove()
+	quint32 i = pQueue->m_nHash & m_nQueueMask;
+	while(m_pQueueIndex[i] != pQueue)
 	{
-		--itFrame;
+		i = (i + 1) & m_nQueueMask;
+	}
 
-		if( *itFrame == pDG )
+	m_pQueueIndex[i] = 0;
+
+	for(quint32 j = (i + 1) & m_nQueueMask; m_pQueueIndex[j]; j = (j + 1) & m_nQueueMask)
+	{
+		quint32 k = m_pQueueIndex[j]->m_nHash & m_nQueueMask;
+		if((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
 		{
-			m_SendCache.erase(itFrame);
-			break;
+			continue;
 		}
+
+		m_pQueueIndex[i] = m_pQueueIndex[j];
+		m_pQueueIndex[j] = 0;
+		i = j;
 	}
 
-	m_FreeDGOut.append(pDG);
+	m_FreeQueues.append(pQueue);
+}
+
+void CDatagrams::RingAppend(DatagramQueue* pQueue)
+{
+	pQueue->m_pRingNext = 0;
+	pQueue->m_pRingPrev = m_pRingLast;
+	if(m_pRingLast)
+	{
+		m_pRingLast->m_pRingNext = pQueue;
+	}
+	else
+	{
+		m_pRingFirst = pQueue;
+	}
+	m_pRingLast = pQueue;
+	pQueue->m_bInRing = true;
+}
+
+void CDatagrams::RingUnlink(DatagramQueue* pQueue)
+{
+	if(!pQueue->m_bInRing)
+	{
+		return;
+	}
 
-	if(pDG->m_pBuffer)
+	if(pQueue->m_pRingPrev)
 	{
-		m_FreeBuffer.append(pDG->m_pBuffer);
-		pDG->m_pBuffer->clear();
-		pDG->m_pBuffer = 0;
+		pQueue->m_pRingPrev->m_pRingNext = pQueue->m_pRingNext;
 	}
+	else
+	{
+		m_pRingFirst = pQueue->m_pRingNext;
+	}
+	if(pQueue->m_pRingNext)
+	{
+		pQueue->m_pRingNext->m_pRingPrev = pQueue->m_pRingPrev;
+	}
+	else
+	{
+		m_pRingLast = pQueue->m_pRingPrev;
+	}
+
+	pQueue->m_bInRing = false;
 }
 
 void CDatagrams::FlushSendCache()
 {
+	m_nFlushPending.storeRelease(0);
+
 	QMutexLocker l(&m_pSection);
 
+	// cheap when nothing is due, runs about once a second
+	RemoveOldIn(false);
+
 	__FlushSendCache();
 }
 
+// Queues a datagram behind the other datagrams waiting for the same host
+void CDatagrams::Schedule(DatagramOut* pDG)
+{
+	quint32 nHash = qHash(static_cast<const QHostAddress&>(pDG->m_oAddress)) * 0x9E3779B1u;
+	DatagramQueue* pQueue = FindQueue(pDG->m_oAddress, nHash);
+
+	if(!pQueue)
+	{
+		// there are as many queues as out frames, a queued datagram holds one of each
+		Q_ASSERT(!m_FreeQueues.isEmpty());
+
+		pQueue = m_FreeQueues.takeLast();
+		pQueue->m_oAddress = pDG->m_oAddress;
+		pQueue->m_nHash = nHash;
+		pQueue->m_pFirst = 0;
+		pQueue->m_pLast = 0;
+		pQueue->m_bInRing = false;
+
+		quint32 i = nHash & m_nQueueMask;
+		while(m_pQueueIndex[i])
+		{
+			i = (i + 1) & m_nQueueMask;
+		}
+		m_pQueueIndex[i] = pQueue;
+	}
+
+	QueueAppend(pQueue, pDG);
+
+	if(!pQueue->m_bInRing)
+	{
+		RingAppend(pQueue);
+	}
+}
+
+// Hands the collected fragments to the socket, then releases datagrams that were sent completely.
+// Stops when the socket is full; fragments that did not go out are put back into their datagrams.
+// Returns the number of batch entries sent, ACKs after that are left to the caller.
+int CDatagrams::SendBatch(DatagramBatch& oBatch)
+{
+	int nSent = 0;
+	bool bBlocked = false;
+
+#ifdef HAVE_SENDMMSG
+	if(m_nSocketFamily == AF_INET || m_nSocketFamily == AF_INET6)
+	{
+		struct mmsghdr arrMessages[UDP_SEND_BATCH];
+		struct iovec arrVectors[UDP_SEND_BATCH];
+		struct sockaddr_storage arrAddresses[UDP_SEND_BATCH];
+		int arrEntries[UDP_SEND_BATCH];	// batch entry of each message
+		int nMessages = 0;
+
+		memset(&arrMessages[0], 0, sizeof(struct mmsghdr) * oBatch.m_nCount);
+
+		for(int i = 0; i < oBatch.m_nCount; i++)
+		{
+			const CEndPoint* pAddress = oBatch.m_pAddress[i];
+			socklen_t nAddress = 0;
+
+			memset(&arrAddresses[nMessages], 0, sizeof(struct sockaddr_storage));
+
+			if(m_nSocketFamily == AF_INET6)
+			{
+				struct sockaddr_in6* pAddress6 = (struct sockaddr_in6*)&arrAddresses[nMessages];
+				pAddress6->sin6_family = AF_INET6;
+				pAddress6->sin6_port = htons(pAddress->port());
+
+				if(pAddress->protocol() == QAbstractSocket::IPv4Protocol)
+				{
+					quint32 nIPv4 = htonl(pAddress->toIPv4Address());
+					pAddress6->sin6_addr.s6_addr[10] = 0xFF;
+					pAddress6->sin6_addr.s6_addr[11] = 0xFF;
+					memcpy(&pAddress6->sin6_addr.s6_addr[12], &nIPv4, sizeof(quint32));
+				}
+				else
+				{
+					Q_IPV6ADDR oIPv6 = pAddress->toIPv6Address();
+					memcpy(&pAddress6->sin6_addr.s6_addr[0], &oIPv6.c[0], 16);
+				}
+
+				nAddress = sizeof(struct sockaddr_in6);
+			}
+			else if(pAddress->protocol() == QAbstractSocket::IPv4Protocol)
+			{
+				struct sockaddr_in* pAddress4 = (struct sockaddr_in*)&arrAddresses[nMessages];
+				pAddress4->sin_family = AF_INET;
+				pAddress4->sin_port = htons(pAddress->port());
+				pAddress4->sin_addr.s_addr = htonl(pAddress->toIPv4Address());
+
+				nAddress = sizeof(struct sockaddr_in);
+			}
+			else
+			{
+				// IPv6 destination on an IPv4-only socket, nothing we can do
+				continue;
+			}
+
+			arrVectors[nMessages].iov_base = (void*)oBatch.m_pData[i];
+			arrVectors[nMessages].iov_len = oBatch.m_nLength[i];
+			arrMessages[nMessages].msg_hdr.msg_iov = &arrVectors[nMessages];
+			arrMessages[nMessages].msg_hdr.msg_iovlen = 1;
+			arrMessages[nMessages].msg_hdr.msg_name = &arrAddresses[nMessages];
+			arrMessages[nMessages].msg_hdr.msg_namelen = nAddress;
+			arrEntries[nMessages] = i;
+			nMessages++;
+		}
+
+		// a failed datagram stops the call, skip it and carry on with the rest
+		int nOffset = 0;
+		while(nOffset < nMessages)
+		{
+			int nResult = sendmmsg(m_pSocket->socketDescriptor(), &arrMessages[nOffset], nMessages - nOffset, MSG_DONTWAIT);
+
+			if(nResult < 0)
+			{
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					bBlocked = true;
+					break;
+				}
+				nResult = 1;
+			}
+
+			nOffset += nResult;
+		}
+
+		// entries skipped above count as sent, they never will be
+		nSent = bBlocked ? arrEntries[nOffset] : oBatch.m_nCount;
+	}
+#endif
+
+	while(!bBlocked && nSent < oBatch.m_nCount)
+	{
+		if(m_pSocket->writeDatagram(oBatch.m_pData[nSent], oBatch.m_nLength[nSent], *oBatch.m_pAddress[nSent], oBatch.m_pAddress[nSent]->port()) < 0
+				&& m_pSocket->error() == QAbstractSocket::TemporaryError)
+		{
+			bBlocked = true;
+			break;
+		}
+		nSent++;
+	}
+
+	for(int i = 0; i < nSent; i++)
+	{
+		m_mOutput.Add(oBatch.m_nLength[i]);
+		if(oBatch.m_pDatagram[i])
+		{
+			m_nOutFrags++;
+		}
+	}
+
+	// datagrams that already left their host's queue go back into it
+	for(int i = nSent; i < oBatch.m_nCount; i++)
+	{
+		if(DatagramOut* pDG = oBatch.m_pDatagram[i])
+		{
+			pDG->Unsend(oBatch.m_pData[i]);
+			if(!pDG->m_pQueue)
+			{
+				Schedule(pDG);
+			}
+		}
+	}
+
+	for(int i = 0; i < oBatch.m_nDone; i++)
+	{
+		if(!oBatch.m_pDone[i]->m_pQueue)
+		{
+			Remove(oBatch.m_pDone[i]);
+		}
+	}
+
+	oBatch.m_nCount = 0;
+	oBatch.m_nDone = 0;
+
+	return nSent;
+}
+
 void CDatagrams::__FlushSendCache()
 {
 	if(!m_bActive)
@@ -494,52 +1031,83 @@ void CDatagrams::__FlushSendCache()
 	if( nMaxPPS <= 0 )
 	{
 		systemLog.postLog( LogSeverity::Debug, Components::Network,
-						   "UDP: PPS limit reached, ACKS: %d, Packets: %d, Average PPS: %u / %u",
-						   m_AckCache.size(), m_SendCache.size(), meter.AvgUsage(), meter.Usage() );
+						   "UDP: PPS limit reached, ACKS: %u, Packets: %u, Average PPS: %u / %u",
+						   m_nAcks, m_nSendCount, meter.AvgUsage(), meter.Usage() );
 		return;
 	}
 
-	while( nToWrite > 0 && !m_AckCache.isEmpty() && nMaxPPS > 0)
+	DatagramBatch oBatch;
+	oBatch.m_nCount = 0;
+	oBatch.m_nDone = 0;
+	bool bBlocked = false;	// the socket is full, the rest waits for the next flush
+
+	// ACKs go first, they stay in the ring until the batch pointing at them has been sent
+	while( nToWrite > 0 && m_nAcks > 0 && nMaxPPS > 0 && !bBlocked)
 	{
-		QPair< CEndPoint, char* > oAck = m_AckCache.takeFirst();
-		m_pSocket->writeDatagram(oAck.second, sizeof(GND_HEADER), oAck.first, oAck.first.port());
-		m_mOutput.Add(sizeof(GND_HEADER));
-		nToWrite -= sizeof(GND_HEADER);
-		delete (GND_HEADER*)oAck.second;
-		nMaxPPS--;
-		meter.Add(1);
+		quint32 nAcks = 0;
+
+		while(nAcks < m_nAcks && nAcks < UDP_SEND_BATCH && nToWrite > 0 && nMaxPPS > 0)
+		{
+			DatagramAck* pAck = &m_pAcks[(m_nAckFirst + nAcks) % UDP_ACK_RING];
+
+			oBatch.m_pData[oBatch.m_nCount] = (const char*)&pAck->m_oHeader;
+			oBatch.m_nLength[oBatch.m_nCount] = sizeof(GND_HEADER);
+			oBatch.m_pAddress[oBatch.m_nCount] = &pAck->m_oAddress;
+			oBatch.m_pDatagram[oBatch.m_nCount] = 0;
+			oBatch.m_nCount++;
+			nAcks++;
+
+			nToWrite -= sizeof(GND_HEADER);
+			nMaxPPS--;
+			meter.Add(1);
+		}
+
+		quint32 nSent = SendBatch(oBatch);
+		bBlocked = (nSent < nAcks);
+
+		m_nAckFirst = (m_nAckFirst + nSent) % UDP_ACK_RING;
+		m_nAcks -= nSent;
 	}
 
-	QHostAddress nLastHost;
+	// datagrams waiting for ACKs go back to their hosts' queues once the resend interval passed
+	while(m_oResendWait.m_pFirst && tNow - m_oResendWait.m_pFirst->m_tQueued >= quazaaSettings.Gnutella2.UdpOutResend)
+	{
+		DatagramOut* pDG = m_oResendWait.m_pFirst;
+
+		QueueUnlink(pDG);
+		Schedule(pDG);
+	}
 
+	// one fragment per destination per round, so a single large datagram can not starve other hosts
 	// it can write slightly more than limit allows... that's ok
-	while(nToWrite > 0 && !m_SendCache.isEmpty() && nMaxPPS > 0)
+	while(nToWrite > 0 && nMaxPPS > 0 && m_pRingFirst && !bBlocked)
 	{
+		DatagramQueue* pQueue = m_pRingFirst;
 		bool bSent = false;
 
-		char* pPacket;
-		quint32 nPacket;
+		RingUnlink(pQueue);
 
-		for(QLinkedList<DatagramOut*>::iterator itPacket = m_SendCache.begin(); itPacket != m_SendCache.end(); ++itPacket)
+		while(!bSent && pQueue->m_pFirst)
 		{
-			DatagramOut* pDG = *itPacket;
+			DatagramOut* pDG = pQueue->m_pFirst;
 
-			if(pDG->m_oAddress == nLastHost)
-			{
-				continue;
-			}
+			char* pPacket;
+			quint32 nPacket;
 
 			// TODO: Check the firewall's UDP state. Could do 3 UDP states.
-			if(pDG->GetPacket(tNow, &pPacket, &nPacket, pDG->m_bAck && m_nInFrags > 0))
+			bool bResend = pDG->m_bAck && m_nInFrags > 0;
+
+			if(pDG->GetPacket(tNow, &pPacket, &nPacket, bResend))
 			{
 #ifdef DEBUG_UDP
 				systemLog.postLog(LogSeverity::Debug, "UDP sending to %s seq %u part %u count %u", pDG->m_oAddress.toString().toLocal8Bit().constData(), pDG->m_nSequence, ((GND_HEADER*)pPacket)->nPart, pDG->m_nCount);
 #endif
 
-				m_pSocket->writeDatagram(pPacket, nPacket, pDG->m_oAddress, pDG->m_oAddress.port());
-				m_nOutFrags++;
-
-				nLastHost = pDG->m_oAddress;
+				oBatch.m_pData[oBatch.m_nCount] = pPacket;
+				oBatch.m_nLength[oBatch.m_nCount] = nPacket;
+				oBatch.m_pAddress[oBatch.m_nCount] = &pDG->m_oAddress;
+				oBatch.m_pDatagram[oBatch.m_nCount] = pDG;
+				oBatch.m_nCount++;
 
 				if(nToWrite >= nPacket)
 				{
@@ -550,31 +1118,55 @@ void CDatagrams::__FlushSendCache()
 					nToWrite = 0;
 				}
 
-				m_mOutput.Add(nPacket);
-
-				if(!pDG->m_bAck)
-				{
-					Remove(pDG);
-				}
-
 				nMaxPPS--;
 				meter.Add(1);
 
 				bSent = true;
+			}
+			else
+			{
+				// every fragment is out, an emptied queue is released here
+				QueueUnlink(pDG);
 
-				break;
+				if(bResend)
+				{
+					pDG->m_tQueued = tNow;
+					QueueAppend(&m_oResendWait, pDG);
+				}
+				else if(!pDG->m_bAck)
+				{
+					// its last fragment may still sit in the batch
+					if(oBatch.m_nDone == UDP_SEND_BATCH)
+					{
+						int nBatch = oBatch.m_nCount;
+						bBlocked = (SendBatch(oBatch) < nBatch);
+					}
+					oBatch.m_pDone[oBatch.m_nDone++] = pDG;
+				}
 			}
 		}
 
-		if(m_SendCache.isEmpty() || !bSent)
+		// SendBatch() may have put it back already when a fragment did not go out
+		if(pQueue->m_pFirst && !pQueue->m_bInRing)
 		{
-			break;
+			RingAppend(pQueue);
 		}
+
+		if(oBatch.m_nCount == UDP_SEND_BATCH)
+		{
+			int nBatch = oBatch.m_nCount;
+			bBlocked = (SendBatch(oBatch) < nBatch);
+		}
+	}
+
+	if(oBatch.m_nCount || oBatch.m_nDone)
+	{
+		SendBatch(oBatch);
 	}
 
-	while(!m_SendCache.isEmpty() && tNow - m_SendCache.back()->m_tSent > quazaaSettings.Gnutella2.UdpOutExpire)
+	while(m_pSendLast && tNow - m_pSendLast->m_tSent > quazaaSettings.Gnutella2.UdpOutExpire)
 	{
-		Remove(m_SendCache.back());
+		Remove(m_pSendLast);
 	}
 
 }
@@ -593,31 +1185,38 @@ void CDatagrams::SendPacket(CEndPoint& oAddr, G2Packet* pPacket, bool bAck, Data
 
 	if(m_FreeDGOut.isEmpty())
 	{
-		systemLog.postLog(LogSeverity::Debug, QString("UDP out frames exhausted"));
+		m_nOutExhausted++;
 
 		if( !bAck ) // if caller does not want ACK, drop the packet here
 			return; // TODO: needs more testing
 
-		Remove(m_SendCache.last());
-
+		Remove(m_pSendLast);
 	}
 
-	if(m_FreeBuffer.isEmpty())
+	// skip sequences still held by an unacknowledged datagram
+	while(m_pSendIndex[m_nSequence & m_nSendMask])
 	{
-		RemoveOldIn(false);
-
-		if(m_FreeBuffer.isEmpty())
-		{
-			systemLog.postLog(LogSeverity::Debug, QString("UDP out discarded, out of buffers"));
-			return;
-		}
+		m_nSequence++;
 	}
 
-	DatagramOut* pDG = m_FreeDGOut.takeFirst();
-	pDG->Create(oAddr, pPacket, m_nSequence++, m_FreeBuffer.takeFirst(), (bAck && (m_nInFrags > 0))); // to prevent net spam when unable to receive datagrams
+	DatagramOut* pDG = m_FreeDGOut.takeLast();
+	pDG->Create(oAddr, pPacket, m_nSequence++, (bAck && (m_nInFrags > 0))); // to prevent net spam when unable to receive datagrams
 
-	m_SendCache.prepend(pDG);
-	m_SendCacheMap[pDG->m_nSequence] = pDG;
+	pDG->m_pCachePrev = 0;
+	pDG->m_pCacheNext = m_pSendFirst;
+	if(m_pSendFirst)
+	{
+		m_pSendFirst->m_pCachePrev = pDG;
+	}
+	else
+	{
+		m_pSendLast = pDG;
+	}
+	m_pSendFirst = pDG;
+	m_nSendCount++;
+	m_pSendIndex[pDG->m_nSequence & m_nSendMask] = pDG;
+
+	Schedule(pDG);
 
 	// TODO: Notify the listener if we have one.
 
@@ -625,8 +1224,15 @@ void CDatagrams::SendPacket(CEndPoint& oAddr, G2Packet* pPacket, bool bAck, Data
 	systemLog.postLog(LogSeverity::Debug, "UDP queued for %s seq %u parts %u", oAddr.toString().toLocal8Bit().constData(), pDG->m_nSequence, pDG->m_nCount);
 #endif
 
-	//emit SendQueueUpdated();
-	__FlushSendCache();
+	// the socket belongs to the UDP thread, other threads only queue
+	if(QThread::currentThread() == thread())
+	{
+		__FlushSendCache();
+	}
+	else if(m_nFlushPending.testAndSetRelaxed(0, 1))
+	{
+		emit SendQueueUpdated();
+	}
 
 }
 
@@ -634,48 +1240,140 @@ void CDatagrams::OnPacket(CEndPoint addr, G2Packet* pPacket)
 {
 	try
 	{
-		if(pPacket->IsType("PI"))
-		{
-			OnPing(addr, pPacket);
-		}
-		else if(pPacket->IsType("PO"))
-		{
-			OnPong(addr, pPacket);
-		}
-		else if(pPacket->IsType("CRAWLR"))
-		{
-			OnCRAWLR(addr, pPacket);
-		}
-		else if(pPacket->IsType("QKR"))
+		switch(pPacket->m_nType)
 		{
-			OnQKR(addr, pPacket);
-		}
-		else if(pPacket->IsType("QKA"))
-		{
-			OnQKA(addr, pPacket);
-		}
-		else if(pPacket->IsType("QA"))
-		{
-			OnQA(addr, pPacket);
-		}
-		else if(pPacket->IsType("QH2"))
-		{
-			OnQH2(addr, pPacket);
-		}
-		else if(pPacket->IsType("Q2"))
-		{
-			OnQuery(addr, pPacket);
+			case G2PacketType::PI:
+				OnPing(addr, pPacket);
+				break;
+			case G2PacketType::PO:
+				OnPong(addr, pPacket);
+				break;
+			case G2PacketType::QKR:
+				OnQKR(addr, pPacket);
+				break;
+			case G2PacketType::QKA:
+				OnQKA(addr, pPacket);
+				break;
+			case G2PacketType::CRAWLR:
+			case G2PacketType::QA:
+			case G2PacketType::QH2:
+				// need neighbours, searches or routes
+				PostToNetwork(addr, pPacket);
+				break;
+			case G2PacketType::Q2:
+				OnQuery(addr, pPacket);
+				break;
+			default:
+				//systemLog.postLog(LogSeverity::Debug, QString("G2 UDP recieved unknown packet %1").arg(pPacket->GetType()));
+				//qDebug() << "UDP RECEIVED unknown packet " << pPacket->GetType();
+				break;
 		}
-		else
+	}
+	catch(...)
+	{
+		systemLog.postLog(LogSeverity::Debug, QString("malformed packet"));
+		//qDebug() << "malformed packet";
+	}
+}
+
+// UDP thread: queues a packet for the network thread, published once the current wakeup is done
+void CDatagrams::PostToNetwork(const CEndPoint& addr, G2Packet* pPacket, CQueryPtr pQuery)
+{
+	DatagramTask* pTask = new DatagramTask;
+	pTask->m_oAddress = addr;
+	pTask->m_pPacket = pPacket;
+	pTask->m_pQuery = pQuery;
+	pPacket->AddRef();
+
+	pTask->m_pNext = m_pOutbox;
+	m_pOutbox = pTask;
+	if(!m_pOutboxTail)
+	{
+		m_pOutboxTail = pTask;
+	}
+}
+
+// UDP thread: pushes the whole outbox onto the lock-free task stack in one go.
+// Only called after the receive path dropped its own packet references.
+void CDatagrams::PublishTasks()
+{
+	if(!m_pOutbox)
+	{
+		return;
+	}
+
+	DatagramTask* pHead;
+	do
+	{
+		pHead = m_pNetworkTasks.loadAcquire();
+		m_pOutboxTail->m_pNext = pHead;
+	}
+	while(!m_pNetworkTasks.testAndSetRelease(pHead, m_pOutbox));
+
+	m_pOutbox = 0;
+	m_pOutboxTail = 0;
+
+	// the network thread takes everything at once, so wake it only on the first push
+	if(!pHead)
+	{
+		QMetaObject::invokeMethod(&Network, "OnDatagramTasks", Qt::QueuedConnection);
+	}
+}
+
+// Network thread: handles everything the UDP thread posted, oldest first
+void CDatagrams::ProcessNetworkTasks()
+{
+	DatagramTask* pList = m_pNetworkTasks.fetchAndStoreAcquire(0);
+
+	DatagramTask* pOrdered = 0;
+	while(pList)
+	{
+		DatagramTask* pNext = pList->m_pNext;
+		pList->m_pNext = pOrdered;
+		pOrdered = pList;
+		pList = pNext;
+	}
+
+	while(pOrdered)
+	{
+		DatagramTask* pTask = pOrdered;
+		pOrdered = pTask->m_pNext;
+
+		OnNetworkPacket(pTask->m_oAddress, pTask->m_pPacket, pTask->m_pQuery);
+
+		pTask->m_pPacket->Release();
+		delete pTask;
+	}
+}
+
+void CDatagrams::OnNetworkPacket(CEndPoint& addr, G2Packet* pPacket, CQueryPtr pQuery)
+{
+	try
+	{
+		switch(pPacket->m_nType)
 		{
-			//systemLog.postLog(LogSeverity::Debug, QString("G2 UDP recieved unknown packet %1").arg(pPacket->GetType()));
-			//qDebug() << "UDP RECEIVED unknown packet " << pPacket->GetType();
+			case G2PacketType::CRAWLR:
+				OnCRAWLR(addr, pPacket);
+				break;
+			case G2PacketType::QKA:
+				OnQKAForward(addr, pPacket);
+				break;
+			case G2PacketType::QA:
+				OnQA(addr, pPacket);
+				break;
+			case G2PacketType::QH2:
+				OnQH2(addr, pPacket);
+				break;
+			case G2PacketType::Q2:
+				OnQueryRoute(addr, pPacket, pQuery);
+				break;
+			default:
+				break;
 		}
 	}
 	catch(...)
 	{
 		systemLog.postLog(LogSeverity::Debug, QString("malformed packet"));
-		//qDebug() << "malformed packet";
 	}
 }
 
@@ -713,8 +1411,6 @@ void CDatagrams::OnPong(CEndPoint& addr, G2Packet* pPacket)
 }
 void CDatagrams::OnCRAWLR(CEndPoint& addr, G2Packet* pPacket)
 {
-	QMutexLocker l2(&Neighbours.m_pSection);
-
 //	bool bRLeaf = false;
 //	bool bRNick = false;
 //	bool bRGPS = false;
@@ -766,7 +1462,9 @@ void CDatagrams::OnCRAWLR(CEndPoint& addr, G2Packet* pPacket)
 	pTmp->WritePacket("NA", ((Network.m_oAddress.protocol() == 0) ? 6 : 18))->WriteHostAddress(&Network.m_oAddress);
 	pTmp->WritePacket("CV", CQuazaaGlobals::USER_AGENT_STRING().toUtf8().size())->WriteString(CQuazaaGlobals::USER_AGENT_STRING(), false);
 	pTmp->WritePacket("V", 4)->WriteString(CQuazaaGlobals::VENDOR_CODE(), false);;
-	quint16 nLeaves = Neighbours.m_nLeavesConnectedG2;
+	NeighboursSnapshotPtr pSnapshot = Neighbours.GetSnapshot();
+
+	quint16 nLeaves = pSnapshot->m_nLeavesConnectedG2;
 	pTmp->WritePacket("HS", 2)->WriteIntLE(nLeaves);
 	if(!quazaaSettings.Profile.GnutellaScreenName.isEmpty())
 	{
@@ -776,28 +1474,29 @@ void CDatagrams::OnCRAWLR(CEndPoint& addr, G2Packet* pPacket)
 	pCA->WritePacket(pTmp);
 	pTmp->Release();
 
-	for(QList<CNeighbour*>::iterator itNode = Neighbours.begin(); itNode != Neighbours.end(); ++itNode)
+	for(QVector<NeighbourStats>::const_iterator itNode = pSnapshot->m_lNodes.constBegin(); itNode != pSnapshot->m_lNodes.constEnd(); ++itNode)
 	{
-		if((*itNode)->m_nProtocol != dpG2)
+		if(itNode->m_nProtocol != dpG2)
 		{
 			continue;
 		}
 
-		CG2Node* pNode = (CG2Node*) * itNode;
-		if(pNode->m_nState == nsConnected)
+		if(itNode->m_nState == nsConnected)
 		{
-			if(pNode->m_nType == G2_HUB)
+			CEndPoint oAddress = itNode->m_oAddress;
+
+			if(itNode->m_nType == G2_HUB)
 			{
 				G2Packet* pNH = G2Packet::New("NH");
-				pNH->WritePacket("NA", ((pNode->m_oAddress.protocol() == 0) ? 6 : 18))->WriteHostAddress(&pNode->m_oAddress);
-				pNH->WritePacket("HS", 2)->WriteIntLE(pNode->m_nLeafCount);
+				pNH->WritePacket("NA", ((oAddress.protocol() == 0) ? 6 : 18))->WriteHostAddress(&oAddress);
+				pNH->WritePacket("HS", 2)->WriteIntLE(itNode->m_nLeafCount);
 				pCA->WritePacket(pNH);
 				pNH->Release();
 			}
-			else if(pNode->m_nType == G2_LEAF)
+			else if(itNode->m_nType == G2_LEAF)
 			{
 				G2Packet* pNL = G2Packet::New("NL");
-				pNL->WritePacket("NA", ((pNode->m_oAddress.protocol() == 0) ? 6 : 18))->WriteHostAddress(&pNode->m_oAddress);
+				pNL->WritePacket("NA", ((oAddress.protocol() == 0) ? 6 : 18))->WriteHostAddress(&oAddress);
 				pCA->WritePacket(pNL);
 				pNL->Release();
 			}
@@ -927,6 +1626,7 @@ void CDatagrams::OnQKA(CEndPoint& addr, G2Packet* pPacket)
 		else
 		{
 			pCache->setKey( nKey );
+			hostCache.onSuccess( pCache );
 		}
 	}
 	hostCache.m_pSection.unlock();
@@ -942,16 +1642,21 @@ void CDatagrams::OnQKA(CEndPoint& addr, G2Packet* pPacket)
 		pQNA->WriteHostAddress(&addr);
 		pPacket->PrependPacket(pQNA);
 
-		Neighbours.m_pSection.lock();
-		CNeighbour* pNode = Neighbours.Find(nKeyHost, dpG2);
-		if( pNode )
-		{
-			((CG2Node*)pNode)->SendPacket(pPacket, true, false);
-		}
-		Neighbours.m_pSection.unlock();
+		PostToNetwork(CEndPoint(nKeyHost, 0), pPacket);
 	}
 
 }
+
+// Network thread: hands a /QKA over to the leaf that asked for it
+void CDatagrams::OnQKAForward(CEndPoint& oHub, G2Packet* pPacket)
+{
+	NeighboursSnapshotPtr pSnapshot = Neighbours.GetSnapshot();
+	const NeighbourStats* pStats = pSnapshot->Find(oHub, dpG2);
+	if( pStats )
+	{
+		((CG2Node*)pStats->m_pNode)->SendPacket(pPacket, true, false);
+	}
+}
 void CDatagrams::OnQA(CEndPoint& addr, G2Packet* pPacket)
 {
 	hostCache.m_pSection.lock();
@@ -975,7 +1680,7 @@ void CDatagrams::OnQA(CEndPoint& addr, G2Packet* pPacket)
 		pPacket->AddOrReplaceChild( "FR", pFR );
 
 		Network.m_pSection.lock();
-		Network.RoutePacket( oGuid, pPacket, true, false );
+		Network.RoutePacket( oGuid, pPacket, false );
 		Network.m_pSection.unlock();
 	}
 }
@@ -1014,7 +1719,7 @@ void CDatagrams::OnQH2(CEndPoint& addr, G2Packet* pPacket)
 					Network.m_oRoutingTable.Add(pInfo->m_oNodeGUID, pInfo->m_lNeighbouringHubs[0], false);
 				}
 
-				Network.RoutePacket(pInfo->m_oGUID, pPacket, true);
+				Network.RoutePacket(pInfo->m_oGUID, pPacket);
 
 				Network.m_pSection.unlock();
 			}
@@ -1071,12 +1776,18 @@ void CDatagrams::OnQuery(CEndPoint &addr, G2Packet *pPacket)
 		{
 			pQKA->WritePacket("SNA", (pQuery->m_oEndpoint.protocol() == QAbstractSocket::IPv6Protocol ? 18 : 6))->WriteHostAddress(&pQuery->m_oEndpoint);
 		}
-		SendPacket(addr, pPacket);
+		SendPacket(addr, pQKA);
 		pQKA->Release();
 
 		return;
 	}
 
+	PostToNetwork(addr, pPacket, pQuery);
+}
+
+// Network thread: routing half of OnQuery, the query key has already been checked
+void CDatagrams::OnQueryRoute(CEndPoint& addr, G2Packet* pPacket, CQueryPtr pQuery)
+{
 	if( !Network.m_oRoutingTable.Add(pQuery->m_oGUID, pQuery->m_oEndpoint) )
 	{
 #if LOG_QUERY_HANDLING
@@ -1104,14 +1815,21 @@ void CDatagrams::OnQuery(CEndPoint &addr, G2Packet *pPacket)
 		pPacket->AddOrReplaceChild("UDP", pUDP);
 	}
 
-	Neighbours.m_pSection.lock();
 	G2Packet* pQA = Neighbours.CreateQueryAck(pQuery->m_oGUID);
 	SendPacket(pQuery->m_oEndpoint, pQA, true);
 	pQA->Release();
 
 	Neighbours.RouteQuery(pQuery, pPacket);
-	Neighbours.m_pSection.unlock();
 
 	// local search
+	QList<G2Packet*> lHits;
+	if( CLocalSearch::Execute(pQuery, lHits) )
+	{
+		foreach( G2Packet* pHit, lHits )
+		{
+			SendPacket(pQuery->m_oEndpoint, pHit, true);
+			pHit->Release();
+		}
+	}
 }
 
@@ -26,15 +26,20 @@
 #define DATAGRAMS_H
 
 #include "types.h"
+#include "thread.h"
 #include <QMutex>
+#include <QAtomicPointer>
 #include <QUdpSocket>
 #include <QHash>
 #include <QLinkedList>
+#include <QVector>
 #include <QTimer>
 #include <QTime>
 
 #include "queryhit.h"
+#include "query.h"
 #include "networkconnection.h"
+#include "datagramfrags.h"
 
 class G2Packet;
 
@@ -46,11 +51,72 @@ public:
 	virtual void OnFailure(void* pParam) = 0;
 };
 
+// Maximum number of datagrams handed to the kernel in one send call
+#define UDP_SEND_BATCH	64
+// Number of receive buffers used by the batched receive path
+#define UDP_RECV_BATCH	32
+// Size of a single batched receive buffer, larger datagrams are discarded
+#define UDP_RECV_BUFFER	4096
+// Number of ACKs that can wait for the next flush
+#define UDP_ACK_RING	256
+
+#pragma pack(push, 1)
+typedef struct
+{
+	char     szTag[3];
+	quint8   nFlags;
+	quint16  nSequence;
+	quint8   nPart;
+	quint8   nCount;
+} GND_HEADER;
+
+#pragma pack(pop)
+
 class DatagramOut;
 class DatagramIn;
 class CBuffer;
 class QHostAddress;
 
+// Outgoing datagrams waiting for one destination host, served round-robin
+struct DatagramQueue
+{
+	QHostAddress	m_oAddress;
+	quint32			m_nHash;
+	DatagramOut*	m_pFirst;
+	DatagramOut*	m_pLast;
+	DatagramQueue*	m_pRingNext;
+	DatagramQueue*	m_pRingPrev;
+	bool			m_bInRing;
+};
+
+// ACK waiting for the next flush
+struct DatagramAck
+{
+	CEndPoint		m_oAddress;
+	GND_HEADER		m_oHeader;
+};
+
+// Fragments collected for a single batched send
+struct DatagramBatch
+{
+	int					m_nCount;
+	const char*			m_pData[UDP_SEND_BATCH];
+	quint32				m_nLength[UDP_SEND_BATCH];
+	const CEndPoint*	m_pAddress[UDP_SEND_BATCH];
+	DatagramOut*		m_pDatagram[UDP_SEND_BATCH];	// Owner of a fragment, 0 for ACKs
+	int					m_nDone;
+	DatagramOut*		m_pDone[UDP_SEND_BATCH];	// Fully sent, released after the batch went out
+};
+
+// Packet handed over from the UDP thread to the network thread
+struct DatagramTask
+{
+	DatagramTask*	m_pNext;
+	CEndPoint		m_oAddress;		// Sender, or the hub a /QKA is forwarded to
+	G2Packet*		m_pPacket;
+	CQueryPtr		m_pQuery;		// Already parsed and key-checked /Q2
+};
+
 class CDatagrams : public QObject
 {
 	Q_OBJECT
@@ -66,24 +132,34 @@ protected:
 
 	QTimer*       m_tSender;
 
-    QHash<quint16, DatagramOut*>     m_SendCacheMap;    // To quicky find the sequence of packets.
-    QLinkedList<DatagramOut*>		 m_SendCache;		// A LIFO queue, last is oldest.
-	QLinkedList<DatagramOut*>		 m_FreeDGOut;
+	DatagramOut*                     m_pSendFirst;      // Send cache, newest first.
+	DatagramOut*                     m_pSendLast;       // Oldest datagram in the send cache.
+	quint32                          m_nSendCount;
+	DatagramOut**                    m_pSendIndex;      // Datagrams by sequence, direct mapped.
+	quint32                          m_nSendMask;
+	QVector<DatagramOut*>            m_FreeDGOut;
 	quint16                          m_nSequence;
 
-	QHash < QHostAddress,
-	      QHash<quint32, DatagramIn*>
-          >                     m_RecvCache;            // For searching by ip & sequence.
-    QLinkedList<DatagramIn*>    m_RecvCacheTime;        // A list ordered by recieve time, last is oldest.
+	DatagramQueue**                  m_pQueueIndex;     // Destination queues by address, open addressed.
+	quint32                          m_nQueueMask;
+	QVector<DatagramQueue*>          m_FreeQueues;
+	DatagramQueue*                   m_pRingFirst;      // Destinations with pending fragments, round-robin order.
+	DatagramQueue*                   m_pRingLast;
+	DatagramQueue                    m_oResendWait;     // Datagrams with all fragments in flight, oldest first.
+	int                              m_nSocketFamily;   // Address family of the UDP socket (batched I/O).
+
+	DatagramInCache             m_RecvCache;            // Datagrams being reassembled, by address, port & sequence.
+	DatagramSlab                m_oSlab;                // Fragment slots of incoming datagrams.
+	CBuffer*                    m_pAssembly;            // Reassembled datagrams are joined here.
 
-    QLinkedList <
-        QPair<CEndPoint, char*>
-                >               m_AckCache;
+	DatagramAck                 m_pAcks[UDP_ACK_RING];  // ACKs waiting for the next flush.
+	quint32                     m_nAckFirst;
+	quint32                     m_nAcks;
 
-    QLinkedList<DatagramIn*> m_FreeDGIn;		// A list of free incoming packets.
-    QLinkedList<CBuffer*>	 m_FreeBuffer;		// A list of free buffers.
+	QVector<DatagramIn*>        m_FreeDGIn;             // Free incoming datagrams.
 
 	CBuffer*    	m_pRecvBuffer;
+	CBuffer*		m_pBatchBuffers[UDP_RECV_BATCH];	// Pre-allocated buffers for batched receive
 	QHostAddress*   m_pHostAddress;
 	quint16         m_nPort;
 
@@ -95,6 +171,14 @@ protected:
 	quint32			m_nDiscarded;
 	quint32			m_nInFrags;
 	quint32			m_nOutFrags;
+	quint32			m_nInExhausted;		// Incoming datagrams dropped for lack of free frames
+	quint32			m_nOutExhausted;	// Outgoing datagrams dropped or evicted for lack of free frames
+	quint32			m_nAckDropped;		// ACKs dropped because the ACK ring was full
+
+	DatagramTask*	m_pOutbox;						// Tasks posted during the current wakeup, newest first
+	DatagramTask*	m_pOutboxTail;
+	QAtomicPointer<DatagramTask> m_pNetworkTasks;	// Published by the UDP thread, drained by the network thread
+	QAtomicInt		m_nFlushPending;				// A flush has been requested from another thread
 
 public:
 	CDatagrams();
@@ -106,8 +190,19 @@ public:
 	void SendPacket(CEndPoint& oAddr, G2Packet* pPacket, bool bAck = false, DatagramWatcher* pWatcher = 0, void* pParam = 0);
 
 	void RemoveOldIn(bool bForce = false);
+	void ReceiveOne();
+	int  ReceiveBatch(int nMax);
+	void ProcessDatagram(qint64 nSize);
 	void Remove(DatagramIn* pDG, bool bReclaim = false);
 	void Remove(DatagramOut* pDG);
+	void Schedule(DatagramOut* pDG);
+	int  SendBatch(DatagramBatch& oBatch);
+	void QueueAppend(DatagramQueue* pQueue, DatagramOut* pDG);
+	void QueueUnlink(DatagramOut* pDG);
+	DatagramQueue* FindQueue(const QHostAddress& oAddress, quint32 nHash);
+	void ReleaseQueue(DatagramQueue* pQueue);
+	void RingUnlink(DatagramQueue* pQueue);
+	void RingAppend(DatagramQueue* pQueue);
 	void OnReceiveGND();
 	void OnAcknowledgeGND();
 
@@ -121,6 +216,13 @@ public:
 	void OnQH2(CEndPoint& addr, G2Packet* pPacket);
 	void OnQuery(CEndPoint& addr, G2Packet* pPacket);
 
+	void PostToNetwork(const CEndPoint& addr, G2Packet* pPacket, CQueryPtr pQuery = CQueryPtr());
+	void PublishTasks();
+	void ProcessNetworkTasks();
+	void OnNetworkPacket(CEndPoint& addr, G2Packet* pPacket, CQueryPtr pQuery);
+	void OnQKAForward(CEndPoint& oHub, G2Packet* pPacket);
+	void OnQueryRoute(CEndPoint& addr, G2Packet* pPacket, CQueryPtr pQuery);
+
 	inline quint32 DownloadSpeed();
 	inline quint32 UploadSpeed();
 	inline bool IsFirewalled();
@@ -131,24 +233,16 @@ public slots:
 	void FlushSendCache();
 	void __FlushSendCache();
 
+protected slots:
+	void SetupThread();
+	void CleanupThread();
+
 signals:
 	void SendQueueUpdated();
 
 	friend class CNetwork;
 };
 
-#pragma pack(push, 1)
-typedef struct
-{
-	char     szTag[3];
-	quint8   nFlags;
-	quint16  nSequence;
-	quint8   nPart;
-	quint8   nCount;
-} GND_HEADER;
-
-#pragma pack(pop)
-
 quint32 CDatagrams::DownloadSpeed()
 {
 	return m_mInput.AvgUsage();
@@ -167,5 +261,6 @@ bool CDatagrams::isListening()
 }
 
 extern CDatagrams Datagrams;
+extern CThread DatagramsThread;
 
 #endif // DATAGRAMS_H
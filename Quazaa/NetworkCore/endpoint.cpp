@@ -255,3 +255,20 @@ QDataStream &operator>>(QDataStream &s, CEndPoint &rhs)
 
 	return s;
 }
+
+uint qHash(const CEndPoint& key)
+{
+	uint nHash;
+
+	if( key.protocol() == QAbstractSocket::IPv4Protocol )
+	{
+		nHash = key.toIPv4Address();
+	}
+	else
+	{
+		Q_IPV6ADDR oAddr = key.toIPv6Address();
+		nHash = qHash(QByteArray::fromRawData((const char*)&oAddr, sizeof(Q_IPV6ADDR)));
+	}
+
+	return nHash ^ (uint(key.port()) * 2654435769u);
+}
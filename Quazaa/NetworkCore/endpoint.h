@@ -209,4 +209,8 @@ void CEndPoint::setAddress(const sockaddr *sockaddr)
 
 QDataStream &operator<<(QDataStream &s, const CEndPoint &rhs);
 QDataStream &operator>>(QDataStream &s, CEndPoint &rhs);
+
+// Hashes the raw address and the port, cheaper than going through the address string
+uint qHash(const CEndPoint& key);
+
 #endif // ENDPOINT_H
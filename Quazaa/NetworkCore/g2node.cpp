@@ -32,6 +32,7 @@
 #include "Hashes/hash.h"
 #include "query.h"
 #include "queryhit.h"
+#include "localsearch.h"
 #include "queryhashtable.h"
 #include "queryhashmaster.h"
 #include "hubhorizon.h"
@@ -84,15 +85,29 @@ CG2Node::~CG2Node()
 
 	if(m_pRemoteTable)
 	{
+		QueryHashMaster.m_pSection.lock();
 		delete m_pRemoteTable;
+		QueryHashMaster.m_pSection.unlock();
 	}
 
 	delete m_pHubGroup;
 }
 
+// Safe from any thread that keeps the node allocated, e.g. by holding a snapshot listing it
 void CG2Node::SendPacket(G2Packet* pPacket, bool bBuffered, bool bRelease)
 {
-	ASSUME_LOCK(Neighbours.m_pSection);
+	if(bBuffered)
+	{
+		// other workers read the packet from now on, so it must own its payload;
+		// forwarded packets keep the time they were received
+		pPacket->Detach();
+		if(pPacket->m_tQueued == 0)
+		{
+			pPacket->m_tQueued = Neighbours.Clock();
+		}
+	}
+
+	m_pSendSection.lock();
 
 	m_nPacketsOut++;
 
@@ -111,6 +126,8 @@ void CG2Node::SendPacket(G2Packet* pPacket, bool bBuffered, bool bRelease)
 		pPacket->ToBuffer(GetOutputBuffer());
 	}
 
+	m_pSendSection.unlock();
+
 	if(bRelease)
 	{
 		pPacket->Release();
@@ -127,7 +144,9 @@ void CG2Node::OnConnect()
 						"Connection with %s established, handshaking...",
 						qPrintable( m_oAddress.toString() ) );
 
+	m_pSection.lock();
 	m_nState = nsHandshaking;
+	m_pSection.unlock();
 	emit NodeStateChanged();
 
 	QByteArray sHs;
@@ -155,16 +174,15 @@ void CG2Node::OnConnect()
 
 	//qDebug() << "Handshake send:\n" << sHs;
 
-	m_sHandshake += "Handshake out:\n" + sHs;
+	AppendHandshake("Handshake out:\n" + sHs);
 
 	Write(sHs);
 }
 
+// Runs on the node's worker without Neighbours.m_pSection, other nodes are reached
+// through the published snapshot
 void CG2Node::OnRead()
 {
-
-	QMutexLocker l(&Neighbours.m_pSection);
-
 	//qDebug() << "CG2Node::OnRead";
 	if(m_nState == nsHandshaking)
 	{
@@ -183,17 +201,31 @@ void CG2Node::OnRead()
 	else if(m_nState == nsConnected)
 	{
 
+		// Packets are parsed in place as views into the input buffer,
+		// consumed bytes are removed once after the whole buffer is drained.
+		CBuffer* pInput = GetInputBuffer();
+		quint32 nOffset = 0;
+
 		G2Packet* pPacket = 0;
+		qint64 tReceived = Neighbours.Clock();
 		try
 		{
-			while((pPacket = G2Packet::ReadBuffer(GetInputBuffer())))
+			while((pPacket = G2Packet::ReadBuffer(pInput, nOffset)))
 			{
 				m_tLastPacketIn = time(0);
 				m_nPacketsIn++;
+				pPacket->m_tQueued = tReceived;
 
 				OnPacket(pPacket);
 
+				// someone kept a reference, give it its own copy (send queues already did)
+				if(pPacket->m_nReference.loadAcquire() > 1)
+				{
+					pPacket->Detach();
+				}
+
 				pPacket->Release();
+				pPacket = 0;
 			}
 		}
 		catch(...)
@@ -201,12 +233,18 @@ void CG2Node::OnRead()
 			if(pPacket)
 			{
 				systemLog.postLog(LogSeverity::Debug, QString("%1").arg(pPacket->Dump()));
+				if(pPacket->m_nReference.loadAcquire() > 1)
+				{
+					pPacket->Detach();
+				}
 				pPacket->Release();
 			}
 
 			systemLog.postLog(LogSeverity::Debug, QString("Packet error - %1").arg(m_oAddress.toString()));
 			Close();
 		}
+
+		pInput->remove(0, nOffset);
 	}
 
 }
@@ -226,7 +264,9 @@ void CG2Node::OnTimer(quint32 tNow)
 			// then we send keep-alive ping, on the occasion of the RTT measurement
 			G2Packet* pPacket = G2Packet::New("PI", false);
 			SendPacket(pPacket, false, true); // Unbuffered, we can accurately measure the RTT
+			m_pSection.lock();
 			m_nPingsWaiting++;
+			m_pSection.unlock();
 			m_tLastPingOut = tNow;
 			m_tRTTTimer.start();
 		}
@@ -240,16 +280,19 @@ void CG2Node::OnTimer(quint32 tNow)
 			return;
 		}*/
 
-		if ( ( m_nType == G2_HUB && tNow - m_tConnected > 30 ) &&
-				(( m_pLocalTable != 0 && m_pLocalTable->m_nCookie != QueryHashMaster.m_nCookie &&
+		if ( m_nType == G2_HUB && tNow - m_tConnected > 30 )
+		{
+			QMutexLocker l(&QueryHashMaster.m_pSection);
+
+			if ( ( m_pLocalTable != 0 && m_pLocalTable->m_nCookie != QueryHashMaster.m_nCookie &&
 				   tNow - m_pLocalTable->m_nCookie > 60 ) ||
 				 ( QueryHashMaster.m_nCookie - m_pLocalTable->m_nCookie > 60 ||
-				   !m_pLocalTable->m_bLive ))
-		   )
-		{
-			if(m_pLocalTable->PatchTo(&QueryHashMaster, this))
+				   !m_pLocalTable->m_bLive ) )
 			{
-				systemLog.postLog(LogSeverity::Notice, tr("Sending query routing table to %1 (%2 bits, %3 entries, %4 bytes, %5% full)").arg(m_oAddress.toString().toLocal8Bit().constData()).arg(m_pLocalTable->m_nBits).arg(m_pLocalTable->m_nHash).arg(m_pLocalTable->m_nHash / 8).arg(m_pLocalTable->GetPercent()));
+				if(m_pLocalTable->PatchTo(&QueryHashMaster, this))
+				{
+					systemLog.postLog(LogSeverity::Notice, tr("Sending query routing table to %1 (%2 bits, %3 entries, %4 bytes, %5% full)").arg(m_oAddress.toString().toLocal8Bit().constData()).arg(m_pLocalTable->m_nBits).arg(m_pLocalTable->m_nHash).arg(m_pLocalTable->m_nHash / 8).arg(m_pLocalTable->GetPercent()));
+				}
 			}
 		}
 
@@ -307,11 +350,14 @@ void CG2Node::ParseIncomingHandshake()
 
 	//qDebug() << "Handshake receive:\n" << sHs;
 
-	m_sHandshake += "Handshake in:\n" + sHs;
+	AppendHandshake("Handshake in:\n" + sHs);
 
 	if(m_sUserAgent.isEmpty())
 	{
-		m_sUserAgent = Parser::GetHeaderValue(sHs, "User-Agent");
+		QString sUserAgent = Parser::GetHeaderValue(sHs, "User-Agent");
+		m_pSection.lock();
+		m_sUserAgent = sUserAgent;
+		m_pSection.unlock();
 	}
 
 	if(m_sUserAgent.isEmpty())
@@ -380,7 +426,7 @@ void CG2Node::ParseIncomingHandshake()
 				Send_ConnectError("503 Maximum hub connections reached");
 				return;
 			}
-			m_nType = G2_HUB;
+			SetType(G2_HUB);
 		}
 		else
 		{
@@ -395,7 +441,8 @@ void CG2Node::ParseIncomingHandshake()
 				Send_ConnectError("503 Maximum leaf connections reached");
 				return;
 			}
-			m_nType = G2_LEAF;
+			SetType(G2_LEAF);
+			m_nTransferClass = tcSearch;	// leaves mostly exchange queries and hits with us
 		}
 
 		Send_ConnectOK(false, m_bAcceptDeflate);
@@ -427,7 +474,7 @@ void CG2Node::ParseIncomingHandshake()
 
 		if(m_bAcceptDeflate)
 		{
-			if(!EnableOutputCompression())
+			if(!EnableDeflate())
 			{
 				systemLog.postLog(LogSeverity::Debug, QString("Deflate init error!"));
 				//qDebug() << "Deflate init error!";
@@ -437,7 +484,9 @@ void CG2Node::ParseIncomingHandshake()
 		}
 #endif
 
+		m_pSection.lock();
 		m_nState = nsConnected;
+		m_pSection.unlock();
 		emit NodeStateChanged();
 
 		SendStartups();
@@ -452,9 +501,8 @@ void CG2Node::ParseIncomingHandshake()
 	{
 		systemLog.postLog(LogSeverity::Debug, QString("Connection to %1 rejected: %2").arg(this->m_oAddress.toString()).arg(sHs.left(sHs.indexOf("\r\n"))));
 		//qDebug() << "Connection rejected: " << sHs.left(sHs.indexOf("\r\n"));
-		m_nState = nsClosing;
-		emit NodeStateChanged();
 		Close();
+		emit NodeStateChanged();
 	}
 }
 
@@ -465,7 +513,7 @@ void CG2Node::ParseOutgoingHandshake()
 
 	//qDebug() << "Handshake receive:\n" << sHs;
 
-	m_sHandshake += "Handshake in:\n" + sHs;
+	AppendHandshake("Handshake in:\n" + sHs);
 
 	QString sAccept = Parser::GetHeaderValue(sHs, "Accept");
 	bool bAcceptG2 = sAccept.contains("application/x-gnutella2");
@@ -485,7 +533,10 @@ void CG2Node::ParseOutgoingHandshake()
 		return;
 	}
 
-	m_sUserAgent = Parser::GetHeaderValue(sHs, "User-Agent");
+	QString sUserAgent = Parser::GetHeaderValue(sHs, "User-Agent");
+	m_pSection.lock();
+	m_sUserAgent = sUserAgent;
+	m_pSection.unlock();
 
 	if(m_sUserAgent.isEmpty())
 	{
@@ -574,7 +625,7 @@ void CG2Node::ParseOutgoingHandshake()
 			Send_ConnectError("503 Maximum hub connections reached");
 			return;
 		}
-		m_nType = G2_HUB;
+		SetType(G2_HUB);
 	}
 	else
 	{
@@ -589,21 +640,20 @@ void CG2Node::ParseOutgoingHandshake()
 			Send_ConnectError("503 Maximum leaf connections reached");
 			return;
 		}
-		m_nType = G2_LEAF;
+		SetType(G2_LEAF);
+		m_nTransferClass = tcSearch;
 	}
 
 	Send_ConnectOK(true, bAcceptDeflate);
 
 	hostCache.m_pSection.lock();
-	CHostCacheHost* pThisHost = hostCache.take(m_oAddress);
-	if( pThisHost )
-		pThisHost->m_nFailures = 0;
+	hostCache.onSuccess(m_oAddress);
 	hostCache.m_pSection.unlock();
 
 #ifndef _DISABLE_COMPRESSION
 	if(bAcceptDeflate)
 	{
-		if(!EnableOutputCompression())
+		if(!EnableDeflate())
 		{
 			systemLog.postLog(LogSeverity::Debug, "Deflate init error!");
 			//qDebug() << "Deflate init error!";
@@ -613,7 +663,9 @@ void CG2Node::ParseOutgoingHandshake()
 	}
 #endif
 
+	m_pSection.lock();
 	m_nState = nsConnected;
+	m_pSection.unlock();
 	emit NodeStateChanged();
 
 	SendStartups();
@@ -638,17 +690,17 @@ void CG2Node::Send_ConnectError(QString sReason)
 	sHs += "Content-Type: application/x-gnutella2\r\n";
 
 	sHs += hostCache.getXTry();
-	for(QList<CNeighbour*>::iterator it = Neighbours.begin(); it != Neighbours.end(); ++it)
+	NeighboursSnapshotPtr pNeighbours = Neighbours.GetSnapshot();
+	for(QVector<NeighbourStats>::const_iterator it = pNeighbours->m_lNodes.constBegin(); it != pNeighbours->m_lNodes.constEnd(); ++it)
 	{
-		CNeighbour* pNeighbour = *it;
 		// Add neighbours with free slots, to promote faster connections.
-		if( pNeighbour->m_nState == nsConnected
-				&& pNeighbour->m_nProtocol == dpG2
-				&& ((CG2Node*)pNeighbour)->m_nType == G2_HUB
-				&& ((CG2Node*)pNeighbour) ->m_nLeafMax > 0
-				&& 100 * ((CG2Node*)pNeighbour)->m_nLeafCount / ((CG2Node*)pNeighbour)->m_nLeafMax < 90 )
+		if( it->m_nState == nsConnected
+				&& it->m_nProtocol == dpG2
+				&& it->m_nType == G2_HUB
+				&& it->m_nLeafMax > 0
+				&& 100 * it->m_nLeafCount / it->m_nLeafMax < 90 )
 		{
-			sHs += "," + pNeighbour->m_oAddress.toStringWithPort() + " " + common::getDateTimeUTC().toString("yyyy-MM-ddThh:mmZ");
+			sHs += "," + it->m_oAddress.toStringWithPort() + " " + common::getDateTimeUTC().toString("yyyy-MM-ddThh:mmZ");
 		}
 	}
 
@@ -656,7 +708,7 @@ void CG2Node::Send_ConnectError(QString sReason)
 
 	//qDebug() << "Handshake send:\n" << sHs;
 
-	m_sHandshake += "Handshake out:\n" + sHs;
+	AppendHandshake("Handshake out:\n" + sHs);
 
 	Write(sHs);
 
@@ -714,12 +766,23 @@ void CG2Node::Send_ConnectOK(bool bReply, bool bDeflated)
 
 	//qDebug() << "Handshake send:\n" << sHs;
 
-	m_sHandshake += "Handshake out:\n" + sHs;
+	AppendHandshake("Handshake out:\n" + sHs);
 
 	Write(sHs);
 
 }
 
+// Leaf links get a smaller deflate state, there are many of them and they carry little
+bool CG2Node::EnableDeflate()
+{
+	if(m_nType == G2_LEAF)
+	{
+		return EnableOutputCompression(true, quazaaSettings.Gnutella2.DeflateLeafWindow, quazaaSettings.Gnutella2.DeflateLeafMemLevel);
+	}
+
+	return EnableOutputCompression(true, quazaaSettings.Gnutella2.DeflateHubWindow, quazaaSettings.Gnutella2.DeflateHubMemLevel);
+}
+
 void CG2Node::SendStartups()
 {
 	if(Network.IsListening())
@@ -752,7 +815,7 @@ void CG2Node::SendLNI()
 	if(Neighbours.IsG2Hub())
 	{
 		quint16 nLeavesMax = quazaaSettings.Gnutella2.NumLeafs;
-		quint16 nLeaves = Neighbours.m_nLeavesConnectedG2;
+		quint16 nLeaves = Neighbours.GetSnapshot()->m_nLeavesConnectedG2;
 		pLNI->WritePacket("HS", 4);
 		pLNI->WriteIntLE<quint16>(nLeaves);
 		pLNI->WriteIntLE<quint16>(nLeavesMax);
@@ -773,54 +836,44 @@ void CG2Node::OnPacket(G2Packet* pPacket)
 	if(!Network.RoutePacket(pPacket))
 	{
 
-		if(pPacket->IsType("PI"))
-		{
-			OnPing(pPacket);
-		}
-		else if(pPacket->IsType("PO"))
-		{
-			OnPong(pPacket);
-		}
-		else if(pPacket->IsType("LNI"))
-		{
-			OnLNI(pPacket);
-		}
-		else if(pPacket->IsType("KHL"))
-		{
-			OnKHL(pPacket);
-		}
-		else if(pPacket->IsType("QHT"))
-		{
-			OnQHT(pPacket);
-		}
-		else if(pPacket->IsType("Q2"))
-		{
-			OnQuery(pPacket);
-		}
-		else if(pPacket->IsType("QKR"))
-		{
-			OnQKR(pPacket);
-		}
-		else if(pPacket->IsType("QKA"))
-		{
-			OnQKA(pPacket);
-		}
-		else if(pPacket->IsType("QA"))
-		{
-			OnQA(pPacket);
-		}
-		else if(pPacket->IsType("QH2"))
-		{
-			OnQH2(pPacket);
-		}
-		else if(pPacket->IsType("HAW"))
-		{
-			OnHaw(pPacket);
-		}
-		else
-		{
-			systemLog.postLog(LogSeverity::Debug, QString("G2 TCP recieved unknown packet %1").arg(pPacket->GetType()));
-			//qDebug() << "Unknown packet " << pPacket->GetType();
+		switch(pPacket->m_nType)
+		{
+			case G2PacketType::PI:
+				OnPing(pPacket);
+				break;
+			case G2PacketType::PO:
+				OnPong(pPacket);
+				break;
+			case G2PacketType::LNI:
+				OnLNI(pPacket);
+				break;
+			case G2PacketType::KHL:
+				OnKHL(pPacket);
+				break;
+			case G2PacketType::QHT:
+				OnQHT(pPacket);
+				break;
+			case G2PacketType::Q2:
+				OnQuery(pPacket);
+				break;
+			case G2PacketType::QKR:
+				OnQKR(pPacket);
+				break;
+			case G2PacketType::QKA:
+				OnQKA(pPacket);
+				break;
+			case G2PacketType::QA:
+				OnQA(pPacket);
+				break;
+			case G2PacketType::QH2:
+				OnQH2(pPacket);
+				break;
+			case G2PacketType::HAW:
+				OnHaw(pPacket);
+				break;
+			default:
+				systemLog.postLog(LogSeverity::Debug, QString("G2 TCP recieved unknown packet %1").arg(pPacket->GetType()));
+				//qDebug() << "Unknown packet " << pPacket->GetType();
 		}
 	}
 	/*}
@@ -832,8 +885,6 @@ void CG2Node::OnPacket(G2Packet* pPacket)
 
 void CG2Node::OnPing(G2Packet* pPacket)
 {
-	ASSUME_LOCK(Neighbours.m_pSection);
-
 	bool bUdp = false;
 	bool bRelay = false;
 	//	bool bTestFirewall = false;
@@ -887,7 +938,8 @@ void CG2Node::OnPing(G2Packet* pPacket)
 			G2Packet* pRelay = G2Packet::New("RELAY");
 			pPacket->PrependPacket(pRelay);
 
-			int nRelayed = 0, nCount = Neighbours.GetCount();
+			NeighboursSnapshotPtr pNeighbours = Neighbours.GetSnapshot();
+			int nRelayed = 0, nCount = pNeighbours->m_lNodes.size();
 			QList<int> lToRelayIndex;
 
 			for(int i = 0; i < nCount && nRelayed < quazaaSettings.Gnutella2.PingRelayLimit; ++i)
@@ -895,14 +947,14 @@ void CG2Node::OnPing(G2Packet* pPacket)
 				int nIndex = qrand() % nCount;
 				if(!lToRelayIndex.contains(nIndex))
 				{
-					CNeighbour* pNode = Neighbours.GetAt(nIndex);
-					if(pNode != this
-							&& pNode->m_nProtocol == dpG2
-							&& pNode->m_nState == nsConnected
-							&& static_cast<CG2Node*>(pNode)->m_nType == G2_LEAF )
+					const NeighbourStats& oNode = pNeighbours->m_lNodes.at(nIndex);
+					if(oNode.m_pNode != this
+							&& oNode.m_nProtocol == dpG2
+							&& oNode.m_nState == nsConnected
+							&& oNode.m_nType == G2_LEAF )
 					{
 						pPacket->AddRef();
-						((CG2Node*)pNode)->SendPacket(pPacket, true, true);
+						((CG2Node*)oNode.m_pNode)->SendPacket(pPacket, true, true);
 						nRelayed++;
 					}
 				}
@@ -926,6 +978,8 @@ void CG2Node::OnPong(G2Packet* pPacket)
 
 	if(m_nPingsWaiting > 0)
 	{
+		QMutexLocker l(&m_pSection);
+
 		m_nPingsWaiting--;
 
 		if(m_nPingsWaiting == 0)
@@ -972,11 +1026,6 @@ void CG2Node::OnLNI(G2Packet* pPacket)
 					Send_ConnectError("403 Attempting to switch to a blocked ip address");
 				} else {
 					hasNA = true;
-
-					if(!m_bInitiated)
-					{
-						m_oAddress = hostAddr;
-					}
 				}
 			}
 		}
@@ -989,25 +1038,48 @@ void CG2Node::OnLNI(G2Packet* pPacket)
 		{
 			if(m_nType == G2_HUB)
 			{
-				m_nLeafCount = pPacket->ReadIntLE<quint16>();
-				m_nLeafMax = pPacket->ReadIntLE<quint16>();
+				quint16 nLeafCount = pPacket->ReadIntLE<quint16>();
+				quint16 nLeafMax = pPacket->ReadIntLE<quint16>();
+
+				m_pSection.lock();
+				m_nLeafCount = nLeafCount;
+				m_nLeafMax = nLeafMax;
+				m_pSection.unlock();
 			}
 		}
 		else if(strcmp("QK", szType) == 0)
 		{
+			m_pSection.lock();
 			m_bCachedKeys = true;
+			m_pSection.unlock();
 		}
 		else if(strcmp("g2core", szType) == 0)
 		{
+			m_pSection.lock();
 			m_bG2Core = true;
+			m_pSection.unlock();
 		}
 
 		pPacket->m_nPosition = nNext;
 	}
 
+	// the address and GUID are indexed, so they change under the list lock
+	if((hasNA && !m_bInitiated) || hasGUID)
+	{
+		Neighbours.Lock();
+		if(hasNA && !m_bInitiated)
+		{
+			Neighbours.SetNodeAddress(this, hostAddr);
+		}
+		if(hasGUID)
+		{
+			Neighbours.SetNodeGUID(this, pGUID);
+		}
+		Neighbours.Unlock();
+	}
+
 	if(hasNA && hasGUID)
 	{
-		QMutexLocker l(&Network.m_pSection);
 		Network.m_oRoutingTable.Add(pGUID, this, true);
 	}
 
@@ -1074,8 +1146,6 @@ void CG2Node::OnKHL(G2Packet* pPacket)
 
 				if(!pGUID.isNull())
 				{
-					QMutexLocker l(&Network.m_pSection);
-
 					Network.m_oRoutingTable.Add(pGUID, this, &pAddr, false);
 				}
 			}
@@ -1148,6 +1218,9 @@ void CG2Node::OnKHL(G2Packet* pPacket)
 
 void CG2Node::OnQHT(G2Packet* pPacket)
 {
+	// routing on other workers reads the table, its group and the master
+	QMutexLocker l(&QueryHashMaster.m_pSection);
+
 	if(m_pRemoteTable == 0)
 	{
 		if(!Neighbours.IsG2Hub())
@@ -1281,7 +1354,9 @@ void CG2Node::OnQKA(G2Packet* pPacket)
 		return;
 	}
 
+	m_pSection.lock();
 	m_tKeyRequest = 0;
+	m_pSection.unlock();
 
 	quint32 nKey = 0;
 	CEndPoint addr;
@@ -1339,6 +1414,7 @@ void CG2Node::OnQKA(G2Packet* pPacket)
 	if ( pCache )
 	{
 		pCache->setKey( nKey, tNow, &m_oAddress );
+		hostCache.onSuccess( pCache );
 
 #if LOG_QUERY_HANDLING
 		systemLog.postLog( LogSeverity::Debug,
@@ -1373,8 +1449,6 @@ void CG2Node::OnQH2(G2Packet* pPacket)
 	} else {
 		if(SearchManager.OnQueryHit(pPacket, pInfo))
 		{
-			Network.m_pSection.lock();
-
 			if(Neighbours.IsG2Hub() && pInfo->m_nHops < 7)
 			{
 				Network.m_oRoutingTable.Add(pInfo->m_oNodeGUID, this, false);
@@ -1382,8 +1456,6 @@ void CG2Node::OnQH2(G2Packet* pPacket)
 				Network.RoutePacket(pInfo->m_oGUID, pPacket);
 			}
 
-			Network.m_pSection.unlock();
-
 			delete pInfo;
 		}
 	}
@@ -1439,19 +1511,113 @@ void CG2Node::OnQuery(G2Packet* pPacket)
 		{
 			Neighbours.RouteQuery(pQuery, pPacket, this, (m_nType != G2_HUB));
 		}
+
+		// local search, leaves get their hits back over TCP
+		QList<G2Packet*> lHits;
+		if( CLocalSearch::Execute(pQuery, lHits) )
+		{
+			foreach( G2Packet* pHit, lHits )
+			{
+				if( m_nType != G2_LEAF && pQuery->m_oEndpoint.isValid() )
+				{
+					Datagrams.SendPacket(pQuery->m_oEndpoint, pHit, true);
+					pHit->Release();
+				}
+				else
+				{
+					SendPacket(pHit, true, true);
+				}
+			}
+		}
 	}
 }
 
+// Writes queued packets straight from their own buffers with one gathered write.
+// Only used on uncompressed links with an empty output buffer.
+qint64 CG2Node::writeSendQueue(qint64 nBytes)
+{
+	IOSegment arrSegments[IO_MAX_SEGMENTS];
+	uchar arrHeaders[IO_MAX_SEGMENTS / 2][G2_HEADER_MAX];
+	quint32 arrFrames[IO_MAX_SEGMENTS / 2];
+	int nSegments = 0, nPackets = 0;
+	qint64 nQueued = 0;
+
+	while(nPackets < m_lSendQueue.size() && nPackets < IO_MAX_SEGMENTS / 2 && nQueued < nBytes)
+	{
+		G2Packet* pPacket = m_lSendQueue.at(nPackets);
+
+		quint32 nHeader = pPacket->EncodeHeader(&arrHeaders[nPackets][0]);
+
+		arrSegments[nSegments].m_pData = (const char*)&arrHeaders[nPackets][0];
+		arrSegments[nSegments].m_nLength = nHeader;
+		nSegments++;
+		arrSegments[nSegments].m_pData = (const char*)pPacket->m_pBuffer;
+		arrSegments[nSegments].m_nLength = pPacket->m_nLength;
+		nSegments++;
+
+		arrFrames[nPackets] = nHeader + pPacket->m_nLength;
+		nQueued += arrFrames[nPackets];
+		nPackets++;
+	}
+
+	qint64 nSent = writeVectored(&arrSegments[0], nSegments, nBytes);
+
+	if(nSent <= 0)
+	{
+		return nSent;
+	}
+
+	qint64 nLeft = nSent;
+
+	for(int i = 0; i < nPackets && nLeft > 0; ++i)
+	{
+		G2Packet* pPacket = m_lSendQueue.dequeue();
+
+		if(nLeft < arrFrames[i])
+		{
+			// partially written frame, the rest goes out through the output buffer
+			pPacket->ToBuffer(m_pOutput);
+			m_pOutput->remove(0, nLeft);
+			nLeft = 0;
+		}
+		else
+		{
+			nLeft -= arrFrames[i];
+		}
+
+		Neighbours.OnPacketSent(pPacket);
+		pPacket->Release();
+	}
+
+	return nSent;
+}
+
 qint64 CG2Node::writeToNetwork(qint64 nBytes)
 {
+	QMutexLocker l(&m_pSendSection);
+
 	qint64 nTotalSent = 0;
 
 	do
 	{
+		if(!m_bCompressedOutput && m_pOutput->isEmpty() && !m_lSendQueue.isEmpty())
+		{
+			qint64 nSent = writeSendQueue(nBytes - nTotalSent);
+
+			if(nSent <= 0)
+			{
+				return nTotalSent ? nTotalSent : nSent;
+			}
+
+			nTotalSent += nSent;
+			continue;
+		}
+
 		if(GetOutputBuffer()->isEmpty() && !m_lSendQueue.isEmpty())
 		{
 			G2Packet* pPacket = m_lSendQueue.dequeue();
 			pPacket->ToBuffer(GetOutputBuffer());
+			Neighbours.OnPacketSent(pPacket);
 			pPacket->Release();
 		}
 
@@ -1480,7 +1646,7 @@ void CG2Node::SendHAW()
 	pPacket->WriteString(CQuazaaGlobals::VENDOR_CODE());
 
 	pPacket->WritePacket("HS", 2);
-	pPacket->WriteIntLE<quint16>(Neighbours.m_nLeavesConnectedG2);
+	pPacket->WriteIntLE<quint16>(Neighbours.GetSnapshot()->m_nLeavesConnectedG2);
 
 	pPacket->WriteByte(0); // end of child packets
 	pPacket->WriteByte(100);
@@ -1556,7 +1722,8 @@ void CG2Node::OnHaw(G2Packet *pPacket)
 		pPtr[0] = nTTL  - 1;
 		pPtr[1] = nHops + 1;
 
-		if ( CG2Node* pNeighbour = (CG2Node*)Neighbours.RandomNode( dpG2, G2_HUB,  this ) )
+		NeighboursSnapshotPtr pNeighbours = Neighbours.GetSnapshot();
+		if ( CG2Node* pNeighbour = (CG2Node*)Neighbours.RandomNode( pNeighbours.data(), dpG2, G2_HUB, this ) )
 		{
 			pNeighbour->SendPacket( pPacket, false, false );
 		}
@@ -29,6 +29,7 @@
 #include <QElapsedTimer>
 #include <QQueue>
 #include <QHash>
+#include <QMutex>
 
 class G2Packet;
 class CQueryHashTable;
@@ -39,6 +40,7 @@ class CG2Node : public CNeighbour
 	Q_OBJECT
 
 public:
+	// written under m_pSection, see CNeighbour
 	bool            m_bG2Core;
 	bool            m_bCachedKeys;
 	G2NodeType      m_nType;
@@ -48,7 +50,7 @@ public:
 
 	bool            m_bAcceptDeflate;
 
-	quint32         m_tKeyRequest;
+	quint32         m_tKeyRequest;          // set by managed searches, under m_pSection
 	quint32         m_tLastHAWIn;			// Time when HAW packet recievied
 	quint32         m_nCountHAWIn;			// Number of HAW packets recievied
 
@@ -58,8 +60,9 @@ public:
 	quint32         m_nHAWWait;
 
 	QQueue<G2Packet*>   m_lSendQueue;
+	QMutex              m_pSendSection; // guards m_lSendQueue and the output buffers, packets are queued from any thread
 
-	CQueryHashTable*    m_pRemoteTable;
+	CQueryHashTable*    m_pRemoteTable;     // read by routing on other threads, under QueryHashMaster.m_pSection
 	CQueryHashTable*    m_pLocalTable;
 	CHubHorizonGroup*   m_pHubGroup;
 
@@ -77,6 +80,12 @@ public:
 	void SendPacket(G2Packet* pPacket, bool bBuffered = false, bool bRelease = false);
 
 protected:
+	inline void SetType(G2NodeType nType)
+	{
+		QMutexLocker l(&m_pSection);
+		m_nType = nType;
+	}
+
 	void ParseOutgoingHandshake();
 	void ParseIncomingHandshake();
 
@@ -111,14 +120,18 @@ protected:
 
 protected:
 	qint64 writeToNetwork(qint64 nBytes);
-	bool HasData()
+	qint64 writeSendQueue(qint64 nBytes);
+	bool EnableDeflate();
+	bool HasPendingOutput()
 	{
+		QMutexLocker l(&m_pSendSection);
+
 		if ( !m_lSendQueue.isEmpty() )
 		{
 			return true;
 		}
 
-		return CNeighbour::HasData();
+		return CNeighbour::HasPendingOutput();
 	}
 
 	friend class CNetwork;
@@ -30,10 +30,10 @@
 
 G2PacketPool G2Packets;
 
-G2Packet::G2Packet()
+G2Packet::G2Packet() :
+	m_nReference(0)
 {
 	m_pNext			= 0;
-	m_nReference	= 0;
 
 	m_nPosition		= 0;
 
@@ -42,16 +42,27 @@ G2Packet::G2Packet()
 	m_nLength = 0;
 
 	memset(&m_sType[0], 0, sizeof(m_sType));
+	m_nType = 0;
 	m_bCompound = false;
+
+	m_bView = false;
+	m_pOwnBuffer = 0;
+	m_nOwnBuffer = 0;
+	m_tQueued = 0;
 }
 
 G2Packet::~G2Packet()
 {
-	if(m_nReference != 0)
+	if(m_nReference.loadAcquire() != 0)
 	{
 		systemLog.postLog(LogSeverity::Debug, QString("%1 not released").arg((char*)&m_sType[0]));
 	}
-	Q_ASSERT(m_nReference == 0);
+	Q_ASSERT(m_nReference.loadAcquire() == 0);
+
+	if(m_bView)
+	{
+		m_pBuffer = m_pOwnBuffer;
+	}
 
 	if(m_pBuffer)
 	{
@@ -61,14 +72,25 @@ G2Packet::~G2Packet()
 
 void G2Packet::Reset()
 {
-	Q_ASSERT(m_nReference == 0);
+	Q_ASSERT(m_nReference.loadAcquire() == 0);
+
+	if(m_bView)
+	{
+		m_pBuffer = m_pOwnBuffer;
+		m_nBuffer = m_nOwnBuffer;
+		m_pOwnBuffer = 0;
+		m_nOwnBuffer = 0;
+		m_bView = false;
+	}
 
 	m_pNext			= 0;
 	m_nLength		= 0;
 	m_nPosition		= 0;
 
 	memset(&m_sType[0], 0, sizeof(m_sType));
+	m_nType = 0;
 	m_bCompound = false;
+	m_tQueued = 0;
 }
 
 void G2Packet::Seek(quint32 nPosition, int nRelative)
@@ -111,6 +133,15 @@ char* G2Packet::GetType() const
 }
 void G2Packet::Delete()
 {
+	Reset();
+
+	if(m_nBuffer > G2_POOL_MAX_KEEP)
+	{
+		free(m_pBuffer);
+		m_pBuffer = 0;
+		m_nBuffer = 0;
+	}
+
 	G2Packets.Delete(this);
 }
 G2Packet* G2Packet::New(const char* pszType, bool bCompound)
@@ -122,16 +153,16 @@ G2Packet* G2Packet::New(const char* pszType, bool bCompound)
 		size_t nLength = strlen(pszType);
 		strncpy(pPacket->m_sType, pszType, nLength);
 		pPacket->m_sType[nLength] = 0;
+		pPacket->m_nType = TypeCode(pPacket->m_sType);
 	}
 
 	pPacket->m_bCompound = bCompound;
 
 	return pPacket;
 }
-G2Packet* G2Packet::New(char* pSource)
+// Parses the frame header at pSource into pPacket and returns a pointer to the payload
+static char* ReadFrameHeader(G2Packet* pPacket, char* pSource, quint32& nLength)
 {
-	G2Packet* pPacket = New();
-
 	char nInput		= *pSource++;
 
 	char nLenLen	= (nInput & 0xC0) >> 6;
@@ -141,7 +172,7 @@ G2Packet* G2Packet::New(char* pSource)
 	pPacket->m_bCompound	= (nFlags & G2_FLAG_COMPOUND) ? true : false;
 	bool	bBigEndian	= (nFlags & G2_FLAG_BIG_ENDIAN) ? true : false;
 
-	quint32 nLength = 0;
+	nLength = 0;
 
 	if(bBigEndian)
 	{
@@ -158,18 +189,103 @@ G2Packet* G2Packet::New(char* pSource)
 
 	nTypeLen++;
 	char* pszType = pPacket->m_sType;
-	for(; nTypeLen-- ;)
+	quint64 nType = 0;
+	for(int i = 0; i < nTypeLen; ++i)
 	{
+		nType |= G2_TYPE_CHAR(*pSource, i);
 		*pszType++ = *pSource++;
 	}
 	*pszType++ = 0;
+	pPacket->m_nType = nType;
+
+	return pSource;
+}
+
+G2Packet* G2Packet::New(char* pSource)
+{
+	G2Packet* pPacket = New();
+
+	quint32 nLength = 0;
+
+	try
+	{
+		pSource = ReadFrameHeader(pPacket, pSource, nLength);
+	}
+	catch(...)
+	{
+		pPacket->Release();
+		throw;
+	}
 
 	pPacket->Write(pSource, nLength);
 
 	return pPacket;
 }
 
-G2PacketPool::G2PacketPool()
+// Creates a read-only packet that references the frame at pSource without copying the payload.
+// The source memory must stay valid until the packet is released or detached.
+G2Packet* G2Packet::NewView(char* pSource)
+{
+	G2Packet* pPacket = New();
+
+	quint32 nLength = 0;
+
+	try
+	{
+		pSource = ReadFrameHeader(pPacket, pSource, nLength);
+	}
+	catch(...)
+	{
+		pPacket->Release();
+		throw;
+	}
+
+	pPacket->m_pOwnBuffer = pPacket->m_pBuffer;
+	pPacket->m_nOwnBuffer = pPacket->m_nBuffer;
+	pPacket->m_pBuffer = (uchar*)pSource;
+	pPacket->m_nBuffer = nLength;
+	pPacket->m_nLength = nLength;
+	pPacket->m_bView = true;
+
+	return pPacket;
+}
+
+// Copies the payload of a view packet into the packet's own storage,
+// so it may outlive the buffer it was parsed from and be modified.
+void G2Packet::Detach()
+{
+	if(!m_bView)
+	{
+		return;
+	}
+
+	uchar* pSource = m_pBuffer;
+
+	m_pBuffer = m_pOwnBuffer;
+	m_nBuffer = m_nOwnBuffer;
+	m_pOwnBuffer = 0;
+	m_nOwnBuffer = 0;
+	m_bView = false;
+
+	if(m_nLength > m_nBuffer)
+	{
+		m_nBuffer = SizeClass(m_nLength);
+		m_pBuffer = (uchar*)realloc(m_pBuffer, m_nBuffer);
+
+		if(!m_pBuffer)
+		{
+			m_nBuffer = 0;
+			throw std::bad_alloc();
+		}
+	}
+
+	memcpy(m_pBuffer, pSource, m_nLength);
+}
+
+G2PacketPool::G2PacketPool() :
+	m_nHits(0),
+	m_nMisses(0),
+	m_nAllocations(0)
 {
 	m_pFree = 0;
 	m_nFree = 0;
@@ -180,6 +296,32 @@ G2PacketPool::~G2PacketPool()
 	Clear();
 }
 
+G2PacketPool::LocalCache::LocalCache(G2PacketPool* pPool)
+{
+	m_pPool = pPool;
+	m_pFree = 0;
+	m_nFree = 0;
+	m_nHits = 0;
+	m_nMisses = 0;
+
+	QMutexLocker l(&m_pPool->m_pSection);
+	m_pPool->m_lCaches.append(this);
+}
+
+G2PacketPool::LocalCache::~LocalCache()
+{
+	// thread is exiting, give everything back to the shared list
+	if(m_nFree)
+	{
+		m_pPool->Return(this, m_nFree);
+	}
+
+	QMutexLocker l(&m_pPool->m_pSection);
+	m_pPool->m_lCaches.removeOne(this);
+	m_pPool->m_nHits += m_nHits;
+	m_pPool->m_nMisses += m_nMisses;
+}
+
 G2Packet* G2Packet::WritePacket(G2Packet* pPacket)
 {
 	if(pPacket == 0)
@@ -278,6 +420,60 @@ bool G2Packet::ReadPacket(char* pszType, quint32& nLength, bool* pbCompound)
 	return true;
 }
 
+// Same as above, but returns the child type packed into an integer (see G2PacketType)
+bool G2Packet::ReadPacket(quint64& nType, quint32& nLength, bool* pbCompound)
+{
+	if(GetRemaining() == 0)
+	{
+		return false;
+	}
+
+	char nInput = ReadByte();
+	if(nInput == 0)
+	{
+		return false;
+	}
+
+	char nLenLen	= (nInput & 0xC0) >> 6;
+	char nTypeLen	= (nInput & 0x38) >> 3;
+	char nFlags		= (nInput & 0x07);
+
+	if(GetRemaining() < nTypeLen + nLenLen + 1)
+	{
+		throw packet_error();
+	}
+
+	nLength = 0;
+	Read(&nLength, nLenLen);
+
+	if(GetRemaining() < (int)(nLength + nTypeLen + 1))
+	{
+		throw packet_error();
+	}
+
+	nType = 0;
+	const uchar* pType = m_pBuffer + m_nPosition;
+	for(int i = 0; i <= nTypeLen; ++i)
+	{
+		nType |= G2_TYPE_CHAR(pType[i], i);
+	}
+	m_nPosition += nTypeLen + 1;
+
+	if(pbCompound)
+	{
+		*pbCompound = (nFlags & G2_FLAG_COMPOUND) == G2_FLAG_COMPOUND;
+	}
+	else
+	{
+		if(nFlags & G2_FLAG_COMPOUND)
+		{
+			SkipCompound(nLength);
+		}
+	}
+
+	return true;
+}
+
 bool G2Packet::SkipCompound()
 {
 	if(m_bCompound)
@@ -337,7 +533,9 @@ bool G2Packet::SkipCompound(quint32& nLength, quint32 nRemaining)
 	return nRemaining ? nLength >= nRemaining : true;
 }
 
-void G2Packet::ToBuffer(CBuffer* pBuffer) const
+// Encodes the frame header into pHeader, which must hold G2_HEADER_MAX bytes.
+// Kept off the packet, a routed packet is framed by several worker threads at once.
+quint32 G2Packet::EncodeHeader(uchar* pHeader) const
 {
 	Q_ASSERT(strlen(m_sType) > 0);
 
@@ -364,14 +562,25 @@ void G2Packet::ToBuffer(CBuffer* pBuffer) const
 		nFlags |= G2_FLAG_COMPOUND;
 	}
 
-	pBuffer->append((char*)&nFlags, 1);
+	*pHeader++ = nFlags;
 
-	quint32 nLength = m_nLength;
-	pBuffer->append((char*)&nLength, nLenLen);
+	quint32 nLength = qToLittleEndian(m_nLength);
+	memcpy(pHeader, &nLength, nLenLen);
+	pHeader += nLenLen;
 
-	pBuffer->append((char*)&m_sType[0], nTypeLen + 1);
+	memcpy(pHeader, &m_sType[0], nTypeLen + 1);
 
-	pBuffer->append((char*)m_pBuffer, m_nLength);
+	return 2 + nLenLen + nTypeLen;
+}
+
+void G2Packet::ToBuffer(CBuffer* pBuffer)
+{
+	uchar pHeader[G2_HEADER_MAX];
+	quint32 nHeader = EncodeHeader(&pHeader[0]);
+
+	pBuffer->ensure(nHeader + m_nLength);
+	pBuffer->append(&pHeader[0], nHeader);
+	pBuffer->append(m_pBuffer, m_nLength);
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -384,53 +593,89 @@ G2Packet* G2Packet::ReadBuffer(CBuffer* pBuffer)
 		return 0;
 	}
 
-	if(pBuffer->size() < 2)
+	quint32 nOffset = 0;
+	G2Packet* pPacket = 0;
+
+	try
 	{
-		return 0;
+		pPacket = ReadBuffer(pBuffer, nOffset);
 	}
-
-	char nInput = *pBuffer->data();
-
-	if(nInput == 0)
+	catch(...)
 	{
-		pBuffer->remove(0, 1);
-		return 0;
+		pBuffer->remove(0, nOffset);
+		throw;
 	}
 
-	char nLenLen	= (nInput & 0xC0) >> 6;
-	char nTypeLen	= (nInput & 0x38) >> 3;
-	char nFlags		= (nInput & 0x07);
-
-	if((quint32)pBuffer->size() < (quint32)nLenLen + nTypeLen + 2u)
+	if(pPacket)
 	{
-		return 0;
+		pPacket->Detach();
 	}
 
-	quint32 nLength = 0;
+	pBuffer->remove(0, nOffset);
+
+	return pPacket;
+}
 
-	if(nFlags & G2_FLAG_BIG_ENDIAN)
+// Parses the next frame starting at nOffset in place and returns a view packet referencing it.
+// nOffset is advanced past the consumed bytes; the caller removes them from the buffer
+// once it is done with all views, so a whole read is drained with a single compaction.
+G2Packet* G2Packet::ReadBuffer(CBuffer* pBuffer, quint32& nOffset)
+{
+	if(pBuffer == 0)
 	{
-		throw packet_error();
+		return 0;
 	}
-	else
+
+	while(pBuffer->size() >= nOffset + 2)
 	{
-		char* pLenIn	= pBuffer->data() + 1;
-		char* pLenOut	= (char*)&nLength;
-		for(char nLenCnt = nLenLen ; nLenCnt-- ;)
+		char* pFrame = pBuffer->data() + nOffset;
+		quint32 nAvailable = pBuffer->size() - nOffset;
+
+		char nInput = *pFrame;
+
+		if(nInput == 0)
 		{
-			*pLenOut++ = *pLenIn++;
+			nOffset++;
+			continue;
 		}
-	}
 
-	if((quint32)pBuffer->size() < (quint32)nLength + nLenLen + nTypeLen + 2)
-	{
-		return 0;
-	}
+		char nLenLen	= (nInput & 0xC0) >> 6;
+		char nTypeLen	= (nInput & 0x38) >> 3;
+		char nFlags		= (nInput & 0x07);
 
-	G2Packet* pPacket = G2Packet::New(pBuffer->data());
-	pBuffer->remove(0, nLength + nLenLen + nTypeLen + 2u);
+		if(nAvailable < (quint32)nLenLen + nTypeLen + 2u)
+		{
+			return 0;
+		}
 
-	return pPacket;
+		quint32 nLength = 0;
+
+		if(nFlags & G2_FLAG_BIG_ENDIAN)
+		{
+			throw packet_error();
+		}
+		else
+		{
+			char* pLenIn	= pFrame + 1;
+			char* pLenOut	= (char*)&nLength;
+			for(char nLenCnt = nLenLen ; nLenCnt-- ;)
+			{
+				*pLenOut++ = *pLenIn++;
+			}
+		}
+
+		if(nAvailable < (quint32)nLength + nLenLen + nTypeLen + 2)
+		{
+			return 0;
+		}
+
+		G2Packet* pPacket = G2Packet::NewView(pFrame);
+		nOffset += nLength + nLenLen + nTypeLen + 2u;
+
+		return pPacket;
+	}
+
+	return 0;
 }
 
 QString G2Packet::ReadString(quint32 nMaximum)
@@ -567,6 +812,75 @@ void G2PacketPool::Clear()
 	m_nFree = 0;
 }
 
+// Totals since startup. Counters of running threads are read without their owner's
+// knowledge, so the figures may lag behind by a few packets.
+void G2PacketPool::GetStats(quint32& nHits, quint32& nMisses, quint32& nAllocations)
+{
+	QMutexLocker l(&m_pSection);
+
+	nHits = m_nHits;
+	nMisses = m_nMisses;
+	nAllocations = m_nAllocations;
+
+	foreach(LocalCache* pCache, m_lCaches)
+	{
+		nHits += pCache->m_nHits;
+		nMisses += pCache->m_nMisses;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// G2PacketPool thread cache batch transfer
+
+void G2PacketPool::Refill(LocalCache* pCache)
+{
+	pCache->m_nMisses++;
+
+	QMutexLocker l(&m_pSection);
+
+	while(m_nFree < G2_POOL_BATCH)
+	{
+		NewPool();
+	}
+
+	// detach a batch from the head of the shared list
+	G2Packet* pFirst = m_pFree;
+	G2Packet* pLast = m_pFree;
+	for(quint32 i = 1; i < G2_POOL_BATCH; ++i)
+	{
+		pLast = pLast->m_pNext;
+	}
+
+	m_pFree = pLast->m_pNext;
+	m_nFree -= G2_POOL_BATCH;
+
+	pLast->m_pNext = pCache->m_pFree;
+	pCache->m_pFree = pFirst;
+	pCache->m_nFree += G2_POOL_BATCH;
+}
+
+void G2PacketPool::Return(LocalCache* pCache, quint32 nCount)
+{
+	Q_ASSERT(nCount > 0 && nCount <= pCache->m_nFree);
+
+	// list walk happens outside the lock
+	G2Packet* pFirst = pCache->m_pFree;
+	G2Packet* pLast = pFirst;
+	for(quint32 i = 1; i < nCount; ++i)
+	{
+		pLast = pLast->m_pNext;
+	}
+
+	pCache->m_pFree = pLast->m_pNext;
+	pCache->m_nFree -= nCount;
+
+	QMutexLocker l(&m_pSection);
+
+	pLast->m_pNext = m_pFree;
+	m_pFree = pFirst;
+	m_nFree += nCount;
+}
+
 //////////////////////////////////////////////////////////////////////
 // G2PacketPool new pool setup
 
@@ -579,6 +893,7 @@ void G2PacketPool::NewPool()
 	pPool	= new G2Packet[ nSize ];
 
 	m_pPools.append(pPool);
+	m_nAllocations++;
 
 	char* pchars = (char*)pPool;
 
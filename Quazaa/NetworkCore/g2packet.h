@@ -29,6 +29,8 @@
 #include <QtGlobal>
 #include <QMutex>
 #include <QList>
+#include <QThreadStorage>
+#include <QAtomicInt>
 
 struct packet_error {};
 struct packet_read_past_end {};
@@ -45,21 +47,28 @@ protected:
 public:
 	static G2Packet* New(const char* pszType = 0, bool bCompound = false);
 	static G2Packet* New(char* pSource);
+	static G2Packet* NewView(char* pSource);
 
 
 	// Attributes
 public:
 	G2Packet* 	m_pNext;
-	quint32		m_nReference;
+	QAtomicInt	m_nReference;	// packets routed to several neighbours are released from their worker threads
 public:
 	uchar*		m_pBuffer;
 	quint32		m_nBuffer;
 	quint32		m_nLength;
 	quint32		m_nPosition;
 	char		m_sType[9];
+	quint64		m_nType;		// m_sType packed into an integer, see G2PacketType
 	bool		m_bCompound;
+	bool		m_bView;		// m_pBuffer points into a foreign buffer (read-only frame view)
+	qint64		m_tQueued;		// Neighbours clock when the packet was received or first queued, 0 if never, fixed once queued
 
 	enum { seekStart, seekEnd };
+protected:
+	uchar*		m_pOwnBuffer;	// own storage parked while the packet is a view
+	quint32		m_nOwnBuffer;
 
 	// Operations
 public:
@@ -74,18 +83,26 @@ public:
 	G2Packet* 	WritePacket(const char* pszType, quint32 nLength, bool bCompound = false);
 	G2Packet*	PrependPacket(G2Packet* pPacket, bool bRelease = true);
 	bool	ReadPacket(char* pszType, quint32& nLength, bool* pbCompound = 0);
+	bool	ReadPacket(quint64& nType, quint32& nLength, bool* pbCompound = 0);
 	bool	SkipCompound();
 	bool	SkipCompound(quint32& nLength, quint32 nRemaining = 0);
 	bool	GetTo(QUuid& pGUID);
+	void	Detach();
 
 
 public:
 	static	G2Packet* ReadBuffer(CBuffer* pBuffer);
-	void	ToBuffer(CBuffer* pBuffer) const;
+	static	G2Packet* ReadBuffer(CBuffer* pBuffer, quint32& nOffset);
+	void	ToBuffer(CBuffer* pBuffer);
+	quint32	EncodeHeader(uchar* pHeader) const;
+	inline quint32 GetFrameSize();
 
 	// Inline Packet Operations
 	inline bool IsType(const char* sType);
+	inline bool IsType(quint64 nType) const;
+	static inline quint64 TypeCode(const char* pszType);
 	inline int GetRemaining();
+	static inline quint32 SizeClass(quint32 nBytes);
 	inline bool Ensure(quint32 nBytes);
 	inline void Read(void* pData, int nLength);
 	inline void Write(void* pData, int nLength);
@@ -126,6 +143,56 @@ protected:
 #define G2_FLAG_COMPOUND	0x04
 #define G2_FLAG_BIG_ENDIAN	0x02
 
+// Longest frame header: control byte, 3 length bytes, 8 type bytes
+#define G2_HEADER_MAX		12
+
+// Packet type names packed into 64 bits, first character in the lowest byte, zero padded.
+// Dispatch code switches on these instead of comparing type strings.
+#define G2_TYPE_CHAR(c, n)	((quint64)(uchar)(c) << ((n) * 8))
+
+namespace G2PacketType
+{
+	// top level packets
+	const quint64 PI		= G2_TYPE_CHAR('P', 0) | G2_TYPE_CHAR('I', 1);
+	const quint64 PO		= G2_TYPE_CHAR('P', 0) | G2_TYPE_CHAR('O', 1);
+	const quint64 LNI		= G2_TYPE_CHAR('L', 0) | G2_TYPE_CHAR('N', 1) | G2_TYPE_CHAR('I', 2);
+	const quint64 KHL		= G2_TYPE_CHAR('K', 0) | G2_TYPE_CHAR('H', 1) | G2_TYPE_CHAR('L', 2);
+	const quint64 QHT		= G2_TYPE_CHAR('Q', 0) | G2_TYPE_CHAR('H', 1) | G2_TYPE_CHAR('T', 2);
+	const quint64 Q2		= G2_TYPE_CHAR('Q', 0) | G2_TYPE_CHAR('2', 1);
+	const quint64 QKR		= G2_TYPE_CHAR('Q', 0) | G2_TYPE_CHAR('K', 1) | G2_TYPE_CHAR('R', 2);
+	const quint64 QKA		= G2_TYPE_CHAR('Q', 0) | G2_TYPE_CHAR('K', 1) | G2_TYPE_CHAR('A', 2);
+	const quint64 QA		= G2_TYPE_CHAR('Q', 0) | G2_TYPE_CHAR('A', 1);
+	const quint64 QH2		= G2_TYPE_CHAR('Q', 0) | G2_TYPE_CHAR('H', 1) | G2_TYPE_CHAR('2', 2);
+	const quint64 HAW		= G2_TYPE_CHAR('H', 0) | G2_TYPE_CHAR('A', 1) | G2_TYPE_CHAR('W', 2);
+	const quint64 CRAWLR	= G2_TYPE_CHAR('C', 0) | G2_TYPE_CHAR('R', 1) | G2_TYPE_CHAR('A', 2) |
+							  G2_TYPE_CHAR('W', 3) | G2_TYPE_CHAR('L', 4) | G2_TYPE_CHAR('R', 5);
+
+	// child packets
+	const quint64 UDP		= G2_TYPE_CHAR('U', 0) | G2_TYPE_CHAR('D', 1) | G2_TYPE_CHAR('P', 2);
+	const quint64 DN		= G2_TYPE_CHAR('D', 0) | G2_TYPE_CHAR('N', 1);
+	const quint64 URN		= G2_TYPE_CHAR('U', 0) | G2_TYPE_CHAR('R', 1) | G2_TYPE_CHAR('N', 2);
+	const quint64 URL		= G2_TYPE_CHAR('U', 0) | G2_TYPE_CHAR('R', 1) | G2_TYPE_CHAR('L', 2);
+	const quint64 SZR		= G2_TYPE_CHAR('S', 0) | G2_TYPE_CHAR('Z', 1) | G2_TYPE_CHAR('R', 2);
+	const quint64 SZ		= G2_TYPE_CHAR('S', 0) | G2_TYPE_CHAR('Z', 1);
+	const quint64 I			= G2_TYPE_CHAR('I', 0);
+	const quint64 H			= G2_TYPE_CHAR('H', 0);
+	const quint64 V			= G2_TYPE_CHAR('V', 0);
+	const quint64 NA		= G2_TYPE_CHAR('N', 0) | G2_TYPE_CHAR('A', 1);
+	const quint64 GU		= G2_TYPE_CHAR('G', 0) | G2_TYPE_CHAR('U', 1);
+	const quint64 NH		= G2_TYPE_CHAR('N', 0) | G2_TYPE_CHAR('H', 1);
+	const quint64 MD		= G2_TYPE_CHAR('M', 0) | G2_TYPE_CHAR('D', 1);
+	const quint64 CSC		= G2_TYPE_CHAR('C', 0) | G2_TYPE_CHAR('S', 1) | G2_TYPE_CHAR('C', 2);
+	const quint64 PART		= G2_TYPE_CHAR('P', 0) | G2_TYPE_CHAR('A', 1) | G2_TYPE_CHAR('R', 2) |
+							  G2_TYPE_CHAR('T', 3);
+}
+
+
+// Number of packets moved between a thread cache and the shared pool at once
+#define G2_POOL_BATCH		64
+// Maximum number of packets held in a thread cache before a batch is returned
+#define G2_POOL_LOCAL_MAX	256
+// Payload buffers larger than this are freed when a packet returns to the pool
+#define G2_POOL_MAX_KEEP	65536
 
 class G2PacketPool
 {
@@ -134,6 +201,19 @@ public:
 	G2PacketPool();
 	~G2PacketPool();
 
+	// Per-thread free list, refilled from and returned to the shared list in batches
+	struct LocalCache
+	{
+		G2PacketPool*	m_pPool;
+		G2Packet*		m_pFree;
+		quint32			m_nFree;
+		quint32			m_nHits;	// packets served from this cache
+		quint32			m_nMisses;	// refills from the shared list
+
+		LocalCache(G2PacketPool* pPool);
+		~LocalCache();
+	};
+
 	// Attributes
 protected:
 	G2Packet* 	m_pFree;
@@ -141,17 +221,29 @@ protected:
 protected:
 	QMutex				m_pSection;
 	QList<G2Packet*>	m_pPools;
+	QThreadStorage<LocalCache*> m_oLocal;
+	QList<LocalCache*>	m_lCaches;		// caches of running threads, for the statistics
+
+	quint32		m_nHits;		// counters of caches whose thread has exited
+	quint32		m_nMisses;
+	quint32		m_nAllocations;	// new packet blocks allocated
 
 	// Operations
 protected:
 	void	Clear();
 	void	NewPool();
+	void	Refill(LocalCache* pCache);
+	void	Return(LocalCache* pCache, quint32 nCount);
 
 	// Inlines
 public:
 	inline G2Packet* New();
 	inline void Delete(G2Packet* pPacket);
 
+	void GetStats(quint32& nHits, quint32& nMisses, quint32& nAllocations);
+
+protected:
+	inline LocalCache* GetLocal();
 };
 
 // Inlines impl
@@ -161,19 +253,62 @@ bool G2Packet::IsType(const char* sType)
 {
 	return strcmp(sType, m_sType) == 0;
 }
+bool G2Packet::IsType(quint64 nType) const
+{
+	return m_nType == nType;
+}
+quint64 G2Packet::TypeCode(const char* pszType)
+{
+	quint64 nType = 0;
+
+	for(int i = 0; i < 8 && pszType[i]; ++i)
+	{
+		nType |= G2_TYPE_CHAR(pszType[i], i);
+	}
+
+	return nType;
+}
+quint32 G2Packet::GetFrameSize()
+{
+	uchar pHeader[G2_HEADER_MAX];
+	return EncodeHeader(&pHeader[0]) + m_nLength;
+}
 int G2Packet::GetRemaining()
 {
 	return m_nLength - m_nPosition;
 }
+quint32 G2Packet::SizeClass(quint32 nBytes)
+{
+	// power of two classes from 128 bytes to 64 KB, 64 KB steps above
+	if(nBytes > 65536u)
+	{
+		return (nBytes + 65535u) & ~65535u;
+	}
+
+	quint32 nClass = 128u;
+	while(nClass < nBytes)
+	{
+		nClass <<= 1;
+	}
+	return nClass;
+}
 bool G2Packet::Ensure(quint32 nBytes)
 {
+	if(m_bView)
+	{
+		Detach();
+	}
+
 	if(m_nLength + nBytes > m_nBuffer)
 	{
-		m_nBuffer += qMax(nBytes, 128u);
+		// pooled packets keep their buffer, so growing by size class
+		// means a recycled packet rarely needs to reallocate again
+		m_nBuffer = SizeClass(m_nLength + nBytes);
 		m_pBuffer = (uchar*)realloc(m_pBuffer, m_nBuffer);
 
 		if(!m_pBuffer)
 		{
+			m_nBuffer = 0;
 			return false;
 		}
 	}
@@ -300,11 +435,11 @@ void G2Packet::WriteGUID(QUuid& guid)
 }
 void G2Packet::AddRef()
 {
-	m_nReference++;
+	m_nReference.ref();
 }
 void G2Packet::Release()
 {
-	if(this != NULL && ! --m_nReference)
+	if(this != NULL && !m_nReference.deref())
 	{
 		Delete();
 	}
@@ -326,21 +461,32 @@ void G2Packet::ReleaseChain()
 
 
 // G2PacketPool
+G2PacketPool::LocalCache* G2PacketPool::GetLocal()
+{
+	if(!m_oLocal.hasLocalData())
+	{
+		m_oLocal.setLocalData(new LocalCache(this));
+	}
+
+	return m_oLocal.localData();
+}
 G2Packet* G2PacketPool::New()
 {
-	m_pSection.lock();
+	LocalCache* pCache = GetLocal();
 
-	if(m_nFree == 0)
+	if(pCache->m_nFree == 0)
 	{
-		NewPool();
+		Refill(pCache);
 	}
-	Q_ASSERT(m_nFree > 0);
-
-	G2Packet* pPacket = m_pFree;
-	m_pFree = m_pFree->m_pNext;
-	m_nFree --;
+	else
+	{
+		pCache->m_nHits++;
+	}
+	Q_ASSERT(pCache->m_nFree > 0);
 
-	m_pSection.unlock();
+	G2Packet* pPacket = pCache->m_pFree;
+	pCache->m_pFree = pPacket->m_pNext;
+	pCache->m_nFree--;
 
 	pPacket->Reset();
 	pPacket->AddRef();
@@ -350,15 +496,18 @@ G2Packet* G2PacketPool::New()
 void G2PacketPool::Delete(G2Packet *pPacket)
 {
 	Q_ASSERT(pPacket != NULL);
-	Q_ASSERT(pPacket->m_nReference == 0);
+	Q_ASSERT(pPacket->m_nReference.loadAcquire() == 0);
 
-	m_pSection.lock();
+	LocalCache* pCache = GetLocal();
 
-	pPacket->m_pNext = m_pFree;
-	m_pFree = pPacket;
-	m_nFree ++;
+	pPacket->m_pNext = pCache->m_pFree;
+	pCache->m_pFree = pPacket;
+	pCache->m_nFree++;
 
-	m_pSection.unlock();
+	if(pCache->m_nFree > G2_POOL_LOCAL_MAX)
+	{
+		Return(pCache, G2_POOL_BATCH);
+	}
 }
 
 extern G2PacketPool G2Packets;
@@ -73,10 +73,20 @@ void CHandshake::OnRead()
 		Handshakes.processNeighbour(this);
 		delete this;
 	}
-    else if(Peek(5).startsWith("GET /"))
+    else if(Peek(5).startsWith("GET /") || Peek(6).startsWith("HEAD /"))
     {
-        if( Peek(bytesAvailable()).indexOf("\r\n\r\n") != -1 )
+        QByteArray baRequest = Peek(bytesAvailable());
+
+        if( baRequest.indexOf("\r\n\r\n") != -1 )
         {
+            if( baRequest.left(baRequest.indexOf("\r\n")).contains(" /uri-res/") )
+            {
+                systemLog.postLog(LogSeverity::Debug, QString("Incoming connection from %1 is an upload request").arg(m_pSocket->peerAddress().toString().toLocal8Bit().constData()));
+                Handshakes.processUpload(this);
+                delete this;
+                return;
+            }
+
             systemLog.postLog(LogSeverity::Debug, QString("Incoming connection from %1 is a Web request").arg(m_pSocket->peerAddress().toString().toLocal8Bit().constData()));
             OnWebRequest();
         }
@@ -157,31 +167,27 @@ void CHandshake::OnWebRequest()
         baHtml += "This node is currently connected to the following nodes:<table width=\"100%\" cellspacing=\"0\">";
         baHtml += "<b><tr><th>Address</th><th>Time</th><th>Mode</th><th>Leaves</th><th>Client</th></tr></b>";
 
-        Neighbours.m_pSection.lock();
+        NeighboursSnapshotPtr pSnapshot = Neighbours.GetSnapshot();
 
-        quint32 tNow = time(0);
-
-        for( QList<CNeighbour*>::iterator it = Neighbours.begin(); it != Neighbours.end(); it++ )
+        for( QVector<NeighbourStats>::const_iterator it = pSnapshot->m_lNodes.constBegin(); it != pSnapshot->m_lNodes.constEnd(); ++it )
         {
-            if( (*it)->m_nState != nsConnected )
+            if( it->m_nState != nsConnected )
                 continue;
 
-            baHtml += "<tr><td style=\"text-align:center;\"><a href=\"http://" + (*it)->address().toStringWithPort() + "\">" + (*it)->address().toStringWithPort() + "</a></td>";
+            baHtml += "<tr><td style=\"text-align:center;\"><a href=\"http://" + it->m_oAddress.toStringWithPort() + "\">" + it->m_oAddress.toStringWithPort() + "</a></td>";
 
-            quint32 tConnected = tNow - (*it)->m_tConnected;
+            quint32 tConnected = it->m_tConnected;
             baHtml += "<td style=\"text-align:center;\">" + QString().sprintf( "%.2u:%.2u:%.2u", tConnected / 3600,
                                                  tConnected % 3600 / 60, ( tConnected % 3600 ) % 60 ) + "</td>";
 
-            if( (*it)->m_nProtocol == dpG2 )
+            if( it->m_nProtocol == dpG2 )
             {
-                CG2Node* pG2 = static_cast<CG2Node*>(*it);
-
-                baHtml += "<td style=\"text-align:center;\">" + QString((pG2->m_nType == G2_HUB ? "G2 Hub" : "G2 Leaf")) + "</td>";
+                baHtml += "<td style=\"text-align:center;\">" + QString((it->m_nType == G2_HUB ? "G2 Hub" : "G2 Leaf")) + "</td>";
 
                 baHtml += "<td style=\"text-align:center;\">";
-                if( pG2->m_nType == G2_HUB )
+                if( it->m_nType == G2_HUB )
                 {
-                    baHtml += QString::number(pG2->m_nLeafCount) + "/" + QString::number(pG2->m_nLeafMax);
+                    baHtml += QString::number(it->m_nLeafCount) + "/" + QString::number(it->m_nLeafMax);
                 }
                 else
                 {
@@ -193,12 +199,10 @@ void CHandshake::OnWebRequest()
             {
                 baHtml += "<td style=\"text-align:center;\">&nbsp;</td><td style=\"text-align:center;\">&nbsp;</td>";
             }
-            baHtml += "<td style=\"text-align:center;\">" + (*it)->m_sUserAgent + "</td>";
+            baHtml += "<td style=\"text-align:center;\">" + it->m_sUserAgent + "</td>";
             baHtml += "</tr>";
         }
 
-        Neighbours.m_pSection.unlock();
-
         baHtml += "</table></div></body></html>";
 
         baResp += "Content-length: " + QString(baHtml.length()) + "\r\n";
@@ -215,7 +219,7 @@ void CHandshake::OnWebRequest()
 
         bool bFound = false;
 
-		if(sPath.startsWith("/res")) // redirect /res prefixed URIs to the resource system, anything not prefixed will go to uploads
+		if(sPath.startsWith("/res")) // redirect /res prefixed URIs to the resource system, /uri-res requests were handed to uploads in OnRead()
         {
 			sPath = ":/Resource/Web" + sPath.mid(4);
 
@@ -241,8 +245,6 @@ void CHandshake::OnWebRequest()
             }
         }
 
-        // TODO: Handle P2P uploads here
-
         if( !bFound )
         {
             baResp += "HTTP/1.1 404 Not found\r\n";
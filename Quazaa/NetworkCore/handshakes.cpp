@@ -28,6 +28,7 @@
 #include "ratecontroller.h"
 #include "neighbours.h"
 #include "securitymanager.h"
+#include "uploads.h"
 
 #include <QTimer>
 
@@ -126,6 +127,12 @@ void CHandshakes::processNeighbour(CHandshake* pHs)
 	Neighbours.OnAccept(pHs);
 }
 
+void CHandshakes::processUpload(CHandshake* pHs)
+{
+	RemoveHandshake(pHs);
+	Uploads.OnAccept(pHs);
+}
+
 void CHandshakes::SetupThread()
 {
 	m_pController = new CRateController(&m_pSection);
@@ -78,6 +78,7 @@ protected:
 	void RemoveHandshake(CHandshake* pHs);
 
 	void processNeighbour(CHandshake* pHs);
+	void processUpload(CHandshake* pHs);
 
 	friend class CHandshake;
 };
@@ -51,6 +51,8 @@ CHubHorizonPool::~CHubHorizonPool()
 
 void CHubHorizonPool::Setup()
 {
+	QMutexLocker l(&m_pSection);
+
 	if(m_pBuffer != 0)
 	{
 		delete [] m_pBuffer;
@@ -71,6 +73,8 @@ void CHubHorizonPool::Setup()
 
 void CHubHorizonPool::Clear()
 {
+	QMutexLocker l(&m_pSection);
+
 	m_pActive	= 0;
 	m_nActive	= 0;
 	m_pFree		= m_pBuffer;
@@ -84,6 +88,8 @@ void CHubHorizonPool::Clear()
 
 CHubHorizonHub* CHubHorizonPool::Add(CEndPoint oAddress)
 {
+	ASSUME_LOCK(m_pSection);
+
 	CHubHorizonHub* pHub = m_pActive;
 	for(; pHub ; pHub = pHub->m_pNext)
 	{
@@ -114,6 +120,8 @@ CHubHorizonHub* CHubHorizonPool::Add(CEndPoint oAddress)
 
 void CHubHorizonPool::Remove(CHubHorizonHub* pHub)
 {
+	ASSUME_LOCK(m_pSection);
+
 	CHubHorizonHub** ppPrev = &m_pActive;
 
 	for(CHubHorizonHub* pSeek = *ppPrev ; pSeek ; pSeek = pSeek->m_pNext)
@@ -133,6 +141,8 @@ void CHubHorizonPool::Remove(CHubHorizonHub* pHub)
 
 CHubHorizonHub* CHubHorizonPool::Find(CEndPoint oAddress)
 {
+	ASSUME_LOCK(m_pSection);
+
 	for(CHubHorizonHub* pHub = m_pActive ; pHub ; pHub = pHub->m_pNext)
 	{
 		if(pHub->m_oAddress == oAddress)
@@ -146,6 +156,8 @@ CHubHorizonHub* CHubHorizonPool::Find(CEndPoint oAddress)
 
 int CHubHorizonPool::AddHorizonHubs(G2Packet* pPacket)
 {
+	QMutexLocker l(&m_pSection);
+
 	int nCount = 0;
 
 	for(CHubHorizonHub* pHub = m_pActive ; pHub ; pHub = pHub->m_pNext)
@@ -187,7 +199,10 @@ void CHubHorizonGroup::Add(CEndPoint oAddress)
 		}
 	}
 
+	HubHorizonPool.m_pSection.lock();
 	CHubHorizonHub* pHub = HubHorizonPool.Add(oAddress);
+	HubHorizonPool.m_pSection.unlock();
+
 	if(pHub == 0)
 	{
 		return;
@@ -217,6 +232,8 @@ void CHubHorizonGroup::Clear()
 {
 	CHubHorizonHub** ppHub = m_pList;
 
+	QMutexLocker l(&HubHorizonPool.m_pSection);
+
 	for(quint32 nCount = m_nCount ; nCount ; nCount--, ppHub++)
 	{
 		if(-- ((*ppHub)->m_nReference) == 0)
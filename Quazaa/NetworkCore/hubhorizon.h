@@ -27,6 +27,7 @@
 #define HUBHORIZON_H
 
 #include "types.h"
+#include <QMutex>
 
 class G2Packet;
 
@@ -71,9 +72,13 @@ protected:
 	CHubHorizonHub*		m_pActive;
 	quint32				m_nActive;
 
+public:
+	QMutex				m_pSection;	// groups of all neighbour threads share the pool
+
 public:
 	void				Setup();
 	void				Clear();
+	// Add(), Remove() and Find() expect m_pSection to be held
 	CHubHorizonHub*		Add(CEndPoint oAddress);
 	void				Remove(CHubHorizonHub* pHub);
 	CHubHorizonHub*		Find(CEndPoint oAddress);
@@ -0,0 +1,91 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public 
+** License version 3.0 requirements will be met: 
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version 
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation, 
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "localsearch.h"
+#include "g2packet.h"
+#include "network.h"
+#include "sharemanager.h"
+#include "quazaasettings.h"
+#include "quazaaglobals.h"
+
+#include "debug_new.h"
+
+bool CLocalSearch::Execute(CQueryPtr pQuery, QList<G2Packet*>& lPackets)
+{
+	QList<ShareIndexEntry> lFiles;
+
+	if(!ShareManager.Search(pQuery, lFiles, quazaaSettings.Gnutella.MaxHits))
+	{
+		return false;
+	}
+
+	int nPerPacket = qMax(1, quazaaSettings.Gnutella.HitsPerPacket);
+
+	for(int nFirst = 0; nFirst < lFiles.size(); nFirst += nPerPacket)
+	{
+		G2Packet* pPacket = CreateQueryHit();
+
+		for(int i = nFirst; i < lFiles.size() && i < nFirst + nPerPacket; ++i)
+		{
+			WriteHit(pPacket, lFiles.at(i));
+		}
+
+		pPacket->WriteByte(0); // end of children
+		pPacket->WriteByte(0); // hops
+		pPacket->WriteGUID(pQuery->m_oGUID);
+
+		lPackets.append(pPacket);
+	}
+
+	return true;
+}
+
+G2Packet* CLocalSearch::CreateQueryHit()
+{
+	G2Packet* pPacket = G2Packet::New("QH2", true);
+
+	pPacket->WritePacket("GU", 16)->WriteGUID(quazaaSettings.Profile.GUID);
+	pPacket->WritePacket("NA", (Network.m_oAddress.protocol() == QAbstractSocket::IPv4Protocol ? 6 : 18))->WriteHostAddress(&Network.m_oAddress);
+	pPacket->WritePacket("V", 4)->WriteString(CQuazaaGlobals::VENDOR_CODE(), false);
+
+	return pPacket;
+}
+
+void CLocalSearch::WriteHit(G2Packet* pPacket, const ShareIndexEntry& oFile)
+{
+	G2Packet* pHit = G2Packet::New("H", true);
+
+	pHit->WritePacket("URN", 5 + oFile.m_baSHA1.size())->WriteString("sha1", true);
+	pHit->Write((void*)oFile.m_baSHA1.constData(), oFile.m_baSHA1.size());
+
+	// SZ goes first, so DN is read as a plain name
+	pHit->WritePacket("SZ", 8)->WriteIntLE<quint64>(oFile.m_nSize);
+	pHit->WritePacket("DN", oFile.m_sName.toUtf8().size())->WriteString(oFile.m_sName, false);
+
+	// empty URL means uri-res on our node address
+	pHit->WritePacket("URL", 0);
+
+	pPacket->WritePacket(pHit);
+	pHit->Release();
+}
@@ -182,32 +182,44 @@ void CManagedSearch::Execute(const QDateTime& tNowDT, quint32* pnMaxPackets)
 
 void CManagedSearch::SearchNeighbours(const QDateTime& tNowDT)
 {
-	QMutexLocker l( &Neighbours.m_pSection );
+	NeighboursSnapshotPtr pNeighbours = Neighbours.GetSnapshot();
 
 	const quint32 tNow = tNowDT.toTime_t();
 
-	for ( QList<CNeighbour*>::iterator itNode = Neighbours.begin();
-	      itNode != Neighbours.end(); ++itNode )
+	for ( QVector<NeighbourStats>::const_iterator itNode = pNeighbours->m_lNodes.constBegin();
+	      itNode != pNeighbours->m_lNodes.constEnd(); ++itNode )
 	{
-		if ( (*itNode)->m_nProtocol != dpG2 )
+		if ( itNode->m_nProtocol != dpG2 )
 		{
 			continue;
 		}
 
-		CG2Node* pNode = (CG2Node*)(*itNode);
-
-		if ( pNode->m_nState == nsConnected &&
-		     tNow - pNode->m_tConnected > 15 &&
-		     ( tNow - pNode->m_tLastQuery > quazaaSettings.Gnutella2.QueryHostThrottle &&
-		       !m_lSearchedNodes.contains( pNode->m_oAddress ) ) )
+		if ( itNode->m_nState == nsConnected &&
+		     itNode->m_tConnected > 15 &&
+		     !m_lSearchedNodes.contains( itNode->m_oAddress ) )
 		{
+			CG2Node* pNode = (CG2Node*)itNode->m_pNode;
+
+			// other searches query the same node from other threads
+			pNode->m_pSection.lock();
+			const bool bThrottled = tNow - pNode->m_tLastQuery <= quazaaSettings.Gnutella2.QueryHostThrottle;
+			if ( !bThrottled )
+			{
+				pNode->m_tLastQuery = tNow;
+			}
+			pNode->m_pSection.unlock();
+
+			if ( bThrottled )
+			{
+				continue;
+			}
+
 			G2Packet* pQuery = m_pQuery->ToG2Packet( Network.IsFirewalled() ?
 			                                             NULL : &Network.m_oAddress );
 			if ( pQuery )
 			{
-				m_lSearchedNodes[pNode->m_oAddress] = tNowDT;
+				m_lSearchedNodes[itNode->m_oAddress] = tNowDT;
 				pNode->SendPacket( pQuery, true, true );
-				pNode->m_tLastQuery = tNow;
 			}
 		}
 	}
@@ -220,6 +232,9 @@ void CManagedSearch::SearchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 	CG2Node* pLastNeighbour = NULL;
 	CHostCacheHost* pHost   = NULL;
 
+	// read without Neighbours.m_pSection, keeps the listed nodes allocated
+	NeighboursSnapshotPtr pNeighbours = Neighbours.GetSnapshot();
+
 	QMutexLocker oHostCacheLock( &hostCache.m_pSection );
 
 	for ( CHostCacheIterator itHost = hostCache.m_lHosts.begin();
@@ -245,14 +260,11 @@ void CManagedSearch::SearchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 			}
 		}
 
-		Neighbours.m_pSection.lock();
-		if ( Neighbours.Find(pHost->m_oAddress ) )
+		// don't udp to neighbours
+		if ( pNeighbours->HasAddress( pHost->m_oAddress ) )
 		{
-			// don't udp to neighbours
-			Neighbours.m_pSection.unlock();
 			continue;
 		}
-		Neighbours.m_pSection.unlock();
 
 		CEndPoint pReceiver;
 
@@ -284,11 +296,9 @@ void CManagedSearch::SearchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 			else
 			{
 				// we are firewalled, so key must be for one of our connected neighbours
-				Neighbours.m_pSection.lock();
-
-				CNeighbour* pNode = Neighbours.Find( pHost->m_nKeyHost, dpG2 );
+				const NeighbourStats* pNode = pNeighbours->Find( pHost->m_nKeyHost, dpG2 );
 
-				if( pNode && static_cast<CG2Node*>(pNode)->m_nState == nsConnected )
+				if( pNode && pNode->m_nState == nsConnected )
 				{
 					pReceiver = pNode->m_oAddress;
 				}
@@ -296,8 +306,6 @@ void CManagedSearch::SearchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 				{
 					pHost->m_nQueryKey = 0;
 				}
-
-				Neighbours.m_pSection.unlock();
 			}
 		}
 
@@ -355,27 +363,25 @@ void CManagedSearch::SearchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 			}
 			else
 			{
-				Neighbours.m_pSection.lock();
-
-				CG2Node* pHub = 0;
+				const NeighbourStats* pHub = 0;
 
 				// Find best hub for routing
-				bool bCheckLast = Neighbours.m_nHubsConnectedG2 > 2;
-				for ( QList<CNeighbour*>::iterator itNode = Neighbours.begin();
-				      itNode != Neighbours.end(); ++itNode )
+				bool bCheckLast = pNeighbours->m_nHubsConnectedG2 > 2;
+				for ( QVector<NeighbourStats>::const_iterator itNode = pNeighbours->m_lNodes.constBegin();
+				      itNode != pNeighbours->m_lNodes.constEnd(); ++itNode )
 				{
-					if ( (*itNode)->m_nProtocol != dpG2 || (*itNode)->m_nState != nsConnected )
+					if ( itNode->m_nProtocol != dpG2 || itNode->m_nState != nsConnected )
 					{
 						continue;
 					}
 
-					CG2Node* pNode = (CG2Node*)(*itNode);
+					const NeighbourStats* pNode = &(*itNode);
 
 					// Must be a hub that already acked our query
 					if ( pNode->m_nType == G2_HUB &&
 					     m_lSearchedNodes.contains( pNode->m_oAddress ) )
 					{
-						if ( ( bCheckLast && pNode == pLastNeighbour ) )
+						if ( ( bCheckLast && pNode->m_pNode == pLastNeighbour ) )
 						{
 							continue;
 						}
@@ -398,11 +404,16 @@ void CManagedSearch::SearchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 
 				if ( pHub )
 				{
-					pLastNeighbour = pHub;
-					if ( !pHub->m_tKeyRequest )
+					CG2Node* pHubNode = (CG2Node*)pHub->m_pNode;
+					CEndPoint oHubAddress = pHub->m_oAddress;
+
+					pLastNeighbour = pHubNode;
+					pHubNode->m_pSection.lock();
+					if ( !pHubNode->m_tKeyRequest )
 					{
-						pHub->m_tKeyRequest = tNow;
+						pHubNode->m_tKeyRequest = tNow;
 					}
+					pHubNode->m_pSection.unlock();
 
 					if ( pHub->m_bCachedKeys )
 					{
@@ -416,15 +427,15 @@ void CManagedSearch::SearchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 						systemLog.postLog( LogSeverity::Debug,
 						                   QString( "Requesting query key from %1 through %2"
 						                            ).arg( pHost->m_oAddress.toString()
-						                                   ).arg( pHub->m_oAddress.toString() ) );
+						                                   ).arg( oHubAddress.toString() ) );
 #endif // LOG_QUERY_HANDLING
-						pHub->SendPacket( pQKR, true, true );
+						pHubNode->SendPacket( pQKR, true, true );
 					}
 					else
 					{
 						G2Packet* pQKR = G2Packet::New( "QKR", true );
-						pQKR->WritePacket( "RNA", (pHub->m_oAddress.protocol() ? 18 : 6)
-						                   )->WriteHostAddress( &pHub->m_oAddress );
+						pQKR->WritePacket( "RNA", (oHubAddress.protocol() ? 18 : 6)
+						                   )->WriteHostAddress( &oHubAddress );
 						Datagrams.SendPacket( pHost->m_oAddress, pQKR, false );
 						pQKR->Release();
 
@@ -432,14 +443,12 @@ void CManagedSearch::SearchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 						systemLog.postLog( LogSeverity::Debug,
 						                   QString( "Requesting query key from %1 for %2"
 						                            ).arg( pHost->m_oAddress.toString()
-						                                   ).arg( pHub->m_oAddress.toString() ) );
+						                                   ).arg( oHubAddress.toString() ) );
 #endif // LOG_QUERY_HANDLING
 					}
 
 					bKeyRequested = true;
 				}
-
-				Neighbours.m_pSection.unlock();
 			}
 
 			if( bKeyRequested )
@@ -43,13 +43,23 @@ CNeighbour::CNeighbour(QObject* parent) :
 	m_tRTT = 0;
 	m_nPacketsIn = m_nPacketsOut = 0;
 	m_bAutomatic = true;
+	m_pWorker = 0;
 
 }
 
 CNeighbour::~CNeighbour()
 {
-	ASSUME_LOCK(Neighbours.m_pSection);
-	Neighbours.RemoveNode(this);
+	Q_ASSERT(m_nReference.loadAcquire() == 0);
+}
+
+// Dropped by Neighbours' list and by snapshots, from any thread. The node is deleted
+// in its own thread once it is out of the list and no snapshot lists it any more.
+void CNeighbour::Release()
+{
+	if(!m_nReference.deref())
+	{
+		deleteLater();
+	}
 }
 
 void CNeighbour::OnTimer(quint32 tNow)
@@ -97,20 +107,54 @@ void CNeighbour::OnTimer(quint32 tNow)
 	}
 }
 
+// Queued by CNeighboursBase::Maintain(), runs OnTimer() in the node's own I/O thread
+void CNeighbour::OnMaintain(quint32 tNow)
+{
+	// may still be queued after the node left the list
+	if(m_nState == nsClosed)
+	{
+		return;
+	}
+
+	OnTimer(tNow);
+}
+
 void CNeighbour::Close(bool bDelayed)
 {
+	m_pSection.lock();
 	m_nState = nsClosing;
+	m_pSection.unlock();
+
 	CCompressedConnection::Close(bDelayed);
 }
 
+// Takes the node out of Neighbours, it is deleted once the last snapshot listing it is gone
+void CNeighbour::Unlist()
+{
+	m_pSection.lock();
+	m_nState = nsClosed;
+	m_pSection.unlock();
+
+	Neighbours.Lock();
+	if(Neighbours.NeighbourExists(this))
+	{
+		Neighbours.RemoveNode(this);
+	}
+	Neighbours.Unlock();
+}
+
 void CNeighbour::OnDisconnect()
 {
-	Neighbours.m_pSection.lock();
-	delete this;
-	Neighbours.m_pSection.unlock();
+	if(m_nState != nsClosed)
+	{
+		Unlist();
+	}
 }
 void CNeighbour::OnError(QAbstractSocket::SocketError e)
 {
+	if ( m_nState == nsClosed )
+		return;
+
 	if ( e == QAbstractSocket::RemoteHostClosedError )
 	{
 		if ( m_nState != nsHandshaking )
@@ -150,8 +194,6 @@ void CNeighbour::OnError(QAbstractSocket::SocketError e)
 		}
 	}
 
-	Neighbours.m_pSection.lock();
-	delete this;
-	Neighbours.m_pSection.unlock();
+	Unlist();
 }
 
@@ -27,6 +27,10 @@
 
 #include "compressedconnection.h"
 #include "types.h"
+#include <QMutex>
+#include <QAtomicInt>
+
+class CNeighboursWorker;
 
 class CNeighbour : public CCompressedConnection
 {
@@ -42,6 +46,7 @@ public:
 	quint32         m_nPacketsIn;
 	quint32         m_nPacketsOut;
 	QString         m_sUserAgent;
+	QUuid           m_oGUID;        // node GUID once the neighbour told us, null before
 
 	quint32         m_tLastPingOut;
 	quint32         m_nPingsWaiting;
@@ -53,6 +58,13 @@ public:
 
 	bool            m_bAutomatic;
 
+	CNeighboursWorker* m_pWorker;   // I/O thread serving this node, set by CNeighboursConnections::AddNode()
+
+	// Guards what other threads copy or test and set: m_nState, m_oAddress, m_oGUID, the handshake
+	// strings, m_tLastQuery and the G2 type, flags and leaf counts. Most of these are written by the
+	// node's own thread only, which reads them without the lock. Never held while taking another lock.
+	QMutex          m_pSection;
+	QAtomicInt      m_nReference;   // Neighbours' list and every snapshot listing the node hold one
 
 public:
 	CNeighbour(QObject* parent = NULL);
@@ -75,9 +87,25 @@ public:
 	virtual void OnTimer(quint32 tNow);
 	void Close(bool bDelayed = false);
 
+	inline void AddRef()
+	{
+		m_nReference.ref();
+	}
+	void Release();
+protected:
+	void Unlist();
+
+	// The handshake text is copied into snapshots from other threads
+	inline void AppendHandshake(const QString& sText)
+	{
+		QMutexLocker l(&m_pSection);
+		m_sHandshake += sText;
+	}
+
 signals:
 
 public slots:
+	void OnMaintain(quint32 tNow);
 	void OnDisconnect();
 	void OnError(QAbstractSocket::SocketError e);
 
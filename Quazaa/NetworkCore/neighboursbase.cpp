@@ -24,11 +24,21 @@
 
 #include "neighboursbase.h"
 #include "neighbour.h"
+#include "g2packet.h"
 #include "debug_new.h"
 
+NeighboursSnapshot::~NeighboursSnapshot()
+{
+	for(QVector<NeighbourStats>::const_iterator itNode = m_lNodes.constBegin(); itNode != m_lNodes.constEnd(); ++itNode)
+	{
+		itNode->m_pNode->Release();
+	}
+}
+
 CNeighboursBase::CNeighboursBase(QObject* parent) :
 	QObject(parent),
-	m_bActive(false)
+	m_bActive(false),
+	m_tLockStats(0)
 {
 }
 CNeighboursBase::~CNeighboursBase()
@@ -56,10 +66,16 @@ void CNeighboursBase::AddNode(CNeighbour* pNode)
 {
 	ASSUME_LOCK(m_pSection);
 
+	pNode->AddRef();
 	m_lNodes.append(pNode);
 	m_lNodesByAddr.insert(pNode->m_oAddress, pNode);
 	m_lNodesByPtr.insert(pNode);
 
+	if(!pNode->m_oGUID.isNull())
+	{
+		m_lNodesByGUID.insert(pNode->m_oGUID, pNode);
+	}
+
 	emit NeighbourAdded(pNode);
 }
 void CNeighboursBase::RemoveNode(CNeighbour* pNode)
@@ -67,28 +83,93 @@ void CNeighboursBase::RemoveNode(CNeighbour* pNode)
 	ASSUME_LOCK(m_pSection);
 
 	m_lNodes.removeAll(pNode);
-	m_lNodesByAddr.remove(pNode->m_oAddress);
+	m_lNodesByAddr.remove(pNode->m_oAddress, pNode);
 	m_lNodesByPtr.remove(pNode);
 
+	if(!pNode->m_oGUID.isNull())
+	{
+		m_lNodesByGUID.remove(pNode->m_oGUID, pNode);
+	}
+
 	emit NeighbourRemoved(pNode);
+
+	// snapshots still listing the node keep it until they are released
+	pNode->Release();
 }
 
-CNeighbour* CNeighboursBase::Find(QHostAddress& oAddress, DiscoveryProtocol nProtocol)
+CNeighbour* CNeighboursBase::Find(const QHostAddress& oAddress, DiscoveryProtocol nProtocol)
 {
 	ASSUME_LOCK(m_pSection);
 
-	if(m_lNodesByAddr.contains(oAddress))
+	// several nodes may share an address, e.g. different protocols or ports
+	QMultiHash<QHostAddress, CNeighbour*>::const_iterator itNode = m_lNodesByAddr.constFind(oAddress);
+	for(; itNode != m_lNodesByAddr.constEnd() && itNode.key() == oAddress; ++itNode)
 	{
-		foreach(CNeighbour * pRet, m_lNodesByAddr.values(oAddress))
+		if(itNode.value()->m_nProtocol == nProtocol || nProtocol == dpNull)
 		{
-			if(pRet->m_nProtocol == nProtocol || nProtocol == dpNull)
-			{
-				return pRet;
-			}
+			return itNode.value();
 		}
 	}
 	return 0;
 }
+CNeighbour* CNeighboursBase::FindByGUID(const QUuid& oGUID)
+{
+	ASSUME_LOCK(m_pSection);
+
+	return m_lNodesByGUID.value(oGUID, 0);
+}
+// Called when a neighbour reports its GUID, replaces a previously reported one
+void CNeighboursBase::SetNodeGUID(CNeighbour* pNode, const QUuid& oGUID)
+{
+	ASSUME_LOCK(m_pSection);
+
+	if(pNode->m_oGUID == oGUID)
+	{
+		return;
+	}
+
+	if(!pNode->m_oGUID.isNull())
+	{
+		m_lNodesByGUID.remove(pNode->m_oGUID, pNode);
+	}
+
+	pNode->m_pSection.lock();
+	pNode->m_oGUID = oGUID;
+	pNode->m_pSection.unlock();
+
+	if(!oGUID.isNull() && m_lNodesByPtr.contains(pNode))
+	{
+		m_lNodesByGUID.insert(oGUID, pNode);
+	}
+}
+// Called when a neighbour reports the address it listens on
+void CNeighboursBase::SetNodeAddress(CNeighbour* pNode, const CEndPoint& oAddress)
+{
+	ASSUME_LOCK(m_pSection);
+
+	if(pNode->m_oAddress == oAddress)
+	{
+		return;
+	}
+
+	bool bListed = m_lNodesByAddr.remove(pNode->m_oAddress, pNode);
+
+	pNode->m_pSection.lock();
+	pNode->m_oAddress = oAddress;
+	pNode->m_pSection.unlock();
+
+	if(bListed)
+	{
+		m_lNodesByAddr.insert(oAddress, pNode);
+	}
+}
+// Totals since startup
+void CNeighboursBase::GetLockStats(quint32& nLocks, quint32& nWaits)
+{
+	nLocks = m_nLocks.fetchAndAddRelaxed(0);
+	nWaits = m_nLockWaits.fetchAndAddRelaxed(0);
+}
+
 bool CNeighboursBase::NeighbourExists(const CNeighbour* pNode)
 {
 	ASSUME_LOCK(m_pSection);
@@ -96,15 +177,41 @@ bool CNeighboursBase::NeighbourExists(const CNeighbour* pNode)
 	return m_lNodesByPtr.contains(const_cast<CNeighbour * const&>(pNode));
 }
 
+NeighboursSnapshotPtr CNeighboursBase::GetSnapshot()
+{
+	QMutexLocker l(&m_pSnapshotSection);
+
+	if(!m_pSnapshot)
+	{
+		m_pSnapshot = NeighboursSnapshotPtr(new NeighboursSnapshot());
+	}
+
+	return m_pSnapshot;
+}
+
 void CNeighboursBase::Maintain()
 {
 	ASSUME_LOCK(m_pSection);
 
 	quint32 tNow = time(0);
 
+	// sockets and meters belong to the worker threads, so do not touch them from here
 	foreach(CNeighbour * pNode, m_lNodes)
 	{
-		pNode->OnTimer(tNow);
+		QMetaObject::invokeMethod(pNode, "OnMaintain", Qt::QueuedConnection, Q_ARG(quint32, tNow));
+	}
+
+	if(tNow - m_tLockStats >= 60)
+	{
+		quint32 nLocks = 0, nWaits = 0;
+		GetLockStats(nLocks, nWaits);
+		systemLog.postLog(LogSeverity::Debug, QString("Neighbours lock: %1 acquisitions, %2 had to wait").arg(nLocks).arg(nWaits));
+		systemLog.postLog(LogSeverity::Debug, QString("Neighbours compression state: %1 KB").arg(CCompressedConnection::TotalCompressionMemory() / 1024));
+
+		quint32 nHits = 0, nMisses = 0, nAllocations = 0;
+		G2Packets.GetStats(nHits, nMisses, nAllocations);
+		systemLog.postLog(LogSeverity::Debug, QString("G2 packet pool: %1 served from thread caches, %2 refills, %3 blocks allocated").arg(nHits).arg(nMisses).arg(nAllocations));
+		m_tLockStats = tNow;
 	}
 }
 
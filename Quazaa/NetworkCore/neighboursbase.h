@@ -28,13 +28,86 @@
 
 #include <QObject>
 #include <QMutex>
+#include <QAtomicInt>
 #include <QList>
 #include <QHash>
 #include <QSet>
+#include <QVector>
 #include "types.h"
 
 class CNeighbour;
 
+// Copy of one neighbour's state, taken under the node's m_pSection and its worker lock
+struct NeighbourStats
+{
+	CNeighbour*			m_pNode;	// allocated while the snapshot is held, use only SendPacket() and m_pSection on it
+	CEndPoint			m_oAddress;
+	DiscoveryProtocol	m_nProtocol;
+	NodeState			m_nState;
+	G2NodeType			m_nType;
+	quint32				m_tConnected;	// seconds since the connection was made
+	bool				m_bInitiated;
+	bool				m_bAutomatic;
+	bool				m_bG2Core;
+	bool				m_bCachedKeys;
+	QString				m_sHandshake;
+	QString				m_sUserAgent;
+	quint32				m_nBandwidthIn;
+	quint32				m_nBandwidthOut;
+	quint64				m_nBytesReceived;
+	quint64				m_nBytesSent;
+	float				m_nCompressionIn;
+	float				m_nCompressionOut;
+	quint32				m_nPacketsIn;
+	quint32				m_nPacketsOut;
+	quint32				m_nPingsWaiting;
+	qint64				m_tRTT;
+	quint16				m_nLeafCount;
+	quint16				m_nLeafMax;
+};
+
+// Immutable view of all neighbours, replaced as a whole once a second and on every add or remove.
+// It holds a reference on every node it lists, so routing can send to them without m_pSection.
+struct NeighboursSnapshot
+{
+	QVector<NeighbourStats>			m_lNodes;
+	QHash<CNeighbour*, int>			m_lIndex;		// m_pNode to position in m_lNodes
+	QMultiHash<QHostAddress, int>	m_lAddresses;	// address to position in m_lNodes
+	quint32							m_nHubsConnectedG2;
+	quint32							m_nLeavesConnectedG2;
+	quint32							m_nDownloadSpeed;
+	quint32							m_nUploadSpeed;
+
+	~NeighboursSnapshot();
+
+	const NeighbourStats* Find(CNeighbour* pNode) const
+	{
+		QHash<CNeighbour*, int>::const_iterator itNode = m_lIndex.constFind(pNode);
+		return (itNode == m_lIndex.constEnd() ? 0 : &m_lNodes.at(itNode.value()));
+	}
+	const NeighbourStats* Find(const QHostAddress& oAddress, DiscoveryProtocol nProtocol = dpNull) const
+	{
+		QMultiHash<QHostAddress, int>::const_iterator itNode = m_lAddresses.constFind(oAddress);
+		for(; itNode != m_lAddresses.constEnd() && itNode.key() == oAddress; ++itNode)
+		{
+			const NeighbourStats& oStats = m_lNodes.at(itNode.value());
+			if(oStats.m_nProtocol == nProtocol || nProtocol == dpNull)
+			{
+				return &oStats;
+			}
+		}
+		return 0;
+	}
+	bool HasAddress(const QHostAddress& oAddress) const
+	{
+		return m_lAddresses.contains(oAddress);
+	}
+};
+
+typedef QSharedPointer<const NeighboursSnapshot> NeighboursSnapshotPtr;
+
+// m_pSection guards the neighbour list and its indices only. Node state has the node's own
+// m_pSection, packet handling and routing read the published snapshot instead.
 class CNeighboursBase : public QObject
 {
 	Q_OBJECT
@@ -43,9 +116,17 @@ public:
 	QMutex	m_pSection;
 	bool	m_bActive;
 protected:
+	QAtomicInt	m_nLocks;		// acquisitions of m_pSection through Lock()
+	QAtomicInt	m_nLockWaits;	// ...of which had to wait for another thread
+	quint32		m_tLockStats;	// last time the counters were logged
+
 	QList<CNeighbour*>				 m_lNodes;
-	QHash<QHostAddress, CNeighbour*> m_lNodesByAddr;  // lookups by ip address
+	QMultiHash<QHostAddress, CNeighbour*> m_lNodesByAddr;  // lookups by ip address, one entry per node
+	QMultiHash<QUuid, CNeighbour*>		 m_lNodesByGUID;  // lookups by node GUID, nodes that sent one
 	QSet<CNeighbour*>				 m_lNodesByPtr;	// lookups by pointer
+
+	QMutex					m_pSnapshotSection;	// guards m_pSnapshot only, held just to copy or swap the pointer
+	NeighboursSnapshotPtr	m_pSnapshot;
 public:
 	CNeighboursBase(QObject* parent = 0);
 	virtual ~CNeighboursBase();
@@ -56,9 +137,31 @@ public:
 	virtual void AddNode(CNeighbour* pNode);
 	virtual void RemoveNode(CNeighbour* pNode);
 
-	CNeighbour* Find(QHostAddress& oAddress, DiscoveryProtocol nProtocol = dpNull);
+	// Locks m_pSection, counting contention
+	inline void Lock()
+	{
+		if(!m_pSection.tryLock())
+		{
+			m_nLockWaits.fetchAndAddRelaxed(1);
+			m_pSection.lock();
+		}
+		m_nLocks.fetchAndAddRelaxed(1);
+	}
+	inline void Unlock()
+	{
+		m_pSection.unlock();
+	}
+	void GetLockStats(quint32& nLocks, quint32& nWaits);
+
+	CNeighbour* Find(const QHostAddress& oAddress, DiscoveryProtocol nProtocol = dpNull);
+	CNeighbour* FindByGUID(const QUuid& oGUID);
+	void SetNodeGUID(CNeighbour* pNode, const QUuid& oGUID);
+	void SetNodeAddress(CNeighbour* pNode, const CEndPoint& oAddress);
 	bool NeighbourExists(const CNeighbour* pNode);
 
+	// Latest published state, readable from any thread without m_pSection
+	NeighboursSnapshotPtr GetSnapshot();
+
 	virtual quint32 DownloadSpeed()
 	{
 		return 0;
@@ -96,4 +199,20 @@ public slots:
 	virtual void Maintain();
 };
 
+// QMutexLocker counterpart of CNeighboursBase::Lock()
+class CNeighboursLocker
+{
+protected:
+	CNeighboursBase* m_pNeighbours;
+public:
+	CNeighboursLocker(CNeighboursBase* pNeighbours) : m_pNeighbours(pNeighbours)
+	{
+		m_pNeighbours->Lock();
+	}
+	~CNeighboursLocker()
+	{
+		m_pNeighbours->Unlock();
+	}
+};
+
 #endif // NEIGHBOURSBASE_H
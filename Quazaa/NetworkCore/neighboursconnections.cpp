@@ -23,8 +23,10 @@
 */
 
 #include "neighboursconnections.h"
+#include "neighboursworker.h"
 #include "ratecontroller.h"
 #include "g2node.h"
+#include "g2packet.h"
 #include "hostcache.h"
 #include "quazaasettings.h"
 #include "network.h"
@@ -38,12 +40,13 @@
 
 CNeighboursConnections::CNeighboursConnections(QObject* parent) :
 	CNeighboursRouting(parent),
-	m_pController(0),
 	m_nHubsConnectedG2(0),
 	m_nLeavesConnectedG2(0),
 	m_nUnknownInitiated(0),
-	m_nUnknownIncoming(0)
+	m_nUnknownIncoming(0),
+	m_nForwardLatency(0)
 {
+	m_tClock.start();
 }
 CNeighboursConnections::~CNeighboursConnections()
 {
@@ -53,12 +56,26 @@ void CNeighboursConnections::Connect()
 {
 	QMutexLocker l(&m_pSection);
 
-	Q_ASSERT(m_pController == 0);
+	Q_ASSERT(m_lWorkers.isEmpty());
 
-	m_pController = new CRateController(&m_pSection);
-	m_pController->SetDownloadLimit(quazaaSettings.Connection.InSpeed);
-	m_pController->SetUploadLimit(quazaaSettings.Connection.OutSpeed);
-	m_pController->moveToThread(&NetworkThread);
+	int nWorkers = quazaaSettings.Connection.IOThreads;
+	if(nWorkers == 0)
+	{
+		nWorkers = QThread::idealThreadCount();
+	}
+	nWorkers = qBound(1, nWorkers, 32);
+
+	// every thread paces its own sockets, the limits are one budget they all draw from,
+	// so a busy thread can use what idle ones leave
+	m_oDownloadBudget.SetLimit(quazaaSettings.Connection.InSpeed);
+	m_oUploadBudget.SetLimit(quazaaSettings.Connection.OutSpeed);
+
+	for(int i = 0; i < nWorkers; ++i)
+	{
+		CNeighboursWorker* pWorker = new CNeighboursWorker(i);
+		pWorker->Start(&m_oDownloadBudget, &m_oUploadBudget);
+		m_lWorkers.append(pWorker);
+	}
 
 	m_nHubsConnectedG2 = m_nLeavesConnectedG2 = 0;
 
@@ -68,14 +85,19 @@ void CNeighboursConnections::Disconnect()
 {
 	QMutexLocker l(&m_pSection);
 
+	// each thread unlists its own nodes on the way out
+	foreach(CNeighboursWorker* pWorker, m_lWorkers)
+	{
+		pWorker->Stop();
+	}
+
 	while(!m_lNodes.isEmpty())
 	{
-		CNeighbour* pCurr = m_lNodes.takeFirst();
-		delete pCurr;
+		RemoveNode(m_lNodes.first());
 	}
 
-	delete m_pController;
-	m_pController = 0;
+	qDeleteAll(m_lWorkers);
+	m_lWorkers.clear();
 
 	CNeighboursRouting::Disconnect();
 }
@@ -84,31 +106,61 @@ void CNeighboursConnections::AddNode(CNeighbour* pNode)
 {
 	ASSUME_LOCK(m_pSection);
 
-	m_pController->AddSocket(pNode);
+	Q_ASSERT(!m_lWorkers.isEmpty());
+
+	CNeighboursWorker* pWorker = m_lWorkers.first();
+	foreach(CNeighboursWorker* pCandidate, m_lWorkers)
+	{
+		if(pCandidate->m_nNodes < pWorker->m_nNodes)
+		{
+			pWorker = pCandidate;
+		}
+	}
+
+	pNode->m_pWorker = pWorker;
+	pWorker->m_nNodes++;
+	pNode->moveToThread(&pWorker->m_oThread);
+
+	pWorker->m_pSection.lock();
+	pWorker->m_pController->AddSocket(pNode);
+	pWorker->m_pSection.unlock();
 
 	CNeighboursRouting::AddNode(pNode);
+
+	UpdateSnapshot();
 }
 
 void CNeighboursConnections::RemoveNode(CNeighbour* pNode)
 {
 	ASSUME_LOCK(m_pSection);
 
-	m_pController->RemoveSocket(pNode);
+	if(CNeighboursWorker* pWorker = pNode->m_pWorker)
+	{
+		pWorker->m_pSection.lock();
+		pWorker->m_pController->RemoveSocket(pNode);
+		pWorker->m_pSection.unlock();
+
+		pWorker->m_nNodes--;
+		pNode->m_pWorker = 0;
+	}
 
 	CNeighboursRouting::RemoveNode(pNode);
+
+	UpdateSnapshot();
 }
 
-CNeighbour* CNeighboursConnections::RandomNode(DiscoveryProtocol nProtocol, int nType, CNeighbour* pNodeExcept)
+// The node stays allocated as long as the caller holds pSnapshot
+CNeighbour* CNeighboursConnections::RandomNode(const NeighboursSnapshot* pSnapshot, DiscoveryProtocol nProtocol, int nType, CNeighbour* pNodeExcept)
 {
 	QList<CNeighbour*> lNodeList;
 
-	for(QList<CNeighbour*>::iterator i = m_lNodes.begin(); i != m_lNodes.end(); i++)
+	for(QVector<NeighbourStats>::const_iterator i = pSnapshot->m_lNodes.constBegin(); i != pSnapshot->m_lNodes.constEnd(); i++)
 	{
-		if((*i)->m_nState == nsConnected && (*i)->m_nProtocol == nProtocol)
+		if(i->m_nState == nsConnected && i->m_nProtocol == nProtocol)
 		{
-			if(( nProtocol == dpG2 ) && ( ((CG2Node*)(*i))->m_nType == nType ) && ( (*i) != pNodeExcept ))
+			if(( nProtocol == dpG2 ) && ( i->m_nType == nType ) && ( i->m_pNode != pNodeExcept ))
 			{
-				lNodeList.append((*i));
+				lNodeList.append(i->m_pNode);
 			}
 		}
 	}
@@ -123,9 +175,13 @@ CNeighbour* CNeighboursConnections::RandomNode(DiscoveryProtocol nProtocol, int
 	return lNodeList.at(nIndex);
 }
 
+// Reads the live node state, Close() marks the node so the next call picks another one
 void CNeighboursConnections::DisconnectYoungest(DiscoveryProtocol nProtocol, int nType, bool bCore)
 {
+	ASSUME_LOCK(m_pSection);
+
 	CNeighbour* pNode = 0;
+	qint32 tNode = 0;
 
 	bool bKeepManual = true;
 
@@ -135,30 +191,34 @@ void CNeighboursConnections::DisconnectYoungest(DiscoveryProtocol nProtocol, int
 	{
 		for(QList<CNeighbour*>::const_iterator i = m_lNodes.begin(); i != m_lNodes.end(); i++)
 		{
-			if((*i)->m_nState == nsConnected && (*i)->m_nProtocol == nProtocol)
+			if((*i)->m_nProtocol != nProtocol)
 			{
-				if( bKeepManual && !(*i)->m_bAutomatic && tNow - (*i)->m_tConnected < 120 )
-					continue;
+				continue;
+			}
 
-				if( nProtocol == dpG2 )
+			(*i)->m_pSection.lock();
+			bool bCandidate = (*i)->m_nState == nsConnected;
+			qint32 tConnected = (*i)->m_tConnected;
+
+			if( nProtocol == dpG2 )
+			{
+				if( ((CG2Node*)(*i))->m_nType != nType // if node type is not requested type
+					|| (!bCore && ((CG2Node*)(*i))->m_bG2Core) ) // or we don't want to disconnect "our" nodes
 				{
-					if( ((CG2Node*)(*i))->m_nType != nType // if node type is not requested type
-						|| (!bCore && ((CG2Node*)(*i))->m_bG2Core) ) // or we don't want to disconnect "our" nodes
-					{
-						continue;
-					}
+					bCandidate = false;
 				}
+			}
+			(*i)->m_pSection.unlock();
+
+			if(bCandidate)
+			{
+				if( bKeepManual && !(*i)->m_bAutomatic && tNow - tConnected < 120 )
+					continue;
 
-				if(pNode == 0)
+				if(pNode == 0 || tConnected > tNode)
 				{
 					pNode = (*i);
-				}
-				else
-				{
-					if((*i)->m_tConnected > pNode->m_tConnected)
-					{
-						pNode = (*i);
-					}
+					tNode = tConnected;
 				}
 			}
 		}
@@ -188,68 +248,44 @@ void CNeighboursConnections::Maintain()
 
 	CNeighboursRouting::Maintain();
 
-	quint32 nHubsG2 = 0, nLeavesG2 = 0;
+	UpdateSnapshot();
+
+	// node state belongs to the worker threads, count from the copy just taken
+	NeighboursSnapshotPtr pSnapshot = GetSnapshot();
+
+	quint32 nHubsG2 = pSnapshot->m_nHubsConnectedG2, nLeavesG2 = pSnapshot->m_nLeavesConnectedG2;
 	quint32 nCoreHubsG2 = 0, nCoreLeavesG2 = 0;
 	quint32 nUnknown = 0;
 
 	m_nUnknownInitiated = m_nUnknownIncoming = 0;
 
-	foreach(CNeighbour * pNode, m_lNodes)
+	for(QVector<NeighbourStats>::const_iterator itNode = pSnapshot->m_lNodes.constBegin(); itNode != pSnapshot->m_lNodes.constEnd(); ++itNode)
 	{
-		if(pNode->m_nState == nsConnected)
+		if(itNode->m_nState == nsConnected && itNode->m_nProtocol == dpG2 && itNode->m_nType != G2_UNKNOWN)
 		{
-			switch(pNode->m_nProtocol)
+			if(itNode->m_bG2Core)
 			{
-			case dpG2:
-				switch(((CG2Node*)pNode)->m_nType)
+				if(itNode->m_nType == G2_HUB)
 				{
-				case G2_UNKNOWN:
-					nUnknown++;
-					if( pNode->m_bInitiated )
-						m_nUnknownInitiated++;
-					else
-						m_nUnknownIncoming++;
-
-					break;
-				case G2_HUB:
-					nHubsG2++;
-					if(((CG2Node*)pNode)->m_bG2Core)
-					{
-						nCoreHubsG2++;
-					}
-					break;
-				case G2_LEAF:
-					nLeavesG2++;
-					if(((CG2Node*)pNode)->m_bG2Core)
-					{
-						nCoreLeavesG2++;
-					}
+					nCoreHubsG2++;
 				}
-				break;
-			default:
-				nUnknown++;
-				if( pNode->m_bInitiated )
-					m_nUnknownInitiated++;
 				else
-					m_nUnknownIncoming++;
-
-				break;
+				{
+					nCoreLeavesG2++;
+				}
 			}
 		}
 		else
 		{
 			nUnknown++;
 
-			if( pNode->m_bInitiated )
+			if( itNode->m_bInitiated )
 				m_nUnknownInitiated++;
 			else
 				m_nUnknownIncoming++;
 		}
 	}
 
-	m_nHubsConnectedG2 = nHubsG2;
-	m_nLeavesConnectedG2 = nLeavesG2;
-
 	if(!Neighbours.IsG2Hub())
 	{
 		if(nHubsG2 > quazaaSettings.Gnutella2.NumHubs)
@@ -293,7 +329,7 @@ void CNeighboursConnections::Maintain()
 							continue;
 						}
 						ConnectTo(pHost->m_oAddress, dpG2);
-						pHost->m_tLastConnect = tNow;
+						hostCache.onConnect( pHost, tNow );
 					}
 					else
 					{
@@ -363,7 +399,7 @@ void CNeighboursConnections::Maintain()
 						}
 
 						ConnectTo( pHost->m_oAddress, dpG2 );
-						pHost->m_tLastConnect = tNow;
+						hostCache.onConnect( pHost, tNow );
 					}
 					else
 					{
@@ -392,12 +428,144 @@ void CNeighboursConnections::Maintain()
 
 quint32 CNeighboursConnections::DownloadSpeed()
 {
-	return m_pController ? m_pController->DownloadSpeed() : 0;
+	quint32 nSpeed = 0;
+	foreach(CNeighboursWorker* pWorker, m_lWorkers)
+	{
+		nSpeed += pWorker->DownloadSpeed();
+	}
+	return nSpeed;
 }
 
 quint32 CNeighboursConnections::UploadSpeed()
 {
-	return m_pController ? m_pController->UploadSpeed() : 0;
+	quint32 nSpeed = 0;
+	foreach(CNeighboursWorker* pWorker, m_lWorkers)
+	{
+		nSpeed += pWorker->UploadSpeed();
+	}
+	return nSpeed;
+}
+
+// Publishes a fresh copy of the neighbour list, readers keep the old one as long as they hold it.
+// The G2 hub and leaf counts are taken here as well.
+void CNeighboursConnections::UpdateSnapshot()
+{
+	ASSUME_LOCK(m_pSection);
+
+	quint32 tNow = time(0);
+	quint32 nHubsG2 = 0, nLeavesG2 = 0;
+
+	NeighboursSnapshot* pSnapshot = new NeighboursSnapshot();
+	pSnapshot->m_lNodes.reserve(m_lNodes.size());
+	pSnapshot->m_nDownloadSpeed = DownloadSpeed();
+	pSnapshot->m_nUploadSpeed = UploadSpeed();
+
+	foreach(CNeighbour* pNode, m_lNodes)
+	{
+		NeighbourStats oStats;
+		oStats.m_pNode = pNode;
+		oStats.m_nProtocol = pNode->m_nProtocol;
+		oStats.m_bInitiated = pNode->m_bInitiated;
+		oStats.m_bAutomatic = pNode->m_bAutomatic;
+
+		pNode->m_pSection.lock();
+		oStats.m_oAddress = pNode->address();
+		oStats.m_nState = pNode->m_nState;
+		oStats.m_nType = G2_UNKNOWN;
+		oStats.m_tConnected = tNow - pNode->m_tConnected;
+		oStats.m_sHandshake = pNode->m_sHandshake;
+		oStats.m_sUserAgent = pNode->m_sUserAgent;
+		oStats.m_nPacketsIn = pNode->m_nPacketsIn;
+		oStats.m_nPacketsOut = pNode->m_nPacketsOut;
+		oStats.m_nPingsWaiting = pNode->m_nPingsWaiting;
+		oStats.m_tRTT = pNode->m_tRTT;
+		oStats.m_bG2Core = false;
+		oStats.m_bCachedKeys = false;
+		oStats.m_nLeafCount = 0;
+		oStats.m_nLeafMax = 0;
+
+		if(pNode->m_nProtocol == dpG2)
+		{
+			CG2Node* pG2Node = (CG2Node*)pNode;
+			oStats.m_nType = pG2Node->m_nType;
+			oStats.m_bG2Core = pG2Node->m_bG2Core;
+			oStats.m_bCachedKeys = pG2Node->m_bCachedKeys;
+			oStats.m_nLeafCount = pG2Node->m_nLeafCount;
+			oStats.m_nLeafMax = pG2Node->m_nLeafMax;
+		}
+		pNode->m_pSection.unlock();
+
+		// meters and compression totals are updated by the worker while it transfers
+		if(pNode->m_pWorker)
+		{
+			pNode->m_pWorker->m_pSection.lock();
+		}
+		oStats.m_nBandwidthIn = pNode->m_mInput.Usage();
+		oStats.m_nBandwidthOut = pNode->m_mOutput.Usage();
+		oStats.m_nBytesReceived = pNode->m_mInput.m_nTotal;
+		oStats.m_nBytesSent = pNode->m_mOutput.m_nTotal;
+		oStats.m_nCompressionIn = pNode->GetTotalInDecompressed();
+		oStats.m_nCompressionOut = pNode->GetTotalOutCompressed();
+		if(pNode->m_pWorker)
+		{
+			pNode->m_pWorker->m_pSection.unlock();
+		}
+
+		if(oStats.m_nState == nsConnected && oStats.m_nProtocol == dpG2)
+		{
+			if(oStats.m_nType == G2_HUB)
+			{
+				nHubsG2++;
+			}
+			else if(oStats.m_nType == G2_LEAF)
+			{
+				nLeavesG2++;
+			}
+		}
+
+		// released again when the snapshot goes
+		pNode->AddRef();
+
+		pSnapshot->m_lIndex.insert(pNode, pSnapshot->m_lNodes.size());
+		pSnapshot->m_lAddresses.insert(oStats.m_oAddress, pSnapshot->m_lNodes.size());
+		pSnapshot->m_lNodes.append(oStats);
+	}
+
+	m_nHubsConnectedG2 = pSnapshot->m_nHubsConnectedG2 = nHubsG2;
+	m_nLeavesConnectedG2 = pSnapshot->m_nLeavesConnectedG2 = nLeavesG2;
+
+	NeighboursSnapshotPtr pNew(pSnapshot);
+
+	m_pSnapshotSection.lock();
+	m_pSnapshot.swap(pNew);
+	m_pSnapshotSection.unlock();
+
+	// the previous snapshot is released here, outside m_pSnapshotSection
+}
+
+// Samples the delay of a buffered packet that has just left its send queue.
+// Called from the I/O threads without m_pSection.
+void CNeighboursConnections::OnPacketSent(G2Packet* pPacket)
+{
+	if(pPacket->m_tQueued == 0)
+	{
+		return;
+	}
+
+	// 1/8 gain, as for TCP's smoothed RTT
+	int nSample = int(Clock() - pPacket->m_tQueued);
+	int nOld, nNew;
+	do
+	{
+		nOld = m_nForwardLatency.fetchAndAddRelaxed(0);
+		nNew = nOld + (nSample - nOld) / 8;
+	}
+	while(!m_nForwardLatency.testAndSetRelaxed(nOld, nNew));
+}
+
+quint32 CNeighboursConnections::ForwardLatency()
+{
+	return m_nForwardLatency.fetchAndAddRelaxed(0);
 }
 
 CNeighbour* CNeighboursConnections::OnAccept(CNetworkConnection* pConn)
@@ -423,7 +591,6 @@ CNeighbour* CNeighboursConnections::OnAccept(CNetworkConnection* pConn)
 	CG2Node* pNew = new CG2Node();
 	pNew->AttachTo(pConn);
 	AddNode(pNew);
-	pNew->moveToThread(&NetworkThread);
 
 	m_pSection.unlock();
 
@@ -447,7 +614,6 @@ CNeighbour* CNeighboursConnections::ConnectTo(CEndPoint& oAddress, DiscoveryProt
 
 	pNode->m_bAutomatic = bAutomatic;
 	pNode->ConnectTo(oAddress);
-	pNode->moveToThread(&NetworkThread);
 	AddNode(pNode);
 	return pNode;
 }
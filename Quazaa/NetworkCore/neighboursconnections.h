@@ -27,15 +27,24 @@
 #define NEIGHBOURSCONNECTIONS_H
 
 #include "neighboursrouting.h"
+#include "ratecontroller.h"
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
 
 class CNetworkConnection;
-class CRateController;
+class CNeighboursWorker;
 
 class CNeighboursConnections : public CNeighboursRouting
 {
 	Q_OBJECT
 protected:
-	CRateController* m_pController;
+	QList<CNeighboursWorker*> m_lWorkers;	// I/O threads, nodes go to the least loaded one
+	CRateBudget		m_oDownloadBudget;	// Connection.InSpeed, drawn by all workers
+	CRateBudget		m_oUploadBudget;	// Connection.OutSpeed, drawn by all workers
+
+	QElapsedTimer	m_tClock;
+	QAtomicInt		m_nForwardLatency;	// smoothed time G2 packets spend inside this node, in ms
 public:
 	quint32 m_nHubsConnectedG2;
 	quint32 m_nLeavesConnectedG2;
@@ -51,13 +60,23 @@ public:
 	void AddNode(CNeighbour* pNode);
 	void RemoveNode(CNeighbour* pNode);
 
-	CNeighbour* RandomNode(DiscoveryProtocol nProtocol, int nType, CNeighbour* pNodeExcept);
+	CNeighbour* RandomNode(const NeighboursSnapshot* pSnapshot, DiscoveryProtocol nProtocol, int nType, CNeighbour* pNodeExcept);
 
 	void DisconnectYoungest(DiscoveryProtocol nProtocol, int nType = 0, bool bCore = false);
 
 	virtual quint32 DownloadSpeed();
 	virtual quint32 UploadSpeed();
 
+	inline qint64 Clock() const
+	{
+		return m_tClock.elapsed();
+	}
+	void OnPacketSent(G2Packet* pPacket);
+	quint32 ForwardLatency();
+protected:
+	void UpdateSnapshot();
+public:
+
 signals:
 
 public slots:
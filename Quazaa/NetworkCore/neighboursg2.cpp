@@ -123,11 +123,12 @@ void CNeighboursG2::Maintain()
 			m_bNeedLNI = false;
 			m_nLNIWait = quazaaSettings.Gnutella2.LNIMinimumUpdate;
 
-			foreach(CNeighbour * pNode, m_lNodes)
+			NeighboursSnapshotPtr pSnapshot = GetSnapshot();
+			for(QVector<NeighbourStats>::const_iterator itNode = pSnapshot->m_lNodes.constBegin(); itNode != pSnapshot->m_lNodes.constEnd(); ++itNode)
 			{
-				if(pNode->m_nProtocol == dpG2 && pNode->m_nState == nsConnected)
+				if(itNode->m_nProtocol == dpG2 && itNode->m_nState == nsConnected)
 				{
-					((CG2Node*)pNode)->SendLNI();
+					((CG2Node*)itNode->m_pNode)->SendLNI();
 				}
 			}
 		}
@@ -200,22 +201,25 @@ void CNeighboursG2::DispatchKHL()
 
 	pKHL->WritePacket( "TS", 4 )->WriteIntLE<quint32>( tNow );
 
-	foreach ( CNeighbour * pNode, m_lNodes )
+	NeighboursSnapshotPtr pSnapshot = GetSnapshot();
+
+	for ( QVector<NeighbourStats>::const_iterator itNode = pSnapshot->m_lNodes.constBegin(); itNode != pSnapshot->m_lNodes.constEnd(); ++itNode )
 	{
-		if ( pNode->m_nProtocol != dpG2 )
+		if ( itNode->m_nProtocol != dpG2 )
 		{
 			continue;
 		}
 
-		if ( pNode->m_nState == nsConnected && ((CG2Node*)pNode)->m_nType == G2_HUB )
+		if ( itNode->m_nState == nsConnected && itNode->m_nType == G2_HUB )
 		{
-			if ( pNode->m_oAddress.protocol() == QAbstractSocket::IPv4Protocol )
+			CEndPoint oAddress = itNode->m_oAddress;
+			if ( oAddress.protocol() == QAbstractSocket::IPv4Protocol )
 			{
-				pKHL->WritePacket( "NH", 6 )->WriteHostAddress( &pNode->m_oAddress );
+				pKHL->WritePacket( "NH", 6 )->WriteHostAddress( &oAddress );
 			}
 			else
 			{
-				pKHL->WritePacket( "NH", 18 )->WriteHostAddress( &pNode->m_oAddress );
+				pKHL->WritePacket( "NH", 18 )->WriteHostAddress( &oAddress );
 			}
 		}
 	}
@@ -246,11 +250,11 @@ void CNeighboursG2::DispatchKHL()
 
 	hostCache.m_pSection.unlock();
 
-	foreach ( CNeighbour * pNode, m_lNodes )
+	for ( QVector<NeighbourStats>::const_iterator itNode = pSnapshot->m_lNodes.constBegin(); itNode != pSnapshot->m_lNodes.constEnd(); ++itNode )
 	{
-		if ( pNode->m_nState == nsConnected && pNode->m_nProtocol == dpG2 )
+		if ( itNode->m_nState == nsConnected && itNode->m_nProtocol == dpG2 )
 		{
-			((CG2Node*)pNode)->SendPacket( pKHL, false, false );
+			((CG2Node*)itNode->m_pNode)->SendPacket( pKHL, false, false );
 		}
 	}
 
@@ -289,24 +293,27 @@ bool CNeighboursG2::SwitchG2ClientMode(G2NodeType nRequestedMode)
 	return true;
 }
 
+// Called while handshaking, from the node's worker
 bool CNeighboursG2::NeedMoreG2(G2NodeType nType)
 {
+	NeighboursSnapshotPtr pSnapshot = GetSnapshot();
+
 	if(nType == G2_HUB)   // Need hubs?
 	{
 		if(IsG2Hub())   // If we are a hub.
 		{
-			return (m_nHubsConnectedG2 < quazaaSettings.Gnutella2.NumPeers);
+			return (pSnapshot->m_nHubsConnectedG2 < quazaaSettings.Gnutella2.NumPeers);
 		}
 		else    // If we are a leaf.
 		{
-			return (m_nLeavesConnectedG2 < quazaaSettings.Gnutella2.NumHubs);
+			return (pSnapshot->m_nLeavesConnectedG2 < quazaaSettings.Gnutella2.NumHubs);
 		}
 	}
 	else // Need leaves?
 	{
 		if(IsG2Hub())      // If we are a hub.
 		{
-			return (m_nLeavesConnectedG2 < quazaaSettings.Gnutella2.NumLeafs);
+			return (pSnapshot->m_nLeavesConnectedG2 < quazaaSettings.Gnutella2.NumLeafs);
 		}
 	}
 
@@ -330,6 +337,8 @@ void CNeighboursG2::HubBalancing()
 
 	bool bHasQHubs = false;
 
+	NeighboursSnapshotPtr pSnapshot = GetSnapshot();
+
 	if(m_nClientMode == G2_LEAF)
 	{
 		// we're a leaf
@@ -340,13 +349,13 @@ void CNeighboursG2::HubBalancing()
 
 		quint32 nLeaves = 0, nCapacity = 0;
 
-		foreach(CNeighbour * pNode, m_lNodes)
+		for(QVector<NeighbourStats>::const_iterator itNode = pSnapshot->m_lNodes.constBegin(); itNode != pSnapshot->m_lNodes.constEnd(); ++itNode)
 		{
-			if(pNode->m_nState == nsConnected && pNode->m_nProtocol == dpG2 && ((CG2Node*)pNode)->m_nType == G2_HUB)
+			if(itNode->m_nState == nsConnected && itNode->m_nProtocol == dpG2 && itNode->m_nType == G2_HUB)
 			{
-				nLeaves += ((CG2Node*)pNode)->m_nLeafCount;
-				nCapacity += ((CG2Node*)pNode)->m_nLeafMax;
-				bHasQHubs |= ((CG2Node*)pNode)->m_bG2Core;
+				nLeaves += itNode->m_nLeafCount;
+				nCapacity += itNode->m_nLeafMax;
+				bHasQHubs |= itNode->m_bG2Core;
 			}
 		}
 
@@ -379,13 +388,13 @@ void CNeighboursG2::HubBalancing()
 		// We're a hub.
 		quint32 nLeaves = 0, nCapacity = 0;
 
-		foreach(CNeighbour * pNode, m_lNodes)
+		for(QVector<NeighbourStats>::const_iterator itNode = pSnapshot->m_lNodes.constBegin(); itNode != pSnapshot->m_lNodes.constEnd(); ++itNode)
 		{
-			if(pNode->m_nState == nsConnected && pNode->m_nProtocol == dpG2 && ((CG2Node*)pNode)->m_nType == G2_HUB)
+			if(itNode->m_nState == nsConnected && itNode->m_nProtocol == dpG2 && itNode->m_nType == G2_HUB)
 			{
-				nLeaves += ((CG2Node*)pNode)->m_nLeafCount;
-				nCapacity += ((CG2Node*)pNode)->m_nLeafMax;
-				bHasQHubs |= ((CG2Node*)pNode)->m_bG2Core;
+				nLeaves += itNode->m_nLeafCount;
+				nCapacity += itNode->m_nLeafMax;
+				bHasQHubs |= itNode->m_bG2Core;
 			}
 		}
 
@@ -411,13 +420,16 @@ void CNeighboursG2::HubBalancing()
 	}
 }
 
+// Reads the published snapshot, so workers call it without m_pSection
 G2Packet* CNeighboursG2::CreateQueryAck(QUuid oGUID, bool bWithHubs, CNeighbour* pExcept, bool bDone)
 {
+	NeighboursSnapshotPtr pSnapshot = GetSnapshot();
+
 	G2Packet* pPacket = G2Packet::New("QA", true);
 
 	pPacket->WritePacket("TS", 4)->WriteIntLE<quint32>( common::getTNowUTC() );
 	pPacket->WritePacket("FR", (Network.m_oAddress.protocol() == QAbstractSocket::IPv4Protocol ? 6 : 18))->WriteHostAddress(&Network.m_oAddress);
-	pPacket->WritePacket("RA", 4)->WriteIntLE<quint32>(30 + 30 * m_nHubsConnectedG2);
+	pPacket->WritePacket("RA", 4)->WriteIntLE<quint32>(30 + 30 * pSnapshot->m_nHubsConnectedG2);
 	pPacket->WritePacket("V", 4)->WriteString(CQuazaaGlobals::VENDOR_CODE(), false);
 
 	if(bDone)
@@ -426,14 +438,15 @@ G2Packet* CNeighboursG2::CreateQueryAck(QUuid oGUID, bool bWithHubs, CNeighbour*
 
 		if(bWithHubs)
 		{
-			pPacket->WriteIntLE<quint16>(m_nLeavesConnectedG2);
+			pPacket->WriteIntLE<quint16>(pSnapshot->m_nLeavesConnectedG2);
 
-			foreach(CNeighbour * pNode, m_lNodes)
+			for(QVector<NeighbourStats>::const_iterator itNode = pSnapshot->m_lNodes.constBegin(); itNode != pSnapshot->m_lNodes.constEnd(); ++itNode)
 			{
-				if(pNode->m_nProtocol == dpG2 && pNode->m_nState == nsConnected && ((CG2Node*)pNode)->m_nType == G2_HUB && pNode != pExcept)
+				if(itNode->m_nProtocol == dpG2 && itNode->m_nState == nsConnected && itNode->m_nType == G2_HUB && itNode->m_pNode != pExcept)
 				{
-					pPacket->WritePacket("D", (pNode->m_oAddress.protocol() == QAbstractSocket::IPv4Protocol ? 8 : 20))->WriteHostAddress(&pNode->m_oAddress);
-					pPacket->WriteIntLE<quint16>(((CG2Node*)pNode)->m_nLeafCount);
+					CEndPoint oAddress = itNode->m_oAddress;
+					pPacket->WritePacket("D", (oAddress.protocol() == QAbstractSocket::IPv4Protocol ? 8 : 20))->WriteHostAddress(&oAddress);
+					pPacket->WriteIntLE<quint16>(itNode->m_nLeafCount);
 				}
 			}
 
@@ -29,6 +29,8 @@
 #include "g2node.h"
 #include "g2packet.h"
 #include "queryhashtable.h"
+#include "queryhashgroup.h"
+#include "queryhashmaster.h"
 
 #include "debug_new.h"
 
@@ -40,44 +42,69 @@ CNeighboursRouting::~CNeighboursRouting()
 {
 }
 
+// Runs on the worker that parsed the query, reads the published snapshot
+// instead of taking m_pSection; the snapshot keeps its nodes allocated
 void CNeighboursRouting::RouteQuery(CQueryPtr pQuery, G2Packet *pPacket, CNeighbour* pFrom, bool bToHubs)
 {
-	quint32 tNow = time(0);
 	quint32 nCount = 0, nHubs = 0, nLeaves = 0;
 
-	foreach(CNeighbour* pNode, m_lNodes)
+	NeighboursSnapshotPtr pSnapshot = GetSnapshot();
+	QList<CG2Node*> lTargets;
+
+	QueryHashMaster.m_pSection.lock();
+
+	// resolves every grouped leaf table at once
+	QueryHashMaster.MatchQuery(pQuery);
+
+	for(QVector<NeighbourStats>::const_iterator itNode = pSnapshot->m_lNodes.constBegin(); itNode != pSnapshot->m_lNodes.constEnd(); ++itNode)
 	{
-		if( pNode != pFrom && pNode->m_nState == nsConnected && pNode->m_nProtocol == dpG2 && tNow - pNode->m_tConnected > 30 )
+		if( itNode->m_pNode != pFrom && itNode->m_nState == nsConnected && itNode->m_nProtocol == dpG2 && itNode->m_tConnected > 30 )
 		{
-			CG2Node* pG2 = static_cast<CG2Node*>(pNode);
+			CG2Node* pG2 = static_cast<CG2Node*>(itNode->m_pNode);
 
-			if( !bToHubs && pG2->m_nType == G2_HUB )
+			if( !bToHubs && itNode->m_nType == G2_HUB )
 			{
 				continue;
 			}
 
 			if( pG2->m_pRemoteTable != 0 && pG2->m_pRemoteTable->m_bLive )
 			{
-				if( !pG2->m_pRemoteTable->CheckQuery(pQuery) )
+				CQueryHashTable* pTable = pG2->m_pRemoteTable;
+
+				if( pTable->m_pGroup && pTable->m_pGroup->m_pLeaves )
+				{
+					if( !(pTable->m_pGroup->m_nMatch & (Q_UINT64_C(1) << pTable->m_nGroupBit)) )
+					{
+						continue;
+					}
+				}
+				else if( !pTable->CheckQuery(pQuery) )
 				{
 					continue;
 				}
 			}
-			else if( pG2->m_nType == G2_LEAF )
+			else if( itNode->m_nType == G2_LEAF )
 			{
 				continue;
 			}
 
-			pG2->SendPacket(pPacket, true, false);
-			nCount++;
+			lTargets.append(pG2);
 
-			if( pG2->m_nType == G2_HUB )
+			if( itNode->m_nType == G2_HUB )
 				nHubs++;
 			else
 				nLeaves++;
 		}
 	}
 
+	QueryHashMaster.m_pSection.unlock();
+
+	foreach(CG2Node* pG2, lTargets)
+	{
+		pG2->SendPacket(pPacket, true, false);
+		nCount++;
+	}
+
 #if LOG_QUERY_FORWARDING
 	qDebug() << "G2 Query forwarded to " << nCount << "nodes (hubs:" << nHubs << "leaves:" << nLeaves << ")";
 #endif
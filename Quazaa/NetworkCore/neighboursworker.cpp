@@ -0,0 +1,108 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "neighboursworker.h"
+#include "neighbours.h"
+#include "neighbour.h"
+#include "ratecontroller.h"
+
+#include <QCoreApplication>
+
+#include "debug_new.h"
+
+CNeighboursWorker::CNeighboursWorker(int nIndex, QObject* parent) :
+	QObject(parent),
+	m_pController(0),
+	m_nNodes(0),
+	m_nIndex(nIndex)
+{
+}
+CNeighboursWorker::~CNeighboursWorker()
+{
+	Q_ASSERT(m_pController == 0);
+}
+
+void CNeighboursWorker::Start(CRateBudget* pDownloadBudget, CRateBudget* pUploadBudget)
+{
+	ASSUME_LOCK(Neighbours.m_pSection);
+
+	Q_ASSERT(m_pController == 0);
+
+	m_pController = new CRateController(&m_pSection);
+	// a single tick may ask for the whole limit, the budgets decide what it gets
+	m_pController->SetDownloadLimit(pDownloadBudget->Limit());
+	m_pController->SetUploadLimit(pUploadBudget->Limit());
+	m_pController->SetBudget(pDownloadBudget, pUploadBudget);
+	m_pController->moveToThread(&m_oThread);
+
+	// CThread waits on Neighbours.m_pSection, so our CleanupThread() runs with it held
+	m_oThread.start(QString("Neighbours #%1").arg(m_nIndex + 1), &Neighbours.m_pSection, this);
+}
+void CNeighboursWorker::Stop()
+{
+	ASSUME_LOCK(Neighbours.m_pSection);
+
+	if(m_oThread.isRunning())
+	{
+		m_oThread.exit(0);
+	}
+}
+
+quint32 CNeighboursWorker::DownloadSpeed()
+{
+	return m_pController ? m_pController->DownloadSpeed() : 0;
+}
+quint32 CNeighboursWorker::UploadSpeed()
+{
+	return m_pController ? m_pController->UploadSpeed() : 0;
+}
+
+void CNeighboursWorker::SetupThread()
+{
+	systemLog.postLog(LogSeverity::Debug, QString("Neighbours I/O thread %1 started").arg(m_nIndex + 1));
+}
+// Runs in the worker thread with Neighbours.m_pSection held
+void CNeighboursWorker::CleanupThread()
+{
+	QList<CNeighbour*> lNodes;
+	for(QList<CNeighbour*>::iterator itNode = Neighbours.begin(); itNode != Neighbours.end(); ++itNode)
+	{
+		if((*itNode)->m_pWorker == this)
+		{
+			lNodes.append(*itNode);
+		}
+	}
+
+	// snapshots may still list them, so they are deleted later on the main thread
+	foreach(CNeighbour* pNode, lNodes)
+	{
+		pNode->moveToThread(qApp->thread());
+		Neighbours.RemoveNode(pNode);
+	}
+
+	delete m_pController;
+	m_pController = 0;
+
+	moveToThread(qApp->thread());
+}
@@ -0,0 +1,65 @@
+/*
+** neighboursworker.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef NEIGHBOURSWORKER_H
+#define NEIGHBOURSWORKER_H
+
+#include <QObject>
+#include <QMutex>
+
+#include "thread.h"
+
+class CRateController;
+class CRateBudget;
+
+// One of the I/O threads neighbour sockets are spread over.
+// Socket reads, writes and (de)compression of its nodes run here under m_pSection,
+// packet handling and routing run here as well, without Neighbours.m_pSection.
+class CNeighboursWorker : public QObject
+{
+	Q_OBJECT
+public:
+	CThread				m_oThread;
+	QMutex				m_pSection;		// guards m_pController's socket sets
+	CRateController*	m_pController;
+	int					m_nNodes;		// nodes assigned to this thread, guarded by Neighbours.m_pSection
+	int					m_nIndex;
+
+public:
+	CNeighboursWorker(int nIndex, QObject* parent = 0);
+	~CNeighboursWorker();
+
+	// Both are called with Neighbours.m_pSection held
+	void Start(CRateBudget* pDownloadBudget, CRateBudget* pUploadBudget);
+	void Stop();
+
+	quint32 DownloadSpeed();
+	quint32 UploadSpeed();
+
+public slots:
+	void SetupThread();
+	void CleanupThread();
+};
+
+#endif // NEIGHBOURSWORKER_H
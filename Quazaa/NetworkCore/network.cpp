@@ -86,8 +86,6 @@ void CNetwork::Connect()
 
 	NetworkThread.start("Network", &m_pSection, this);
 
-	Datagrams.moveToThread(&NetworkThread);
-
 	SearchManager.moveToThread(&NetworkThread);
 	Neighbours.moveToThread(&NetworkThread);
 	Neighbours.Connect();
@@ -163,7 +161,10 @@ void CNetwork::OnSecondTimer()
 
 	if(!QueryHashMaster.IsValid())
 	{
+		// workers patch the master and groups under its own lock
+		QueryHashMaster.m_pSection.lock();
 		QueryHashMaster.Build();
+		QueryHashMaster.m_pSection.unlock();
 	}
 
 	Neighbours.Maintain();
@@ -203,30 +204,25 @@ bool CNetwork::IsConnectedTo(CEndPoint /*addr*/)
 	return false;
 }
 
-bool CNetwork::RoutePacket(QUuid& pTargetGUID, G2Packet* pPacket, bool bLockNeighbours, bool bBuffered)
+// The snapshot is taken before the route lookup: a node it lists stays allocated
+// while it is held, and a node deleted earlier has already left the route table
+bool CNetwork::RoutePacket(QUuid& pTargetGUID, G2Packet* pPacket, bool bBuffered)
 {
 	CG2Node* pNode = 0;
 	CEndPoint pAddr;
 
+	NeighboursSnapshotPtr pSnapshot = Neighbours.GetSnapshot();
+
 	if(m_oRoutingTable.Find(pTargetGUID, &pNode, &pAddr))
 	{
 		if(pNode)
 		{
-			if( bLockNeighbours )
-			{
-				Neighbours.m_pSection.lock();
-			}
-
-			if( Neighbours.NeighbourExists(pNode) )
+			if( const NeighbourStats* pStats = pSnapshot->Find(pNode) )
 			{
 				pNode->SendPacket(pPacket, bBuffered, false);
-				systemLog.postLog(LogSeverity::Debug, QString("CNetwork::RoutePacket %1 Packet: %2 routed to neighbour: %3").arg(pTargetGUID.toString()).arg(pPacket->GetType()).arg(pNode->m_oAddress.toString().toLocal8Bit().constData()));
+				systemLog.postLog(LogSeverity::Debug, QString("CNetwork::RoutePacket %1 Packet: %2 routed to neighbour: %3").arg(pTargetGUID.toString()).arg(pPacket->GetType()).arg(pStats->m_oAddress.toString().toLocal8Bit().constData()));
 			}
 
-			if( bLockNeighbours )
-			{
-				Neighbours.m_pSection.unlock();
-			}
 			return true;
 		}
 		else if(pAddr.isValid())
@@ -250,11 +246,20 @@ bool CNetwork::RoutePacket(G2Packet* pPacket, CG2Node* pNbr)
 		CG2Node* pNode = 0;
 		CEndPoint pAddr;
 
+		NeighboursSnapshotPtr pSnapshot = Neighbours.GetSnapshot();
+
 		if(m_oRoutingTable.Find(pGUID, &pNode, &pAddr))
 		{
 			bool bForwardTCP = false;
 			bool bForwardUDP = false;
 
+			// only nodes the snapshot lists are safe to touch
+			const NeighbourStats* pStats = pNode ? pSnapshot->Find(pNode) : 0;
+			if(pNode && !pStats)
+			{
+				pNode = 0;
+			}
+
 			if(pNbr)
 			{
 				if(pNbr->m_nType == G2_LEAF)    // if received from leaf - can forward anywhere
@@ -263,7 +268,7 @@ bool CNetwork::RoutePacket(G2Packet* pPacket, CG2Node* pNbr)
 				}
 				else    // if received from a hub - can be forwarded to leaf
 				{
-					if(pNode && pNode->m_nType == G2_LEAF)
+					if(pNode && pStats->m_nType == G2_LEAF)
 					{
 						bForwardTCP = true;
 					}
@@ -307,3 +312,8 @@ void CNetwork::OnSharesReady()
 	m_bSharesReady = true;
 }
 
+// Packets the UDP thread received and left for us, see CDatagrams::PostToNetwork()
+void CNetwork::OnDatagramTasks()
+{
+	Datagrams.ProcessNetworkTasks();
+}
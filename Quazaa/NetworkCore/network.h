@@ -66,7 +66,7 @@ public:
 	bool IsListening();
 	bool IsFirewalled();
 
-	bool RoutePacket(QUuid& pTargetGUID, G2Packet* pPacket, bool bLockNeighbours = false, bool bBuffered = true);
+	bool RoutePacket(QUuid& pTargetGUID, G2Packet* pPacket, bool bBuffered = true);
 	bool RoutePacket(G2Packet* pPacket, CG2Node* pNbr = 0);
 
 	inline CEndPoint GetLocalAddress()
@@ -86,6 +86,7 @@ public slots:
 	void ConnectTo(CEndPoint& addr);
 
 	void OnSharesReady();
+	void OnDatagramTasks();
 
 signals:
 	void LocalAddressChanged();
@@ -27,6 +27,12 @@
 #include <QTcpSocket>
 #include <QMetaType>
 
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#endif
+
 #include "buffer.h"
 
 #include "debug_new.h"
@@ -49,6 +55,8 @@ CNetworkConnection::CNetworkConnection(QObject* parent)
 	m_bInitiated = false;
 	m_bConnected = false;
 	m_tConnected = 0;
+
+	m_nTransferClass = tcControl;
 }
 CNetworkConnection::~CNetworkConnection()
 {
@@ -259,6 +267,94 @@ qint64 CNetworkConnection::writeToNetwork(qint64 nBytes)
 
 	return nBytesWritten;
 }
+// Writes up to nMaxSize bytes taken from the segments in order, without first
+// collecting them in the output buffer. Returns the number of bytes written.
+qint64 CNetworkConnection::writeVectored(const IOSegment* pSegments, int nSegments, qint64 nMaxSize)
+{
+	Q_ASSERT(m_pSocket != 0);
+	Q_ASSERT(nSegments <= IO_MAX_SEGMENTS);
+
+	qint64 nWritten = 0;
+
+#ifdef Q_OS_UNIX
+	// Hand the segments to the kernel in one call, but only if the socket has nothing
+	// buffered internally, or we would reorder the stream.
+	if(m_pSocket->state() == QAbstractSocket::ConnectedState && m_pSocket->bytesToWrite() == 0)
+	{
+		struct iovec arrVector[IO_MAX_SEGMENTS];
+		int nVector = 0;
+		qint64 nQueued = 0;
+
+		for(int i = 0; i < nSegments && nQueued < nMaxSize; ++i)
+		{
+			if(pSegments[i].m_nLength == 0)
+			{
+				continue;
+			}
+
+			quint32 nLength = qMin<qint64>(pSegments[i].m_nLength, nMaxSize - nQueued);
+			arrVector[nVector].iov_base = const_cast<char*>(pSegments[i].m_pData);
+			arrVector[nVector].iov_len = nLength;
+			nQueued += nLength;
+			nVector++;
+		}
+
+		if(nVector == 0)
+		{
+			return 0;
+		}
+
+		ssize_t nRet = ::writev(m_pSocket->socketDescriptor(), arrVector, nVector);
+
+		if(nRet >= 0)
+		{
+			m_mOutput.Add(nRet);
+			return nRet;
+		}
+		else if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		{
+			return 0;
+		}
+
+		// other errors are left for QTcpSocket to report
+	}
+#endif
+
+	for(int i = 0; i < nSegments && nWritten < nMaxSize; ++i)
+	{
+		if(pSegments[i].m_nLength == 0)
+		{
+			continue;
+		}
+
+		qint64 nLength = qMin<qint64>(pSegments[i].m_nLength, nMaxSize - nWritten);
+		qint64 nRet = m_pSocket->write(pSegments[i].m_pData, nLength);
+
+		if(nRet <= 0)
+		{
+			if(nWritten == 0)
+			{
+				return nRet;
+			}
+			break;
+		}
+
+		nWritten += nRet;
+
+		if(nRet < nLength)
+		{
+			break;
+		}
+	}
+
+	if(nWritten > 0)
+	{
+		m_mOutput.Add(nWritten);
+	}
+
+	return nWritten;
+}
+
 qint64 CNetworkConnection::readData(char* data, qint64 maxlen)
 {
 	Q_ASSERT(m_pInput != 0);
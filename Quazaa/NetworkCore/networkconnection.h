@@ -35,6 +35,16 @@ class QThread;
 
 #include "buffer.h"
 
+// One contiguous piece of data for a gathered write
+struct IOSegment
+{
+	const char*	m_pData;
+	quint32		m_nLength;
+};
+
+// Maximum number of segments passed to a single gathered write
+#define IO_MAX_SEGMENTS 32
+
 class TCPBandwidthMeter
 {
 public:
@@ -70,6 +80,8 @@ public:
 	bool    m_bConnected;
 	qint32  m_tConnected;
 
+	TransferClass m_nTransferClass;	// traffic class in the rate controller
+
 public:
 	CNetworkConnection(QObject* parent = 0);
 	virtual ~CNetworkConnection();
@@ -111,6 +123,8 @@ protected:
 	virtual qint64 readFromNetwork(qint64 nBytes);
 	virtual qint64 writeToNetwork(qint64 nBytes);
 
+	qint64 writeVectored(const IOSegment* pSegments, int nSegments, qint64 nMaxSize);
+
 protected:
 	virtual qint64 readData(char* data, qint64 maxlen);
 	virtual qint64 writeData(const char* data, qint64 len);
@@ -130,27 +144,25 @@ public:
 		return m_oAddress;
 	}
 
-	inline virtual bool HasData()
+	// Work for the rate controller: output to send or bytes waiting in the socket.
+	// Input already read is left to OnRead() and does not count.
+	inline bool HasData()
 	{
 		if(!m_pSocket)
 		{
 			return false;
 		}
 
-		if(m_pInput && !m_pInput->isEmpty())
-		{
-			return true;
-		}
-		if(m_pOutput && !m_pOutput->isEmpty())
-		{
-			return true;
-		}
-		if(networkBytesAvailable())
+		return HasPendingOutput() || networkBytesAvailable() > 0;
+	}
+	inline virtual bool HasPendingOutput()
+	{
+		if(!m_pSocket)
 		{
-			return true;
+			return false;
 		}
 
-		return false;
+		return m_pOutput && !m_pOutput->isEmpty();
 	}
 
 	inline virtual CBuffer* GetInputBuffer()
@@ -261,14 +261,14 @@ bool CQuery::FromG2Packet(G2Packet *pPacket, CEndPoint *pEndpoint)
 	if( !pPacket->m_bCompound )
 		return false;
 
-	char szType[9];
+	quint64 nType = 0;
 	quint32 nLength = 0, nNext = 0;
 
-	while(pPacket->ReadPacket(&szType[0], nLength))
+	while(pPacket->ReadPacket(nType, nLength))
 	{
 		nNext = pPacket->m_nPosition + nLength;
 
-		if( strcmp("UDP", szType) == 0 && nLength >= 6 )
+		if( nType == G2PacketType::UDP && nLength >= 6 )
 		{
 			if( nLength > 18 )
 			{
@@ -292,11 +292,11 @@ bool CQuery::FromG2Packet(G2Packet *pPacket, CEndPoint *pEndpoint)
 				*pKey = 0;
 			}
 		}
-		else if( strcmp("DN", szType) == 0 )
+		else if( nType == G2PacketType::DN )
 		{
 			m_sDescriptiveName = pPacket->ReadString(nLength);
 		}
-		else if( strcmp("URN", szType) == 0 )
+		else if( nType == G2PacketType::URN )
 		{
 			QString sURN;
 			QByteArray hashBuff;
@@ -326,7 +326,7 @@ bool CQuery::FromG2Packet(G2Packet *pPacket, CEndPoint *pEndpoint)
 				}
 			}
 		}
-		else if( strcmp("SZR", szType) == 0 && nLength >= 8 )
+		else if( nType == G2PacketType::SZR && nLength >= 8 )
 		{
 			if( nLength >= 16 )
 			{
@@ -340,7 +340,7 @@ bool CQuery::FromG2Packet(G2Packet *pPacket, CEndPoint *pEndpoint)
 			}
 
 		}
-		else if( strcmp("I", szType) == 0 )
+		else if( nType == G2PacketType::I )
 		{
 
 		}
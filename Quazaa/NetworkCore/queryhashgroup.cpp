@@ -24,6 +24,7 @@
 
 #include "queryhashgroup.h"
 #include "queryhashmaster.h"
+#include "queryhashops.h"
 #include "quazaasettings.h"
 
 #include "debug_new.h"
@@ -33,7 +34,18 @@ CQueryHashGroup::CQueryHashGroup(quint32 nHash)
 	m_nHash = nHash ? nHash : 1u << quazaaSettings.Library.QueryRouteSize;
 	m_pHash = new uchar[ m_nHash ];
 	memset(m_pHash, 0, m_nHash);
+	// 8 bytes per slot, only worth it for the tables we route most queries to;
+	// odd sized tables are checked one by one
+	m_pLeaves = 0;
+	if(m_nHash == QueryHashMaster.m_nHash)
+	{
+		m_pLeaves = new quint64[ m_nHash ];
+		memset(m_pLeaves, 0, m_nHash * sizeof(quint64));
+	}
+	for(m_nBits = 0; (1u << m_nBits) < m_nHash; m_nBits++);
 	m_nCount = 0;
+	m_nMatch = 0;
+	m_nUsed = 0;
 }
 
 CQueryHashGroup::~CQueryHashGroup()
@@ -45,9 +57,11 @@ CQueryHashGroup::~CQueryHashGroup()
 	{
 		Q_ASSERT(*pTest++ == 0);
 	}
+	Q_ASSERT(m_nUsed == 0);
 #endif
 
 	delete [] m_pHash;
+	delete [] m_pLeaves;
 }
 
 void CQueryHashGroup::Add(CQueryHashTable* pTable)
@@ -59,8 +73,11 @@ void CQueryHashGroup::Add(CQueryHashTable* pTable)
 	pTable->m_pGroup = this;
 	m_pTables.append(pTable);
 
+	Q_ASSERT(m_nUsed != ~Q_UINT64_C(0));
+	for(pTable->m_nGroupBit = 0; m_nUsed & (Q_UINT64_C(1) << pTable->m_nGroupBit); pTable->m_nGroupBit++);
+	m_nUsed |= Q_UINT64_C(1) << pTable->m_nGroupBit;
+
 	Operate(pTable, true);
-	QueryHashMaster.Invalidate();
 }
 
 void CQueryHashGroup::Remove(CQueryHashTable* pTable)
@@ -75,7 +92,7 @@ void CQueryHashGroup::Remove(CQueryHashTable* pTable)
 	pTable->m_pGroup = 0;
 
 	Operate(pTable, false);
-	QueryHashMaster.Invalidate();
+	m_nUsed &= ~(Q_UINT64_C(1) << pTable->m_nGroupBit);
 }
 
 void CQueryHashGroup::Operate(CQueryHashTable* pTable, bool bAdd)
@@ -83,152 +100,61 @@ void CQueryHashGroup::Operate(CQueryHashTable* pTable, bool bAdd)
 	Q_ASSERT(m_pHash != 0);
 	Q_ASSERT(pTable->m_nHash == m_nHash);
 
-	uchar* pSource = pTable->m_pHash;
-	uchar* pTarget = m_pHash;
-
 	if(bAdd)
 	{
-		for(quint32 nHash = m_nHash >> 3 ; nHash ; nHash--)
-		{
-			register uchar nSource = *pSource++;
-
-			if((nSource & 0x01) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x02) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x04) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x08) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x10) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x20) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x40) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x80) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-		}
+		QHTOps::GroupAdd(m_pHash, pTable->m_pHash, m_nHash);
 	}
 	else
 	{
-		for(quint32 nHash = m_nHash >> 3 ; nHash ; nHash--)
-		{
-			register uchar nSource = *pSource++;
+		QHTOps::GroupSubtract(m_pHash, pTable->m_pHash, m_nHash);
+	}
 
-			if((nSource & 0x01) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x02) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x04) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x08) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x10) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x20) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x40) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x80) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
+	// tables are sparse, only the slots they have are touched
+	const quint64 nBit = Q_UINT64_C(1) << pTable->m_nGroupBit;
+	const bool bMaster = QueryHashMaster.IsIncremental(m_nHash);
+
+	for(quint32 nByte = 0 ; nByte < (m_nHash >> 3) && (m_pLeaves || bMaster) ; nByte++)
+	{
+		uchar nPresent = ~pTable->m_pHash[nByte];
+
+		for(quint32 nSlot = nByte << 3; nPresent; nSlot++, nPresent >>= 1)
+		{
+			if(nPresent & 1)
+			{
+				if(m_pLeaves)
+				{
+					if(bAdd)
+					{
+						m_pLeaves[nSlot] |= nBit;
+					}
+					else
+					{
+						m_pLeaves[nSlot] &= ~nBit;
+					}
+				}
+
+				if(bMaster)
+				{
+					if(bAdd)
+					{
+						QueryHashMaster.AddSlot(nSlot);
+					}
+					else
+					{
+						QueryHashMaster.RemoveSlot(nSlot);
+					}
+				}
 			}
 		}
 	}
+
+	if(bMaster)
+	{
+		QueryHashMaster.Commit();
+	}
+	else
+	{
+		QueryHashMaster.Invalidate();
+	}
 }
 
@@ -30,6 +30,9 @@
 
 class CQueryHashTable;
 
+// Tables per group, each gets one bit of the leaf masks
+#define QHT_GROUP_SIZE	64
+
 class CQueryHashGroup
 {
 public:
@@ -38,10 +41,14 @@ public:
 
 public:
 	uchar*		m_pHash;
+	quint64*	m_pLeaves;	// For every slot, the tables that have it set; 0 unless the group has the master's size
 	quint32		m_nHash;
+	quint32		m_nBits;
 	quint32		m_nCount;
+	quint64		m_nMatch;	// Tables matching the last query passed to CQueryHashMaster::MatchQuery()
 protected:
 	QList< CQueryHashTable* > m_pTables;
+	quint64		m_nUsed;	// Leaf mask bits taken by m_pTables
 
 public:
 	void	Add(CQueryHashTable* pTable);
@@ -25,6 +25,8 @@
 #include "queryhashmaster.h"
 #include "queryhashgroup.h"
 #include "sharemanager.h"
+#include "query.h"
+#include "Hashes/hash.h"
 #include <QDateTime>
 
 #include "debug_new.h"
@@ -34,19 +36,30 @@ CQueryHashMaster QueryHashMaster;
 CQueryHashMaster::CQueryHashMaster()
 {
 	m_nPerGroup = 0;
+	m_bValid = false;
+	m_bChanged = false;
+	m_pTotals = 0;
 }
 
 CQueryHashMaster::~CQueryHashMaster()
 {
 	Q_ASSERT(GetCount() == 0);
+
+	delete [] m_pTotals;
 }
 
 void CQueryHashMaster::Create()
 {
 	CQueryHashTable::Create();
+	m_oBase.Create();
 
-	m_nPerGroup			= 100;
+	delete [] m_pTotals;
+	m_pTotals = new quint16[m_nHash];
+	memset(m_pTotals, 0, m_nHash * sizeof(quint16));
+
+	m_nPerGroup			= QHT_GROUP_SIZE;
 	m_bValid			= false;
+	m_bChanged			= false;
 	m_bLive				= false;
 	m_nCookie			= 0;
 }
@@ -66,7 +79,6 @@ void CQueryHashMaster::Add(CQueryHashTable* pTable)
 		        pGroup->GetCount() < m_nPerGroup)
 		{
 			pGroup->Add(pTable);
-			m_bValid = false;
 			return;
 		}
 	}
@@ -74,7 +86,6 @@ void CQueryHashMaster::Add(CQueryHashTable* pTable)
 	CQueryHashGroup* pGroup = new CQueryHashGroup(pTable->m_nHash);
 	m_pGroups.append(pGroup);
 	pGroup->Add(pTable);
-	m_bValid = false;
 }
 
 void CQueryHashMaster::Remove(CQueryHashTable* pTable)
@@ -95,27 +106,17 @@ void CQueryHashMaster::Remove(CQueryHashTable* pTable)
 		m_pGroups.removeAt(pos);
 		delete pGroup;
 	}
-
-	m_bValid = false;
 }
 
+// Full rebuild, needed when the local shares change or the table was never built.
+// Leaf tables of our size are kept up to date by AddSlot() and RemoveSlot() afterwards.
 void CQueryHashMaster::Build()
 {
 	quint32 tNow = time(0);
 
-	if(m_bValid)
-	{
-		if(tNow - m_nCookie < 600)
-		{
-			return;
-		}
-	}
-	else
+	if(m_bValid || tNow - m_nCookie < 20)
 	{
-		if(tNow - m_nCookie < 20)
-		{
-			return;
-		}
+		return;
 	}
 
 	ShareManager.m_oSection.lock();
@@ -128,19 +129,121 @@ void CQueryHashMaster::Build()
 		return;
 	}
 
-	Clear();
-	Merge(pLocalTable);
+	m_oBase.Clear();
+	m_oBase.Merge(pLocalTable);
 
 	ShareManager.m_oSection.unlock();
 
+	memset(m_pTotals, 0, m_nHash * sizeof(quint16));
+
 	for(QList<CQueryHashGroup*>::iterator itGroup = m_pGroups.begin(); itGroup != m_pGroups.end(); itGroup++)
 	{
 		CQueryHashGroup* pGroup = *itGroup;
-		Merge(pGroup);
+
+		if(pGroup->m_nHash == m_nHash)
+		{
+			for(quint32 nSlot = 0; nSlot < m_nHash; nSlot++)
+			{
+				m_pTotals[nSlot] += pGroup->m_pHash[nSlot];
+			}
+		}
+		else
+		{
+			m_oBase.Merge(pGroup);
+		}
+	}
+
+	memcpy(m_pHash, m_oBase.m_pHash, m_nHash >> 3);
+	m_nCount = m_oBase.m_nCount;
+
+	for(QList<CQueryHashGroup*>::iterator itGroup = m_pGroups.begin(); itGroup != m_pGroups.end(); itGroup++)
+	{
+		CQueryHashGroup* pGroup = *itGroup;
+
+		if(pGroup->m_nHash == m_nHash)
+		{
+			Merge(pGroup);
+		}
 	}
 
 	m_bValid	= true;
+	m_bChanged	= false;
 	m_bLive		= true;
 	m_nCookie	= tNow;
 }
 
+// Sets m_nMatch of every group to the tables CQueryHashTable::CheckQuery() would accept,
+// a few mask operations per group instead of a probe per table
+void CQueryHashMaster::MatchQuery(CQueryPtr pQuery)
+{
+	QList<QByteArray> lURNs;
+	for(int i = 0; i < pQuery->m_lHashes.size(); ++i)
+	{
+		lURNs.append(pQuery->m_lHashes[i].ToURN().toUtf8());
+	}
+
+	const int nWords = pQuery->m_lHashedKeywords.size();
+	const int nNeeded = (nWords >= 3) ? (2 * nWords + 2) / 3 : nWords;
+
+	int nPlanes = 1;
+	while((1 << nPlanes) <= nWords)
+	{
+		nPlanes++;
+	}
+
+	for(QList<CQueryHashGroup*>::iterator itGroup = m_pGroups.begin(); itGroup != m_pGroups.end(); itGroup++)
+	{
+		CQueryHashGroup* pGroup = *itGroup;
+		quint64 nMatch = 0;
+
+		if(!pGroup->m_pLeaves)
+		{
+			// routed with CQueryHashTable::CheckQuery()
+			pGroup->m_nMatch = 0;
+			continue;
+		}
+
+		foreach(const QByteArray& baURN, lURNs)
+		{
+			nMatch |= pGroup->m_pLeaves[HashWord(baURN.constData(), baURN.size(), pGroup->m_nBits)];
+		}
+
+		if(nWords > 0)
+		{
+			// bit-sliced hit counters, plane n holds bit n of every table's count
+			quint64 pPlanes[32];
+			memset(pPlanes, 0, sizeof(quint64) * nPlanes);
+
+			foreach(quint32 nHash, pQuery->m_lHashedKeywords)
+			{
+				quint64 nCarry = pGroup->m_pLeaves[nHash >> (32 - pGroup->m_nBits)];
+
+				for(int n = 0; nCarry && n < nPlanes; n++)
+				{
+					quint64 nNext = pPlanes[n] & nCarry;
+					pPlanes[n] ^= nCarry;
+					nCarry = nNext;
+				}
+			}
+
+			// tables with at least nNeeded hits
+			quint64 nGreater = 0, nEqual = ~Q_UINT64_C(0);
+			for(int n = nPlanes - 1; n >= 0; n--)
+			{
+				if(nNeeded & (1 << n))
+				{
+					nEqual &= pPlanes[n];
+				}
+				else
+				{
+					nGreater |= nEqual & pPlanes[n];
+					nEqual &= ~pPlanes[n];
+				}
+			}
+
+			nMatch |= nGreater | nEqual;
+		}
+
+		pGroup->m_nMatch = nMatch;
+	}
+}
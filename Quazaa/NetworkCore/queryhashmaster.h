@@ -26,6 +26,7 @@
 #define QUERYHASHMASTER_H
 
 #include "queryhashtable.h"
+#include <QMutex>
 
 class CQueryHashGroup;
 
@@ -40,14 +41,26 @@ protected:
 	QList< CQueryHashGroup* > m_pGroups;
 	int			m_nPerGroup;
 	bool		m_bValid;
+	bool		m_bChanged;		// A slot flipped since the last Commit()
+	quint16*	m_pTotals;		// For every slot, the number of same sized leaf tables that have it
+	CQueryHashTable	m_oBase;	// Local shares and odd sized leaf tables, rebuilt by Build()
+
+public:
+	QMutex		m_pSection;		// guards the master, its groups and the leaf tables in them
 
 public:
 	void		Create();
 	void		Add(CQueryHashTable* pTable);
 	void		Remove(CQueryHashTable* pTable);
+	void		MatchQuery(CQueryPtr pQuery);
 public slots:
 	void		Build();
 
+	inline void Invalidate()
+	{
+		m_bValid = false;
+	}
+
 public:
 
 	inline int GetCount() const
@@ -55,14 +68,53 @@ public:
 		return m_pGroups.size();
 	}
 
-	inline void Invalidate()
-	{
-		m_bValid = false;
-	}
 	inline bool IsValid()
 	{
 		return m_bValid;
 	}
+
+	// Leaf tables of this size are applied slot by slot instead of waiting for Build()
+	inline bool IsIncremental(quint32 nHash) const
+	{
+		return m_bValid && nHash == m_nHash;
+	}
+
+	// A leaf table gained nSlot
+	inline void AddSlot(quint32 nSlot)
+	{
+		const uchar nMask = uchar(1 << (nSlot & 7));
+
+		if(m_pTotals[nSlot]++ == 0 && (m_pHash[nSlot >> 3] & nMask))
+		{
+			m_pHash[nSlot >> 3] &= ~nMask;
+			++m_nCount;
+			m_bChanged = true;
+		}
+	}
+
+	// A leaf table lost nSlot
+	inline void RemoveSlot(quint32 nSlot)
+	{
+		const uchar nMask = uchar(1 << (nSlot & 7));
+
+		Q_ASSERT(m_pTotals[nSlot] > 0);
+		if(--m_pTotals[nSlot] == 0 && (m_oBase.m_pHash[nSlot >> 3] & nMask))
+		{
+			m_pHash[nSlot >> 3] |= nMask;
+			--m_nCount;
+			m_bChanged = true;
+		}
+	}
+
+	// Ends a batch of slot changes, hubs pick the new cookie up and get patched
+	inline void Commit()
+	{
+		if(m_bChanged)
+		{
+			m_nCookie = time(0);
+			m_bChanged = false;
+		}
+	}
 };
 
 extern CQueryHashMaster QueryHashMaster;
@@ -0,0 +1,474 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public 
+** License version 3.0 requirements will be met: 
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version 
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation, 
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "queryhashops.h"
+#include "systemlog.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	if defined(__SSE2__)
+#		define QHT_SSE2
+#	endif
+#	if defined(__clang__) || (__GNUC__ * 100 + __GNUC_MINOR__ >= 409)
+#		define QHT_AVX2
+#		define QHT_TARGET_AVX2 __attribute__((target("avx2")))
+#	endif
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#	if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#		define QHT_SSE2
+#	endif
+#	if _MSC_VER >= 1700
+#		define QHT_AVX2
+#		define QHT_TARGET_AVX2
+#		include <intrin.h>
+#	endif
+#endif
+
+#if defined(QHT_AVX2)
+#	include <immintrin.h>
+#elif defined(QHT_SSE2)
+#	include <emmintrin.h>
+#endif
+
+#include "debug_new.h"
+
+static inline quint32 PopCount32(quint32 n)
+{
+	n = n - ((n >> 1) & 0x55555555);
+	n = (n & 0x33333333) + ((n >> 2) & 0x33333333);
+	return (((n + (n >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+// Scalar kernels, also used for the tails of the vector ones
+
+static quint32 MergeScalar(uchar* pDest, const uchar* pSource, quint32 nBytes)
+{
+	quint32 nCleared = 0;
+
+	for(; nBytes >= 4; nBytes -= 4, pDest += 4, pSource += 4)
+	{
+		quint32 nDest, nSource;
+		memcpy(&nDest, pDest, 4);
+		memcpy(&nSource, pSource, 4);
+
+		nCleared += PopCount32(nDest & ~nSource);
+		nDest &= nSource;
+
+		memcpy(pDest, &nDest, 4);
+	}
+
+	for(; nBytes; nBytes--, pDest++, pSource++)
+	{
+		nCleared += PopCount32(*pDest & ~*pSource & 0xFF);
+		*pDest &= *pSource;
+	}
+
+	return nCleared;
+}
+
+static quint32 MergeGroupScalar(uchar* pDest, const uchar* pCounters, quint32 nBits)
+{
+	quint32 nCleared = 0;
+
+	for(quint32 nByte = nBits >> 3; nByte; nByte--, pDest++)
+	{
+		uchar nUsed = 0;
+
+		for(int nBit = 0; nBit < 8; nBit++)
+		{
+			if(*pCounters++)
+			{
+				nUsed |= 1 << nBit;
+			}
+		}
+
+		nCleared += PopCount32(*pDest & nUsed);
+		*pDest &= ~nUsed;
+	}
+
+	return nCleared;
+}
+
+static bool DiffScalar(uchar* pOut, const uchar* pA, const uchar* pB, quint32 nBytes)
+{
+	quint32 nAny = 0;
+
+	for(; nBytes >= 4; nBytes -= 4, pOut += 4, pA += 4, pB += 4)
+	{
+		quint32 nA, nB;
+		memcpy(&nA, pA, 4);
+		memcpy(&nB, pB, 4);
+
+		nA ^= nB;
+		nAny |= nA;
+
+		memcpy(pOut, &nA, 4);
+	}
+
+	for(; nBytes; nBytes--)
+	{
+		nAny |= (*pOut++ = *pA++ ^ *pB++);
+	}
+
+	return nAny != 0;
+}
+
+template<bool bAdd>
+static void GroupOperateScalar(uchar* pCounters, const uchar* pSource, quint32 nBits)
+{
+	for(quint32 nByte = nBits >> 3; nByte; nByte--)
+	{
+		uchar nPresent = ~*pSource++;
+
+		for(int nBit = 0; nBit < 8; nBit++, pCounters++)
+		{
+			if(bAdd)
+			{
+				*pCounters += (nPresent >> nBit) & 1;
+			}
+			else
+			{
+				*pCounters -= (nPresent >> nBit) & 1;
+			}
+		}
+	}
+}
+
+#ifdef QHT_SSE2
+
+// Per byte bit counts
+static inline __m128i PopCountSSE2(__m128i x)
+{
+	const __m128i m1 = _mm_set1_epi8(0x55);
+	const __m128i m2 = _mm_set1_epi8(0x33);
+	const __m128i m4 = _mm_set1_epi8(0x0F);
+
+	x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi16(x, 1), m1));
+	x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi16(x, 2), m2));
+	return _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi16(x, 4)), m4);
+}
+
+static inline quint32 SumSSE2(__m128i oSum)
+{
+	return _mm_cvtsi128_si32(oSum) + _mm_cvtsi128_si32(_mm_srli_si128(oSum, 8));
+}
+
+static quint32 MergeSSE2(uchar* pDest, const uchar* pSource, quint32 nBytes)
+{
+	const __m128i oZero = _mm_setzero_si128();
+	__m128i oSum = oZero;
+
+	for(; nBytes >= 16; nBytes -= 16, pDest += 16, pSource += 16)
+	{
+		__m128i oDest = _mm_loadu_si128((const __m128i*)pDest);
+		__m128i oSource = _mm_loadu_si128((const __m128i*)pSource);
+
+		oSum = _mm_add_epi64(oSum, _mm_sad_epu8(PopCountSSE2(_mm_andnot_si128(oSource, oDest)), oZero));
+		_mm_storeu_si128((__m128i*)pDest, _mm_and_si128(oDest, oSource));
+	}
+
+	return SumSSE2(oSum) + MergeScalar(pDest, pSource, nBytes);
+}
+
+static quint32 MergeGroupSSE2(uchar* pDest, const uchar* pCounters, quint32 nBits)
+{
+	const __m128i oZero = _mm_setzero_si128();
+	quint32 nCleared = 0;
+
+	for(; nBits >= 16; nBits -= 16, pDest += 2, pCounters += 16)
+	{
+		// one bit per unused slot
+		quint32 nUnused = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)pCounters), oZero));
+		quint32 nDest = pDest[0] | (pDest[1] << 8);
+
+		nCleared += PopCount32(nDest & ~nUnused & 0xFFFF);
+		nDest &= nUnused;
+
+		pDest[0] = uchar(nDest);
+		pDest[1] = uchar(nDest >> 8);
+	}
+
+	return nCleared + MergeGroupScalar(pDest, pCounters, nBits);
+}
+
+static bool DiffSSE2(uchar* pOut, const uchar* pA, const uchar* pB, quint32 nBytes)
+{
+	const __m128i oZero = _mm_setzero_si128();
+	__m128i oAny = oZero;
+
+	for(; nBytes >= 16; nBytes -= 16, pOut += 16, pA += 16, pB += 16)
+	{
+		__m128i oDiff = _mm_xor_si128(_mm_loadu_si128((const __m128i*)pA), _mm_loadu_si128((const __m128i*)pB));
+		oAny = _mm_or_si128(oAny, oDiff);
+		_mm_storeu_si128((__m128i*)pOut, oDiff);
+	}
+
+	bool bAny = _mm_movemask_epi8(_mm_cmpeq_epi8(oAny, oZero)) != 0xFFFF;
+
+	return DiffScalar(pOut, pA, pB, nBytes) || bAny;
+}
+
+template<bool bAdd>
+static void GroupOperateSSE2(uchar* pCounters, const uchar* pSource, quint32 nBits)
+{
+	const __m128i oZero = _mm_setzero_si128();
+	const __m128i oMask = _mm_set_epi8(char(0x80), 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+									   char(0x80), 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+
+	for(; nBits >= 16; nBits -= 16, pSource += 2, pCounters += 16)
+	{
+		// spread 2 bytes over 16, then 0xFF for every present slot
+		__m128i oBits = _mm_cvtsi32_si128(pSource[0] | (pSource[1] << 8));
+		oBits = _mm_unpacklo_epi8(oBits, oBits);
+		oBits = _mm_unpacklo_epi16(oBits, oBits);
+		oBits = _mm_unpacklo_epi32(oBits, oBits);
+		__m128i oPresent = _mm_cmpeq_epi8(_mm_and_si128(oBits, oMask), oZero);
+
+		__m128i oCounters = _mm_loadu_si128((const __m128i*)pCounters);
+		oCounters = bAdd ? _mm_sub_epi8(oCounters, oPresent) : _mm_add_epi8(oCounters, oPresent);
+		_mm_storeu_si128((__m128i*)pCounters, oCounters);
+	}
+
+	GroupOperateScalar<bAdd>(pCounters, pSource, nBits);
+}
+
+#endif // QHT_SSE2
+
+#ifdef QHT_AVX2
+
+QHT_TARGET_AVX2 static inline __m256i PopCountAVX2(__m256i x)
+{
+	const __m256i oTable = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+											0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i m4 = _mm256_set1_epi8(0x0F);
+
+	return _mm256_add_epi8(_mm256_shuffle_epi8(oTable, _mm256_and_si256(x, m4)),
+						   _mm256_shuffle_epi8(oTable, _mm256_and_si256(_mm256_srli_epi16(x, 4), m4)));
+}
+
+QHT_TARGET_AVX2 static inline quint32 SumAVX2(__m256i oSum)
+{
+	__m128i oHalf = _mm_add_epi64(_mm256_castsi256_si128(oSum), _mm256_extracti128_si256(oSum, 1));
+	return _mm_cvtsi128_si32(oHalf) + _mm_cvtsi128_si32(_mm_srli_si128(oHalf, 8));
+}
+
+QHT_TARGET_AVX2 static quint32 MergeAVX2(uchar* pDest, const uchar* pSource, quint32 nBytes)
+{
+	const __m256i oZero = _mm256_setzero_si256();
+	__m256i oSum = oZero;
+
+	for(; nBytes >= 32; nBytes -= 32, pDest += 32, pSource += 32)
+	{
+		__m256i oDest = _mm256_loadu_si256((const __m256i*)pDest);
+		__m256i oSource = _mm256_loadu_si256((const __m256i*)pSource);
+
+		oSum = _mm256_add_epi64(oSum, _mm256_sad_epu8(PopCountAVX2(_mm256_andnot_si256(oSource, oDest)), oZero));
+		_mm256_storeu_si256((__m256i*)pDest, _mm256_and_si256(oDest, oSource));
+	}
+
+	return SumAVX2(oSum) + MergeScalar(pDest, pSource, nBytes);
+}
+
+QHT_TARGET_AVX2 static quint32 MergeGroupAVX2(uchar* pDest, const uchar* pCounters, quint32 nBits)
+{
+	const __m256i oZero = _mm256_setzero_si256();
+	quint32 nCleared = 0;
+
+	for(; nBits >= 32; nBits -= 32, pDest += 4, pCounters += 32)
+	{
+		// one bit per unused slot
+		quint32 nUnused = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)pCounters), oZero));
+		quint32 nDest;
+		memcpy(&nDest, pDest, 4);
+
+		nCleared += PopCount32(nDest & ~nUnused);
+		nDest &= nUnused;
+
+		memcpy(pDest, &nDest, 4);
+	}
+
+	return nCleared + MergeGroupScalar(pDest, pCounters, nBits);
+}
+
+QHT_TARGET_AVX2 static bool DiffAVX2(uchar* pOut, const uchar* pA, const uchar* pB, quint32 nBytes)
+{
+	__m256i oAny = _mm256_setzero_si256();
+
+	for(; nBytes >= 32; nBytes -= 32, pOut += 32, pA += 32, pB += 32)
+	{
+		__m256i oDiff = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)pA), _mm256_loadu_si256((const __m256i*)pB));
+		oAny = _mm256_or_si256(oAny, oDiff);
+		_mm256_storeu_si256((__m256i*)pOut, oDiff);
+	}
+
+	bool bAny = !_mm256_testz_si256(oAny, oAny);
+
+	return DiffScalar(pOut, pA, pB, nBytes) || bAny;
+}
+
+template<bool bAdd>
+QHT_TARGET_AVX2 static void GroupOperateAVX2(uchar* pCounters, const uchar* pSource, quint32 nBits)
+{
+	const __m256i oZero = _mm256_setzero_si256();
+	const __m256i oSpread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+											 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+	const __m256i oMask = _mm256_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80),
+										   0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80),
+										   0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80),
+										   0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80));
+
+	for(; nBits >= 32; nBits -= 32, pSource += 4, pCounters += 32)
+	{
+		// spread 4 bytes over 32, then 0xFF for every present slot
+		quint32 nSource;
+		memcpy(&nSource, pSource, 4);
+
+		__m256i oBits = _mm256_shuffle_epi8(_mm256_set1_epi32(nSource), oSpread);
+		__m256i oPresent = _mm256_cmpeq_epi8(_mm256_and_si256(oBits, oMask), oZero);
+
+		__m256i oCounters = _mm256_loadu_si256((const __m256i*)pCounters);
+		oCounters = bAdd ? _mm256_sub_epi8(oCounters, oPresent) : _mm256_add_epi8(oCounters, oPresent);
+		_mm256_storeu_si256((__m256i*)pCounters, oCounters);
+	}
+
+	GroupOperateScalar<bAdd>(pCounters, pSource, nBits);
+}
+
+static bool CpuHasAVX2()
+{
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	int pInfo[4];
+
+	__cpuid(pInfo, 0);
+	if(pInfo[0] < 7)
+	{
+		return false;
+	}
+
+	// the OS has to save the YMM registers too
+	__cpuid(pInfo, 1);
+	if((pInfo[2] & (1 << 27)) == 0 || (pInfo[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+	{
+		return false;
+	}
+
+	__cpuidex(pInfo, 7, 0);
+	return (pInfo[1] & (1 << 5)) != 0;
+#endif
+}
+
+#endif // QHT_AVX2
+
+// The pointers start at these, the first call picks the kernels
+
+static quint32 MergeResolve(uchar* pDest, const uchar* pSource, quint32 nBytes)
+{
+	QHTOps::Init();
+	return QHTOps::Merge(pDest, pSource, nBytes);
+}
+
+static quint32 MergeGroupResolve(uchar* pDest, const uchar* pCounters, quint32 nBits)
+{
+	QHTOps::Init();
+	return QHTOps::MergeGroup(pDest, pCounters, nBits);
+}
+
+static bool DiffResolve(uchar* pOut, const uchar* pA, const uchar* pB, quint32 nBytes)
+{
+	QHTOps::Init();
+	return QHTOps::Diff(pOut, pA, pB, nBytes);
+}
+
+static void GroupAddResolve(uchar* pCounters, const uchar* pSource, quint32 nBits)
+{
+	QHTOps::Init();
+	QHTOps::GroupAdd(pCounters, pSource, nBits);
+}
+
+static void GroupSubtractResolve(uchar* pCounters, const uchar* pSource, quint32 nBits)
+{
+	QHTOps::Init();
+	QHTOps::GroupSubtract(pCounters, pSource, nBits);
+}
+
+quint32 (*QHTOps::Merge)(uchar*, const uchar*, quint32) = &MergeResolve;
+quint32 (*QHTOps::MergeGroup)(uchar*, const uchar*, quint32) = &MergeGroupResolve;
+bool (*QHTOps::Diff)(uchar*, const uchar*, const uchar*, quint32) = &DiffResolve;
+void (*QHTOps::GroupAdd)(uchar*, const uchar*, quint32) = &GroupAddResolve;
+void (*QHTOps::GroupSubtract)(uchar*, const uchar*, quint32) = &GroupSubtractResolve;
+const char* QHTOps::m_sName = 0;
+
+void QHTOps::Init()
+{
+	// every thread picks the same kernels, a race here is harmless
+	if(m_sName)
+	{
+		return;
+	}
+
+	const char* sName = "scalar";
+
+	Merge = &MergeScalar;
+	MergeGroup = &MergeGroupScalar;
+	Diff = &DiffScalar;
+	GroupAdd = &GroupOperateScalar<true>;
+	GroupSubtract = &GroupOperateScalar<false>;
+
+#ifdef QHT_SSE2
+	sName = "SSE2";
+
+	Merge = &MergeSSE2;
+	MergeGroup = &MergeGroupSSE2;
+	Diff = &DiffSSE2;
+	GroupAdd = &GroupOperateSSE2<true>;
+	GroupSubtract = &GroupOperateSSE2<false>;
+#endif
+
+#ifdef QHT_AVX2
+	if(CpuHasAVX2())
+	{
+		sName = "AVX2";
+
+		Merge = &MergeAVX2;
+		MergeGroup = &MergeGroupAVX2;
+		Diff = &DiffAVX2;
+		GroupAdd = &GroupOperateAVX2<true>;
+		GroupSubtract = &GroupOperateAVX2<false>;
+	}
+#endif
+
+	m_sName = sName;
+
+	systemLog.postLog(LogSeverity::Debug, QString("QHT: using %1 kernels").arg(sName));
+}
+
+const char* QHTOps::Name()
+{
+	Init();
+	return m_sName;
+}
@@ -0,0 +1,54 @@
+/*
+** queryhashops.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef QUERYHASHOPS_H
+#define QUERYHASHOPS_H
+
+#include <QtGlobal>
+
+// Bulk operations on QHT bitmaps and group counters.
+// A clear bit in a bitmap means the slot is present. The best kernel
+// for the CPU is picked on first use, with a scalar fallback.
+class QHTOps
+{
+public:
+	// Clears the bits of pDest that are clear in pSource, returns how many got cleared
+	static quint32 (*Merge)(uchar* pDest, const uchar* pSource, quint32 nBytes);
+	// Clears the bits of pDest whose group counter is non-zero, returns how many got cleared
+	static quint32 (*MergeGroup)(uchar* pDest, const uchar* pCounters, quint32 nBits);
+	// pOut = pA ^ pB, returns true if the bitmaps differ
+	static bool (*Diff)(uchar* pOut, const uchar* pA, const uchar* pB, quint32 nBytes);
+	// Counts a table into a group: every present slot of pSource bumps its counter
+	static void (*GroupAdd)(uchar* pCounters, const uchar* pSource, quint32 nBits);
+	static void (*GroupSubtract)(uchar* pCounters, const uchar* pSource, quint32 nBits);
+
+	static void Init();
+	static const char* Name();
+
+protected:
+	static const char* m_sName;
+};
+
+#endif // QUERYHASHOPS_H
@@ -25,6 +25,7 @@
 #include "queryhashtable.h"
 #include "queryhashmaster.h"
 #include "queryhashgroup.h"
+#include "queryhashops.h"
 #include <QString>
 #include "network.h"
 #include "neighbour.h"
@@ -52,6 +53,7 @@ CQueryHashTable::CQueryHashTable() : QObject(0),
 	,	m_nCount(0ul)
 	,	m_pBuffer(new CBuffer(131072))    // 128KB
 	,	m_pGroup(0)
+	,	m_nGroupBit(0)
 {
 }
 
@@ -124,34 +126,7 @@ bool CQueryHashTable::Merge(const CQueryHashTable* pSource)
 
 	if(m_nHash == pSource->m_nHash)
 	{
-		uchar* pSourcePtr	= pSource->m_pHash;
-		uchar* pDestPtr		= m_pHash;
-
-		for(quint32 nPosition = m_nHash >> 3 ; nPosition ; --nPosition)
-		{
-			register uchar nSourceByte = *pSourcePtr;
-			register uchar nDestByte = *pDestPtr;
-
-#define DO_MERGE(MASKVAL) \
-	if ( ! ( nSourceByte & MASKVAL ) && ( nDestByte & MASKVAL ) ) \
-	{ \
-		*pDestPtr &= ~ MASKVAL; \
-		++m_nCount; \
-	}
-
-			DO_MERGE(0x01);
-			DO_MERGE(0x02);
-			DO_MERGE(0x04);
-			DO_MERGE(0x08);
-			DO_MERGE(0x10);
-			DO_MERGE(0x20);
-			DO_MERGE(0x40);
-			DO_MERGE(0x80);
-#undef DO_MERGE
-
-			++pSourcePtr;
-			++pDestPtr;
-		}
+		m_nCount += QHTOps::Merge(m_pHash, pSource->m_pHash, m_nHash >> 3);
 	}
 	else
 	{
@@ -247,32 +222,7 @@ bool CQueryHashTable::Merge(const CQueryHashGroup* pSource)
 
 	if(m_nHash == pSource->m_nHash)
 	{
-		uchar* pSourcePtr	= pSource->m_pHash;
-		uchar* pDestPtr		= m_pHash;
-
-		for(quint32 nPosition = m_nHash >> 3 ; nPosition ; --nPosition)
-		{
-			register uchar nDestByte = *pDestPtr;
-
-#define DO_MERGE(MASKVAL) \
-	if ( *pSourcePtr++ && ( nDestByte & MASKVAL ) ) \
-	{ \
-		*pDestPtr &= ~ MASKVAL; \
-		m_nCount++; \
-	}
-
-			DO_MERGE(0x01);
-			DO_MERGE(0x02);
-			DO_MERGE(0x04);
-			DO_MERGE(0x08);
-			DO_MERGE(0x10);
-			DO_MERGE(0x20);
-			DO_MERGE(0x40);
-			DO_MERGE(0x80);
-#undef DO_MERGE
-
-			++pDestPtr;
-		}
+		m_nCount += QHTOps::MergeGroup(m_pHash, pSource->m_pHash, m_nHash);
 	}
 	else
 	{
@@ -394,15 +344,9 @@ bool CQueryHashTable::PatchTo(const CQueryHashTable* pTarget,
 	uchar* pHashS	= m_pHash;
 
 	const quint32 nEnd = (m_nHash + 31) / 32;
-	quint32* const pDwordBuffer = reinterpret_cast< quint32* >(pBuffer);
-	const quint32* const pDwordHashS = reinterpret_cast< quint32* >(pHashS);
-	const quint32* const pDwordHashT = reinterpret_cast< quint32* >(pHashT);
-	for(quint32 nPosition = 0; nPosition < nEnd; ++nPosition)
+	if(QHTOps::Diff(pBuffer, pHashS, pHashT, nEnd * 4))
 	{
-		if((pDwordBuffer[ nPosition ] = pDwordHashS[ nPosition ] ^ pDwordHashT[ nPosition ]) != 0)
-		{
-			bChanged = true;
-		}
+		bChanged = true;
 	}
 	if(bChanged)
 	{
@@ -598,9 +542,11 @@ bool CQueryHashTable::OnPatch(G2Packet* pPacket)
 		return true;
 	}
 
-	if(nCompression == 1)
+	// a valid patch inflates to exactly one entry per slot
+	if(nCompression == 1 && !ZLibUtils::Uncompress(*m_pBuffer, m_nHash / (8 / nBits)))
 	{
-		ZLibUtils::Uncompress(*m_pBuffer);
+		m_pBuffer->clear();
+		return false;
 	}
 
 	if(m_pBuffer->size() != m_nHash / (8 / nBits))
@@ -614,55 +560,82 @@ bool CQueryHashTable::OnPatch(G2Packet* pPacket)
 
 	const bool bGroup = (m_pGroup && m_pGroup->m_nHash == m_nHash);
 	uchar* pGroup	= bGroup ? m_pGroup->m_pHash : 0;
+	quint64* pLeaves	= bGroup ? m_pGroup->m_pLeaves : 0;	// 0 for odd sized groups
+	const quint64 nLeafBit = Q_UINT64_C(1) << m_nGroupBit;
+
+	// leaf changes go straight into the master table when it can take them
+	const bool bMaster = bGroup && QueryHashMaster.IsIncremental(m_nHash);
 
 	if(nBits == 1)
 	{
-		for(quint32 nPosition = (m_nHash >> 3) ; nPosition ; --nPosition, ++pHash, ++pData)
+		for(quint32 nByte = 0 ; nByte < (m_nHash >> 3) ; ++nByte)
 		{
-			for(uchar nMask = 1 ; ; nMask <<= 1)
+			// most of a patch leaves the table alone
+			if(pData[nByte] == 0)
+			{
+				continue;
+			}
+
+			for(quint32 nBit = 0 ; nBit < 8 ; ++nBit)
 			{
-				if(*pData & nMask)
+				const uchar nMask = uchar(1 << nBit);
+				const quint32 nSlot = (nByte << 3) | nBit;
+
+				if((pData[nByte] & nMask) == 0)
+				{
+					continue;
+				}
+
+				if(pHash[nByte] & nMask)
 				{
-					if(*pHash & nMask)
+					++m_nCount;
+					pHash[nByte] &= ~nMask;
+					if(bGroup)
 					{
-						++m_nCount;
-						*pHash &= ~nMask;
-						if(bGroup)
-						{
 #ifdef _DEBUG
-							Q_ASSERT(*pGroup < 255);
-							if(*pGroup == 0)
-							{
-								++m_pGroup->m_nCount;
-							}
+						Q_ASSERT(pGroup[nSlot] < 255);
+						if(pGroup[nSlot] == 0)
+						{
+							++m_pGroup->m_nCount;
+						}
 #endif
-							++(*pGroup);
+						++pGroup[nSlot];
+						if(pLeaves)
+						{
+							pLeaves[nSlot] |= nLeafBit;
 						}
-					}
-					else
-					{
-						--m_nCount;
-						*pHash |= nMask;
 
-						if(bGroup)
+						if(bMaster)
 						{
-#ifdef _DEBUG
-							Q_ASSERT(*pGroup);
-							if(*pGroup == 1)
-							{
-								--m_pGroup->m_nCount;
-							}
-#endif
-							--(*pGroup);
+							QueryHashMaster.AddSlot(nSlot);
 						}
 					}
 				}
+				else
+				{
+					--m_nCount;
+					pHash[nByte] |= nMask;
 
-				++pGroup;
+					if(bGroup)
+					{
+#ifdef _DEBUG
+						Q_ASSERT(pGroup[nSlot]);
+						if(pGroup[nSlot] == 1)
+						{
+							--m_pGroup->m_nCount;
+						}
+#endif
+						--pGroup[nSlot];
+						if(pLeaves)
+						{
+							pLeaves[nSlot] &= ~nLeafBit;
+						}
 
-				if(nMask == 0x80)
-				{
-					break;
+						if(bMaster)
+						{
+							QueryHashMaster.RemoveSlot(nSlot);
+						}
+					}
 				}
 			}
 		}
@@ -676,7 +649,11 @@ bool CQueryHashTable::OnPatch(G2Packet* pPacket)
 	m_bLive		= true;
 	m_nCookie	= time(0);
 
-	if(bGroup)
+	if(bMaster)
+	{
+		QueryHashMaster.Commit();
+	}
+	else if(bGroup)
 	{
 		QueryHashMaster.Invalidate();
 	}
@@ -55,6 +55,7 @@ public:
 	quint32				m_nCount;
 	CBuffer*			m_pBuffer;
 	CQueryHashGroup* 	m_pGroup;
+	quint8				m_nGroupBit;	// Our bit in the group's leaf masks
 
 public:
 	static quint32 HashWord(const char* pSz, const quint32 nLength, qint32 nBits);
@@ -76,7 +76,7 @@ QueryHitInfo* CQueryHit::ReadInfo(G2Packet* pPacket, CEndPoint* pSender)
 
 	try
 	{
-		char szType[9];
+		quint64 nType = 0;
 		quint32 nLength = 0, nNext = 0;
 		bool bCompound = false;
 
@@ -87,11 +87,11 @@ QueryHitInfo* CQueryHit::ReadInfo(G2Packet* pPacket, CEndPoint* pSender)
 			bHaveNA = true;
 		}
 
-		while(pPacket->ReadPacket(&szType[0], nLength, &bCompound))
+		while(pPacket->ReadPacket(nType, nLength, &bCompound))
 		{
 			nNext = pPacket->m_nPosition + nLength;
 
-			if(strcmp("H", szType) == 0 && bCompound)
+			if(nType == G2PacketType::H && bCompound)
 			{
 				bHaveHits = true;
 				continue;
@@ -102,7 +102,7 @@ QueryHitInfo* CQueryHit::ReadInfo(G2Packet* pPacket, CEndPoint* pSender)
 				pPacket->SkipCompound();
 			}
 
-			if(strcmp("NA", szType) == 0 && nLength >= 6)
+			if(nType == G2PacketType::NA && nLength >= 6)
 			{
 				CEndPoint oNodeAddr;
 				pPacket->ReadHostAddress(&oNodeAddr, !(nLength >= 18));
@@ -112,7 +112,7 @@ QueryHitInfo* CQueryHit::ReadInfo(G2Packet* pPacket, CEndPoint* pSender)
 					bHaveNA = true;
 				}
 			}
-			else if(strcmp("GU", szType) == 0 && nLength >= 16)
+			else if(nType == G2PacketType::GU && nLength >= 16)
 			{
 				QUuid oNodeGUID = pPacket->ReadGUID();
 				if(!oNodeGUID.isNull())
@@ -121,7 +121,7 @@ QueryHitInfo* CQueryHit::ReadInfo(G2Packet* pPacket, CEndPoint* pSender)
 					bHaveGUID = true;
 				}
 			}
-			else if(strcmp("NH", szType) == 0 && nLength >= 6)
+			else if(nType == G2PacketType::NH && nLength >= 6)
 			{
 				CEndPoint oNH;
 				pPacket->ReadHostAddress(&oNH, !(nLength >= 18));
@@ -130,7 +130,7 @@ QueryHitInfo* CQueryHit::ReadInfo(G2Packet* pPacket, CEndPoint* pSender)
 					pHitInfo->m_lNeighbouringHubs.append(oNH);
 				}
 			}
-			else if(strcmp("V", szType) == 0 && nLength >= 4)
+			else if(nType == G2PacketType::V && nLength >= 4)
 			{
 				pHitInfo->m_sVendor = pPacket->ReadString(4);
 			}
@@ -174,15 +174,15 @@ CQueryHit* CQueryHit::ReadPacket(G2Packet* pPacket, QueryHitInfo* pHitInfo)
 
 	try
 	{
-		char szType[9], szTypeX[9];
+		quint64 nType = 0, nTypeX = 0;
 		quint32 nLength = 0, nLengthX = 0, nNext = 0, nNextX = 0;
 		bool bCompound = false;
 
-		while(pPacket->ReadPacket(&szType[0], nLength, &bCompound))
+		while(pPacket->ReadPacket(nType, nLength, &bCompound))
 		{
 			nNext = pPacket->m_nPosition + nLength;
 
-			if(strcmp("H", szType) == 0 && bCompound)
+			if(nType == G2PacketType::H && bCompound)
 			{
 				CQueryHit* pHit = (bFirstHit ? pThisHit : new CQueryHit());
 
@@ -201,11 +201,11 @@ CQueryHit* CQueryHit::ReadPacket(G2Packet* pPacket, QueryHitInfo* pHitInfo)
 				bool bHaveDN = false;
 				bool bHaveURN = false;
 
-				while(pPacket->m_nPosition < nNext && pPacket->ReadPacket(&szTypeX[0], nLengthX))
+				while(pPacket->m_nPosition < nNext && pPacket->ReadPacket(nTypeX, nLengthX))
 				{
 					nNextX = pPacket->m_nPosition + nLengthX;
 
-					if(strcmp("URN", szTypeX) == 0)
+					if(nTypeX == G2PacketType::URN)
 					{
 						QString sURN;
 						QByteArray hashBuff;
@@ -238,13 +238,13 @@ CQueryHit* CQueryHit::ReadPacket(G2Packet* pPacket, QueryHitInfo* pHitInfo)
 						}
 
 					}
-					else if(strcmp("URL", szTypeX) == 0 && nLengthX)
+					else if(nTypeX == G2PacketType::URL && nLengthX)
 					{
 						// if url empty - try uri-res resolver or a node do not have this object
 						// bez sensu...
 						pHit->m_sURL = pPacket->ReadString();
 					}
-					else if(strcmp("DN", szTypeX) == 0)
+					else if(nTypeX == G2PacketType::DN)
 					{
 						if(bHaveSize)
 						{
@@ -259,11 +259,11 @@ CQueryHit* CQueryHit::ReadPacket(G2Packet* pPacket, QueryHitInfo* pHitInfo)
 
 						bHaveDN = true;
 					}
-					else if(strcmp("MD", szTypeX) == 0)
+					else if(nTypeX == G2PacketType::MD)
 					{
 						pHit->m_sMetadata = pPacket->ReadString();
 					}
-					else if(strcmp("SZ", szTypeX) == 0 && nLengthX >= 4)
+					else if(nTypeX == G2PacketType::SZ && nLengthX >= 4)
 					{
 						if(nLengthX >= 8)
 						{
@@ -284,11 +284,11 @@ CQueryHit* CQueryHit::ReadPacket(G2Packet* pPacket, QueryHitInfo* pHitInfo)
 							bHaveSize = true;
 						}
 					}
-					else if(strcmp("CSC", szTypeX) == 0 && nLengthX >= 2)
+					else if(nTypeX == G2PacketType::CSC && nLengthX >= 2)
 					{
 						pHit->m_nCachedSources = pPacket->ReadIntLE<quint16>();
 					}
-					else if(strcmp("PART", szTypeX) == 0 && nLengthX >= 4)
+					else if(nTypeX == G2PacketType::PART && nLengthX >= 4)
 					{
 						pHit->m_bIsPartial = true;
 						pHit->m_nPartialBytesAvailable = pPacket->ReadIntLE<quint32>();
@@ -34,23 +34,87 @@
 
 #include "debug_new.h"
 
+// Guaranteed share of the limits per traffic class, in percent
+static const int g_nClassShare[tcCount] = { 20, 10, 35, 35 };
+
+CRateBudget::CRateBudget()
+{
+	m_nLimit = std::numeric_limits<qint32>::max() / 2;
+	m_nTokens = 0;
+	m_tRefill.invalidate();
+}
+
+void CRateBudget::SetLimit(qint64 nLimit)
+{
+	QMutexLocker l(&m_pSection);
+
+	m_nLimit = nLimit;
+	m_nTokens = qMin(m_nTokens, m_nLimit);
+}
+qint64 CRateBudget::Limit()
+{
+	QMutexLocker l(&m_pSection);
+
+	return m_nLimit;
+}
+qint64 CRateBudget::Take(qint64 nWanted)
+{
+	QMutexLocker l(&m_pSection);
+
+	if(!m_tRefill.isValid())
+	{
+		m_nTokens = m_nLimit;
+		m_tRefill.start();
+	}
+	else
+	{
+		// the clock restarts only once whole bytes were added, so slow limits still refill
+		qint64 nAdd = m_nLimit * qMin(qint64(1000), m_tRefill.elapsed()) / 1000;
+		if(nAdd > 0)
+		{
+			m_nTokens = qMin(m_nLimit, m_nTokens + nAdd);
+			m_tRefill.start();
+		}
+	}
+
+	qint64 nGranted = qMin(nWanted, m_nTokens);
+	m_nTokens -= nGranted;
+
+	return nGranted;
+}
+void CRateBudget::Return(qint64 nUnused)
+{
+	if(nUnused <= 0)
+	{
+		return;
+	}
+
+	QMutexLocker l(&m_pSection);
+
+	m_nTokens = qMin(m_nLimit, m_nTokens + nUnused);
+}
+
 CRateController::CRateController(QMutex* pMutex, QObject* parent): QObject(parent)
 {
 	m_bTransferSheduled = false;
+	m_bIdle = true;
 	m_nUploadLimit = std::numeric_limits<qint32>::max() / 2;
 	m_nDownloadLimit = std::numeric_limits<qint32>::max() / 2;
 	m_tStopWatch.invalidate();
 
 	m_pMutex = pMutex;
+	m_pDownloadBudget = 0;
+	m_pUploadBudget = 0;
 }
 
 void CRateController::AddSocket(CNetworkConnection* pSock)
 {
 	ASSUME_LOCK(*m_pMutex);
 
-	connect(pSock, SIGNAL(readyToTransfer()), this, SLOT(sheduleTransfer()));
+	connect(pSock, SIGNAL(readyToTransfer()), this, SLOT(socketReady()));
 	pSock->setReadBufferSize(8192);
 	m_lSockets.insert(pSock);
+	m_lReady[pSock->m_nTransferClass].insert(pSock);
 
 	QMetaObject::invokeMethod(this, "sheduleTransfer", Qt::QueuedConnection);
 }
@@ -60,8 +124,13 @@ void CRateController::RemoveSocket(CNetworkConnection* pSock)
 
 	if(m_lSockets.remove(pSock))
 	{
-		disconnect(pSock, SIGNAL(readyToTransfer()), this, SLOT(sheduleTransfer()));
+		disconnect(pSock, SIGNAL(readyToTransfer()), this, SLOT(socketReady()));
 		pSock->setReadBufferSize(0);
+
+		for(int i = 0; i < tcCount; ++i)
+		{
+			m_lReady[i].remove(pSock);
+		}
 	}
 }
 void CRateController::sheduleTransfer()
@@ -72,7 +141,17 @@ void CRateController::sheduleTransfer()
 	}
 
 	m_bTransferSheduled = true;
-	QTimer::singleShot(50, this, SLOT(transfer()));
+
+	// an idle controller serves new work on the next event loop pass,
+	// a busy one paces itself; the budget follows the elapsed time either way
+	QTimer::singleShot(m_bIdle ? 0 : 50, this, SLOT(transfer()));
+}
+// Runs in the controller thread, possibly with m_pMutex already held by the emitter
+void CRateController::socketReady()
+{
+	// the sender may be gone by the time a queued signal arrives, the pointer is only compared
+	m_lSignalled.insert(static_cast<CNetworkConnection*>(sender()));
+	sheduleTransfer();
 }
 void CRateController::transfer()
 {
@@ -80,6 +159,29 @@ void CRateController::transfer()
 
 	QMutexLocker l(m_pMutex);
 
+	for(QSet<CNetworkConnection*>::const_iterator itSocket = m_lSignalled.constBegin(); itSocket != m_lSignalled.constEnd(); ++itSocket)
+	{
+		CNetworkConnection* pSock = *itSocket;
+		if(m_lSockets.contains(pSock))
+		{
+			m_lReady[pSock->m_nTransferClass].insert(pSock);
+		}
+	}
+	m_lSignalled.clear();
+
+	bool bReady = false;
+	for(int i = 0; i < tcCount && !bReady; ++i)
+	{
+		bReady = !m_lReady[i].isEmpty();
+	}
+
+	m_bIdle = !bReady;
+
+	if(m_bIdle)
+	{
+		return;
+	}
+
 	qint64 nMsecs = 1000;
 	if(m_tStopWatch.isValid())
 	{
@@ -89,48 +191,106 @@ void CRateController::transfer()
 	qint64 nToRead = (m_nDownloadLimit * nMsecs) / 1000;
 	qint64 nToWrite = (m_nUploadLimit * nMsecs) / 1000;
 
+	// with a shared budget we may spend only what the other controllers left
+	if(m_pDownloadBudget)
+	{
+		nToRead = m_pDownloadBudget->Take(nToRead);
+	}
+	if(m_pUploadBudget)
+	{
+		nToWrite = m_pUploadBudget->Take(nToWrite);
+	}
+
 	if(nToRead == 0 && nToWrite == 0)
 	{
 		sheduleTransfer();
 		return;
 	}
 
-	QSet<CNetworkConnection*> lSockets;
-	for(QSet<CNetworkConnection*>::const_iterator itSocket = m_lSockets.constBegin(); itSocket != m_lSockets.constEnd(); ++itSocket)
+	m_tStopWatch.start();
+
+	// first every class spends its guaranteed share...
+	qint64 nReadLeft = nToRead, nWriteLeft = nToWrite;
+	for(int i = 0; i < tcCount; ++i)
 	{
-		CNetworkConnection* pSock = *itSocket;
-		if(pSock->HasData())
+		if(m_lReady[i].isEmpty())
 		{
-			lSockets.insert(pSock);
+			continue;
 		}
+
+		qint64 nRead = qMin(nReadLeft, nToRead * g_nClassShare[i] / 100);
+		qint64 nWrite = qMin(nWriteLeft, nToWrite * g_nClassShare[i] / 100);
+		nReadLeft -= nRead;
+		nWriteLeft -= nWrite;
+
+		transferClass(i, nRead, nWrite);
+
+		nReadLeft += nRead;
+		nWriteLeft += nWrite;
 	}
 
-	if(lSockets.isEmpty())
+	// ...then borrows what is left, higher priority classes first
+	for(int i = 0; i < tcCount && (nReadLeft > 0 || nWriteLeft > 0); ++i)
 	{
-		return;
+		if(!m_lReady[i].isEmpty())
+		{
+			transferClass(i, nReadLeft, nWriteLeft);
+		}
 	}
 
-	m_tStopWatch.start();
+	if(m_pDownloadBudget)
+	{
+		m_pDownloadBudget->Return(nReadLeft);
+	}
+	if(m_pUploadBudget)
+	{
+		m_pUploadBudget->Return(nWriteLeft);
+	}
 
-	bool bCanTransferMore = false;
-	bool bRestart = false;
+	m_bIdle = true;
+	for(int i = 0; i < tcCount && m_bIdle; ++i)
+	{
+		m_bIdle = m_lReady[i].isEmpty();
+	}
 
-	do
+	if(!m_bIdle)
+	{
+		sheduleTransfer();
+	}
+}
+
+// Splits the budget evenly among the ready sockets of nClass, returns the unused part in nToRead and nToWrite.
+// Sockets that have nothing more to do leave the ready set until they signal again.
+void CRateController::transferClass(int nClass, qint64& nToRead, qint64& nToWrite)
+{
+	QList<CNetworkConnection*> lSockets = m_lReady[nClass].toList();
+
+	quint32 nDownloaded = 0, nUploaded = 0;
+
+	while(!lSockets.isEmpty() && (nToRead > 0 || nToWrite > 0))
 	{
-		bCanTransferMore = false;
-		bRestart = false;
 		qint64 nWriteChunk = qMax(qint64(1), nToWrite / lSockets.size());
 		qint64 nReadChunk = qMax(qint64(1), nToRead / lSockets.size());
 
-		quint32 nDownloaded = 0, nUploaded = 0;
-
-		for(QSet<CNetworkConnection*>::iterator itSocket = lSockets.begin(); itSocket != lSockets.end() && (nToRead > 0 || nToWrite > 0);)
+		for(QList<CNetworkConnection*>::iterator itSocket = lSockets.begin(); itSocket != lSockets.end() && (nToRead > 0 || nToWrite > 0);)
 		{
 			CNetworkConnection* pConn = *itSocket;
 
+			if(pConn->m_nTransferClass != nClass)
+			{
+				// reclassified since it became ready, served with its new class from now on
+				m_lReady[nClass].remove(pConn);
+				m_lReady[pConn->m_nTransferClass].insert(pConn);
+				itSocket = lSockets.erase(itSocket);
+				continue;
+			}
+
 			bool bDataTransferred = false;
+			bool bBlocked = false;	// output is waiting, but the socket cannot take it now
+			bool bOutput = pConn->HasPendingOutput();
 
-			if(m_nUploadLimit * 2 > pConn->bytesToWrite())
+			// without output a 0 from writeToNetwork() means nothing, not a blocked socket
+			if(bOutput && m_nUploadLimit * 2 > pConn->bytesToWrite())
 			{
 				qint64 nChunkSize = qMin(qMin(nWriteChunk, nToWrite), m_nUploadLimit * 2 - pConn->bytesToWrite());
 
@@ -145,13 +305,17 @@ void CRateController::transfer()
 					}
 					else if( nBytesWritten == 0 )
 					{
-						bRestart = true;
+						bBlocked = true;
 					}
 				}
 			}
+			else if(bOutput)
+			{
+				bBlocked = true;
+			}
 
 			qint64 nAvailable = qMin(nReadChunk, pConn->networkBytesAvailable());
-			if(nAvailable > 0)
+			if(nAvailable > 0 && nToRead > 0)
 			{
 				qint64 nReadBytes = pConn->readFromNetwork(qMin(nAvailable, nToRead));
 				if(nReadBytes > 0)
@@ -164,25 +328,22 @@ void CRateController::transfer()
 
 			if(bDataTransferred && pConn->HasData())
 			{
-				bCanTransferMore = true;
+				++itSocket;
+				continue;
 			}
-			else
+
+			// idle with budget in both directions, wait for the next signal
+			if(!pConn->HasData() || (!bDataTransferred && !bBlocked && nToRead > 0 && nToWrite > 0))
 			{
-				itSocket = lSockets.erase(itSocket);
-				continue;
+				m_lReady[nClass].remove(pConn);
 			}
 
-			++itSocket;
+			itSocket = lSockets.erase(itSocket);
 		}
-
-		m_mDownload.Add(nDownloaded);
-		m_mUpload.Add(nUploaded);
 	}
-	while(bCanTransferMore && (nToRead > 0 || nToWrite > 0) && !lSockets.isEmpty());
 
-	if(bCanTransferMore || bRestart || nToRead == 0 || nToWrite == 0)
-	{
-		sheduleTransfer();
-	}
+	m_mDownload.Add(nDownloaded);
+	m_mUpload.Add(nUploaded);
+	m_mClassDownload[nClass].Add(nDownloaded);
+	m_mClassUpload[nClass].Add(nUploaded);
 }
-
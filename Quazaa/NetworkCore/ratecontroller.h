@@ -33,6 +33,30 @@
 
 #include "networkconnection.h"
 
+// Token bucket shared by several rate controllers, e.g. one per I/O thread.
+// Holds at most one second of the limit, controllers take what they are
+// about to spend and give back what they did not.
+class CRateBudget
+{
+protected:
+	QMutex			m_pSection;
+	qint64			m_nLimit;	// bytes per second
+	qint64			m_nTokens;
+	QElapsedTimer	m_tRefill;
+
+public:
+	CRateBudget();
+
+	void	SetLimit(qint64 nLimit);
+	qint64	Limit();
+	qint64	Take(qint64 nWanted);
+	void	Return(qint64 nUnused);
+};
+
+// Hierarchical token bucket over the sockets of one subsystem.
+// Every traffic class is guaranteed a share of the limits, budget a class
+// leaves unused is lent to the others in class order. Sockets are served
+// only after they signalled readyToTransfer, nothing is scanned per tick.
 class CRateController : public QObject
 {
 	Q_OBJECT
@@ -40,15 +64,22 @@ protected:
 	qint64  m_nUploadLimit;
 	qint64  m_nDownloadLimit;
 	bool    m_bTransferSheduled;
+	bool    m_bIdle;	// nothing was ready on the last tick
 	QMutex* 	m_pMutex;
+	CRateBudget*	m_pDownloadBudget;	// shared with other controllers, 0 = own limits only
+	CRateBudget*	m_pUploadBudget;
 
 	QElapsedTimer   m_tStopWatch;
 
 	QSet<CNetworkConnection*>   m_lSockets;
+	QSet<CNetworkConnection*>   m_lReady[tcCount];	// sockets with pending I/O, by class
+	QSet<CNetworkConnection*>   m_lSignalled;		// readyToTransfer received, not yet sorted into m_lReady (controller thread only)
 
 public:
 	TCPBandwidthMeter	m_mDownload;
 	TCPBandwidthMeter	m_mUpload;
+	TCPBandwidthMeter	m_mClassDownload[tcCount];
+	TCPBandwidthMeter	m_mClassUpload[tcCount];
 
 public:
 	CRateController(QMutex* pMutex, QObject* parent = 0);
@@ -65,6 +96,12 @@ public:
 		systemLog.postLog(LogSeverity::Debug, QString("New upload limit: %1").arg(nLimit));
 		m_nUploadLimit = nLimit;
 	}
+	// Budgets are read from the controller thread, set them before it starts
+	void SetBudget(CRateBudget* pDownload, CRateBudget* pUpload)
+	{
+		m_pDownloadBudget = pDownload;
+		m_pUploadBudget = pUpload;
+	}
 	qint32 UploadLimit() const
 	{
 		return m_nUploadLimit;
@@ -82,9 +119,21 @@ public:
 	{
 		return m_mUpload.AvgUsage();
 	}
+	quint32 DownloadSpeed(TransferClass nClass)
+	{
+		return m_mClassDownload[nClass].AvgUsage();
+	}
+	quint32 UploadSpeed(TransferClass nClass)
+	{
+		return m_mClassUpload[nClass].AvgUsage();
+	}
+
+protected:
+	void transferClass(int nClass, qint64& nToRead, qint64& nToWrite);
 
 public slots:
 	void sheduleTransfer();
+	void socketReady();
 	void transfer();
 };
 
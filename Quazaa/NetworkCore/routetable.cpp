@@ -28,11 +28,10 @@
 
 CRouteTable::CRouteTable()
 {
+	Clear();
 }
 CRouteTable::~CRouteTable()
 {
-	qDeleteAll(m_lRoutes);
-	m_lRoutes.clear();
 }
 
 bool CRouteTable::Add(QUuid& pGUID, CG2Node* pNeighbour, CEndPoint* pEndpoint, bool bNoExpire)
@@ -45,23 +44,26 @@ bool CRouteTable::Add(QUuid& pGUID, CG2Node* pNeighbour, CEndPoint* pEndpoint, b
 		return false;
 	}
 
-	if((quint32)m_lRoutes.size() >= MaxRoutes)
+	QMutexLocker l(&m_pSection);
+
+	if(m_nCount >= MaxRoutes)
 	{
-		ExpireOldRoutes(true);
+		Expire(true);
 	}
 
-	G2RouteItem* pRoute = 0;
+	quint32 nSlot = FindSlot(pGUID);
 
-	if( m_lRoutes.contains(pGUID) )
+	if(nSlot == RouteNone)
 	{
-		pRoute = m_lRoutes.value(pGUID);
+		nSlot = InsertSlot(pGUID);
 	}
 	else
 	{
-		pRoute = new G2RouteItem();
-		m_lRoutes.insert(pGUID, pRoute);
+		UnlinkBucket(nSlot);
 	}
 
+	G2RouteItem* pRoute = m_lSlots.data() + nSlot;
+
 	if(bNoExpire && pNeighbour)
 	{
 		pRoute->nExpireTime = 0;
@@ -71,18 +73,37 @@ bool CRouteTable::Add(QUuid& pGUID, CG2Node* pNeighbour, CEndPoint* pEndpoint, b
 		pRoute->nExpireTime = time(0) + RouteExpire;
 	}
 
-	pRoute->pGUID = pGUID;
+	LinkBucket(nSlot);
 
-	if(pNeighbour)
+	if(pNeighbour && pRoute->pNeighbour != pNeighbour)
 	{
+		UnlinkNode(nSlot);
 		pRoute->pNeighbour = pNeighbour;
+		LinkNode(nSlot);
 	}
+
 	if(pEndpoint)
 	{
-		pRoute->pEndpoint = *pEndpoint;
+		if(pEndpoint->protocol() == QAbstractSocket::IPv4Protocol)
+		{
+			quint32 nIPv4 = pEndpoint->toIPv4Address();
+			memcpy(pRoute->pAddress, &nIPv4, sizeof(quint32));
+			pRoute->nAddressType = 4;
+		}
+		else if(pEndpoint->protocol() == QAbstractSocket::IPv6Protocol)
+		{
+			Q_IPV6ADDR oIPv6 = pEndpoint->toIPv6Address();
+			memcpy(pRoute->pAddress, &oIPv6, sizeof(Q_IPV6ADDR));
+			pRoute->nAddressType = 6;
+		}
+		else
+		{
+			pRoute->nAddressType = 0;
+		}
+		pRoute->nPort = pEndpoint->port();
 	}
 
-	Q_ASSERT_X(m_lRoutes[pGUID]->pNeighbour != 0 || !m_lRoutes[pGUID]->pEndpoint.isNull(), Q_FUNC_INFO, "Whooops! No neighbour and no endpoint!");
+	Q_ASSERT_X(pRoute->pNeighbour != 0 || pRoute->nAddressType != 0, Q_FUNC_INFO, "Whooops! No neighbour and no endpoint!");
 
 	return true;
 
@@ -98,139 +119,407 @@ bool CRouteTable::Add(QUuid& pGUID, CEndPoint& pEndpoint, bool bNoExpire)
 
 void CRouteTable::Remove(QUuid& pGUID)
 {
-	G2RouteItem* pRoute = m_lRoutes.value(pGUID, 0);
-	if( pRoute )
+	QMutexLocker l(&m_pSection);
+
+	quint32 nSlot = FindSlot(pGUID);
+	if(nSlot != RouteNone)
 	{
-		m_lRoutes.remove(pGUID);
-		delete pRoute;
+		RemoveSlot(nSlot);
 	}
 }
+// Walks only the routes of pNeighbour
 void CRouteTable::Remove(CG2Node* pNeighbour)
 {
-	for(QHash<QUuid, G2RouteItem*>::iterator itRoute = m_lRoutes.begin(); itRoute != m_lRoutes.end();)
+	QMutexLocker l(&m_pSection);
+
+	QHash<CG2Node*, quint32>::iterator itHead = m_lNodeRoutes.find(pNeighbour);
+	if(itHead == m_lNodeRoutes.end())
+	{
+		return;
+	}
+
+	quint32 nSlot = itHead.value();
+	m_lNodeRoutes.erase(itHead);
+
+	while(nSlot != RouteNone)
 	{
-		if(itRoute.value()->pNeighbour == pNeighbour)
+		G2RouteItem* pRoute = m_lSlots.data() + nSlot;
+		const quint32 nNext = pRoute->nNodeNext;
+
+		UnlinkBucket(nSlot);
+		pRoute->pNeighbour = 0;
+		pRoute->nState = rsDeleted;
+		m_nCount--;
+		m_nDeleted++;
+
+		nSlot = nNext;
+	}
+}
+
+bool CRouteTable::Find(QUuid& pGUID, CG2Node** ppNeighbour, CEndPoint* pEndpoint)
+{
+	Q_ASSERT_X(ppNeighbour || pEndpoint, Q_FUNC_INFO, "Invalid arguments");
+
+	QMutexLocker l(&m_pSection);
+
+	quint32 nSlot = FindSlot(pGUID);
+	if(nSlot == RouteNone)
+	{
+		return false;
+	}
+
+	G2RouteItem* pRoute = m_lSlots.data() + nSlot;
+
+	if(ppNeighbour)
+	{
+		*ppNeighbour = pRoute->pNeighbour;
+	}
+	if(pEndpoint)
+	{
+		if(pRoute->nAddressType == 4)
 		{
-			delete *itRoute;
-			itRoute = m_lRoutes.erase(itRoute);
+			quint32 nIPv4;
+			memcpy(&nIPv4, pRoute->pAddress, sizeof(quint32));
+			pEndpoint->setAddress(nIPv4);
+			pEndpoint->setPort(pRoute->nPort);
+		}
+		else if(pRoute->nAddressType == 6)
+		{
+			Q_IPV6ADDR oIPv6;
+			memcpy(&oIPv6, pRoute->pAddress, sizeof(Q_IPV6ADDR));
+			pEndpoint->setAddress(oIPv6);
+			pEndpoint->setPort(pRoute->nPort);
 		}
 		else
 		{
-			itRoute++;
+			pEndpoint->clear();
 		}
 	}
+
+	Q_ASSERT_X(pRoute->pNeighbour != 0 || pRoute->nAddressType != 0, Q_FUNC_INFO, "Found GUID but no destination");
+
+	// routes to our neighbours themselves stay until the neighbour goes
+	if(pRoute->nExpireTime != 0)
+	{
+		UnlinkBucket(nSlot);
+		pRoute->nExpireTime = time(0) + RouteExpire;
+		LinkBucket(nSlot);
+	}
+
+	return true;
+}
+
+void CRouteTable::ExpireOldRoutes(bool bForce)
+{
+	QMutexLocker l(&m_pSection);
+	Expire(bForce);
+}
+
+void CRouteTable::Clear()
+{
+	QMutexLocker l(&m_pSection);
+
+	m_nBits = 10;
+	m_lSlots = QVector<G2RouteItem>(1 << m_nBits);
+	m_nCount = 0;
+	m_nDeleted = 0;
+
+	for(quint32 i = 0; i < RouteBuckets; ++i)
+	{
+		m_lBuckets[i] = RouteNone;
+	}
+	m_nExpireSpan = time(0) / RouteBucketSpan;
+
+	m_lNodeRoutes.clear();
 }
 
-bool CRouteTable::Find(QUuid& pGUID, CG2Node** ppNeighbour, CEndPoint* pEndpoint)
+// Cleans the buckets whose span has passed since the last call.
+// When forced, also evicts the routes that would expire soonest until the table is down to three quarters.
+void CRouteTable::Expire(bool bForce)
 {
-	Q_ASSERT_X(ppNeighbour || pEndpoint, Q_FUNC_INFO, "Invalid arguments");
+	const quint32 tNow = time(0);
+	const quint32 nNowSpan = tNow / RouteBucketSpan;
 
-	if(m_lRoutes.contains(pGUID))
+	for(quint32 i = 0; m_nExpireSpan < nNowSpan && i < RouteBuckets; ++i, ++m_nExpireSpan)
 	{
-		if(ppNeighbour)
+		ExpireBucket(m_nExpireSpan, tNow, false);
+	}
+	m_nExpireSpan = nNowSpan;
+
+	for(quint32 i = 0; bForce && i < RouteBuckets && m_nCount > MaxRoutes * 3 / 4; ++i)
+	{
+		ExpireBucket(nNowSpan + i, tNow, true);
+	}
+}
+
+void CRouteTable::Dump()
+{
+	QMutexLocker l(&m_pSection);
+
+	quint32 tNow = time(0);
+
+    systemLog.postLog(LogSeverity::Debug, "----------------------------------");
+    systemLog.postLog(LogSeverity::Debug, "Dumping routing table:");
+    systemLog.postLog(LogSeverity::Debug, QString("Table size: %1").arg(m_nCount));
+
+	for(int i = 0; i < m_lSlots.size(); ++i)
+	{
+		const G2RouteItem& oRoute = m_lSlots.at(i);
+		if(oRoute.nState != rsUsed)
 		{
-			*ppNeighbour = m_lRoutes[pGUID]->pNeighbour;
+			continue;
 		}
-		if(pEndpoint)
+
+		qint64 nExpire = oRoute.nExpireTime - tNow;
+		if(oRoute.nExpireTime == 0)
 		{
-			*pEndpoint = m_lRoutes[pGUID]->pEndpoint;
+			nExpire = 0;
 		}
 
-		Q_ASSERT_X(*ppNeighbour != 0 || !pEndpoint->isNull(), Q_FUNC_INFO, "Found GUID but no destination");
-
-		m_lRoutes[pGUID]->nExpireTime = time(0) + RouteExpire;
+		CEndPoint oEndpoint;
+		if(oRoute.nAddressType == 4)
+		{
+			quint32 nIPv4;
+			memcpy(&nIPv4, oRoute.pAddress, sizeof(quint32));
+			oEndpoint = CEndPoint(nIPv4, oRoute.nPort);
+		}
+		else if(oRoute.nAddressType == 6)
+		{
+			Q_IPV6ADDR oIPv6;
+			memcpy(&oIPv6, oRoute.pAddress, sizeof(Q_IPV6ADDR));
+			oEndpoint = CEndPoint(oIPv6, oRoute.nPort);
+		}
 
-		return true;
+		systemLog.postLog( LogSeverity::Debug, Components::G2, "%s %i %s TTL %i",
+		                   qPrintable( oRoute.pGUID.toString() ), oRoute.pNeighbour,
+                           qPrintable( oEndpoint.toString() ), nExpire );
 	}
 
-	return false;
+    systemLog.postLog(LogSeverity::Debug, "End of data");
+    systemLog.postLog(LogSeverity::Debug, "----------------------------------");
 }
 
-void CRouteTable::ExpireOldRoutes(bool bForce)
+quint32 CRouteTable::FindSlot(const QUuid& oGUID) const
 {
-	quint32 tNow = time(0);
+	const quint32 nMask = (1u << m_nBits) - 1;
+	const G2RouteItem* pSlots = m_lSlots.constData();
 
-    // First expired.
-	for(QHash<QUuid, G2RouteItem*>::iterator itRoute = m_lRoutes.begin(); itRoute != m_lRoutes.end();)
+	// multiplicative mixing, the top bits of the product are the best ones
+	quint32 nSlot = (qHash(oGUID) * 2654435769u) >> (32 - m_nBits);
+
+	for(;;)
 	{
-		if(itRoute.value()->nExpireTime < tNow)
+		if(pSlots[nSlot].nState == rsEmpty)
 		{
-			delete *itRoute;
-			itRoute = m_lRoutes.erase(itRoute);
+			return RouteNone;
 		}
-		else
+		if(pSlots[nSlot].nState == rsUsed && pSlots[nSlot].pGUID == oGUID)
 		{
-			itRoute++;
+			return nSlot;
 		}
+		nSlot = (nSlot + 1) & nMask;
+	}
+}
+// Takes a free slot for a GUID that is not in the table yet, the slot is linked nowhere
+quint32 CRouteTable::InsertSlot(const QUuid& oGUID)
+{
+	// keep at least half of the slots empty so probe sequences stay short
+	if((m_nCount + m_nDeleted + 1) * 2 > (1u << m_nBits))
+	{
+		// grow once live routes take a quarter, otherwise dropping the tombstones is enough
+		Resize((m_nCount + 1) * 4 > (1u << m_nBits) ? m_nBits + 1 : m_nBits);
+	}
+
+	const quint32 nMask = (1u << m_nBits) - 1;
+	G2RouteItem* pSlots = m_lSlots.data();
+
+	quint32 nSlot = (qHash(oGUID) * 2654435769u) >> (32 - m_nBits);
+
+	while(pSlots[nSlot].nState == rsUsed)
+	{
+		nSlot = (nSlot + 1) & nMask;
 	}
 
-    // Now, we are forced to clean something
-    // only if the list is full at 75%
+	if(pSlots[nSlot].nState == rsDeleted)
+	{
+		m_nDeleted--;
+	}
+	m_nCount++;
+
+	G2RouteItem* pRoute = pSlots + nSlot;
+	pRoute->pGUID = oGUID;
+	pRoute->pNeighbour = 0;
+	pRoute->nExpireTime = 0;
+	pRoute->nNodePrev = pRoute->nNodeNext = RouteNone;
+	pRoute->nBucketPrev = pRoute->nBucketNext = RouteNone;
+	pRoute->nAddressType = 0;
+	pRoute->nPort = 0;
+	pRoute->nState = rsUsed;
+
+	return nSlot;
+}
+void CRouteTable::RemoveSlot(quint32 nSlot)
+{
+	UnlinkBucket(nSlot);
+	UnlinkNode(nSlot);
+
+	G2RouteItem* pRoute = m_lSlots.data() + nSlot;
+	pRoute->pNeighbour = 0;
+	pRoute->nState = rsDeleted;
 
-	if(bForce && m_lRoutes.size() >= MaxRoutes * 0.75)
+	m_nCount--;
+	m_nDeleted++;
+}
+// Rebuilds the table with 2^nBits slots, links are rebuilt for the new slot indexes
+void CRouteTable::Resize(quint32 nBits)
+{
+	QVector<G2RouteItem> lOld = m_lSlots;
+
+	m_nBits = nBits;
+	m_lSlots = QVector<G2RouteItem>(1 << m_nBits);
+	m_nCount = 0;
+	m_nDeleted = 0;
+
+	for(quint32 i = 0; i < RouteBuckets; ++i)
 	{
-		qint32 tExpire = RouteExpire;
+		m_lBuckets[i] = RouteNone;
+	}
+	m_lNodeRoutes.clear();
 
-		while(m_lRoutes.size() > MaxRoutes * 0.75)
+	for(int i = 0; i < lOld.size(); ++i)
+	{
+		const G2RouteItem& oOld = lOld.at(i);
+		if(oOld.nState != rsUsed)
 		{
-			if( tExpire > 0 )
-			{
-				tExpire /= 2;
-			}
-			else if( tExpire < 0 )
-			{
-				tExpire *= 2;
-			}
-			else
-			{
-				tExpire = -10;
-			}
-
-            // We reduce the hash to three quarters of its value.
-			for( QHash<QUuid, G2RouteItem*>::iterator itRoute = m_lRoutes.begin(); itRoute != m_lRoutes.end() && m_lRoutes.size() > MaxRoutes * 0.75; )
-			{
-				if( itRoute.value()->nExpireTime < tNow + tExpire )
-				{
-					delete *itRoute;
-					itRoute = m_lRoutes.erase(itRoute);
-				}
-				else
-				{
-					itRoute++;
-				}
-			}
+			continue;
 		}
+
+		quint32 nSlot = InsertSlot(oOld.pGUID);
+		G2RouteItem* pRoute = m_lSlots.data() + nSlot;
+
+		pRoute->pNeighbour = oOld.pNeighbour;
+		pRoute->nExpireTime = oOld.nExpireTime;
+		memcpy(pRoute->pAddress, oOld.pAddress, sizeof(pRoute->pAddress));
+		pRoute->nPort = oOld.nPort;
+		pRoute->nAddressType = oOld.nAddressType;
+
+		LinkBucket(nSlot);
+		LinkNode(nSlot);
 	}
 }
 
-void CRouteTable::Clear()
+void CRouteTable::LinkNode(quint32 nSlot)
 {
-	qDeleteAll(m_lRoutes);
-	m_lRoutes.clear();
+	G2RouteItem* pRoute = m_lSlots.data() + nSlot;
+
+	if(!pRoute->pNeighbour)
+	{
+		return;
+	}
+
+	pRoute->nNodePrev = RouteNone;
+
+	QHash<CG2Node*, quint32>::iterator itHead = m_lNodeRoutes.find(pRoute->pNeighbour);
+	if(itHead == m_lNodeRoutes.end())
+	{
+		pRoute->nNodeNext = RouteNone;
+		m_lNodeRoutes.insert(pRoute->pNeighbour, nSlot);
+	}
+	else
+	{
+		pRoute->nNodeNext = itHead.value();
+		m_lSlots[itHead.value()].nNodePrev = nSlot;
+		itHead.value() = nSlot;
+	}
 }
+void CRouteTable::UnlinkNode(quint32 nSlot)
+{
+	G2RouteItem* pRoute = m_lSlots.data() + nSlot;
 
-void CRouteTable::Dump()
+	if(!pRoute->pNeighbour)
+	{
+		return;
+	}
+
+	if(pRoute->nNodePrev != RouteNone)
+	{
+		m_lSlots[pRoute->nNodePrev].nNodeNext = pRoute->nNodeNext;
+	}
+	else if(pRoute->nNodeNext != RouteNone)
+	{
+		m_lNodeRoutes[pRoute->pNeighbour] = pRoute->nNodeNext;
+	}
+	else
+	{
+		m_lNodeRoutes.remove(pRoute->pNeighbour);
+	}
+
+	if(pRoute->nNodeNext != RouteNone)
+	{
+		m_lSlots[pRoute->nNodeNext].nNodePrev = pRoute->nNodePrev;
+	}
+
+	pRoute->nNodePrev = pRoute->nNodeNext = RouteNone;
+}
+void CRouteTable::LinkBucket(quint32 nSlot)
 {
+	G2RouteItem* pRoute = m_lSlots.data() + nSlot;
 
-	quint32 tNow = time(0);
+	if(pRoute->nExpireTime == 0)
+	{
+		return;
+	}
 
-    systemLog.postLog(LogSeverity::Debug, "----------------------------------");
-    systemLog.postLog(LogSeverity::Debug, "Dumping routing table:");
-    systemLog.postLog(LogSeverity::Debug, QString("Table size: ").arg(m_lRoutes.size()));
+	quint32& nHead = m_lBuckets[(pRoute->nExpireTime / RouteBucketSpan) % RouteBuckets];
 
-	for(QHash<QUuid, G2RouteItem*>::iterator itRoute = m_lRoutes.begin(); itRoute != m_lRoutes.end(); itRoute++)
+	pRoute->nBucketPrev = RouteNone;
+	pRoute->nBucketNext = nHead;
+	if(nHead != RouteNone)
 	{
-		qint64 nExpire = itRoute.value()->nExpireTime - tNow;
-		if(itRoute.value()->nExpireTime == 0)
-		{
-			nExpire = 0;
-		}
-		systemLog.postLog( LogSeverity::Debug, Components::G2, "%s %i %s TTL %i",
-		                   qPrintable( itRoute.key().toString() ), itRoute.value()->pNeighbour,
-                           qPrintable( itRoute.value()->pEndpoint.toString() ), nExpire );
+		m_lSlots[nHead].nBucketPrev = nSlot;
 	}
+	nHead = nSlot;
+}
+void CRouteTable::UnlinkBucket(quint32 nSlot)
+{
+	G2RouteItem* pRoute = m_lSlots.data() + nSlot;
 
-    systemLog.postLog(LogSeverity::Debug, "End of data");
-    systemLog.postLog(LogSeverity::Debug, "----------------------------------");
+	if(pRoute->nExpireTime == 0)
+	{
+		return;
+	}
+
+	if(pRoute->nBucketPrev != RouteNone)
+	{
+		m_lSlots[pRoute->nBucketPrev].nBucketNext = pRoute->nBucketNext;
+	}
+	else
+	{
+		m_lBuckets[(pRoute->nExpireTime / RouteBucketSpan) % RouteBuckets] = pRoute->nBucketNext;
+	}
+
+	if(pRoute->nBucketNext != RouteNone)
+	{
+		m_lSlots[pRoute->nBucketNext].nBucketPrev = pRoute->nBucketPrev;
+	}
+
+	pRoute->nBucketPrev = pRoute->nBucketNext = RouteNone;
 }
+// Removes the expired routes of one bucket, or with bEvict all of them while the table is over three quarters
+void CRouteTable::ExpireBucket(quint32 nSpan, quint32 tNow, bool bEvict)
+{
+	quint32 nSlot = m_lBuckets[nSpan % RouteBuckets];
+
+	while(nSlot != RouteNone && (!bEvict || m_nCount > MaxRoutes * 3 / 4))
+	{
+		const quint32 nNext = m_lSlots.at(nSlot).nBucketNext;
 
+		// the bucket may also hold routes of a later span
+		if(bEvict || m_lSlots.at(nSlot).nExpireTime < tNow)
+		{
+			RemoveSlot(nSlot);
+		}
+
+		nSlot = nNext;
+	}
+}
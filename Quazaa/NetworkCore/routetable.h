@@ -26,28 +26,60 @@
 
 #include "types.h"
 #include <QHash>
+#include <QMutex>
+#include <QVector>
 
 class CG2Node;
 
+const quint32 MaxRoutes = 50000;
+const quint32 RouteExpire = 600;
+const quint32 RouteBucketSpan = 10;		// seconds of expire times per bucket
+const quint32 RouteBuckets = 128;		// RouteBuckets * RouteBucketSpan must exceed RouteExpire plus the cleaning interval
+const quint32 RouteNone = 0xffffffff;	// null slot index
+
+// One slot of the route table, stored inline.
+// Live slots are linked into their neighbour's list and into the bucket of their expire time, by slot index.
 struct G2RouteItem
 {
-	QUuid           pGUID;
-	CG2Node*        pNeighbour;
-	CEndPoint	    pEndpoint;
-	quint32         nExpireTime;
+	QUuid		pGUID;
+	CG2Node*	pNeighbour;
+	quint32		nExpireTime;	// 0 = never
+	quint32		nNodePrev;
+	quint32		nNodeNext;
+	quint32		nBucketPrev;
+	quint32		nBucketNext;
+	quint8		pAddress[16];	// endpoint, IPv4 in the first 4 bytes
+	quint16		nPort;
+	quint8		nAddressType;	// 0 = no endpoint, 4 or 6
+	quint8		nState;			// slot state, see CRouteTable
 
 	G2RouteItem()
 	{
 		pNeighbour = 0;
 		nExpireTime = 0;
+		nAddressType = 0;
+		nState = 0;
 	}
-
 };
 
+// Open addressing GUID table with linear probing.
+// Expiry walks only the buckets whose time has come, removing a neighbour walks only its routes.
+// Public methods lock the table themselves, it is used from all neighbour worker threads.
 class CRouteTable
 {
 protected:
-	QHash<QUuid, G2RouteItem*>  m_lRoutes;
+	enum SlotState { rsEmpty, rsUsed, rsDeleted };
+
+	QMutex						m_pSection;
+
+	QVector<G2RouteItem>		m_lSlots;		// size is a power of two
+	quint32						m_nBits;		// log2 of m_lSlots.size()
+	quint32						m_nCount;		// live routes
+	quint32						m_nDeleted;		// tombstones
+	quint32						m_lBuckets[RouteBuckets];	// heads of the expiry lists
+	quint32						m_nExpireSpan;	// first bucket span not yet cleaned
+	QHash<CG2Node*, quint32>	m_lNodeRoutes;	// head of each neighbour's route list
+
 public:
 	CRouteTable();
 	~CRouteTable();
@@ -65,8 +97,19 @@ public:
 	void Clear();
 
 	void Dump();
+
+protected:
+	quint32 FindSlot(const QUuid& oGUID) const;
+	quint32 InsertSlot(const QUuid& oGUID);
+	void RemoveSlot(quint32 nSlot);
+	void Resize(quint32 nBits);
+
+	void LinkNode(quint32 nSlot);
+	void UnlinkNode(quint32 nSlot);
+	void LinkBucket(quint32 nSlot);
+	void UnlinkBucket(quint32 nSlot);
+	void Expire(bool bForce);
+	void ExpireBucket(quint32 nSpan, quint32 tNow, bool bEvict);
 };
 
-const quint32 MaxRoutes = 50000;
-const quint32 RouteExpire = 600;
 #endif // ROUTETABLE_H
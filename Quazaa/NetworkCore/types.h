@@ -68,6 +68,9 @@ enum NodeState { nsClosed, nsConnecting, nsHandshaking, nsConnected, nsClosing,
 
 enum G2NodeType {G2_UNKNOWN = 0, G2_LEAF = 1, G2_HUB = 2};
 
+// Traffic classes of the rate controllers, in borrowing priority order
+enum TransferClass { tcControl, tcSearch, tcDownload, tcUpload, tcCount };
+
 const quint64 SIZE_UNKNOWN = ~0ull;
 
 typedef unsigned char BYTE;
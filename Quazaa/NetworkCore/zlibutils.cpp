@@ -25,73 +25,195 @@
 #include "zlibutils.h"
 #include "zlib.h"
 
+#include <QThreadStorage>
+#include <cstring>
+
 #include "debug_new.h"
 
-QMutex ZLibUtils::m_oMutex;
-CBuffer ZLibUtils::m_oCompressBuffer(262144); // 256KB
+// Streams of one thread, reset between uses instead of being set up again
+struct ZLibContext
+{
+	z_stream	m_oInflate;
+	z_stream	m_oDeflate;
+	bool		m_bInflate;		// m_oInflate initialised
+	bool		m_bDeflate;		// m_oDeflate initialised
+	CBuffer		m_oBuffer;		// output of the in-place variants, swapped with the caller's buffer
+
+	ZLibContext() :
+		m_bInflate(false),
+		m_bDeflate(false),
+		m_oBuffer(262144) // 256KB
+	{
+		memset(&m_oInflate, 0, sizeof(z_stream));
+		memset(&m_oDeflate, 0, sizeof(z_stream));
+	}
+	~ZLibContext()
+	{
+		if(m_bInflate)
+		{
+			inflateEnd(&m_oInflate);
+		}
+		if(m_bDeflate)
+		{
+			deflateEnd(&m_oDeflate);
+		}
+	}
+
+	z_stream* Inflater()
+	{
+		if(!m_bInflate)
+		{
+			m_bInflate = (inflateInit(&m_oInflate) == Z_OK);
+			return m_bInflate ? &m_oInflate : 0;
+		}
 
-bool ZLibUtils::Compress(CBuffer& pSrc, bool bIfSmaller)
+		inflateReset(&m_oInflate);
+		return &m_oInflate;
+	}
+	z_stream* Deflater()
+	{
+		if(!m_bDeflate)
+		{
+			m_bDeflate = (deflateInit(&m_oDeflate, Z_DEFAULT_COMPRESSION) == Z_OK);
+			return m_bDeflate ? &m_oDeflate : 0;
+		}
+
+		deflateReset(&m_oDeflate);
+		return &m_oDeflate;
+	}
+};
+
+static QThreadStorage<ZLibContext*> g_oContexts;
+
+static ZLibContext* GetContext()
 {
-	QMutexLocker l(&ZLibUtils::m_oMutex);
+	if(!g_oContexts.hasLocalData())
+	{
+		g_oContexts.setLocalData(new ZLibContext());
+	}
+
+	return g_oContexts.localData();
+}
 
+bool ZLibUtils::Compress(CBuffer& pSrc, bool bIfSmaller)
+{
 	if(bIfSmaller && pSrc.size() < 64)
 	{
 		return false;
 	}
 
-	ulong nCompress = qMax(ZLibUtils::m_oCompressBuffer.size(), pSrc.size() * 2);
+	CBuffer& oBuffer = GetContext()->m_oBuffer;
+	oBuffer.clear();
 
-	ZLibUtils::m_oCompressBuffer.resize(nCompress);
-
-	int nRet = ::compress((Bytef*)ZLibUtils::m_oCompressBuffer.data(), &nCompress, (const Bytef*)pSrc.data(), pSrc.size());
+	if(!Compress(pSrc.data(), pSrc.size(), oBuffer))
+	{
+		return false;
+	}
 
-	if(nRet != Z_OK)
+	if(bIfSmaller && oBuffer.size() > pSrc.size())
 	{
-		Q_ASSERT(nRet != Z_BUF_ERROR);
 		return false;
 	}
 
-	ZLibUtils::m_oCompressBuffer.resize(nCompress);
+	pSrc.swap(oBuffer);
+
+	return true;
+}
 
-	if(bIfSmaller && ZLibUtils::m_oCompressBuffer.size() > pSrc.size())
+bool ZLibUtils::Uncompress(CBuffer& pSrc, quint32 nLimit)
+{
+	CBuffer& oBuffer = GetContext()->m_oBuffer;
+	oBuffer.clear();
+
+	if(!Uncompress(pSrc.data(), pSrc.size(), oBuffer, nLimit))
 	{
 		return false;
 	}
 
-	pSrc.clear();
-	pSrc.append(ZLibUtils::m_oCompressBuffer);
+	pSrc.swap(oBuffer);
 
 	return true;
 }
 
-bool ZLibUtils::Uncompress(CBuffer& pSrc)
+bool ZLibUtils::Compress(const char* pData, quint32 nLength, CBuffer& oDest)
 {
-	QMutexLocker l(&ZLibUtils::m_oMutex);
+	z_stream* pStream = GetContext()->Deflater();
+	if(!pStream)
+	{
+		return false;
+	}
+
+	// one pass, the bound covers incompressible input
+	const quint32 nBound = deflateBound(pStream, nLength);
+	oDest.ensure(nBound);
+
+	pStream->next_in = (Bytef*)pData;
+	pStream->avail_in = nLength;
+	pStream->next_out = (Bytef*)oDest.data() + oDest.size();
+	pStream->avail_out = nBound;
 
-	for(ulong nSize = qMax(pSrc.size() * 6u, 1024u); ; nSize *= 2)
+	int nRet = deflate(pStream, Z_FINISH);
+
+	if(nRet != Z_STREAM_END)
 	{
-		ZLibUtils::m_oCompressBuffer.resize(nSize);
+		Q_ASSERT(nRet != Z_BUF_ERROR);
+		return false;
+	}
 
-		ulong nCompress = ZLibUtils::m_oCompressBuffer.size();
+	oDest.resize(oDest.size() + nBound - pStream->avail_out);
 
-		int nRet = ::uncompress((Bytef*)ZLibUtils::m_oCompressBuffer.data(), &nCompress, (Bytef*)pSrc.data(), pSrc.size());
+	return true;
+}
 
-		if(nRet == Z_OK)
+bool ZLibUtils::Uncompress(const char* pData, quint32 nLength, CBuffer& oDest, quint32 nLimit)
+{
+	z_stream* pStream = GetContext()->Inflater();
+	if(!pStream)
+	{
+		return false;
+	}
+
+	const quint32 nStart = oDest.size();
+
+	pStream->next_in = (Bytef*)pData;
+	pStream->avail_in = nLength;
+
+	for(;;)
+	{
+		const quint32 nProduced = oDest.size() - nStart;
+
+		// one byte over the limit tells a stream that ends exactly there from a longer one
+		if(nProduced > nLimit)
 		{
-			ZLibUtils::m_oCompressBuffer.resize(nCompress);
-			pSrc.clear();
-			pSrc.append(ZLibUtils::m_oCompressBuffer);
+			break;
+		}
+
+		const quint32 nChunk = quint32(qMin<quint64>(qMax(nLength * 4, 4096u), quint64(nLimit) - nProduced + 1));
+		oDest.ensure(nChunk);
 
+		pStream->next_out = (Bytef*)oDest.data() + oDest.size();
+		pStream->avail_out = nChunk;
+
+		int nRet = inflate(pStream, Z_NO_FLUSH);
+
+		oDest.resize(oDest.size() + nChunk - pStream->avail_out);
+
+		if(nRet == Z_STREAM_END)
+		{
+			if(oDest.size() - nStart <= nLimit)
+			{
+				return true;
+			}
 			break;
 		}
 
-		if(nRet != Z_BUF_ERROR)
+		// corrupt, or truncated input that cannot make progress any more
+		if(nRet != Z_OK || (pStream->avail_in == 0 && pStream->avail_out != 0))
 		{
-			return false;
+			break;
 		}
 	}
 
-	return true;
-
+	oDest.resize(nStart);
+	return false;
 }
-
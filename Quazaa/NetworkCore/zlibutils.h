@@ -26,18 +26,19 @@
 #define ZLIBUTILS_H
 
 #include "buffer.h"
-#include <QMutex>
-#include <QMutexLocker>
 
+// zlib helpers. Every thread works with its own reusable streams, so callers never wait on each other.
 class ZLibUtils
 {
 public:
-
-	static QMutex m_oMutex;
-	static CBuffer m_oCompressBuffer;
-
+	// In-place variants, pSrc is replaced by the result
 	static bool Compress(CBuffer& pSrc, bool bIfSmaller = false);
-	static bool Uncompress(CBuffer& pSrc);
+	static bool Uncompress(CBuffer& pSrc, quint32 nLimit = 0xffffffff);
+
+	// Append the (de)compressed form of pData to oDest, oDest is left unchanged on failure.
+	// Inflating stops with an error once the output would exceed nLimit bytes.
+	static bool Compress(const char* pData, quint32 nLength, CBuffer& oDest);
+	static bool Uncompress(const char* pData, quint32 nLength, CBuffer& oDest, quint32 nLimit = 0xffffffff);
 };
 
 #endif // ZLIBUTILS_H
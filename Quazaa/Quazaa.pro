@@ -278,6 +278,7 @@ HEADERS += \
 		NetworkCore/handshakes.h \
 		NetworkCore/Hashes/hash.h \
 		NetworkCore/hubhorizon.h \
+		NetworkCore/localsearch.h \
 		NetworkCore/managedsearch.h \
 		NetworkCore/neighbour.h \
 		NetworkCore/neighbours.h \
@@ -285,12 +286,14 @@ HEADERS += \
 		NetworkCore/neighboursconnections.h \
 		NetworkCore/neighboursg2.h \
 		NetworkCore/neighboursrouting.h \
+		NetworkCore/neighboursworker.h \
 		NetworkCore/network.h \
 		NetworkCore/networkconnection.h \
 		NetworkCore/parser.h \
 		NetworkCore/query.h \
 		NetworkCore/queryhashgroup.h \
 		NetworkCore/queryhashmaster.h \
+		NetworkCore/queryhashops.h \
 		NetworkCore/queryhashtable.h \
 		NetworkCore/queryhit.h \
 		NetworkCore/querykeys.h \
@@ -309,6 +312,7 @@ HEADERS += \
 		ShareManager/file.h \
 		ShareManager/filehasher.h \
 		ShareManager/sharedfile.h \
+		ShareManager/shareindex.h \
 		ShareManager/sharemanager.h \
 		Skin/skinsettings.h \
 		systemlog.h \
@@ -318,6 +322,10 @@ HEADERS += \
 		Transfers/downloadtransfer.h \
 		Transfers/transfer.h \
 		Transfers/transfers.h \
+		Transfers/uploadqueue.h \
+		Transfers/uploadqueues.h \
+		Transfers/uploads.h \
+		Transfers/uploadtransfer.h \
 		UI/completerlineedit.h \
 		UI/dialogabout.h \
 		UI/dialogadddownload.h \
@@ -441,6 +449,7 @@ SOURCES += \
 		NetworkCore/handshakes.cpp \
 		NetworkCore/Hashes/hash.cpp \
 		NetworkCore/hubhorizon.cpp \
+		NetworkCore/localsearch.cpp \
 		NetworkCore/managedsearch.cpp \
 		NetworkCore/neighbour.cpp \
 		NetworkCore/neighbours.cpp \
@@ -448,12 +457,14 @@ SOURCES += \
 		NetworkCore/neighboursconnections.cpp \
 		NetworkCore/neighboursg2.cpp \
 		NetworkCore/neighboursrouting.cpp \
+		NetworkCore/neighboursworker.cpp \
 		NetworkCore/network.cpp \
 		NetworkCore/networkconnection.cpp \
 		NetworkCore/parser.cpp \
 		NetworkCore/query.cpp \
 		NetworkCore/queryhashgroup.cpp \
 		NetworkCore/queryhashmaster.cpp \
+		NetworkCore/queryhashops.cpp \
 		NetworkCore/queryhashtable.cpp \
 		NetworkCore/queryhit.cpp \
 		NetworkCore/querykeys.cpp \
@@ -471,6 +482,7 @@ SOURCES += \
 		ShareManager/file.cpp \
 		ShareManager/filehasher.cpp \
 		ShareManager/sharedfile.cpp \
+		ShareManager/shareindex.cpp \
 		ShareManager/sharemanager.cpp \
 		Skin/skinsettings.cpp \
 		systemlog.cpp \
@@ -480,6 +492,10 @@ SOURCES += \
 		Transfers/downloadtransfer.cpp \
 		Transfers/transfer.cpp \
 		Transfers/transfers.cpp \
+		Transfers/uploadqueue.cpp \
+		Transfers/uploadqueues.cpp \
+		Transfers/uploads.cpp \
+		Transfers/uploadtransfer.cpp \
 		UI/completerlineedit.cpp \
 		UI/dialogabout.cpp \
 		UI/dialogadddownload.cpp \
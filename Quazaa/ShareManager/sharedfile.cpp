@@ -116,6 +116,7 @@ void CSharedFile::serialize(QSqlDatabase* pDatabase)
 
 		qint64 nFileID = query.lastInsertId().toLongLong();
 		qDebug() << "New file ID: " << nFileID;
+		m_nFileID = nFileID;
 
 		QSqlQuery q2( *pDatabase );
 		q2.exec( QString( "DELETE FROM hashes WHERE file_id = %1" ).arg( nFileID ) );
@@ -0,0 +1,284 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "shareindex.h"
+
+#include <QFileInfo>
+#include <QRegExp>
+#include <QStringList>
+
+#include "queryhashtable.h"
+#include "Hashes/hash.h"
+
+#include "debug_new.h"
+
+CShareIndex::CShareIndex()
+{
+}
+
+CShareIndex::~CShareIndex()
+{
+	Clear();
+}
+
+void CShareIndex::Add(quint64 nFileID, const QString& sPath, quint64 nSize, const QByteArray& baSHA1)
+{
+	ShareIndexEntry* pEntry = new ShareIndexEntry();
+	pEntry->m_nFileID = nFileID;
+	pEntry->m_sPath = sPath;
+	pEntry->m_sName = QFileInfo(sPath).fileName();
+	pEntry->m_nSize = nSize;
+	pEntry->m_baSHA1 = baSHA1;
+	MakeKeywords(pEntry->m_sName, pEntry->m_lKeywords);
+
+	QMutexLocker l(&m_pSection);
+
+	QHash<quint64, ShareIndexEntry*>::iterator itFile = m_lFiles.find(nFileID);
+	if(itFile != m_lFiles.end())
+	{
+		RemoveEntry(itFile.value());
+	}
+
+	m_lFiles.insert(nFileID, pEntry);
+
+	foreach(quint32 nHash, pEntry->m_lKeywords)
+	{
+		m_lKeywords[nHash].append(pEntry);
+	}
+
+	if(!baSHA1.isEmpty())
+	{
+		m_lSHA1.insert(baSHA1, pEntry);
+	}
+}
+
+void CShareIndex::Remove(quint64 nFileID)
+{
+	QMutexLocker l(&m_pSection);
+
+	QHash<quint64, ShareIndexEntry*>::iterator itFile = m_lFiles.find(nFileID);
+	if(itFile != m_lFiles.end())
+	{
+		RemoveEntry(itFile.value());
+	}
+}
+
+void CShareIndex::Clear()
+{
+	QMutexLocker l(&m_pSection);
+
+	qDeleteAll(m_lFiles);
+	m_lFiles.clear();
+	m_lKeywords.clear();
+	m_lSHA1.clear();
+}
+
+// Unlinks pEntry from all indices and deletes it, caller holds the lock
+void CShareIndex::RemoveEntry(ShareIndexEntry* pEntry)
+{
+	foreach(quint32 nHash, pEntry->m_lKeywords)
+	{
+		QHash<quint32, QVector<ShareIndexEntry*> >::iterator itWord = m_lKeywords.find(nHash);
+		if(itWord == m_lKeywords.end())
+		{
+			continue;
+		}
+
+		QVector<ShareIndexEntry*>& lPostings = itWord.value();
+		int nIndex = lPostings.indexOf(pEntry);
+		if(nIndex != -1)
+		{
+			// order does not matter, swap with the last posting
+			lPostings[nIndex] = lPostings.last();
+			lPostings.pop_back();
+		}
+
+		if(lPostings.isEmpty())
+		{
+			m_lKeywords.erase(itWord);
+		}
+	}
+
+	// other files with the same content stay indexed
+	m_lSHA1.remove(pEntry->m_baSHA1, pEntry);
+
+	m_lFiles.remove(pEntry->m_nFileID);
+	delete pEntry;
+}
+
+int CShareIndex::Search(CQueryPtr pQuery, QList<ShareIndexEntry>& lResults, int nMaximum)
+{
+	if(nMaximum <= 0)
+	{
+		return 0;
+	}
+
+	// negative words and phrases are matched as substrings of the file name
+	QStringList lNegative;
+	foreach(QString sWord, pQuery->m_sG2NegativeWords.split(",", QString::SkipEmptyParts))
+	{
+		sWord.remove('"');
+		if(sWord.startsWith('-'))
+		{
+			sWord.remove(0, 1);
+		}
+		if(!sWord.isEmpty())
+		{
+			lNegative.append(sWord);
+		}
+	}
+
+	QMutexLocker l(&m_pSection);
+
+	int nFound = 0;
+
+	// URN queries are answered from the hash index alone
+	if(!pQuery->m_lHashes.isEmpty())
+	{
+		foreach(const CHash& oHash, pQuery->m_lHashes)
+		{
+			if(oHash.getAlgorithm() != CHash::SHA1)
+			{
+				continue;
+			}
+
+			ShareIndexEntry* pEntry = m_lSHA1.value(oHash.RawValue(), 0);
+			if(pEntry && pEntry->m_nSize >= pQuery->m_nMinimumSize && pEntry->m_nSize <= pQuery->m_nMaximumSize)
+			{
+				lResults.append(*pEntry);
+				nFound++;
+				break;
+			}
+		}
+
+		return nFound;
+	}
+
+	if(pQuery->m_lHashedKeywords.isEmpty())
+	{
+		return 0;
+	}
+
+	// every keyword must match, so walk the shortest posting list and check the rest per file
+	const QVector<ShareIndexEntry*>* pShortest = 0;
+	foreach(quint32 nHash, pQuery->m_lHashedKeywords)
+	{
+		QHash<quint32, QVector<ShareIndexEntry*> >::const_iterator itWord = m_lKeywords.constFind(nHash);
+		if(itWord == m_lKeywords.constEnd())
+		{
+			return 0;
+		}
+
+		if(!pShortest || itWord.value().size() < pShortest->size())
+		{
+			pShortest = &itWord.value();
+		}
+	}
+
+	for(int i = 0; i < pShortest->size() && nFound < nMaximum; ++i)
+	{
+		ShareIndexEntry* pEntry = pShortest->at(i);
+
+		if(pEntry->m_nSize < pQuery->m_nMinimumSize || pEntry->m_nSize > pQuery->m_nMaximumSize)
+		{
+			continue;
+		}
+
+		bool bMatch = true;
+		foreach(quint32 nHash, pQuery->m_lHashedKeywords)
+		{
+			if(!pEntry->m_lKeywords.contains(nHash))
+			{
+				bMatch = false;
+				break;
+			}
+		}
+
+		if(bMatch && !lNegative.isEmpty())
+		{
+			QString sName = pEntry->m_sName;
+			sName = sName.replace("_", " ").normalized(QString::NormalizationForm_KC).toLower();
+
+			foreach(const QString& sWord, lNegative)
+			{
+				if(sName.contains(sWord))
+				{
+					bMatch = false;
+					break;
+				}
+			}
+		}
+
+		if(bMatch)
+		{
+			lResults.append(*pEntry);
+			nFound++;
+		}
+	}
+
+	return nFound;
+}
+
+bool CShareIndex::FindBySHA1(const QByteArray& baSHA1, ShareIndexEntry& oEntry)
+{
+	QMutexLocker l(&m_pSection);
+
+	ShareIndexEntry* pEntry = m_lSHA1.value(baSHA1, 0);
+	if(pEntry)
+	{
+		oEntry = *pEntry;
+		return true;
+	}
+
+	return false;
+}
+
+int CShareIndex::GetCount()
+{
+	QMutexLocker l(&m_pSection);
+	return m_lFiles.size();
+}
+
+// Splits a file name into words the same way CQuery::BuildG2Keywords does
+void CShareIndex::MakeKeywords(const QString& sName, QList<quint32>& lKeywords)
+{
+	QString sPhrase = sName;
+	sPhrase = sPhrase.replace("_", " ").normalized(QString::NormalizationForm_KC).toLower();
+
+	foreach(const QString& sWord, sPhrase.split(QRegExp("\\W+"), QString::SkipEmptyParts))
+	{
+		if(sWord.size() < 4)
+		{
+			continue;
+		}
+
+		QByteArray baWord = sWord.toUtf8();
+		quint32 nHash = CQueryHashTable::HashWord(baWord.constData(), baWord.size(), 32);
+
+		if(!lKeywords.contains(nHash))
+		{
+			lKeywords.append(nHash);
+		}
+	}
+}
@@ -0,0 +1,76 @@
+/*
+** shareindex.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef SHAREINDEX_H
+#define SHAREINDEX_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+#include "query.h"
+
+struct ShareIndexEntry
+{
+	quint64			m_nFileID;
+	QString			m_sName;
+	QString			m_sPath;		// absolute path, used by uploads
+	quint64			m_nSize;
+	QByteArray		m_baSHA1;		// raw digest
+	QList<quint32>	m_lKeywords;	// 32-bit word hashes, same as CQuery::m_lHashedKeywords
+};
+
+// In-memory keyword and URN index of shared files.
+// Answers queries without touching the shares database; safe to use from any thread.
+class CShareIndex
+{
+protected:
+	QMutex										m_pSection;
+	QHash<quint64, ShareIndexEntry*>			m_lFiles;
+	QHash<quint32, QVector<ShareIndexEntry*> >	m_lKeywords;
+	QMultiHash<QByteArray, ShareIndexEntry*>	m_lSHA1;		// files with the same content share a hash
+
+public:
+	CShareIndex();
+	~CShareIndex();
+
+	void Add(quint64 nFileID, const QString& sPath, quint64 nSize, const QByteArray& baSHA1);
+	void Remove(quint64 nFileID);
+	void Clear();
+
+	// Appends at most nMaximum matching files to lResults, returns the number appended
+	int Search(CQueryPtr pQuery, QList<ShareIndexEntry>& lResults, int nMaximum);
+	bool FindBySHA1(const QByteArray& baSHA1, ShareIndexEntry& oEntry);
+	int GetCount();
+
+	static void MakeKeywords(const QString& sName, QList<quint32>& lKeywords);
+
+protected:
+	void RemoveEntry(ShareIndexEntry* pEntry);
+};
+
+#endif // SHAREINDEX_H
@@ -59,7 +59,7 @@ void CShareManager::Start()
 {
 	QMutexLocker l(&m_oSection);
 	systemLog.postLog(LogSeverity::Debug, QString("Starting share manager..."));
-	connect(this, SIGNAL(sharesReady()), &QueryHashMaster, SLOT(Build()));
+	connect(this, SIGNAL(sharesReady()), &QueryHashMaster, SLOT(Invalidate()));
 	ShareManagerThread.start("ShareManager", &m_oSection, this);
 }
 
@@ -150,6 +150,7 @@ void CShareManager::Stop()
 		delete m_pTable;
 		m_pTable = 0;
 	}
+	m_oIndex.Clear();
 	disconnect(SIGNAL(executeQuery(const QString&)), this, SLOT(execQuery(const QString&)));
 	ShareManagerThread.exit(0);
 }
@@ -198,7 +199,13 @@ void CShareManager::RemoveDir(quint64 nId)
 		RemoveDir(delq.record().value(0).toUInt());
 	}
 
-	delq.exec(QString("DELETE FROM hashes WHERE file_id IN (SELECT dir_id FROM files WHERE dir_id = %1)").arg(nId));
+	delq.exec(QString("SELECT file_id FROM files WHERE dir_id = %1").arg(nId));
+	while(delq.next())
+	{
+		m_oIndex.Remove(delq.record().value(0).toULongLong());
+	}
+
+	delq.exec(QString("DELETE FROM hashes WHERE file_id IN (SELECT file_id FROM files WHERE dir_id = %1)").arg(nId));
 	delq.exec(QString("DELETE FROM files WHERE dir_id = %1").arg(nId));
 	delq.exec(QString("DELETE FROM dirs WHERE id = %1").arg(nId));
 }
@@ -211,6 +218,8 @@ void CShareManager::RemoveFile(QString sPath)
 
 void CShareManager::RemoveFile(quint64 nFileId)
 {
+	m_oIndex.Remove(nFileId);
+
 	QSqlQuery delq(m_oDatabase);
 	delq.exec(QString("DELETE FROM hashes WHERE file_id = %1").arg(nFileId));
 	delq.exec(QString("DELETE FROM files WHERE file_id = %1").arg(nFileId));
@@ -421,6 +430,7 @@ void CShareManager::SyncShares()
 	}
 
 	query.exec("PRAGMA synchronous = 1");
+	LoadIndex();
 	m_bReady = true;
 	if(m_bActive)
 	{
@@ -669,6 +679,18 @@ void CShareManager::OnFileHashed(CSharedFilePtr pFile)
 	pFile->m_bShared = true;
 	pFile->serialize( &m_oDatabase );
 
+	if( pFile->getFileID() )
+	{
+		foreach( CHash oHash, pFile->getHashes() )
+		{
+			if( oHash.getAlgorithm() == CHash::SHA1 )
+			{
+				m_oIndex.Add( pFile->getFileID(), pFile->absoluteFilePath(), pFile->size(), oHash.RawValue() );
+				break;
+			}
+		}
+	}
+
 	m_nRemainingFiles--;
 	emit remainingFilesChanged(m_nRemainingFiles);
 }
@@ -684,6 +706,31 @@ CQueryHashTable* CShareManager::GetHashTable()
 	return m_pTable;
 }
 
+// Rebuilds the in-memory search index from the database
+void CShareManager::LoadIndex()
+{
+	ASSUME_LOCK(m_oSection);
+
+	m_oIndex.Clear();
+
+	QSqlQuery query(m_oDatabase);
+	query.setForwardOnly(true);
+	if(!query.exec("SELECT f.file_id, d.path, f.name, f.size, h.sha1 FROM files f JOIN dirs d ON(f.dir_id = d.id) JOIN hashes h ON(f.file_id = h.file_id) WHERE f.shared = 1"))
+	{
+		systemLog.postLog(LogSeverity::Debug, QString("SQL Query failed: %1").arg(query.lastError().text()));
+		return;
+	}
+
+	while(query.next())
+	{
+		QSqlRecord oRecord = query.record();
+		m_oIndex.Add(oRecord.value(0).toULongLong(), oRecord.value(1).toString() + "/" + oRecord.value(2).toString(),
+					 oRecord.value(3).toULongLong(), oRecord.value(4).toByteArray());
+	}
+
+	systemLog.postLog(LogSeverity::Debug, QString("Indexed %1 shared files").arg(m_oIndex.GetCount()));
+}
+
 void CShareManager::BuildHashTable()
 {
 	ASSUME_LOCK(m_oSection);
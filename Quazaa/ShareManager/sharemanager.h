@@ -33,6 +33,7 @@
 
 #include "thread.h"
 #include "sharedfile.h"
+#include "shareindex.h"
 
 class CQueryHashTable;
 
@@ -54,6 +55,8 @@ protected:
 	bool				m_bTableReady;
 
 	qint32				m_nRemainingFiles;
+
+	CShareIndex			m_oIndex;
 public:
 	explicit CShareManager(QObject* parent = 0);
 
@@ -78,8 +81,19 @@ public:
 
 	QList<QSqlRecord> Query(const QString sQuery);
 
+	// Index lookups use their own lock, not m_oSection
+	int Search(CQueryPtr pQuery, QList<ShareIndexEntry>& lResults, int nMaximum)
+	{
+		return m_oIndex.Search(pQuery, lResults, nMaximum);
+	}
+	bool FindBySHA1(const QByteArray& baSHA1, ShareIndexEntry& oEntry)
+	{
+		return m_oIndex.FindBySHA1(baSHA1, oEntry);
+	}
+
 protected:
 	void BuildHashTable();
+	void LoadIndex();
 signals:
 	void sharesReady();
 	void executeQuery(const QString& sQuery);
@@ -11,6 +11,7 @@ CDownloadTransfer::CDownloadTransfer(CDownload *pOwner, CDownloadSource *pSource
 	m_nQueuePos(0),
 	m_nQueueLength(0)
 {
+	m_nTransferClass = tcDownload;
 }
 
 CDownloadTransfer::~CDownloadTransfer()
@@ -35,6 +35,16 @@ CTransfer::CTransfer(void* pOwner, QObject *parent) :
 	Transfers.add(this);
 }
 
+// Takes over the socket of an accepted connection
+CTransfer::CTransfer(void* pOwner, CNetworkConnection* pConn, QObject *parent) :
+	CNetworkConnection(parent),
+	m_pOwner(pOwner)
+{
+	ASSUME_LOCK(Transfers.m_pSection);
+	AttachTo(pConn);
+	Transfers.add(this);
+}
+
 CTransfer::~CTransfer()
 {
 	ASSUME_LOCK(Transfers.m_pSection);
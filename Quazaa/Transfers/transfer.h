@@ -11,6 +11,7 @@ public:
 	void* m_pOwner;
 public:
 	CTransfer(void* pOwner, QObject *parent = 0);
+	CTransfer(void* pOwner, CNetworkConnection* pConn, QObject *parent = 0);
 	virtual ~CTransfer();
 
 	virtual void onTimer(quint32 tNow = 0);
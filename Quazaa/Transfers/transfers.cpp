@@ -27,6 +27,8 @@
 #include "transfer.h"
 #include "downloads.h"
 
+#include "quazaasettings.h"
+
 #include <QMutexLocker>
 
 #include "debug_new.h"
@@ -56,6 +58,8 @@ void CTransfers::start()
 	m_bActive = true;
 	TransfersThread.start("Transfers", &m_pSection);
 	m_pController->moveToThread(&TransfersThread);
+	m_pController->SetDownloadLimit(quazaaSettings.Connection.InSpeed);
+	m_pController->SetUploadLimit(quazaaSettings.Connection.OutSpeed);
 	Downloads.start();
 	Downloads.moveToThread(&TransfersThread);
 
@@ -79,7 +83,7 @@ void CTransfers::stop()
 
 void CTransfers::add(CTransfer *pTransfer)
 {
-	QMutexLocker l(&m_pSection);
+	ASSUME_LOCK(m_pSection);
 
 	Q_ASSERT_X(m_bActive, "CTransfers::add()", "Adding transfer while thread is inactive");
 
@@ -97,7 +101,7 @@ void CTransfers::add(CTransfer *pTransfer)
 
 void CTransfers::remove(CTransfer *pTransfer)
 {
-	QMutexLocker l(&m_pSection);
+	ASSUME_LOCK(m_pSection);
 
 	if(!m_lTransfers.contains(pTransfer->m_pOwner, pTransfer))
 	{
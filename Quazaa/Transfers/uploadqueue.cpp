@@ -0,0 +1,140 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "uploadqueue.h"
+#include "uploadtransfer.h"
+
+#include "debug_new.h"
+
+CUploadQueue::CUploadQueue(const QString& sName, quint64 nMinSize, quint64 nMaxSize, int nSlots, int nMaxQueued) :
+	m_sName(sName),
+	m_nMinSize(nMinSize),
+	m_nMaxSize(nMaxSize),
+	m_nSlots(nSlots),
+	m_nMaxQueued(nMaxQueued),
+	m_nNextTicket(0),
+	m_nQueued(0)
+{
+	rebuild(64);
+}
+
+void CUploadQueue::enqueue(CUploadTransfer* pUpload)
+{
+	Q_ASSERT(pUpload->m_nTicket == UPLOAD_NO_TICKET);
+
+	if( m_nNextTicket == (quint32)m_lTickets.size() )
+	{
+		// out of tickets, compact and grow if more than half are still waiting
+		rebuild(m_nQueued * 2 >= m_lTickets.size() ? m_lTickets.size() * 2 : m_lTickets.size());
+	}
+
+	pUpload->m_nTicket = m_nNextTicket++;
+	m_lTickets[pUpload->m_nTicket] = pUpload;
+	add(pUpload->m_nTicket, 1);
+	m_nQueued++;
+}
+
+void CUploadQueue::dequeue(CUploadTransfer* pUpload)
+{
+	if( pUpload->m_nTicket == UPLOAD_NO_TICKET )
+		return;
+
+	Q_ASSERT(m_lTickets[pUpload->m_nTicket] == pUpload);
+
+	m_lTickets[pUpload->m_nTicket] = 0;
+	add(pUpload->m_nTicket, -1);
+	pUpload->m_nTicket = UPLOAD_NO_TICKET;
+	m_nQueued--;
+}
+
+// 1-based place in the waiting line, 0 if not waiting
+int CUploadQueue::position(const CUploadTransfer* pUpload) const
+{
+	if( pUpload->m_nTicket == UPLOAD_NO_TICKET )
+		return 0;
+
+	int nCount = 0;
+	for( quint32 i = pUpload->m_nTicket + 1; i > 0; i &= i - 1 )
+		nCount += m_lTree[i - 1];
+
+	return nCount;
+}
+
+CUploadTransfer* CUploadQueue::front() const
+{
+	if( m_nQueued == 0 )
+		return 0;
+
+	// descend to the first ticket whose prefix count reaches one
+	int nSize = m_lTree.size();
+	int nStep = 1;
+	while( nStep * 2 <= nSize )
+		nStep *= 2;
+
+	int nPos = 0;
+	for( ; nStep > 0; nStep /= 2 )
+	{
+		if( nPos + nStep <= nSize && m_lTree[nPos + nStep - 1] == 0 )
+			nPos += nStep;
+	}
+
+	return m_lTickets[nPos];
+}
+
+void CUploadQueue::add(quint32 nTicket, int nDelta)
+{
+	for( quint32 i = nTicket + 1; i <= (quint32)m_lTree.size(); i += i & (~i + 1) )
+		m_lTree[i - 1] += nDelta;
+}
+
+// Renumbers the waiting tickets from zero, keeping their order
+void CUploadQueue::rebuild(int nCapacity)
+{
+	QVector<CUploadTransfer*> lTickets(nCapacity, 0);
+	quint32 nNext = 0;
+
+	for( quint32 i = 0; i < m_nNextTicket; ++i )
+	{
+		if( CUploadTransfer* pUpload = m_lTickets[i] )
+		{
+			pUpload->m_nTicket = nNext;
+			lTickets[nNext++] = pUpload;
+		}
+	}
+
+	m_lTickets = lTickets;
+	m_nNextTicket = nNext;
+
+	// linear-time Fenwick build
+	m_lTree.fill(0, nCapacity);
+	for( quint32 i = 1; i <= (quint32)nCapacity; ++i )
+	{
+		if( i <= nNext )
+			m_lTree[i - 1] += 1;
+
+		quint32 j = i + (i & (~i + 1));
+		if( j <= (quint32)nCapacity )
+			m_lTree[j - 1] += m_lTree[i - 1];
+	}
+}
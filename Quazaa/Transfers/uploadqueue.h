@@ -0,0 +1,86 @@
+/*
+** uploadqueue.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef UPLOADQUEUE_H
+#define UPLOADQUEUE_H
+
+#include <QSet>
+#include <QString>
+#include <QVector>
+
+class CUploadTransfer;
+
+// One named upload queue for a range of file sizes.
+// Waiting requesters get increasing tickets, counted in a Fenwick tree over the ticket
+// numbers, so enqueue, dequeue, position and front lookups are all O(log n).
+class CUploadQueue
+{
+public:
+	QString		m_sName;
+	quint64		m_nMinSize;
+	quint64		m_nMaxSize;
+	int			m_nSlots;
+	int			m_nMaxQueued;
+
+	QSet<CUploadTransfer*>	m_lActive;		// requesters holding a slot
+
+protected:
+	QVector<int>				m_lTree;	// Fenwick tree, one counter per ticket
+	QVector<CUploadTransfer*>	m_lTickets;	// holder of each ticket, 0 once it left
+	quint32						m_nNextTicket;
+	int							m_nQueued;
+
+public:
+	CUploadQueue(const QString& sName, quint64 nMinSize, quint64 nMaxSize, int nSlots, int nMaxQueued);
+
+	inline bool accepts(quint64 nSize) const;
+	inline int freeSlots() const;
+	inline int queued() const;
+
+	void enqueue(CUploadTransfer* pUpload);
+	void dequeue(CUploadTransfer* pUpload);
+	int position(const CUploadTransfer* pUpload) const;
+	CUploadTransfer* front() const;
+
+protected:
+	void add(quint32 nTicket, int nDelta);
+	void rebuild(int nCapacity);
+};
+
+bool CUploadQueue::accepts(quint64 nSize) const
+{
+	return (nSize >= m_nMinSize && nSize <= m_nMaxSize);
+}
+
+int CUploadQueue::freeSlots() const
+{
+	return qMax(0, m_nSlots - m_lActive.size());
+}
+
+int CUploadQueue::queued() const
+{
+	return m_nQueued;
+}
+
+#endif // UPLOADQUEUE_H
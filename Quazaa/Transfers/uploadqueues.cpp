@@ -0,0 +1,226 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "uploadqueues.h"
+#include "uploadqueue.h"
+#include "uploadtransfer.h"
+#include "transfers.h"
+
+#include "quazaasettings.h"
+
+#include "debug_new.h"
+
+CUploadQueues UploadQueues;
+
+CUploadQueues::CUploadQueues()
+{
+	// limits come from the settings, see applySettings()
+	m_lQueues.append(new CUploadQueue("Small Files", 0, 0, 0, 0));
+	m_lQueues.append(new CUploadQueue("Medium Files", 0, 0, 0, 0));
+	m_lQueues.append(new CUploadQueue("Large Files", 0, SIZE_UNKNOWN, 0, 0));
+}
+
+CUploadQueues::~CUploadQueues()
+{
+	qDeleteAll(m_lQueues);
+	m_lQueues.clear();
+}
+
+// Decides whether pUpload may send a file of nSize bytes now.
+// Waiting requesters are expected to repeat the request on the same connection.
+CUploadQueues::QueueResult CUploadQueues::request(CUploadTransfer* pUpload, quint64 nSize)
+{
+	ASSUME_LOCK(Transfers.m_pSection);
+
+	applySettings();
+
+	CUploadQueue* pQueue = queueFor(nSize);
+
+	if( pUpload->m_pQueue && pUpload->m_pQueue != pQueue )
+	{
+		// asked for a file of another size class, start over in the new queue
+		remove(pUpload);
+	}
+
+	if( !pQueue )
+		return uqBusy;
+
+	if( !pUpload->m_pQueue )
+	{
+		QString sHost = pUpload->m_oAddress.toString();
+
+		if( m_lPerHost.value(sHost, 0) >= quazaaSettings.Uploads.MaxPerHost )
+			return uqBusy;
+
+		if( pQueue->freeSlots() > 0 && pQueue->queued() == 0 )
+		{
+			m_lPerHost[sHost]++;
+			grant(pQueue, pUpload);
+			return uqSlot;
+		}
+
+		if( !pUpload->m_bKeepAlive || pQueue->queued() >= pQueue->m_nMaxQueued )
+			return uqBusy;
+
+		m_lPerHost[sHost]++;
+		pUpload->m_pQueue = pQueue;
+		pQueue->enqueue(pUpload);
+		return uqQueued;
+	}
+
+	if( pUpload->m_bSlot )
+		return uqSlot;
+
+	// the first requesters in line may take the free slots
+	if( pQueue->position(pUpload) <= pQueue->freeSlots() )
+	{
+		pQueue->dequeue(pUpload);
+		grant(pQueue, pUpload);
+		return uqSlot;
+	}
+
+	return uqQueued;
+}
+
+// pUpload leaves the queues, either disconnected or done
+void CUploadQueues::remove(CUploadTransfer* pUpload)
+{
+	ASSUME_LOCK(Transfers.m_pSection);
+
+	CUploadQueue* pQueue = pUpload->m_pQueue;
+	if( !pQueue )
+		return;
+
+	if( pUpload->m_bSlot )
+		pQueue->m_lActive.remove(pUpload);
+	else
+		pQueue->dequeue(pUpload);
+
+	pUpload->m_pQueue = 0;
+	pUpload->m_bSlot = false;
+
+	QHash<QString, int>::iterator itHost = m_lPerHost.find(pUpload->m_oAddress.toString());
+	if( itHost != m_lPerHost.end() && --itHost.value() <= 0 )
+		m_lPerHost.erase(itHost);
+}
+
+// Rotation: once a slot holder has sent its chunk while others wait, it goes to the back of the line
+void CUploadQueues::onResponseSent(CUploadTransfer* pUpload)
+{
+	ASSUME_LOCK(Transfers.m_pSection);
+
+	CUploadQueue* pQueue = pUpload->m_pQueue;
+	if( !pQueue || !pUpload->m_bSlot )
+		return;
+
+	if( pUpload->m_nSlotBytes < quint64(quazaaSettings.Uploads.RotateChunkLimit) * 1024 )
+		return;
+
+	if( pQueue->queued() == 0 )
+	{
+		// nobody waits, keep the slot for another chunk
+		pUpload->m_nSlotBytes = 0;
+		return;
+	}
+
+	if( !pUpload->m_bKeepAlive )
+	{
+		remove(pUpload);
+		return;
+	}
+
+	pQueue->m_lActive.remove(pUpload);
+	pUpload->m_bSlot = false;
+	pQueue->enqueue(pUpload);
+}
+
+// Bytes pUpload may still send in this chunk, 0 for no limit.
+// Ranged responses are cut to the chunk so a slot holder can be rotated out once others start waiting.
+quint64 CUploadQueues::allowance(CUploadTransfer* pUpload) const
+{
+	CUploadQueue* pQueue = pUpload->m_pQueue;
+	if( !pQueue || !pUpload->m_bSlot || quazaaSettings.Uploads.RotateChunkLimit <= 0 )
+		return 0;
+
+	quint64 nChunk = quint64(quazaaSettings.Uploads.RotateChunkLimit) * 1024;
+	return (pUpload->m_nSlotBytes < nChunk ? nChunk - pUpload->m_nSlotBytes : 1);
+}
+
+// Value of the X-Queue header for a waiting requester
+QByteArray CUploadQueues::queueHeader(CUploadTransfer* pUpload) const
+{
+	CUploadQueue* pQueue = pUpload->m_pQueue;
+	if( !pQueue )
+		return QByteArray();
+
+	return QString("position=%1,length=%2,limit=%3,pollMin=%4,pollMax=%5,id=\"%6\"")
+			.arg(pQueue->position(pUpload))
+			.arg(pQueue->queued())
+			.arg(pQueue->m_nSlots)
+			.arg(quazaaSettings.Uploads.QueuePollMin / 1000)
+			.arg(quazaaSettings.Uploads.QueuePollMax / 1000)
+			.arg(pQueue->m_sName).toUtf8();
+}
+
+// Picks up changed queue settings, queued requesters move on their next request if their queue no longer fits
+void CUploadQueues::applySettings()
+{
+	const quint64 nSmall = quint64(qMax(0, quazaaSettings.Uploads.QueueSmallSize)) * 1024;
+	const quint64 nLarge = qMax(nSmall + 1, quint64(qMax(0, quazaaSettings.Uploads.QueueLargeSize)) * 1024);
+
+	CUploadQueue* pSmall = m_lQueues[0];
+	pSmall->m_nMaxSize   = nSmall;
+	pSmall->m_nSlots     = quazaaSettings.Uploads.QueueSmallSlots;
+	pSmall->m_nMaxQueued = quazaaSettings.Uploads.QueueSmallLength;
+
+	CUploadQueue* pMedium = m_lQueues[1];
+	pMedium->m_nMinSize   = nSmall + 1;
+	pMedium->m_nMaxSize   = nLarge - 1;
+	pMedium->m_nSlots     = quazaaSettings.Uploads.QueueMediumSlots;
+	pMedium->m_nMaxQueued = quazaaSettings.Uploads.QueueMediumLength;
+
+	CUploadQueue* pLarge = m_lQueues[2];
+	pLarge->m_nMinSize   = nLarge;
+	pLarge->m_nSlots     = quazaaSettings.Uploads.QueueLargeSlots;
+	pLarge->m_nMaxQueued = quazaaSettings.Uploads.QueueLargeLength;
+}
+
+CUploadQueue* CUploadQueues::queueFor(quint64 nSize) const
+{
+	foreach( CUploadQueue* pQueue, m_lQueues )
+	{
+		if( pQueue->accepts(nSize) )
+			return pQueue;
+	}
+
+	return 0;
+}
+
+void CUploadQueues::grant(CUploadQueue* pQueue, CUploadTransfer* pUpload)
+{
+	pUpload->m_pQueue = pQueue;
+	pUpload->m_bSlot = true;
+	pUpload->m_nSlotBytes = 0;
+	pQueue->m_lActive.insert(pUpload);
+}
@@ -0,0 +1,73 @@
+/*
+** uploadqueues.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef UPLOADQUEUES_H
+#define UPLOADQUEUES_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+
+#include "types.h"
+
+class CUploadQueue;
+class CUploadTransfer;
+
+// Hands out upload slots, guarded by Transfers.m_pSection
+class CUploadQueues
+{
+public:
+	enum QueueResult
+	{
+		uqSlot,		// may send now
+		uqQueued,	// waiting, tell the client its place
+		uqBusy		// refused
+	};
+
+public:
+	QList<CUploadQueue*>	m_lQueues;
+
+protected:
+	QHash<QString, int>		m_lPerHost;		// requesters holding or waiting for a slot, by address
+
+public:
+	CUploadQueues();
+	~CUploadQueues();
+
+	QueueResult request(CUploadTransfer* pUpload, quint64 nSize);
+	void remove(CUploadTransfer* pUpload);
+	void onResponseSent(CUploadTransfer* pUpload);
+
+	quint64 allowance(CUploadTransfer* pUpload) const;
+	QByteArray queueHeader(CUploadTransfer* pUpload) const;
+
+protected:
+	void applySettings();
+	CUploadQueue* queueFor(quint64 nSize) const;
+	void grant(CUploadQueue* pQueue, CUploadTransfer* pUpload);
+};
+
+extern CUploadQueues UploadQueues;
+
+#endif // UPLOADQUEUES_H
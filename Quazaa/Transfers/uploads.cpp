@@ -0,0 +1,77 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "uploads.h"
+#include "uploadtransfer.h"
+#include "transfers.h"
+
+#include "debug_new.h"
+
+CUploads Uploads;
+
+CUploads::CUploads(QObject *parent) :
+	QObject(parent)
+{
+}
+
+// Called from the handshakes thread with a complete /uri-res request in the input buffer
+void CUploads::OnAccept(CNetworkConnection* pConn)
+{
+	if( !Transfers.m_bActive )
+	{
+		pConn->Close();
+		return;
+	}
+
+	if( !Transfers.m_pSection.tryLock(50) )
+	{
+		systemLog.postLog(LogSeverity::Debug, Components::Uploads, "Not accepting upload request, transfers overloaded");
+		pConn->Close();
+		return;
+	}
+
+	CUploadTransfer* pUpload = new CUploadTransfer(pConn);
+	pUpload->moveToThread(&TransfersThread);
+
+	Transfers.m_pSection.unlock();
+}
+
+void CUploads::add(CUploadTransfer *pUpload)
+{
+	ASSUME_LOCK(Transfers.m_pSection);
+
+	m_lUploads.insert(pUpload);
+}
+
+void CUploads::remove(CUploadTransfer *pUpload)
+{
+	ASSUME_LOCK(Transfers.m_pSection);
+
+	m_lUploads.remove(pUpload);
+}
+
+int CUploads::count() const
+{
+	return m_lUploads.size();
+}
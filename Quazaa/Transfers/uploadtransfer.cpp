@@ -0,0 +1,559 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "uploadtransfer.h"
+#include "uploads.h"
+#include "uploadqueues.h"
+#include "transfers.h"
+#include "sharemanager.h"
+#include "Hashes/hash.h"
+
+#include "quazaasettings.h"
+#include "quazaaglobals.h"
+
+#include <QFile>
+#include <QTcpSocket>
+
+#ifdef Q_OS_LINUX
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#endif
+
+#include "debug_new.h"
+
+CUploadTransfer::CUploadTransfer(CNetworkConnection* pConn, QObject *parent) :
+	CTransfer(&Uploads, pConn, parent),
+	m_nState(utsRequest),
+	m_tLastActive(time(0)),
+	m_bKeepAlive(true),
+	m_nOffset(0),
+	m_nRemaining(0),
+	m_nUploaded(0),
+	m_pQueue(0),
+	m_nTicket(UPLOAD_NO_TICKET),
+	m_bSlot(false),
+	m_nSlotBytes(0),
+	m_pFile(0),
+	m_pMap(0),
+	m_nMapOffset(0),
+	m_nMapLength(0)
+{
+	m_nTransferClass = tcUpload;
+	Uploads.add(this);
+}
+
+CUploadTransfer::~CUploadTransfer()
+{
+	ASSUME_LOCK(Transfers.m_pSection);
+
+	CloseFile();
+	UploadQueues.remove(this);
+	Uploads.remove(this);
+}
+
+void CUploadTransfer::onTimer(quint32 tNow)
+{
+	if( tNow == 0 )
+		tNow = time(0);
+
+	// queued clients only come back once per poll interval
+	quint32 nTimeout = quazaaSettings.Connection.TimeoutTraffic;
+	if( m_pQueue && !m_bSlot )
+		nTimeout = qMax<quint32>(nTimeout, quazaaSettings.Uploads.QueuePollMax / 1000);
+
+	if( m_nState != utsClosing && tNow - m_tLastActive > nTimeout )
+	{
+		systemLog.postLog(LogSeverity::Debug, Components::Uploads, "Closing idle upload connection to %s", qPrintable(m_oAddress.toStringWithPort()));
+		m_nState = utsClosing;
+		Close();
+	}
+}
+
+bool CUploadTransfer::HasPendingOutput()
+{
+	if( m_nState == utsSending && m_nRemaining > 0 && m_pSocket )
+		return true;
+
+	return CTransfer::HasPendingOutput();
+}
+
+void CUploadTransfer::OnConnect()
+{
+}
+
+void CUploadTransfer::OnDisconnect()
+{
+	Transfers.m_pSection.lock();
+	delete this;
+	Transfers.m_pSection.unlock();
+}
+
+void CUploadTransfer::OnError(QAbstractSocket::SocketError e)
+{
+	Q_UNUSED(e);
+	Transfers.m_pSection.lock();
+	delete this;
+	Transfers.m_pSection.unlock();
+}
+
+void CUploadTransfer::OnRead()
+{
+	QMutexLocker l(&Transfers.m_pSection);
+
+	// pipelined requests wait until the current body is out
+	if( m_nState != utsRequest )
+		return;
+
+	int nEnd = Peek().indexOf("\r\n\r\n");
+
+	if( nEnd == -1 )
+	{
+		if( bytesAvailable() > 4096 )
+			SendError("400 Bad Request", true);
+		return;
+	}
+
+	m_tLastActive = time(0);
+
+	QString sHeader = Read(nEnd + 4);
+	OnRequest(sHeader);
+}
+
+void CUploadTransfer::OnRequest(const QString& sHeader)
+{
+	QStringList lLines = sHeader.trimmed().split("\r\n");
+	QStringList lRequest = lLines.first().split(' ', QString::SkipEmptyParts);
+
+	if( lRequest.size() < 3 )
+	{
+		SendError("400 Bad Request", true);
+		return;
+	}
+
+	bool bHead = (lRequest[0] == "HEAD");
+	QString sPath = lRequest[1];
+	QString sRange;
+
+	m_bKeepAlive = (lRequest[2] != "HTTP/1.0");
+
+	for( int i = 1; i < lLines.size(); ++i )
+	{
+		int nColon = lLines[i].indexOf(':');
+		if( nColon == -1 )
+			continue;
+
+		QString sName = lLines[i].left(nColon).trimmed().toLower();
+		QString sValue = lLines[i].mid(nColon + 1).trimmed();
+
+		if( sName == "connection" )
+		{
+			if( sValue.compare("close", Qt::CaseInsensitive) == 0 )
+				m_bKeepAlive = false;
+			else if( sValue.compare("keep-alive", Qt::CaseInsensitive) == 0 )
+				m_bKeepAlive = true;
+		}
+		else if( sName == "range" )
+		{
+			sRange = sValue;
+		}
+		else if( sName == "user-agent" )
+		{
+			m_sUserAgent = sValue;
+		}
+	}
+
+	if( !bHead && lRequest[0] != "GET" )
+	{
+		SendError("501 Not Implemented", true);
+		return;
+	}
+
+	if( !sPath.startsWith("/uri-res/N2R?", Qt::CaseInsensitive) )
+	{
+		SendError("404 Not Found", false);
+		return;
+	}
+
+	QString sURN = sPath.mid(13);
+
+	// urn:bitprint:[SHA1].[TIGER] carries the same SHA1
+	if( sURN.startsWith("urn:bitprint:", Qt::CaseInsensitive) )
+		sURN = "urn:sha1:" + sURN.mid(13, 32);
+
+	CHash* pHash = 0;
+	try
+	{
+		pHash = CHash::FromURN(sURN);
+	}
+	catch(...)
+	{
+	}
+
+	ShareIndexEntry oFile;
+	bool bFound = (pHash && pHash->getAlgorithm() == CHash::SHA1 && ShareManager.FindBySHA1(pHash->RawValue(), oFile));
+	delete pHash;
+
+	if( !bFound )
+	{
+		SendError("404 Not Found", false);
+		return;
+	}
+
+	quint64 nFirst = 0, nLast = 0;
+	bool bPartial = !sRange.isEmpty();
+
+	if( bPartial && !ParseRange(sRange, oFile.m_nSize, nFirst, nLast) )
+	{
+		QByteArray baResp;
+		baResp += "HTTP/1.1 416 Requested Range Not Satisfiable\r\n";
+		baResp += "Server: " + CQuazaaGlobals::USER_AGENT_STRING() + "\r\n";
+		baResp += "Content-Range: bytes */" + QByteArray::number(oFile.m_nSize) + "\r\n";
+		baResp += "Content-Length: 0\r\n";
+		baResp += QByteArray("Connection: ") + (m_bKeepAlive ? "Keep-Alive" : "close") + "\r\n";
+		baResp += "\r\n";
+		Write(baResp);
+		FinishRequest();
+		return;
+	}
+
+	// HEAD requests carry no body and never wait for a slot
+	if( !bHead )
+	{
+		switch( UploadQueues.request(this, oFile.m_nSize) )
+		{
+		case CUploadQueues::uqSlot:
+			break;
+		case CUploadQueues::uqQueued:
+			SendQueued();
+			return;
+		default:
+			SendError("503 Busy", true);
+			return;
+		}
+
+		// ranged responses are cut to the rotation chunk; a plain GET may only be
+		// answered with the whole file, its holder goes back to the queue afterwards
+		quint64 nAllowance = UploadQueues.allowance(this);
+		if( bPartial && nAllowance > 0 && nLast - nFirst + 1 > nAllowance )
+			nLast = nFirst + nAllowance - 1;
+	}
+
+	quint64 nLength = (bPartial ? nLast - nFirst + 1 : oFile.m_nSize);
+
+	if( !OpenFile(oFile.m_sPath, oFile.m_nSize) )
+	{
+		UploadQueues.remove(this);
+		SendError("404 Not Found", false);
+		return;
+	}
+
+	m_sName = oFile.m_sName;
+	m_baSHA1 = oFile.m_baSHA1;
+
+	CHash oHash(oFile.m_baSHA1, CHash::SHA1);
+
+	QByteArray baResp;
+	baResp += (bPartial ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n");
+	baResp += "Server: " + CQuazaaGlobals::USER_AGENT_STRING() + "\r\n";
+	baResp += "Content-Type: application/x-binary\r\n";
+	baResp += "Content-Length: " + QByteArray::number(nLength) + "\r\n";
+	if( bPartial )
+		baResp += "Content-Range: bytes " + QByteArray::number(nFirst) + "-" + QByteArray::number(nLast) + "/" + QByteArray::number(oFile.m_nSize) + "\r\n";
+	baResp += "Accept-Ranges: bytes\r\n";
+	baResp += "X-Content-URN: " + oHash.ToURN() + "\r\n";
+	baResp += QByteArray("Connection: ") + (m_bKeepAlive ? "Keep-Alive" : "close") + "\r\n";
+	baResp += "\r\n";
+	Write(baResp);
+
+	systemLog.postLog(LogSeverity::Debug, Components::Uploads, "Uploading %s bytes %s-%s to %s",
+					  qPrintable(m_sName), qPrintable(QString::number(nFirst)), qPrintable(QString::number(nFirst + nLength)),
+					  qPrintable(m_oAddress.toStringWithPort()));
+
+	if( bHead || nLength == 0 )
+	{
+		FinishRequest();
+		return;
+	}
+
+	m_nOffset = nFirst;
+	m_nRemaining = nLength;
+	m_nState = utsSending;
+	emit readyToTransfer();
+}
+
+void CUploadTransfer::SendError(const QString& sStatus, bool bClose)
+{
+	if( bClose )
+		m_bKeepAlive = false;
+
+	QByteArray baBody = sStatus.toUtf8() + "\r\n";
+
+	QByteArray baResp;
+	baResp += "HTTP/1.1 " + sStatus + "\r\n";
+	baResp += "Server: " + CQuazaaGlobals::USER_AGENT_STRING() + "\r\n";
+	baResp += "Content-Type: text/plain\r\n";
+	baResp += "Content-Length: " + QByteArray::number(baBody.size()) + "\r\n";
+	baResp += QByteArray("Connection: ") + (m_bKeepAlive ? "Keep-Alive" : "close") + "\r\n";
+	baResp += "\r\n";
+	baResp += baBody;
+	Write(baResp);
+
+	FinishRequest();
+}
+
+// Tells a waiting client its place in the queue, it keeps the connection and asks again
+void CUploadTransfer::SendQueued()
+{
+	QByteArray baResp;
+	baResp += "HTTP/1.1 503 Busy Queued\r\n";
+	baResp += "Server: " + CQuazaaGlobals::USER_AGENT_STRING() + "\r\n";
+	baResp += "X-Queue: " + UploadQueues.queueHeader(this) + "\r\n";
+	baResp += "Content-Length: 0\r\n";
+	baResp += "Connection: Keep-Alive\r\n";
+	baResp += "\r\n";
+	Write(baResp);
+
+	FinishRequest();
+}
+
+// Current response is complete, wait for the next request or close
+void CUploadTransfer::FinishRequest()
+{
+	m_nRemaining = 0;
+	m_tLastActive = time(0);
+
+	UploadQueues.onResponseSent(this);
+
+	if( !m_bKeepAlive )
+	{
+		m_nState = utsClosing;
+		CloseFile();
+		Close(true);
+		return;
+	}
+
+	m_nState = utsRequest;
+
+	if( GetInputBuffer()->size() )
+		emit readyRead();
+}
+
+bool CUploadTransfer::OpenFile(const QString& sPath, quint64 nSize)
+{
+	if( m_pFile && m_pFile->fileName() == sPath && m_pFile->isOpen() )
+		return ((quint64)m_pFile->size() == nSize);
+
+	CloseFile();
+
+	m_pFile = new QFile(sPath);
+
+	// a changed file is picked up by the share manager on the next sync
+	if( !m_pFile->open(QIODevice::ReadOnly) || (quint64)m_pFile->size() != nSize )
+	{
+		CloseFile();
+		return false;
+	}
+
+	return true;
+}
+
+void CUploadTransfer::CloseFile()
+{
+	Unmap();
+
+	if( m_pFile )
+	{
+		delete m_pFile;
+		m_pFile = 0;
+	}
+}
+
+void CUploadTransfer::Unmap()
+{
+	if( m_pMap )
+	{
+		m_pFile->unmap(m_pMap);
+		m_pMap = 0;
+		m_nMapOffset = m_nMapLength = 0;
+	}
+}
+
+// Response headers go out through the output buffer, file data straight from disk
+qint64 CUploadTransfer::writeToNetwork(qint64 nBytes)
+{
+	qint64 nWritten = 0;
+
+	if( !GetOutputBuffer()->isEmpty() )
+	{
+		nWritten = CTransfer::writeToNetwork(nBytes);
+
+		if( nWritten <= 0 || !GetOutputBuffer()->isEmpty() )
+			return nWritten;
+	}
+
+	if( m_nState == utsSending && nWritten < nBytes )
+	{
+		qint64 nBody = writeFile(nBytes - nWritten);
+
+		if( nBody > 0 )
+			nWritten += nBody;
+		else if( nWritten == 0 )
+			return nBody;
+	}
+
+	return nWritten;
+}
+
+qint64 CUploadTransfer::writeFile(qint64 nBytes)
+{
+	Q_ASSERT(m_pFile != 0);
+
+	qint64 nLength = qMin<quint64>(nBytes, m_nRemaining);
+	qint64 nSent = -1;
+
+#ifdef Q_OS_LINUX
+	// zero-copy path, only while QTcpSocket has nothing of its own queued
+	if( m_pSocket->state() == QAbstractSocket::ConnectedState && m_pSocket->bytesToWrite() == 0 )
+	{
+		off_t nOffset = m_nOffset;
+		ssize_t nRet = ::sendfile(m_pSocket->socketDescriptor(), m_pFile->handle(), &nOffset, nLength);
+
+		if( nRet >= 0 )
+		{
+			nSent = nRet;
+		}
+		else if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+		{
+			return 0;
+		}
+
+		// other errors fall back to the mapped path
+	}
+#endif
+
+	if( nSent < 0 )
+	{
+		if( !m_pMap || m_nOffset < m_nMapOffset || m_nOffset >= m_nMapOffset + m_nMapLength )
+		{
+			Unmap();
+			m_nMapOffset = m_nOffset;
+			m_nMapLength = qMin<quint64>(UPLOAD_MAP_WINDOW, m_pFile->size() - m_nOffset);
+			m_pMap = m_pFile->map(m_nMapOffset, m_nMapLength);
+		}
+
+		if( m_pMap )
+		{
+			nLength = qMin<quint64>(nLength, m_nMapOffset + m_nMapLength - m_nOffset);
+			nSent = m_pSocket->write((const char*)m_pMap + (m_nOffset - m_nMapOffset), nLength);
+		}
+		else
+		{
+			m_nMapLength = 0;
+
+			QByteArray baData;
+			if( m_pFile->seek(m_nOffset) )
+				baData = m_pFile->read(qMin<qint64>(nLength, UPLOAD_MAP_WINDOW));
+
+			if( baData.isEmpty() )
+			{
+				systemLog.postLog(LogSeverity::Error, Components::Uploads, "Cannot read %s, closing upload", qPrintable(m_sName));
+				m_bKeepAlive = false;
+				FinishRequest();
+				return -1;
+			}
+
+			nSent = m_pSocket->write(baData);
+		}
+	}
+
+	if( nSent <= 0 )
+		return nSent;
+
+	m_mOutput.Add(nSent);
+	m_nOffset += nSent;
+	m_nRemaining -= nSent;
+	m_nUploaded += nSent;
+	m_nSlotBytes += nSent;
+	m_tLastActive = time(0);
+
+	if( m_nRemaining == 0 )
+		FinishRequest();
+
+	return nSent;
+}
+
+// Parses a "bytes=" range against nSize. Only the first range of a multi-range
+// request is served, clients ask for the rest on the same connection.
+bool CUploadTransfer::ParseRange(QString sRange, quint64 nSize, quint64& nFirst, quint64& nLast)
+{
+	if( !sRange.startsWith("bytes", Qt::CaseInsensitive) || nSize == 0 )
+		return false;
+
+	sRange = sRange.mid(5).trimmed();
+	if( !sRange.startsWith('=') )
+		return false;
+	sRange = sRange.mid(1);
+
+	int nComma = sRange.indexOf(',');
+	if( nComma != -1 )
+		sRange.truncate(nComma);
+
+	int nDash = sRange.indexOf('-');
+	if( nDash == -1 )
+		return false;
+
+	QString sFirst = sRange.left(nDash).trimmed();
+	QString sLast = sRange.mid(nDash + 1).trimmed();
+	bool bOK = false;
+
+	if( sFirst.isEmpty() )
+	{
+		// suffix range, the last n bytes
+		quint64 nSuffix = sLast.toULongLong(&bOK);
+		if( !bOK || nSuffix == 0 )
+			return false;
+
+		nFirst = nSize - qMin(nSuffix, nSize);
+		nLast = nSize - 1;
+		return true;
+	}
+
+	nFirst = sFirst.toULongLong(&bOK);
+	if( !bOK || nFirst >= nSize )
+		return false;
+
+	if( sLast.isEmpty() )
+	{
+		nLast = nSize - 1;
+		return true;
+	}
+
+	nLast = sLast.toULongLong(&bOK);
+	if( !bOK || nLast < nFirst )
+		return false;
+
+	nLast = qMin(nLast, nSize - 1);
+	return true;
+}
@@ -0,0 +1,79 @@
+#ifndef UPLOADTRANSFER_H
+#define UPLOADTRANSFER_H
+
+#include "transfer.h"
+
+class QFile;
+class CUploadQueue;
+
+// Size of the file window mapped at once when sendfile() is not available
+#define UPLOAD_MAP_WINDOW (1024 * 1024)
+
+// Ticket of a requester that is not waiting in a queue
+#define UPLOAD_NO_TICKET 0xffffffff
+
+// Serves /uri-res/N2R requests for shared files over one HTTP connection
+class CUploadTransfer : public CTransfer
+{
+	Q_OBJECT
+public:
+	enum UploadTransferState
+	{
+		utsRequest,
+		utsSending,
+		utsClosing
+	};
+
+public:
+	UploadTransferState	m_nState;
+	quint32				m_tLastActive;
+	bool				m_bKeepAlive;
+
+	QString				m_sUserAgent;
+	QString				m_sName;
+	QByteArray			m_baSHA1;
+	quint64				m_nOffset;		// next byte of the file to send
+	quint64				m_nRemaining;	// bytes left in the current range
+	quint64				m_nUploaded;
+
+	// managed by UploadQueues
+	CUploadQueue*		m_pQueue;
+	quint32				m_nTicket;
+	bool				m_bSlot;
+	quint64				m_nSlotBytes;	// sent since the slot was granted
+
+protected:
+	QFile*				m_pFile;
+	uchar*				m_pMap;
+	quint64				m_nMapOffset;
+	quint64				m_nMapLength;
+
+public:
+	CUploadTransfer(CNetworkConnection* pConn, QObject *parent = 0);
+	virtual ~CUploadTransfer();
+
+	virtual void onTimer(quint32 tNow = 0);
+	virtual bool HasPendingOutput();
+
+	static bool ParseRange(QString sRange, quint64 nSize, quint64& nFirst, quint64& nLast);
+
+protected:
+	virtual qint64 writeToNetwork(qint64 nBytes);
+	qint64 writeFile(qint64 nBytes);
+
+	void OnRequest(const QString& sHeader);
+	void SendError(const QString& sStatus, bool bClose);
+	void SendQueued();
+	void FinishRequest();
+	bool OpenFile(const QString& sPath, quint64 nSize);
+	void CloseFile();
+	void Unmap();
+
+public slots:
+	void OnConnect();
+	void OnDisconnect();
+	void OnRead();
+	void OnError(QAbstractSocket::SocketError e);
+};
+
+#endif // UPLOADTRANSFER_H
@@ -126,23 +126,18 @@ void CWidgetNeighbours::updateG2()
 	quint32 nUDPInSpeed = 0;
 	quint32 nUDPOutSpeed = 0;
 
-	if(Neighbours.m_pSection.tryLock(50))
-	{
-		nHubsConnected = Neighbours.m_nHubsConnectedG2;
-		nLeavesConnected = Neighbours.m_nLeavesConnectedG2;
-
-		nTCPInSpeed = Neighbours.DownloadSpeed();
-		nTCPOutSpeed = Neighbours.UploadSpeed();
-
-		if(Network.m_pSection.tryLock(50))
-		{
-			nUDPInSpeed = Datagrams.DownloadSpeed();
-			nUDPOutSpeed = Datagrams.UploadSpeed();
+	NeighboursSnapshotPtr pSnapshot = Neighbours.GetSnapshot();
+	nHubsConnected = pSnapshot->m_nHubsConnectedG2;
+	nLeavesConnected = pSnapshot->m_nLeavesConnectedG2;
+	nTCPInSpeed = pSnapshot->m_nDownloadSpeed;
+	nTCPOutSpeed = pSnapshot->m_nUploadSpeed;
 
-			Network.m_pSection.unlock();
-		}
+	if(Network.m_pSection.tryLock(50))
+	{
+		nUDPInSpeed = Datagrams.DownloadSpeed();
+		nUDPOutSpeed = Datagrams.UploadSpeed();
 
-		Neighbours.m_pSection.unlock();
+		Network.m_pSection.unlock();
 	}
 
 	labelG2Stats->setText(tr(" %1 Hubs, %2 Leaves, %3/s In:%4/s Out").arg(nHubsConnected).arg(nLeavesConnected).arg(common::formatBytes(nTCPInSpeed + nUDPInSpeed)).arg(common::formatBytes(nTCPOutSpeed + nUDPOutSpeed)));
@@ -452,6 +452,7 @@ void CWinMain::quazaaShutdown()
 	hostCache.m_pSection.lock();
 	hostCache.save( common::getTNowUTC() );
 	hostCache.m_pSection.unlock();
+	hostCache.waitForSave();
 
 	dlgSplash->updateProgress(30, tr("Removing Tray Icon..."));
 	qApp->processEvents();
@@ -814,12 +815,9 @@ void CWinMain::updateStatusBar()
 		Handshakes.m_pSection.unlock();
 	}
 
-	if(Neighbours.m_pSection.tryLock(50))
-	{
-		nTCPInSpeed = Neighbours.DownloadSpeed();
-		nTCPOutSpeed = Neighbours.UploadSpeed();
-		Neighbours.m_pSection.unlock();
-	}
+	NeighboursSnapshotPtr pSnapshot = Neighbours.GetSnapshot();
+	nTCPInSpeed = pSnapshot->m_nDownloadSpeed;
+	nTCPOutSpeed = pSnapshot->m_nUploadSpeed;
 
 	if(Datagrams.m_pSection.tryLock(50))
 	{
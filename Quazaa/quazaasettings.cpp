@@ -108,11 +108,15 @@ void CQuazaaSettings::saveSettings()
 	m_qSettings.endGroup();
 
 	m_qSettings.beginGroup("Connection");
+	m_qSettings.setValue("DeflateFlushBytes", quazaaSettings.Connection.DeflateFlushBytes);
+	m_qSettings.setValue("DeflateFlushDelay", quazaaSettings.Connection.DeflateFlushDelay);
+	m_qSettings.setValue("DeflateMinSaving", quazaaSettings.Connection.DeflateMinSaving);
 	m_qSettings.setValue("DetectConnectionLoss", quazaaSettings.Connection.DetectConnectionLoss);
 	m_qSettings.setValue("DetectConnectionReset", quazaaSettings.Connection.DetectConnectionReset);
 	m_qSettings.setValue("FailureLimit", quazaaSettings.Connection.FailureLimit);
 	m_qSettings.setValue("FailurePenalty", quazaaSettings.Connection.FailurePenalty);
 	m_qSettings.setValue("InSpeed", quazaaSettings.Connection.InSpeed);
+	m_qSettings.setValue("IOThreads", quazaaSettings.Connection.IOThreads);
 	m_qSettings.setValue("OutSpeed", quazaaSettings.Connection.OutSpeed);
 	m_qSettings.setValue("Port", quazaaSettings.Connection.Port);
 	m_qSettings.setValue("RandomPort", quazaaSettings.Connection.RandomPort);
@@ -232,6 +236,10 @@ void CQuazaaSettings::saveSettings()
 
 	m_qSettings.beginGroup("Gnutella2");
 	m_qSettings.setValue("ClientMode", quazaaSettings.Gnutella2.ClientMode);
+	m_qSettings.setValue("DeflateHubMemLevel", quazaaSettings.Gnutella2.DeflateHubMemLevel);
+	m_qSettings.setValue("DeflateHubWindow", quazaaSettings.Gnutella2.DeflateHubWindow);
+	m_qSettings.setValue("DeflateLeafMemLevel", quazaaSettings.Gnutella2.DeflateLeafMemLevel);
+	m_qSettings.setValue("DeflateLeafWindow", quazaaSettings.Gnutella2.DeflateLeafWindow);
 	m_qSettings.setValue("Enable", quazaaSettings.Gnutella2.Enable);
 	m_qSettings.setValue("HAWPeriod", quazaaSettings.Gnutella2.HAWPeriod);
 	m_qSettings.setValue("HostCount", quazaaSettings.Gnutella2.HostCount);
@@ -259,6 +267,7 @@ void CQuazaaSettings::saveSettings()
 	m_qSettings.setValue("UdpOutFrames", quazaaSettings.Gnutella2.UdpOutFrames);
 	m_qSettings.setValue("UdpMTU", quazaaSettings.Gnutella2.UdpMTU);
 	m_qSettings.setValue("UdpOutResend", quazaaSettings.Gnutella2.UdpOutResend);
+	m_qSettings.setValue("UdpReceiveBatch", quazaaSettings.Gnutella2.UdpReceiveBatch);
 	m_qSettings.setValue("HubBalancePeriod", quazaaSettings.Gnutella2.HubBalancePeriod);
 	m_qSettings.setValue("HubBalanceGrace", quazaaSettings.Gnutella2.HubBalanceGrace);
 	m_qSettings.setValue("HubBalanceLow", quazaaSettings.Gnutella2.HubBalanceLow);
@@ -439,8 +448,16 @@ void CQuazaaSettings::saveSettings()
 	m_qSettings.setValue("MaxPerHost", quazaaSettings.Uploads.MaxPerHost);
 	m_qSettings.setValue("PreviewQuality", quazaaSettings.Uploads.PreviewQuality);
 	m_qSettings.setValue("PreviewTransfers", quazaaSettings.Uploads.PreviewTransfers);
+	m_qSettings.setValue("QueueLargeLength", quazaaSettings.Uploads.QueueLargeLength);
+	m_qSettings.setValue("QueueLargeSize", quazaaSettings.Uploads.QueueLargeSize);
+	m_qSettings.setValue("QueueLargeSlots", quazaaSettings.Uploads.QueueLargeSlots);
+	m_qSettings.setValue("QueueMediumLength", quazaaSettings.Uploads.QueueMediumLength);
+	m_qSettings.setValue("QueueMediumSlots", quazaaSettings.Uploads.QueueMediumSlots);
 	m_qSettings.setValue("QueuePollMax", quazaaSettings.Uploads.QueuePollMax);
 	m_qSettings.setValue("QueuePollMin", quazaaSettings.Uploads.QueuePollMin);
+	m_qSettings.setValue("QueueSmallLength", quazaaSettings.Uploads.QueueSmallLength);
+	m_qSettings.setValue("QueueSmallSize", quazaaSettings.Uploads.QueueSmallSize);
+	m_qSettings.setValue("QueueSmallSlots", quazaaSettings.Uploads.QueueSmallSlots);
 	m_qSettings.setValue("RewardQueuePercentage", quazaaSettings.Uploads.RewardQueuePercentage);
 	m_qSettings.setValue("RotateChunkLimit", quazaaSettings.Uploads.RotateChunkLimit);
 	m_qSettings.setValue("ShareHashset", quazaaSettings.Uploads.ShareHashset);
@@ -522,11 +539,15 @@ void CQuazaaSettings::loadSettings()
 	m_qSettings.endGroup();
 
 	m_qSettings.beginGroup("Connection");
+	quazaaSettings.Connection.DeflateFlushBytes = m_qSettings.value("DeflateFlushBytes", 4096).toUInt();
+	quazaaSettings.Connection.DeflateFlushDelay = m_qSettings.value("DeflateFlushDelay", 250).toUInt();
+	quazaaSettings.Connection.DeflateMinSaving = m_qSettings.value("DeflateMinSaving", 10).toInt();
 	quazaaSettings.Connection.DetectConnectionLoss = m_qSettings.value("DetectConnectionLoss", true).toBool();
 	quazaaSettings.Connection.DetectConnectionReset = m_qSettings.value("DetectConnectionReset", false).toBool();
 	quazaaSettings.Connection.FailureLimit = m_qSettings.value("FailureLimit", 3).toInt();
 	quazaaSettings.Connection.FailurePenalty = m_qSettings.value("FailurePenalty", 300).toInt();
 	quazaaSettings.Connection.InSpeed = m_qSettings.value("InSpeed", 1024 * 1024).toULongLong(); // 1Mbit
+	quazaaSettings.Connection.IOThreads = m_qSettings.value("IOThreads", 0).toUInt();
 	quazaaSettings.Connection.OutSpeed = m_qSettings.value("OutSpeed", 16384).toULongLong();	 // 16KB/s
 	quazaaSettings.Connection.Port = m_qSettings.value("Port", 6350).toUInt();
 	quazaaSettings.Connection.RandomPort = m_qSettings.value("RandomPort", false).toBool();
@@ -648,6 +669,10 @@ void CQuazaaSettings::loadSettings()
 
 	m_qSettings.beginGroup("Gnutella2");
 	quazaaSettings.Gnutella2.ClientMode = m_qSettings.value("ClientMode", 0).toInt();
+	quazaaSettings.Gnutella2.DeflateHubMemLevel = m_qSettings.value("DeflateHubMemLevel", 8).toInt();
+	quazaaSettings.Gnutella2.DeflateHubWindow = m_qSettings.value("DeflateHubWindow", 15).toInt();
+	quazaaSettings.Gnutella2.DeflateLeafMemLevel = m_qSettings.value("DeflateLeafMemLevel", 4).toInt();
+	quazaaSettings.Gnutella2.DeflateLeafWindow = m_qSettings.value("DeflateLeafWindow", 11).toInt();
 	quazaaSettings.Gnutella2.Enable = m_qSettings.value("Enable", true).toBool();
 	quazaaSettings.Gnutella2.HAWPeriod = m_qSettings.value("HAWPeriod", 300).toInt();
 	quazaaSettings.Gnutella2.HostCount = m_qSettings.value("HostCount", 15).toInt();
@@ -676,6 +701,9 @@ void CQuazaaSettings::loadSettings()
 	quazaaSettings.Gnutella2.UdpOutExpire = m_qSettings.value("UdpOutExpire", 26).toInt();
 	quazaaSettings.Gnutella2.UdpOutFrames = m_qSettings.value("UdpOutFrames", 512).toInt();
 	quazaaSettings.Gnutella2.UdpOutResend = m_qSettings.value("UdpOutResend", 6).toInt();
+	quazaaSettings.Gnutella2.UdpReceiveBatch = m_qSettings.value("UdpReceiveBatch", 64).toUInt();
+	if( quazaaSettings.Gnutella2.UdpReceiveBatch < 1 )
+		quazaaSettings.Gnutella2.UdpReceiveBatch = 1; // failsafe
 	quazaaSettings.Gnutella2.HubBalancePeriod = m_qSettings.value("HubBalancePeriod", 60).toUInt();
 	quazaaSettings.Gnutella2.HubBalanceGrace = m_qSettings.value("HubBalanceGrace", 3600).toUInt();
 	quazaaSettings.Gnutella2.HubBalanceLow = m_qSettings.value("HubBalanceLow", 50).toUInt();
@@ -873,8 +901,16 @@ void CQuazaaSettings::loadSettings()
 	quazaaSettings.Uploads.MaxPerHost = m_qSettings.value("MaxPerHost", 2).toInt();
 	quazaaSettings.Uploads.PreviewQuality = m_qSettings.value("PreviewQuality", 70).toInt();
 	quazaaSettings.Uploads.PreviewTransfers = m_qSettings.value("PreviewTransfers", 3).toInt();
+	quazaaSettings.Uploads.QueueLargeLength = m_qSettings.value("QueueLargeLength", 500).toInt();
+	quazaaSettings.Uploads.QueueLargeSize = m_qSettings.value("QueueLargeSize", 65536).toInt();
+	quazaaSettings.Uploads.QueueLargeSlots = m_qSettings.value("QueueLargeSlots", 3).toInt();
+	quazaaSettings.Uploads.QueueMediumLength = m_qSettings.value("QueueMediumLength", 100).toInt();
+	quazaaSettings.Uploads.QueueMediumSlots = m_qSettings.value("QueueMediumSlots", 2).toInt();
 	quazaaSettings.Uploads.QueuePollMax = m_qSettings.value("QueuePollMax", 120000).toInt();
 	quazaaSettings.Uploads.QueuePollMin = m_qSettings.value("QueuePollMin", 45000).toInt();
+	quazaaSettings.Uploads.QueueSmallLength = m_qSettings.value("QueueSmallLength", 50).toInt();
+	quazaaSettings.Uploads.QueueSmallSize = m_qSettings.value("QueueSmallSize", 1024).toInt();
+	quazaaSettings.Uploads.QueueSmallSlots = m_qSettings.value("QueueSmallSlots", 2).toInt();
 	quazaaSettings.Uploads.RewardQueuePercentage = m_qSettings.value("RewardQueuePercentage", 10).toInt();
 	quazaaSettings.Uploads.RotateChunkLimit = m_qSettings.value("RotateChunkLimit", 1024).toInt();
 	quazaaSettings.Uploads.ShareHashset = m_qSettings.value("ShareHashset", true).toBool();
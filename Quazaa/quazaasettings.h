@@ -165,11 +165,15 @@ namespace Settings
 
 	struct sConnection
 	{
+		quint32		DeflateFlushBytes;						// Bytes batched on a compressed link before the stream is flushed
+		quint32		DeflateFlushDelay;						// Milliseconds a partial batch may wait for more data
+		int			DeflateMinSaving;						// Send uncompressed for a while if compression saves less (percent, 0 = always compress)
 		bool		DetectConnectionLoss;					// Detect loss of internet
 		bool		DetectConnectionReset;					// Detect regaining of internet connection
 		int			FailureLimit;							// Max allowed connection failures (default = 3) (Neighbour connections)
 		int			FailurePenalty;							// Delay after connection failure (seconds, default = 300) (Neighbour connections)
 		quint64		InSpeed;								// Inbound internet connection speed in B/s
+		quint32		IOThreads;								// Threads neighbour connections are spread over (0 = one per CPU core)
 		quint64		OutSpeed;								// Outbound internet connection speed in B/s
 		quint16		Port;									// Incoming port
 		bool		RandomPort;								// Select a random incoming port
@@ -295,6 +299,10 @@ namespace Settings
 	struct sGnutella2
 	{
 		int			ClientMode;								// Desired mode of operation: MODE_AUTO, MODE_LEAF, MODE_HUB
+		int			DeflateHubMemLevel;						// zlib memLevel (1-9) of compressed links to hubs
+		int			DeflateHubWindow;						// zlib windowBits (9-15) of compressed links to hubs
+		int			DeflateLeafMemLevel;					// zlib memLevel (1-9) of compressed links to leaves
+		int			DeflateLeafWindow;						// zlib windowBits (9-15) of compressed links to leaves
 		bool		Enable;									// Connect to G2
 		int			HAWPeriod;
 		int			HostCount;								// Number of hosts in X-Try-Hubs
@@ -323,6 +331,7 @@ namespace Settings
 		quint32		UdpOutExpire;							// Time before dropping a UDP connection
 		int			UdpOutFrames;							// UDP protocol out frame size
 		quint32		UdpOutResend;							// Time before resending a UDP protocol packet
+		quint32		UdpReceiveBatch;						// Maximum number of datagrams read per socket wakeup
 		quint32		HubBalancePeriod;
 		quint32		HubBalanceGrace;
 		quint32		HubBalanceLow;
@@ -592,8 +601,16 @@ namespace Settings
 		int			MaxPerHost;								// Max simultaneous uploads to one remote client
 		int			PreviewQuality;							// Quality of dynamically created previews
 		int			PreviewTransfers;						// Max simultaneous uploads of previews
+		int			QueueLargeLength;						// Max requesters waiting in the large files queue
+		int			QueueLargeSize;							// Smallest file in the large files queue (KB)
+		int			QueueLargeSlots;						// Upload slots of the large files queue
+		int			QueueMediumLength;						// Max requesters waiting in the medium files queue
+		int			QueueMediumSlots;						// Upload slots of the medium files queue
 		int			QueuePollMax;
 		int			QueuePollMin;
+		int			QueueSmallLength;						// Max requesters waiting in the small files queue
+		int			QueueSmallSize;							// Largest file in the small files queue (KB)
+		int			QueueSmallSlots;						// Upload slots of the small files queue
 		int			RewardQueuePercentage;					// The percentage of each reward queue reserved for uploaders
 		int			RotateChunkLimit;						// Limit on the size of rotating chunks
 		bool		ShareHashset;							// Share the hashset for a particular file